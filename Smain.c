@@ -1,8 +1,11 @@
+// memfd_create and file sealing
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -11,37 +14,563 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <dirent.h>
-
+#include <fnmatch.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define PORT 8080
 #define BUFSIZE 102400
+// Paths and one-line commands (which hold at most two paths) live on the stack in buffers of these sizes,
+// bulk data in buffers of the buffer pool: IO_BUFSIZE for streaming, BUFSIZE for requests and file lists
+#define PATH_BUFSIZE 4096
+#define CMD_BUFSIZE (2 * PATH_BUFSIZE + 256)
+#define IO_BUFSIZE 65536
+#define LIST_BUFSIZE (3 * BUFSIZE)
+// Buffer pool: buffers are carved from arenas of POOL_ARENA_SIZE bytes (one huge page, see the
+// buffer_hugepages setting) in POOL_CLASSES size classes and reused by the session once released
+#define POOL_ARENA_SIZE (2 * 1024 * 1024)
+#define POOL_CLASSES 3
 #define CMD_END_MARKER "END_CMD"
-#define TAR_FILE_PATH "c_files.tar"
+// Every sized body (an upload, a file, a tarball or a signature) is followed by "CRC32C <8 hex digits>",
+// the CRC32C of the body, checked by each hop that receives it
+#define CRC_TRAILER_LEN 15
+// Default routing table location, can be overridden with the DFS_CONFIG environment variable
+#define ROUTE_CONFIG_FILE "dfs.conf"
+#define MAX_ROUTES 32
+#define MAX_ENDPOINTS 16
+// Virtual nodes per backend on the consistent-hash ring, can be changed with "vnodes <n>" in the config
+#define DEFAULT_VNODES 64
+// Latency histogram buckets (bucket k counts first-byte times in [2^k, 2^(k+1)) microseconds)
+#define LATENCY_BUCKETS 32
+// Samples needed before a backend's own p95 is trusted as its hedging delay, and the delay used until then
+#define HEDGE_MIN_SAMPLES 20
+#define HEDGE_DEFAULT_US 50000
+#define HEDGE_FLOOR_US 1000
+// Backend failure handling defaults, see the connect_timeout_ms, io_timeout_ms, health_interval_ms and breaker settings
+#define DEFAULT_CONNECT_TIMEOUT_MS 1000
+#define DEFAULT_IO_TIMEOUT_MS 30000
+#define DEFAULT_HEALTH_INTERVAL_MS 2000
+#define DEFAULT_BREAKER_FAILURES 3
+#define DEFAULT_BREAKER_COOLDOWN_MS 5000
+// Circuit breaker states of a backend: half-open lets one trial request through, which is then in flight
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+#define BREAKER_TRIAL 3
+// Admission control defaults, see the listen_backlog, max_sessions, max_transfers, transfer_queue,
+// transfer_wait_ms and busy_retry_ms settings
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_MAX_SESSIONS 64
+#define DEFAULT_MAX_TRANSFERS 16
+#define DEFAULT_TRANSFER_QUEUE 64
+#define DEFAULT_TRANSFER_WAIT_MS 10000
+#define DEFAULT_BUSY_RETRY_MS 200
+// Largest upload body (and dtar manifest) a session accepts, see the upload_max_size setting
+#define DEFAULT_UPLOAD_MAX_SIZE (1024LL * 1024 * 1024)
+// Sessions admitted beyond max_sessions that only serve metadata commands (display, rmfile, query)
+#define DEFAULT_PRIORITY_SESSIONS 8
+// The priority lane of an Sstore listens on its port plus this offset (and on <dir>/<store>.prio.sock)
+#define PRIORITY_PORT_OFFSET 1000
+// A backend found without a priority lane is only tried on it again after this long
+#define PRIORITY_LANE_RETRY_MS 60000
+// Upper bound for max_transfers, the size of the shared transfer slot table
+#define MAX_TRANSFER_SLOTS 256
+// Bandwidth scheduler: the operation classes (see rate_class_of), the size of the client table, how many tokens a
+// bucket may hold (as time at its rate), how long a class counts as active after it moved data, and how long a
+// client must be idle before its entry goes to another one
+#define RATE_INTERACTIVE 0
+#define RATE_TRANSFER 1
+#define RATE_BULK 2
+#define RATE_CLASSES 3
+#define RATE_CLIENTS 1024
+#define RATE_BURST_US 100000
+#define RATE_ACTIVE_US 250000
+#define RATE_CLIENT_IDLE_US 60000000ULL
+// Delta uploads: signature block sizes (a power of two between these) and the FNV-1a constants of the strong hash
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+// File index kept in ~/INDEX_FILE, see the index_entries setting; INDEX_SCAN_WORKERS processes rebuild it
+// Deepest subdirectory level a filtered display or a search may descend to
+#define MAX_LIST_DEPTH 16
+// Search: at most one worker process per CPU core up to SEARCH_MAX_JOBS, at most SEARCH_MAX_MATCHES lines
+// reported, each showing up to SEARCH_SNIPPET bytes of its text; files with a NUL in the first SEARCH_BINARY_PROBE
+// bytes are skipped as binary
+#define SEARCH_MAX_JOBS 16
+#define SEARCH_MAX_MATCHES 10000
+#define SEARCH_SNIPPET 200
+#define SEARCH_BINARY_PROBE 4096
+
+#define INDEX_FILE ".smain_index"
+#define INDEX_MAGIC 0x49534644
+#define INDEX_VERSION 3
+#define DEFAULT_INDEX_ENTRIES 262144
+#define INDEX_SCAN_WORKERS 8
+#define INDEX_PATH_MAX 256
+// States of an index slot
+#define INDEX_SLOT_FREE 0
+#define INDEX_SLOT_USED 1
+#define INDEX_SLOT_REMOVED 2
+// Pack store defaults, see the pack_max_size, pack_segment_size, pack_compact_percent and
+// pack_compact_interval_ms settings; segments are kept in ~/PACK_DIR
+#define PACK_DIR ".smain_pack"
+// Tarballs built by dtar are kept in ~/TAR_CACHE_DIR, one per extension, while the tree does not change
+#define TAR_CACHE_DIR ".smain_tarcache"
+#define DEFAULT_PACK_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DEFAULT_PACK_COMPACT_PERCENT 50
+#define DEFAULT_PACK_COMPACT_INTERVAL_MS 10000
+#define MAX_PACK_SEGMENTS 1024
+// Segment record magic ("PACK") and types
+#define PACK_MAGIC 0x4b434150
+#define PACK_PUT 1
+#define PACK_DELETE 2
+// Type flag of a put whose crc field holds the CRC32C of the data (records written before carry none)
+#define PACK_HAS_CRC 0x100
+
+struct backend_stats;
+
+// A backend endpoint (host and port) that serves one store, with its shared statistics
+// A backend on the same host may also give its Unix-domain socket ("host:port@/path/store.sock"), which is then used first
+struct endpoint {
+    char host[64];
+    int port;
+    char unix_path[108];
+    struct backend_stats *stats;
+};
+
+// A point on the consistent-hash ring, owned by one endpoint of the route
+struct ring_point {
+    uint32_t hash;
+    int endpoint;
+};
+
+// A routing rule: files matching an extension (".pdf") or a path prefix ("~/smain/logs/")
+// are served by the named store, either locally by Smain or by backend endpoints.
+// The files of a store are sharded over its endpoints by consistent hashing of the path,
+// and each file is kept on `replicas` endpoints; an upload succeeds once `write_quorum` of them stored it.
+struct route {
+    char match[256];
+    int is_prefix;
+    char store[64];
+    int local;
+    int replicas;
+    int write_quorum;
+    int n_endpoints;
+    struct endpoint endpoints[MAX_ENDPOINTS];
+    struct ring_point *ring;
+    int ring_size;
+};
+
+// Read latency statistics and circuit breaker of one backend endpoint, shared by all Smain processes
+struct backend_stats {
+    uint64_t ewma_us;
+    int outstanding;
+    uint64_t samples;
+    uint32_t latency_hist[LATENCY_BUCKETS];
+    int breaker_state;
+    int consecutive_failures;
+    uint64_t open_until_us;
+    // Until when the backend is taken to have no priority lane (0 while it has one or was not tried yet)
+    uint64_t no_lane_until_us;
+};
+
+// Admission control state shared by all Smain processes: the pid holding each data transfer slot
+// (0 when free) and the number of sessions queued for one. The parent frees the slots of exited children.
+struct admission {
+    int waiting;
+    pid_t holders[MAX_TRANSFER_SLOTS];
+};
+
+// A token bucket of the bandwidth scheduler: the time (now_us) at which its tokens run out
+struct rate_bucket {
+    uint64_t empty_us;
+};
+
+// A client address in the scheduler, with its byte and command buckets and when it was last seen
+struct rate_client {
+    uint32_t addr;
+    uint32_t pad;
+    uint64_t last_us;
+    struct rate_bucket bytes;
+    struct rate_bucket ops;
+};
+
+// Shared by all sessions: the buckets of the operation classes, when each class last moved data, and the clients
+struct rate_state {
+    struct rate_bucket class_bytes[RATE_CLASSES];
+    struct rate_bucket class_ops[RATE_CLASSES];
+    uint64_t class_active_us[RATE_CLASSES];
+    struct rate_client clients[RATE_CLIENTS];
+};
+
+// A record of a pack segment: this header, the full path of the file and, for a put, the file data
+struct pack_record {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t path_len;
+    uint32_t crc;
+    int64_t mtime_ns;
+    uint64_t data_len;
+};
+
+// Index entry of a local file: its size, modification time, FNV-1a hash of the contents (0 until known) and
+// the CRC32C it was uploaded with (-1 until known), and where it is: a regular file at `path` (segment -1)
+// or `size` bytes at `offset` in pack segment `segment`
+struct index_entry {
+    char path[INDEX_PATH_MAX];
+    int state;
+    int segment;
+    long long offset;
+    long long size;
+    long long mtime_ns;
+    uint64_t hash;
+    long long crc;
+};
+
+// A segment file (id -1 for a free table slot), its size and how many of its bytes are live records
+struct pack_segment {
+    int id;
+    long long size;
+    long long live;
+};
+
+// The file index, a file mapped by all Smain processes so it survives restarts: the lock (pid of the holder,
+// 0 when free), the pack segments with the one appended to, and an open-addressed hash table of `capacity`
+// entries by path. `dirty` is set when a process died holding the lock, `complete` is cleared when a file
+// did not fit (lookups that miss then ask the file system), and boot_id names the boot it was last used in.
+// `generation` is the version of the tree, raised by every change to an entry, that cached tarballs are built at.
+struct file_index {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    int capacity;
+    int dirty;
+    int complete;
+    char boot_id[40];
+    pid_t lock;
+    int count;
+    int removed;
+    int active;
+    int next_id;
+    long long generation;
+    struct pack_segment segments[MAX_PACK_SEGMENTS];
+    struct index_entry entries[];
+};
+
+// Predicates of a filtered display, "display <dir> [name=<glob>] [min=<bytes>] [max=<bytes>] [since=<time>] [depth=<n>]":
+// only files whose name matches the shell pattern, whose size is within the bounds and that were modified at or after
+// `since` (seconds since the epoch) are listed, looking `depth` levels of subdirectories below the directory
+struct list_filter {
+    char glob[256];
+    long long min_size;
+    long long max_size;
+    long long since;
+    int depth;
+};
+
+// A file of a search: the file the bytes are in, the name it is reported by, and where it lies in the file
+// (size -1 for a whole regular file; a packed file is a region of its pack segment)
+struct search_file {
+    char path[512];
+    char name[256];
+    long long offset;
+    long long size;
+};
+
+// Shared by the workers of a search: the next file to scan and the number of matching lines found
+struct search_state {
+    int next;
+    int matches;
+};
+
+// A file of the client's last backup, from the manifest of an incremental dtar
+struct manifest_entry {
+    const char *path;
+    long long size;
+    long long mtime;
+    int seen;
+};
+
+// An incremental dtar, "dtar <ext> [since=<time>] [manifest=<bytes>]": the manifest lists the files of the client's
+// last backup, one "<size> <mtime> <path>" line each (path relative to ~/smain, mtime in seconds), and is sorted by
+// path once loaded. Only files modified at or after `since`, or missing from the manifest or with another size or
+// mtime, are archived. The tarball also gets the manifest of the files there are now and the list of the files of
+// the old manifest that are gone, as the members .dfs_manifest.<store> and .dfs_deleted.<store>.
+struct tar_delta {
+    long long since;
+    char *text;
+    struct manifest_entry *entries;
+    int n_entries;
+    char store[64];
+    char tmp_dir[64];
+    FILE *current;
+};
+
+// Routing table loaded at startup and inherited by every forked child
+struct route routes[MAX_ROUTES];
+int n_routes = 0;
+int ring_vnodes = DEFAULT_VNODES;
+// Shared mapping of MAX_ROUTES * MAX_ENDPOINTS backend statistics, created before the first fork
+struct backend_stats *backend_stats = NULL;
+// Backend failure handling settings
+int connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+int io_timeout_ms = DEFAULT_IO_TIMEOUT_MS;
+int health_interval_ms = DEFAULT_HEALTH_INTERVAL_MS;
+int breaker_failures = DEFAULT_BREAKER_FAILURES;
+int breaker_cooldown_ms = DEFAULT_BREAKER_COOLDOWN_MS;
+// Admission control settings and the shared slot table, created before the first fork
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+int max_sessions = DEFAULT_MAX_SESSIONS;
+int max_transfers = DEFAULT_MAX_TRANSFERS;
+int transfer_queue = DEFAULT_TRANSFER_QUEUE;
+int transfer_wait_ms = DEFAULT_TRANSFER_WAIT_MS;
+int busy_retry_ms = DEFAULT_BUSY_RETRY_MS;
+int priority_sessions = DEFAULT_PRIORITY_SESSIONS;
+long long upload_max_size = DEFAULT_UPLOAD_MAX_SIZE;
+// Send metadata commands to the priority lane of the backends (1) or to their regular port (0)
+int priority_lanes = 0;
+// Set in a session admitted beyond max_sessions, which turns away transfers
+int session_priority_only = 0;
+// Set while the session runs a metadata command, its backend connections then go to the priority lanes
+int session_lane = 0;
+struct admission *admission = NULL;
+// Bandwidth scheduler settings (0 for no limit) and its shared state, created before the first fork when a limit is
+// set; the client of the session (NULL if it has no entry) and the class of the command being served
+long long rate_total = 0;
+int rate_class_weight[RATE_CLASSES] = { 8, 4, 1 };
+long long rate_class_bytes[RATE_CLASSES];
+int rate_class_ops[RATE_CLASSES];
+long long rate_client_bytes = 0;
+int rate_client_ops = 0;
+int rate_enabled = 0;
+struct rate_state *rate_state = NULL;
+struct rate_client *session_client = NULL;
+int session_class = RATE_INTERACTIVE;
+// File index of the local files and pack store settings (small files are packed when pack_max_size > 0),
+// the index is mapped before the first fork
+int index_entries = DEFAULT_INDEX_ENTRIES;
+int pack_max_size = 0;
+int pack_segment_size = DEFAULT_PACK_SEGMENT_SIZE;
+int pack_compact_percent = DEFAULT_PACK_COMPACT_PERCENT;
+int pack_compact_interval_ms = DEFAULT_PACK_COMPACT_INTERVAL_MS;
+struct file_index *file_index = NULL;
+char index_root[512];
+char pack_dir[512];
+char tar_cache_dir[512];
+// CRC32C: set when the CPU has the SSE4.2 crc32 instruction, otherwise the slicing-by-8 tables are used
+int crc32c_hw = 0;
+uint32_t crc32c_table[8][256];
+
+// A buffer of the pool is preceded by this header: its size class (-1 for an oversized buffer from malloc)
+// and, while it is free, the next free buffer of its class
+struct pool_buffer {
+    struct pool_buffer *next;
+    int cls;
+    int pad;
+};
+
+// Buffer pool of this process (each session is a process of its own): the free buffers of every
+// size class and the unused rest of the current arena; buffer_hugepages backs arenas with huge pages
+static const size_t pool_class_size[POOL_CLASSES] = {IO_BUFSIZE, BUFSIZE, LIST_BUFSIZE};
+struct pool_buffer *pool_free[POOL_CLASSES];
+char *pool_arena = NULL;
+size_t pool_arena_left = 0;
+int buffer_hugepages = 0;
 
 // Function prototypes
 void prcclient(int client_sock);
-void handle_ufile(int client_sock, char *command, char *file_data);
+void handle_ufile(int client_sock, char *command, char *file_data, size_t file_len, uint32_t file_crc);
 void handle_dfile(int client_sock, char *command);
 void handle_rmfile(int client_sock, char *command);
-void handle_dtar(int client_sock, char *command);
+void handle_dtar(int client_sock, char *command, char *manifest, size_t manifest_len);
 void handle_display(int client_sock, char *command);
-int connect_to_spdf();
-int connect_to_stext();
-void send_file_to_server(int server_sock, int client_sock, char *command, char *filename, char *destination_path, char *file_data);
-int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data);
-void remove_file_from_server(int sock, int client_sock, char *command, char *destination_path);
-void send_file_to_client(int client_sock, const char *file_path, const char *file_name);
+int parse_list_filter(const char *options, struct list_filter *filter);
+int filter_needs_stat(const struct list_filter *filter);
+int filter_match(const struct list_filter *filter, const char *name, long long size, long long mtime);
+void list_local_dir(const char *dir_path, const char *pathname, const char *relative, int depth, const struct list_filter *filter, char *list, size_t list_size);
+void handle_search(int client_sock, char *command);
+void handle_query(int client_sock, char *command);
+void collect_local_search(const char *dir_path, const char *pathname, const char *relative, int depth, struct search_file **files, int *n, int *capacity);
+long long relay_search_results(const struct endpoint *ep, const char *message, int client_sock);
+int add_search_file(struct search_file **files, int *n, int *capacity, const char *path, const char *name, long long offset, long long size);
+void search_file_region(const struct search_file *f, const char *text, size_t text_len, int out_fd, struct search_state *state);
+long long run_search(int sock, const struct search_file *files, int n, const char *text);
+void handle_dsig(int client_sock, char *command);
+void handle_udelta(int client_sock, char *command, char *delta, size_t delta_len, uint32_t delta_crc);
+int load_routes(const char *config_path);
+int add_route(const char *match, const char *store, char *endpoints);
+const struct route *route_for_path(const char *path);
+const struct route *route_for_ext(const char *ext);
+int first_route_of_store(int i);
+int has_extension(const char *name, const char *ext);
+int connect_to_endpoint(const struct endpoint *ep);
+int connect_with_timeout(const struct endpoint *ep);
+int connect_unix(const char *path);
+int connect_tcp(const struct endpoint *ep, int port);
+int is_metadata_command(const char *command);
+void set_io_timeouts(int sock);
+int is_unix_socket(int sock);
+void tune_socket(int sock);
+void report_connection(int sock);
+int breaker_allow(struct backend_stats *st);
+void report_backend(const struct endpoint *ep, int ok);
+void report_probe(const struct endpoint *ep, int ok);
+int probe_endpoint(const struct endpoint *ep);
+void run_health_checker();
+uint32_t hash_key(const char *key);
+int build_ring(struct route *r);
+int build_rings();
+int replicas_of(const struct route *r, const char *path, int *replicas);
+int replicate_request(const struct route *r, const int *replicas, int n, const char *message, size_t message_len, size_t header_len, int body_fd, const char *ok_prefix, int quorum, int client_sock, const char *ok_reply, const char *fail_reply, char responses[][128]);
+int create_body_memfd(const char *body, size_t body_len);
+ssize_t send_with_fd(int sock, const char *data, size_t len, int fd);
+void shard_key(const char *path, char *key, size_t key_size);
+void append_unique_lines(char *list, size_t list_size, const char *lines);
+int fetch_tar_from_server(const struct endpoint *ep, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len, const char *out_path, char *error_buffer, size_t error_size);
+void merge_shard_tars(int client_sock, const struct route *r, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len);
+void send_file_to_replicas(const struct route *r, const int *replicas, int n, int client_sock, char *command, char *filename, char *destination_path, char *file_data, size_t file_len, const char *options, uint32_t file_crc);
+int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data, size_t file_len, uint32_t file_crc);
+void remove_file_from_replicas(const struct route *r, const int *replicas, int n, int client_sock, char *command, char *destination_path);
+void send_file_to_client(int client_sock, const char *file_path, const char *file_name, long long offset, long long length, const char *if_tag);
 int delete_file(const char *file_path);
-void send_download_request(int server_sock, int client_sock, char *command, char *file_path);
-void get_file_names_from_server(int (*connect_func)(), const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size);
-void c_tar_file(int client_sock, const char *path);
-void request_tar_file(int server_sock, int client_sock, char *path);
+int send_download_request(int server_sock, char *command, char *file_path, long long offset, long long length, const char *if_tag);
+int relay_download(const struct endpoint *ep, int server_sock, int client_sock, char *error_buffer, size_t error_size);
+int request_download(int server_sock, char *command, char *file_path, long long offset, long long length, const char *if_tag, int *pass_fd);
+int relay_passed_file(int server_sock, int client_sock, const char *file_path, long long offset, long long length, const char *if_tag, char *error_buffer, size_t error_size);
+ssize_t recv_line(int sock, char *line, size_t line_size);
+int send_file_with_header(int sock, int file_fd, const char *file_name, long long offset, long long length, const char *if_tag);
+void version_tag(const struct stat *file_stat, char *tag, size_t tag_size);
+int init_backend_stats();
+struct backend_stats *stats_for(const struct route *r, int endpoint);
+uint64_t now_us();
+void record_latency(struct backend_stats *st, uint64_t latency_us);
+uint64_t p95_latency_us(const struct backend_stats *st);
+int rank_replicas(const struct route *r, int *replicas, int n);
+void hedged_download(int client_sock, const struct route *r, const int *replicas, int n, char *command, char *file_path, long long offset, long long length, const char *if_tag);
+int get_file_names_from_server(const struct endpoint *ep, const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size);
+void local_tar_file(int client_sock, const char *path, const char *ext, struct tar_delta *delta);
+void request_tar_file(const struct endpoint *ep, int server_sock, int client_sock, char *path, const char *ext, long long since, const char *manifest, long long manifest_len);
+int send_tar_request(int server_sock, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len);
+int parse_tar_options(const char *options, long long *since, long long *manifest_len);
+int begin_tar_delta(struct tar_delta *delta, const char *store_name, long long since, const char *manifest, long long manifest_len);
+int tar_delta_wants(struct tar_delta *delta, const char *relative, long long size, long long mtime);
+void collect_tar_files(const char *dir_path, const char *relative, const char *ext, struct tar_delta *delta, FILE *list);
+int append_tar_delta(struct tar_delta *delta, const char *tar_path);
+void end_tar_delta(struct tar_delta *delta);
+long long tree_generation();
+int tar_cache_lookup(const char *ext, long long generation, char *cached_path, size_t path_size, uint32_t *crc);
+void tar_cache_store(const char *built_path, const char *ext, long long generation, uint32_t crc);
+int file_crc32c(int file_fd, uint32_t *crc);
+int init_admission();
+int init_rate_limits();
+long long rate_take(struct rate_bucket *b, double amount, double rate, long long max_wait_us);
+struct rate_client *rate_client_for(uint32_t addr);
+int rate_class_of(const char *command);
+int rate_admit_command();
+void rate_limit_bytes(size_t bytes);
+int acquire_transfer_slot();
+void release_transfer_slot(int slot);
+void reclaim_transfer_slots(pid_t pid);
+void send_busy(int client_sock);
+int delta_block_size(long long file_size);
+uint32_t weak_checksum(const unsigned char *data, size_t len);
+uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len);
+int send_signature(int sock, int file_fd);
+int apply_delta(const char *file_path, const unsigned char *delta, size_t delta_len, int block_size, uint64_t base_hash, uint64_t new_hash);
+int send_file_region(int sock, int file_fd, off_t base, const struct stat *file_stat, const char *file_name, long long offset, long long length, const char *if_tag, long long stored_crc);
+void crc32c_init();
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int send_crc_trailer(int sock, uint32_t crc);
+int parse_crc_trailer(const char *trailer, uint32_t *crc);
+void *pool_get(size_t size);
+void pool_put(void *buffer);
+int pool_map_arena();
+int send_not_modified(int sock, const char *tag);
+int init_file_index();
+void read_boot_id(char *boot_id, size_t boot_id_size);
+int scan_into_index();
+void scan_directory(const char *dir, int share);
+int replay_pack_segments();
+int replay_pack_segment(int id);
+int read_pack_record(int fd, long long pos, long long end, struct pack_record *record, char *path);
+void pack_segment_path(int id, char *path, size_t path_size);
+struct pack_segment *pack_segment_of(int id);
+long long pack_record_size(const struct index_entry *e);
+struct index_entry *index_lookup(const char *path, int insert);
+int index_set(const char *path, int segment, long long offset, long long size, long long mtime_ns, uint64_t hash, long long crc);
+void index_drop(struct index_entry *e);
+void index_rehash();
+void index_key(const char *path, char *key, size_t key_size);
+int index_get(const char *full_path, struct index_entry *found);
+void index_store_file(const char *full_path, const struct stat *file_stat, uint64_t hash, long long crc);
+void index_forget(const char *full_path);
+void index_entry_stat(const struct index_entry *e, struct stat *file_stat);
+void index_lock();
+void index_unlock();
+void reclaim_index_lock(pid_t pid);
+long long pack_append(uint32_t type, const char *path, const char *data, size_t len, long long mtime_ns, long long crc);
+int pack_put(const char *full_path, const char *data, size_t len, uint32_t crc);
+int pack_remove(const char *full_path);
+int pack_send_file(int sock, const char *full_path, const char *file_name, long long offset, long long length, const char *if_tag);
+int pack_list_dir(const char *dir, const struct list_filter *filter, char *list, size_t list_size);
+void pack_collect_search(const char *dir, struct search_file **files, int *n, int *capacity);
+int pack_write_tar(int tar_fd, const char *dir, const char *ext, struct tar_delta *delta);
+int write_tar_header(int tar_fd, const char *name, long long size, long long mtime);
+int write_tar_block(int tar_fd, const char *name, long long size, long long mtime, char type);
+void run_compactor();
+int compact_pack_segment(int id);
 
 int main() {
     int server_sock, client_sock;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_size;
-    pid_t child_pid;
+    pid_t child_pid, health_pid, compactor_pid = -1;
+    // Number of client sessions (forked children) currently running
+    int sessions = 0;
+
+    // Load the extension/prefix routing table before accepting any client
+    const char *config_path = getenv("DFS_CONFIG");
+    if (load_routes(config_path != NULL ? config_path : ROUTE_CONFIG_FILE) < 0 || build_rings() < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Pick the CRC32C implementation before the file index rebuild, which may checksum pack records
+    crc32c_init();
+    // Backend latency statistics are shared by every child so they all learn from each other's reads
+    if (init_backend_stats() < 0 || init_admission() < 0 || init_rate_limits() < 0 || init_file_index() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Start the background health checker, it keeps the circuit breakers of the backends up to date
+    health_pid = fork();
+    if (health_pid == 0) {
+        run_health_checker();
+        exit(0);
+    } else if (health_pid < 0) {
+        perror("Health checker fork failed");
+    }
+
+    // Start the pack store compactor, it rewrites the segments that are mostly dead records
+    if (pack_max_size > 0 || file_index->next_id > 0) {
+        compactor_pid = fork();
+        if (compactor_pid == 0) {
+            run_compactor();
+            exit(0);
+        } else if (compactor_pid < 0) {
+            perror("Compactor fork failed");
+        }
+    }
 
     // Create a socket for the server
     server_sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -61,6 +590,10 @@ int main() {
     // Zero out the rest of the struct
     memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
 
+    // A restarted server may take the port over right away, while connections of the last run are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Bind the socket to the specified port and address so it can listen for incoming connections
     if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         // If binding fails, print an error and close the socket
@@ -69,8 +602,8 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Set the server to listen for incoming connections, with a maximum of 10 queued connections
-    if (listen(server_sock, 10) < 0) {
+    // Set the server to listen for incoming connections, bursts wait in a backlog of listen_backlog connections
+    if (listen(server_sock, listen_backlog) < 0) {
         // If listening fails, print an error and close the socket
         perror("Listen failed");
         close(server_sock);
@@ -90,21 +623,46 @@ int main() {
         }
 
         printf("Connection accepted from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        tune_socket(client_sock);
+
+        // Reap every finished child, freeing its session and any transfer slot or lock it still held
+        while ((child_pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            reclaim_index_lock(child_pid);
+            if (child_pid != health_pid && child_pid != compactor_pid) {
+                reclaim_transfer_slots(child_pid);
+                sessions--;
+            }
+        }
+
+        // Turn the client away right away when all sessions are taken, instead of forking without limit. The last
+        // priority_sessions are kept for metadata commands, so display and rmfile get in while transfers fill the rest
+        if (sessions >= max_sessions + priority_sessions) {
+            printf("Session limit of %d reached, rejecting client\n", max_sessions + priority_sessions);
+            send_busy(client_sock);
+            close(client_sock);
+            continue;
+        }
 
         // Fork a child process to handle the client
         child_pid = fork();
         if (child_pid == 0) {
             // If this is the child process, close the server socket and handle the client's requests
             close(server_sock);  // Close the server socket in the child
+            session_priority_only = sessions >= max_sessions;
+            // A client that disconnects mid-transfer must not kill the child while it holds a transfer slot
+            signal(SIGPIPE, SIG_IGN);
             prcclient(client_sock);  // Handle communication with the client
+            report_connection(client_sock);
             close(client_sock);  // Close the client socket
             exit(0);  // Exit the child process
         } else if (child_pid > 0) {
             // In the parent process
             close(client_sock);  // Close the client socket in the parent
-            waitpid(-1, NULL, WNOHANG);  // Wait for child processes to terminate
+            sessions++;
         } else {
             perror("Fork failed");
+            send_busy(client_sock);
+            close(client_sock);
         }
     }
 
@@ -114,29 +672,153 @@ int main() {
 
 // Function to handle communication with a connected client
 void prcclient(int client_sock) {
-    char buffer[BUFSIZE];
+    // The request buffer is taken from the pool once and reused for every command of the session
+    char *buffer = pool_get(BUFSIZE);
     int bytes_read;
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return;
+    }
+
+    // The scheduler keeps the limits of each client address, shared by all of its sessions
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (rate_state != NULL && getpeername(client_sock, (struct sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET) {
+        session_client = rate_client_for(peer.sin_addr.s_addr);
+    }
 
-    // Read messages from the client
-    while ((bytes_read = recv(client_sock, buffer, BUFSIZE, 0)) > 0) {
+    // Read messages from the client, a session may send any number of commands on one connection
+    while ((bytes_read = recv(client_sock, buffer, BUFSIZE - 1, 0)) > 0) {
         // Null-terminate the received string to prevent buffer overflow
         buffer[bytes_read] = '\0';
+        session_class = rate_class_of(buffer);
+        session_lane = priority_lanes && is_metadata_command(buffer);
+
 
+        // Determine which command the client sent and call the appropriate function to handle it
+        // Data transfers (ufile, dfile, dtar and the delta upload commands) need one of the max_transfers slots,
+        // others run right away. Admission comes before an upload body is read, so the slots also bound the memory
+        // that uploads hold
+        int is_transfer = strncmp(buffer, "ufile", 5) == 0 || strncmp(buffer, "dfile", 5) == 0
+                          || strncmp(buffer, "dtar", 4) == 0 || strncmp(buffer, "dsig", 4) == 0
+                          || strncmp(buffer, "udelta", 6) == 0;
+        int slot = -1, busy = 0;
+        // A session on a reserved priority seat only runs metadata commands
+        if (session_priority_only && !is_metadata_command(buffer)) {
+            printf("Priority session, rejecting %.16s\n", buffer);
+            busy = 1;
+        // The client's and the class's command rates come first
+        } else if (rate_admit_command() < 0) {
+            busy = 1;
+        } else if (is_transfer && (slot = acquire_transfer_slot()) < 0) {
+            busy = 1;
+        }
 
         // Check if the received message contains file data after the command
         char *file_data = strstr(buffer, "END_CMD");
+        size_t file_len = 0;
+        uint32_t file_crc = 0;
+        // Upload body read past the first receive, freed after the command
+        char *body = NULL;
         if (file_data) {
             // If found, separate the command part from the file data
             *file_data = '\0';
             // Move the pointer past the "END_CMD" marker to get to the file data
             file_data += strlen("END_CMD");
+            file_len = bytes_read - (file_data - buffer);
+
+            // "ufile <name> <dest> <size> END_CMD" (and "udelta", laid out the same) announces the body size, as does
+            // "dtar <ext> ... manifest=<size> END_CMD": read all of it and its CRC32C trailer, so a large file never
+            // spills into the next command (older clients send the body in one piece, without a trailer)
+            unsigned long long announced;
+            char *manifest_option = strncmp(buffer, "dtar", 4) == 0 ? strstr(buffer, " manifest=") : NULL;
+            if (((strncmp(buffer, "ufile", 5) == 0 || strncmp(buffer, "udelta", 6) == 0)
+                 && sscanf(buffer, "%*s %*s %*s %llu", &announced) == 1)
+                || (manifest_option != NULL && sscanf(manifest_option, " manifest=%llu", &announced) == 1)) {
+                // A body above upload_max_size is never buffered; it cannot be skipped cheaply either, so the session ends
+                if (announced > (unsigned long long)upload_max_size || announced > SIZE_MAX - CRC_TRAILER_LEN - 1) {
+                    char error_message[128];
+                    snprintf(error_message, sizeof(error_message), "ERROR: Upload too large, the limit is %lld bytes!", upload_max_size);
+                    printf("%s\n", error_message);
+                    send(client_sock, error_message, strlen(error_message), 0);
+                    if (slot >= 0) {
+                        release_transfer_slot(slot);
+                    }
+                    break;
+                }
+                size_t needed = announced + CRC_TRAILER_LEN;
+                // A command turned away is answered after its body, read into the request buffer and dropped, so the
+                // next command starts where the client sends it
+                if (busy) {
+                    while (file_len < needed) {
+                        ssize_t n = recv(client_sock, buffer, needed - file_len < BUFSIZE ? needed - file_len : BUFSIZE, 0);
+                        if (n <= 0) {
+                            break;
+                        }
+                        file_len += n;
+                    }
+                    if (file_len < needed) {
+                        break;
+                    }
+                    send_busy(client_sock);
+                    continue;
+                }
+                if (needed > file_len) {
+                    body = pool_get(needed + 1);
+                    if (body == NULL) {
+                        perror("Memory allocation failed");
+                        send(client_sock, "File upload failed", 18, 0);
+                        if (slot >= 0) {
+                            release_transfer_slot(slot);
+                        }
+                        break;
+                    }
+                    memcpy(body, file_data, file_len);
+                    while (file_len < needed) {
+                        ssize_t n = recv(client_sock, body + file_len, needed - file_len, 0);
+                        if (n <= 0) {
+                            break;
+                        }
+                        file_len += n;
+                        rate_limit_bytes(n);
+                    }
+                    if (file_len < needed) {
+                        printf("Upload body truncated (%zu of %zu bytes)\n", file_len, needed);
+                        pool_put(body);
+                        if (slot >= 0) {
+                            release_transfer_slot(slot);
+                        }
+                        break;
+                    }
+                    body[file_len] = '\0';
+                    file_data = body;
+                }
+                // The body must arrive as the client read it, otherwise it is not stored anywhere
+                uint32_t sent_crc;
+                file_len = announced;
+                file_crc = crc32c(0, file_data, file_len);
+                if (parse_crc_trailer(file_data + file_len, &sent_crc) < 0 || sent_crc != file_crc) {
+                    const char *error_message = "ERROR: Upload checksum mismatch!";
+                    printf("%s\n", error_message);
+                    send(client_sock, error_message, strlen(error_message), 0);
+                    if (slot >= 0) {
+                        release_transfer_slot(slot);
+                    }
+                    pool_put(body);
+                    continue;
+                }
+            } else {
+                file_crc = crc32c(0, file_data, file_len);
+            }
+        }
+        if (busy) {
+            send_busy(client_sock);
+            continue;
         }
-        
-        // Determine which command the client sent and call the appropriate function to handle it
         if (strncmp(buffer, "ufile", 5) == 0) {
             // Handle the 'ufile' command, which uploads a file
             printf("File Upload request\n");
-            handle_ufile(client_sock, buffer, file_data);
+            handle_ufile(client_sock, buffer, file_data, file_len, file_crc);
         } else if (strncmp(buffer, "dfile", 5) == 0) {
             // Handle the 'dfile' command, which downloads a file
             printf("File download request\n");
@@ -148,15 +830,319 @@ void prcclient(int client_sock) {
         } else if (strncmp(buffer, "dtar", 4) == 0) {
             // Handle the 'dtar' command, which download file of given extension to Tar
             printf("TarFile download request\n");
-            handle_dtar(client_sock, buffer);
+            handle_dtar(client_sock, buffer, file_data, file_len);
         } else if (strncmp(buffer, "display", 7) == 0) {
             // Handle the 'display' command, which shows files in a directory
             printf("Display Files request\n");
             handle_display(client_sock, buffer);
+        } else if (strncmp(buffer, "search", 6) == 0) {
+            // Handle the 'search' command, which finds the lines of the files in a directory that contain a text
+            printf("Search request\n");
+            handle_search(client_sock, buffer);
+        } else if (strncmp(buffer, "query", 5) == 0) {
+            // Handle the 'query' command, which looks up the files containing some words in the stores' term indexes
+            printf("Query request\n");
+            handle_query(client_sock, buffer);
+        } else if (strncmp(buffer, "dsig", 4) == 0) {
+            // Handle the 'dsig' command, which sends the block signature of a file for a delta upload
+            printf("File signature request\n");
+            handle_dsig(client_sock, buffer);
+        } else if (strncmp(buffer, "udelta", 6) == 0) {
+            // Handle the 'udelta' command, which uploads a file as a delta against the stored copy
+            printf("Delta upload request\n");
+            handle_udelta(client_sock, buffer, file_data, file_len, file_crc);
+        }
+        if (slot >= 0) {
+            release_transfer_slot(slot);
+        }
+        pool_put(body);
+    }
+    pool_put(buffer);
+}
+
+// Function to take a buffer of at least size bytes from the buffer pool, NULL if no memory is left
+// Sizes above the largest class are allocated with malloc, pool_put frees them again
+void *pool_get(size_t size) {
+    int cls = 0;
+    while (cls < POOL_CLASSES && pool_class_size[cls] < size) {
+        cls++;
+    }
+    struct pool_buffer *b = NULL;
+    if (cls < POOL_CLASSES && pool_free[cls] != NULL) {
+        // Reuse a released buffer of the class
+        b = pool_free[cls];
+        pool_free[cls] = b->next;
+        return b + 1;
+    }
+    if (cls < POOL_CLASSES) {
+        // Carve a new buffer from the arena, mapping another one when it is used up
+        size_t need = sizeof(struct pool_buffer) + pool_class_size[cls];
+        if (need <= pool_arena_left || pool_map_arena() == 0) {
+            b = (struct pool_buffer *)pool_arena;
+            pool_arena += need;
+            pool_arena_left -= need;
+            b->cls = cls;
+            return b + 1;
+        }
+    }
+    b = malloc(sizeof(struct pool_buffer) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+    b->cls = -1;
+    return b + 1;
+}
+
+// Function to give a buffer from pool_get back to the pool (NULL is ignored)
+void pool_put(void *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    struct pool_buffer *b = (struct pool_buffer *)buffer - 1;
+    if (b->cls < 0) {
+        free(b);
+        return;
+    }
+    b->next = pool_free[b->cls];
+    pool_free[b->cls] = b;
+}
+
+// Function to map a new arena for the buffer pool. With buffer_hugepages it is one huge page if the system
+// has one reserved, otherwise transparent huge pages are requested for it; pages are only touched when used
+int pool_map_arena() {
+    void *arena = MAP_FAILED;
+    if (buffer_hugepages) {
+        arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (arena == MAP_FAILED) {
+        arena = mmap(NULL, POOL_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            perror("Buffer pool mapping failed");
+            return -1;
+        }
+        if (buffer_hugepages) {
+            madvise(arena, POOL_ARENA_SIZE, MADV_HUGEPAGE);
+        }
+    }
+    pool_arena = arena;
+    pool_arena_left = POOL_ARENA_SIZE;
+    return 0;
+}
+
+// Function to create the shared admission control state, before the first fork
+int init_admission() {
+    admission = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        perror("Admission control mapping failed");
+        admission = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to create the shared state of the bandwidth scheduler before the first fork, if any limit is set
+int init_rate_limits() {
+    rate_enabled = rate_total > 0 || rate_client_bytes > 0 || rate_client_ops > 0;
+    for (int c = 0; c < RATE_CLASSES; c++) {
+        rate_enabled |= rate_class_bytes[c] > 0 || rate_class_ops[c] > 0;
+    }
+    if (!rate_enabled) {
+        return 0;
+    }
+    rate_state = mmap(NULL, sizeof(struct rate_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rate_state == MAP_FAILED) {
+        perror("Rate limit mapping failed");
+        rate_state = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to take `amount` units from a token bucket refilled at `rate` units per second, kept as the time its
+// tokens run out (GCRA): a bucket never holds more than RATE_BURST_US worth of tokens. Returns how many
+// microseconds the caller has to wait before using them, or -1 without taking them if that is more than max_wait_us
+long long rate_take(struct rate_bucket *b, double amount, double rate, long long max_wait_us) {
+    uint64_t now = now_us();
+    uint64_t cost = (uint64_t)(amount * 1000000.0 / rate);
+    uint64_t old = __atomic_load_n(&b->empty_us, __ATOMIC_RELAXED);
+    while (1) {
+        uint64_t next = (old > now ? old : now) + cost;
+        long long wait = next - now > RATE_BURST_US ? (long long)(next - now - RATE_BURST_US) : 0;
+        if (max_wait_us >= 0 && wait > max_wait_us) {
+            return -1;
+        }
+        if (__atomic_compare_exchange_n(&b->empty_us, &old, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return wait;
+        }
+    }
+}
+
+// Function to find the scheduler entry of a client address, claiming a free one (or one idle for RATE_CLIENT_IDLE_US)
+// for a new client; NULL when the table is full
+struct rate_client *rate_client_for(uint32_t addr) {
+    uint64_t now = now_us();
+    uint32_t start = (uint32_t)strong_hash(FNV_OFFSET, (const unsigned char *)&addr, sizeof(addr)) % RATE_CLIENTS;
+    for (int probe = 0; probe < RATE_CLIENTS; probe++) {
+        struct rate_client *rc = &rate_state->clients[(start + probe) % RATE_CLIENTS];
+        uint32_t current = __atomic_load_n(&rc->addr, __ATOMIC_ACQUIRE);
+        if (current == addr) {
+            return rc;
+        }
+        uint64_t last = __atomic_load_n(&rc->last_us, __ATOMIC_RELAXED);
+        if ((current == 0 || now - last > RATE_CLIENT_IDLE_US)
+            && __atomic_compare_exchange_n(&rc->addr, &current, addr, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&rc->bytes.empty_us, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&rc->ops.empty_us, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&rc->last_us, now, __ATOMIC_RELAXED);
+            return rc;
+        }
+    }
+    return NULL;
+}
+
+// Function to pick the scheduler class of a command: dtar is bulk, the commands that move one file are transfers,
+// everything else (display, search, query, rmfile) is interactive
+int rate_class_of(const char *command) {
+    if (strncmp(command, "dtar", 4) == 0) {
+        return RATE_BULK;
+    }
+    if (strncmp(command, "ufile", 5) == 0 || strncmp(command, "dfile", 5) == 0 || strncmp(command, "udelta", 6) == 0
+        || strncmp(command, "dsig", 4) == 0) {
+        return RATE_TRANSFER;
+    }
+    return RATE_INTERACTIVE;
+}
+
+// Function to admit the current command (of class session_class) in the scheduler's operation limits of the
+// session's client and the class, waiting for a token
+// Returns -1 if the client or the class would have to wait longer than transfer_wait_ms
+int rate_admit_command() {
+    if (!rate_enabled) {
+        return 0;
+    }
+    long long max_wait = (long long)transfer_wait_ms * 1000, wait = 0, w;
+    if (session_client != NULL && rate_client_ops > 0) {
+        __atomic_store_n(&session_client->last_us, now_us(), __ATOMIC_RELAXED);
+        if ((w = rate_take(&session_client->ops, 1, rate_client_ops, max_wait)) < 0) {
+            return -1;
+        }
+        wait = w;
+    }
+    if (rate_class_ops[session_class] > 0) {
+        if ((w = rate_take(&rate_state->class_ops[session_class], 1, rate_class_ops[session_class], max_wait)) < 0) {
+            return -1;
+        }
+        wait = w > wait ? w : wait;
+    }
+    if (wait > 0) {
+        usleep(wait);
+    }
+    return 0;
+}
+
+// Function to account for `bytes` of the current command sent to or received from the client, waiting as long as
+// the client's limit and the class's share need. With rate_total set, the bandwidth is shared among the classes
+// that moved data in the last RATE_ACTIVE_US in proportion to their weights, so an idle class leaves its share to
+// the others, capped at each class's own limit.
+void rate_limit_bytes(size_t bytes) {
+    if (!rate_enabled || bytes == 0) {
+        return;
+    }
+    uint64_t now = now_us();
+    long long wait = 0, w;
+    if (session_client != NULL) {
+        __atomic_store_n(&session_client->last_us, now, __ATOMIC_RELAXED);
+        if (rate_client_bytes > 0) {
+            wait = rate_take(&session_client->bytes, bytes, rate_client_bytes, -1);
+        }
+    }
+    __atomic_store_n(&rate_state->class_active_us[session_class], now, __ATOMIC_RELAXED);
+    double rate = rate_class_bytes[session_class] > 0 ? (double)rate_class_bytes[session_class] : 0;
+    if (rate_total > 0) {
+        int weights = 0;
+        for (int c = 0; c < RATE_CLASSES; c++) {
+            if (now - __atomic_load_n(&rate_state->class_active_us[c], __ATOMIC_RELAXED) < RATE_ACTIVE_US) {
+                weights += rate_class_weight[c];
+            }
+        }
+        double share = (double)rate_total * rate_class_weight[session_class] / weights;
+        rate = (rate == 0 || share < rate) ? share : rate;
+    }
+    if (rate > 0 && (w = rate_take(&rate_state->class_bytes[session_class], bytes, rate, -1)) > wait) {
+        wait = w;
+    }
+    if (wait > 0) {
+        usleep(wait);
+    }
+}
+
+// Function to take a data transfer slot, waiting in the bounded queue while all of them are busy
+// Returns the slot index, or -1 when the queue is full or the wait exceeded transfer_wait_ms
+int acquire_transfer_slot() {
+    pid_t self = getpid();
+    int queued = 0;
+    uint64_t deadline = now_us() + (uint64_t)transfer_wait_ms * 1000;
+    useconds_t backoff = 500;
+
+    while (1) {
+        for (int i = 0; i < max_transfers; i++) {
+            pid_t expected = 0;
+            if (__atomic_compare_exchange_n(&admission->holders[i], &expected, self, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                if (queued) {
+                    __atomic_sub_fetch(&admission->waiting, 1, __ATOMIC_RELAXED);
+                }
+                return i;
+            }
+        }
+        // All slots are busy: join the queue if there is room, otherwise fail fast
+        if (!queued) {
+            if (__atomic_add_fetch(&admission->waiting, 1, __ATOMIC_RELAXED) > transfer_queue) {
+                __atomic_sub_fetch(&admission->waiting, 1, __ATOMIC_RELAXED);
+                printf("Transfer queue full, rejecting request\n");
+                return -1;
+            }
+            queued = 1;
         }
+        if (now_us() >= deadline) {
+            __atomic_sub_fetch(&admission->waiting, 1, __ATOMIC_RELAXED);
+            printf("Waited %d ms for a transfer slot, rejecting request\n", transfer_wait_ms);
+            return -1;
+        }
+        // Poll again with a short exponential backoff
+        usleep(backoff);
+        if (backoff < 8000) {
+            backoff *= 2;
+        }
+    }
+}
+
+// Function to give a data transfer slot back
+void release_transfer_slot(int slot) {
+    __atomic_store_n(&admission->holders[slot], 0, __ATOMIC_RELEASE);
+}
+
+// Function used by the parent to free the slots of a child that exited (or crashed) while holding them
+void reclaim_transfer_slots(pid_t pid) {
+    for (int i = 0; i < MAX_TRANSFER_SLOTS; i++) {
+        pid_t expected = pid;
+        __atomic_compare_exchange_n(&admission->holders[i], &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
     }
 }
 
+// Function to tell an overloaded client when to try again
+void send_busy(int client_sock) {
+    char message[128];
+    snprintf(message, sizeof(message), "ERROR: Server busy, retry after %d ms", busy_retry_ms);
+    printf("%s\n", message);
+    send(client_sock, message, strlen(message), MSG_NOSIGNAL);
+}
+
+// Function to tell the metadata commands (display, rmfile, query), which only touch the indexes and never move file
+// data, from the transfers: they get the priority sessions and the priority lanes of the backends
+int is_metadata_command(const char *command) {
+    return strncmp(command, "display", 7) == 0 || strncmp(command, "rmfile", 6) == 0 || strncmp(command, "query", 5) == 0;
+}
+
 // helper Function to check if the path is valid
 int is_valid_path(const char *path) {
     // Check if the path starts with "smain"
@@ -167,9 +1153,8 @@ int is_valid_path(const char *path) {
 }
 
 // Function to handle 'ufile' command
-void handle_ufile(int client_sock, char *command, char *file_data) {
+void handle_ufile(int client_sock, char *command, char *file_data, size_t file_len, uint32_t file_crc) {
     char filename[256], destination_path[256];
-    int server_sock;
     char *f_name;
 
     // Extract filename and destination path from the command
@@ -187,38 +1172,26 @@ void handle_ufile(int client_sock, char *command, char *file_data) {
         f_name = filename;
     }
 
-    // Check if the file is a PDF
-    if (strstr(filename, ".pdf") != NULL) {
-        // Forward to Spdf server
-        server_sock = connect_to_spdf();
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            // Notify the client that the file upload failed
-            send(client_sock, "File upload failed", 18, 0);
-            return;
-        }
-        // Send the file to the Spdf server
-        send_file_to_server(server_sock, client_sock, "ufile", f_name, destination_path, file_data);
-        close(server_sock);
+    // Look up the store responsible for the destination file
+    char route_path[512];
+    snprintf(route_path, sizeof(route_path), "%s/%s", destination_path, f_name);
+    const struct route *r = route_for_path(route_path);
 
-    // Check if the file is a text file
-    } else if (strstr(filename, ".txt") != NULL) {
-        // Connect to the Stext server
-        server_sock = connect_to_stext();
-        if (server_sock < 0) {
-            // Notify the client that the file upload failed
-            printf("Failed to connect to Stext server\n");
-            send(client_sock, "File upload failed", 18, 0);
-            return;
-        }
-        // Send the file to the Stext server
-        send_file_to_server(server_sock, client_sock, "ufile", f_name, destination_path, file_data);
-        close(server_sock);
+    if (r == NULL) {
+        // If the file type is unsupported, notify the client
+        printf("Unsupported file type: %s\n", filename);
+        send(client_sock, "Unsupported file type", 21, 0);
+
+    // Files routed to a backend store are written to all replicas of the path in parallel
+    } else if (!r->local) {
+        int replicas[MAX_ENDPOINTS];
+        int n = replicas_of(r, route_path, replicas);
+        send_file_to_replicas(r, replicas, n, client_sock, "ufile", f_name, destination_path, file_data, file_len, "", file_crc);
 
-    // Check if the file is a C file
-    } else if (strstr(filename, ".c") != NULL) {
+    // Files routed to the local store are saved by Smain
+    } else {
         // upload by Smain
-        if (receive_and_save_file(client_sock, destination_path, f_name, file_data) == 0) {
+        if (receive_and_save_file(client_sock, destination_path, f_name, file_data, file_len, file_crc) == 0) {
             // Notify the client that the file upload was successful
             const char *success_message = "File Uploaded successfully.";
             printf("%s\n",success_message);
@@ -229,20 +1202,25 @@ void handle_ufile(int client_sock, char *command, char *file_data) {
             printf("%s\n",failed_message);
             send(client_sock, failed_message, strlen(failed_message), 0);
         }
-    } else {
-        // If the file type is unsupported, notify the client
-        printf("Unsupported file type: %s\n", filename);
-        send(client_sock, "Unsupported file type", 21, 0);
     }
 }
 
 // Function to handle 'dfile' command
 void handle_dfile(int client_sock, char *command) {
-    int server_sock;
     char file_path[256];
+    // Optional byte range "dfile <path> <offset> <length>", used by clients that fetch large files in stripes,
+    // optionally followed by the version tag of a cached copy, which turns it into a conditional download,
+    // or by "if-match=<tag>", which only serves the range from that version of the file
+    long long offset = -1, length = -1;
+    char if_tag[64];
 
-    // Extract the file path from the command
-    sscanf(command, "dfile %s", file_path);
+    // Extract the file path (and the range and tag) from the command
+    int parsed = sscanf(command, "dfile %255s %lld %lld %63s", file_path, &offset, &length, if_tag);
+    if (parsed < 3 || offset < 0) {
+        offset = -1;
+        length = -1;
+        parsed = 1;
+    }
 
     // check if requested doenload file path is valid or not
     if(!is_valid_path(file_path)){
@@ -261,36 +1239,22 @@ void handle_dfile(int client_sock, char *command) {
         return;
     }
 
-    // Determine the file type and process accordingly
-    if(strstr(file_name,".c") != NULL){
-        // Handle .c file - Send file directly to the client
-        send_file_to_client(client_sock, file_path, file_name);
-    }else if(strstr(file_name,".txt") != NULL){
-        // Handle .txt file - Forward request to Stext server
-        server_sock = connect_to_stext();
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            return;
-        }
-        send_download_request(server_sock, client_sock, "dfile", file_path);
-        close(server_sock);
-
-    }else if(strstr(file_name,".pdf") != NULL){
-        // Handle .pdf file - Forward request to Spdf server
-        server_sock = connect_to_spdf();
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            return;
-        }
-        send_download_request(server_sock, client_sock, "dfile", file_path);
-        close(server_sock);
-
-    }else{
+    // Determine the store for the file and process accordingly
+    const struct route *r = route_for_path(file_path);
+    if (r == NULL) {
         printf("Invalid file type\n");
         // Send an error message to the client with a specific prefix
         const char *success_message = "ERROR: Invalid file type!";
         send(client_sock, success_message, strlen(success_message), 0);
         return;
+    } else if (r->local) {
+        // Handle local file - Send file directly to the client
+        send_file_to_client(client_sock, file_path, file_name, offset, length, parsed == 4 ? if_tag : NULL);
+    } else {
+        // Handle backend file - Read from the fastest replica, hedging to another one if it is slow
+        int replicas[MAX_ENDPOINTS];
+        int n = replicas_of(r, file_path, replicas);
+        hedged_download(client_sock, r, replicas, n, "dfile", file_path, offset, length, parsed == 4 ? if_tag : NULL);
     }
 }
 
@@ -298,15 +1262,14 @@ void handle_dfile(int client_sock, char *command) {
 void handle_rmfile(int client_sock, char *command) {
     // variable to store the file path
     char file_path[256];
-    int server_sock;
 
     // Extract the file path from the command
     sscanf(command, "rmfile %s", file_path);
     
     // Create a copy of the file path to use for Tokenization
-    char file_path_copy[BUFSIZE];
-    strncpy(file_path_copy, file_path, BUFSIZE - 1);
-    file_path_copy[BUFSIZE - 1] = '\0';
+    char file_path_copy[PATH_BUFSIZE];
+    strncpy(file_path_copy, file_path, sizeof(file_path_copy) - 1);
+    file_path_copy[sizeof(file_path_copy) - 1] = '\0';
 
     // Tokenize the file path to get the file name
     char *file_name = NULL;
@@ -316,39 +1279,22 @@ void handle_rmfile(int client_sock, char *command) {
         token = strtok(NULL, "/");
     }
 
-    // Check if the file has a .pdf extension
-    if (strstr(file_name, ".pdf") != NULL) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_spdf();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            send(client_sock, "File remove failed", 18, 0);
-            return;
-        }
-        // Remove the file from the server
-        remove_file_from_server(server_sock, client_sock, "rmfile", file_path);
-        // Close the server connection after the operation
-        close(server_sock);
+    // Look up the store responsible for the file
+    const struct route *r = (file_name != NULL) ? route_for_path(file_path) : NULL;
 
-    // Check if the file has a .txt extension
-    } else if (strstr(file_name, ".txt") != NULL) {
-        // Connect to the server responsible for handling text files
-        server_sock = connect_to_stext();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
-            send(client_sock, "File remove failed", 18, 0);
-            return;
-        }
-        // Remove the file from the server
-        remove_file_from_server(server_sock, client_sock, "rmfile", file_path);
-        // Close the server connection after the operation
-        close(server_sock);
+    // Handle unsupported file types
+    if (r == NULL) {
+        printf("Unsupported file type: %s\n", file_path);
+        send(client_sock, "Unsupported file type", 21, 0);
+
+    // Files stored on a backend are removed from every replica
+    } else if (!r->local) {
+        int replicas[MAX_ENDPOINTS];
+        int n = replicas_of(r, file_path, replicas);
+        remove_file_from_replicas(r, replicas, n, client_sock, "rmfile", file_path);
 
-    // Check if the file has a .c extension
-    } else if (strstr(file_name, ".c") != NULL) {
-        // Delete the .c file by Smain
+    // Files in the local store are deleted by Smain
+    } else {
         int result = delete_file(file_path);
         if (result == 0) {
             // Send confirmation to the client
@@ -366,21 +1312,26 @@ void handle_rmfile(int client_sock, char *command) {
             printf("%s\n",success_message);
             send(client_sock, success_message, strlen(success_message), 0);
         }
-
-    // Handle unsupported file types
-    } else {
-        printf("Unsupported file type: %s\n", file_name);
     }
 }
 
 // Function to handle 'dtar' command from client
-void handle_dtar(int client_sock, char *command) {
+void handle_dtar(int client_sock, char *command, char *manifest, size_t manifest_len) {
     // variable to store the file extension
-    char ext[10];
+    char ext[32];
     // store the server socket connection
     int server_sock;
-    // Extract the file extension from the command 
-    sscanf(command, "dtar %s", ext);
+    // Extract the file extension from the command, the words after it make the dtar incremental
+    int consumed = 0;
+    sscanf(command, "dtar %31s %n", ext, &consumed);
+    long long since, announced;
+    if (consumed == 0 || parse_tar_options(command + consumed, &since, &announced) < 0
+        || (announced >= 0 && (manifest == NULL || (size_t)announced != manifest_len))) {
+        const char *error_message = "ERROR: Invalid dtar options!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
 
     // Define the path to be searched
     const char *home_dir = getenv("HOME");
@@ -394,34 +1345,39 @@ void handle_dtar(int client_sock, char *command) {
     snprintf(full_path, sizeof(full_path), "%s/smain", home_dir);
 
 
-    // Check if the file has a .pdf extension
-    if (strcmp(ext, ".pdf") == 0) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_spdf();
-        // If the connection fails, inform the client and exit the function
-        if (server_sock < 0) {
-            printf("Failed to connect to Spdf server\n");
-            return;
-        }
-        // Send Request to the server to create a tarball and send it back and forward to client
-        request_tar_file(server_sock,client_sock,full_path);
-        close(server_sock);
+    // Look up the store responsible for the extension
+    const struct route *r = route_for_ext(ext);
+    if (r == NULL) {
+        // Print a message indicating that the file extension is not supported
+        const char *success_message = "ERROR: Invalid Extention Format!";
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+
+    // A sharded store is asked for every shard's tarball, which are merged into one
+    } else if (!r->local && r->n_endpoints > 1) {
+        merge_shard_tars(client_sock, r, full_path, ext, since, manifest, announced);
 
-    // Check if the file has a .txt extension
-    }else if (strcmp(ext, ".txt") == 0) {
-        // Connect to the server responsible for handling PDF files
-        server_sock = connect_to_stext();
+    // A single backend builds the tarball itself
+    } else if (!r->local) {
+        // Connect to the server responsible for the store
+        server_sock = connect_to_endpoint(&r->endpoints[0]);
         // If the connection fails, inform the client and exit the function
         if (server_sock < 0) {
-            printf("Failed to connect to Stext server\n");
+            printf("Failed to connect to %s server\n", r->store);
+            const char *error_message = "ERROR: Storage server unavailable!";
+            send(client_sock, error_message, strlen(error_message), 0);
             return;
         }
         // Send Request to the server to create a tarball and send it back and forward to client
-        request_tar_file(server_sock,client_sock,full_path);
+        request_tar_file(&r->endpoints[0], server_sock, client_sock, full_path, ext, since, manifest, announced);
         close(server_sock);
 
-    // Check if the file has a .c extension
-    }else if (strcmp(ext, ".c") == 0) {
+    // Local store: tar the files under Smain's own directory
+    } else {
+        // Packed files have no directory on disk, but the tarball is built in Smain's directory
+        if (file_index->active >= 0) {
+            mkdir(full_path, 0777);
+        }
         // Check if the full_path exists and is a directory
         struct stat path_stat;
         if (stat(full_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
@@ -432,68 +1388,164 @@ void handle_dtar(int client_sock, char *command) {
             send(client_sock, error_message, strlen(error_message), 0);
             return;
         }
-        // Create a tarball of the ".c" files and send it to the client
-        c_tar_file(client_sock, full_path);
-
-    } else {
-        // Print a message indicating that the file extension is not supported
-        const char *success_message = "ERROR: Invalid Extention Format!";
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+        // Create a tarball of the matching files (or of those that changed) and send it to the client
+        struct tar_delta delta;
+        if (since < 0 && announced < 0) {
+            local_tar_file(client_sock, full_path, ext, NULL);
+        } else if (begin_tar_delta(&delta, r->store, since, manifest, announced) < 0) {
+            const char *error_message = "ERROR: Tar file creation failed!";
+            send(client_sock, error_message, strlen(error_message), 0);
+        } else {
+            local_tar_file(client_sock, full_path, ext, &delta);
+            end_tar_delta(&delta);
+        }
     }
 }
 
-// Function to handle 'display' command
-void handle_display(int client_sock, char *command) {
-    // variables to store the pathname and full path
-    char pathname[256];
-    char full_path[BUFSIZE];
-    // variables for server socket connections and file stats
-    int server_sock;
-    struct stat path_stat;
-    int server_sock_pdf,server_sock_txt;
-
-    // Extract the pathname from the command
-    sscanf(command, "display %s", pathname);
-
-    // Initialize file lists
-    char c_files[BUFSIZE] = "";  // List of .c files
-    char pdf_files[BUFSIZE] = ""; // List of .pdf files from server
-    char txt_files[BUFSIZE] = ""; // List of .txt files from server
+// Function to handle 'dsig' command: "dsig <path>" sends the block signature of the stored file,
+// which the client compares with its new version to upload only what changed
+void handle_dsig(int client_sock, char *command) {
+    char file_path[256];
 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+    // Extract the file path from the command and check it
+    if (sscanf(command, "dsig %255s", file_path) != 1 || !is_valid_path(file_path)) {
+        printf("ERROR: Invalid path!\n");
+        const char *error_message = "ERROR: Invalid path!";
+        send(client_sock, error_message, strlen(error_message), 0);
         return;
     }
-    // Construct the full path for the directory
-    if (pathname[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, pathname + 1);
-    } else {
-        snprintf(full_path, sizeof(full_path), "%s", pathname);
-    }
 
-    // Initialize a flag to check if the path exists
+    // Determine the store for the file and process accordingly
+    const struct route *r = route_for_path(file_path);
+    if (r == NULL) {
+        const char *error_message = "ERROR: Invalid file type!";
+        send(client_sock, error_message, strlen(error_message), 0);
+    } else if (r->local) {
+        // Local file: compute the signature here
+        const char *home_dir = getenv("HOME");
+        char full_path[PATH_BUFSIZE];
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir ? home_dir : "", file_path + 1);
+        int file_fd = open(full_path, O_RDONLY);
+        if (file_fd < 0) {
+            const char *error_message = "ERROR: File not found!";
+            send(client_sock, error_message, strlen(error_message), 0);
+            return;
+        }
+        send_signature(client_sock, file_fd);
+        close(file_fd);
+    } else {
+        // Backend file: the signature is read like a download, from the fastest replica
+        int replicas[MAX_ENDPOINTS];
+        int n = replicas_of(r, file_path, replicas);
+        hedged_download(client_sock, r, replicas, n, "dsig", file_path, -1, -1, NULL);
+    }
+}
+
+// Function to handle 'udelta' command: "udelta <name> <dest> <size> <block size> <old hash> <new hash> END_CMD"
+// followed by the delta, applied to the stored copy (on every replica) and swapped in atomically
+void handle_udelta(int client_sock, char *command, char *delta, size_t delta_len, uint32_t delta_crc) {
+    char filename[256], destination_path[256];
+    int block_size;
+    unsigned long long base_hash, new_hash;
+
+    // Extract the file name, destination and the delta parameters from the command
+    if (sscanf(command, "udelta %255s %255s %*s %d %llx %llx", filename, destination_path, &block_size, &base_hash, &new_hash) != 5
+        || block_size <= 0) {
+        printf("Command parsing failed\n");
+        send(client_sock, "File upload failed", 18, 0);
+        return;
+    }
+    char *f_name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+
+    // Look up the store responsible for the destination file
+    char route_path[512];
+    snprintf(route_path, sizeof(route_path), "%s/%s", destination_path, f_name);
+    const struct route *r = route_for_path(route_path);
+    if (r == NULL) {
+        printf("Unsupported file type: %s\n", filename);
+        send(client_sock, "Unsupported file type", 21, 0);
+    } else if (!r->local) {
+        // Every replica checks the delta against its own copy, one with another version fails the write
+        char options[64];
+        snprintf(options, sizeof(options), " %d %016llx %016llx", block_size, base_hash, new_hash);
+        int replicas[MAX_ENDPOINTS];
+        int n = replicas_of(r, route_path, replicas);
+        send_file_to_replicas(r, replicas, n, client_sock, "udelta", f_name, destination_path, delta, delta_len, options, delta_crc);
+    } else {
+        // Local file: rebuild it here
+        const char *home_dir = getenv("HOME");
+        char full_path[PATH_BUFSIZE];
+        if (destination_path[0] == '~') {
+            snprintf(full_path, sizeof(full_path), "%s%s/%s", home_dir ? home_dir : "", destination_path + 1, f_name);
+        } else {
+            snprintf(full_path, sizeof(full_path), "%s/%s", destination_path, f_name);
+        }
+        if (apply_delta(full_path, (const unsigned char *)delta, delta_len, block_size, base_hash, new_hash) == 0) {
+            const char *success_message = "File Uploaded successfully.";
+            printf("%s\n", success_message);
+            send(client_sock, success_message, strlen(success_message), 0);
+        } else {
+            const char *failed_message = "File uploading failed!";
+            printf("%s\n", failed_message);
+            send(client_sock, failed_message, strlen(failed_message), 0);
+        }
+    }
+}
+
+// Function to handle 'display' command, "display <dir>" optionally followed by the predicates of a filter
+// (see struct list_filter), which Smain and every store apply before anything is sent
+void handle_display(int client_sock, char *command) {
+    // variables to store the pathname and full path
+    char pathname[256];
+    char full_path[PATH_BUFSIZE];
+    // variable for file stats
+    struct stat path_stat;
+    // Extract the pathname and the filter from the command
+    struct list_filter filter;
+    int consumed = 0;
+    if (sscanf(command, "display %255s %n", pathname, &consumed) != 1 || parse_list_filter(command + consumed, &filter) < 0) {
+        const char *error_message = "ERROR: Invalid display filter!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+    const char *options = command + consumed;
+
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return;
+    }
+
+    // Initialize file lists, in buffers from the pool
+    char *local_files = pool_get(BUFSIZE);      // List of files kept by Smain
+    char *remote_files = pool_get(BUFSIZE);     // List of files from one backend store
+    char *combined_list = pool_get(LIST_BUFSIZE);
+    if (local_files == NULL || remote_files == NULL || combined_list == NULL) {
+        perror("Memory allocation failed");
+        const char *error_message = "ERROR: Server out of memory!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        pool_put(local_files);
+        pool_put(remote_files);
+        pool_put(combined_list);
+        return;
+    }
+    local_files[0] = remote_files[0] = combined_list[0] = '\0';
+    // Construct the full path for the directory
+    if (pathname[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, pathname + 1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", pathname);
+    }
+
+    // Initialize a flag to check if the path exists
     int path_exists = 0;
     if (stat(full_path, &path_stat) == 0) {
         if (S_ISDIR(path_stat.st_mode)) {
             path_exists = 1;
-            // Step 1: Retrieve the list of .c files from the local directory
-            DIR *dir = opendir(full_path);
-            struct dirent *entry;
-            // If the directory is opened successfully, read its contents
-            if (dir != NULL) {
-                while ((entry = readdir(dir)) != NULL) {
-                    // Check if the file has a .c extension and add it to the list
-                    if (strstr(entry->d_name, ".c") != NULL) {
-                        strcat(c_files, entry->d_name);
-                        strcat(c_files, "\n");
-                    }
-                }
-                // Close the directory after reading its contents
-                closedir(dir);
-            }
+            // Step 1: Retrieve the list of locally stored files that pass the filter from the local directory
+            list_local_dir(full_path, pathname, "", filter.depth, &filter, local_files, BUFSIZE);
         } else {
             // If the path exists but is not a directory, print an error
             printf("ERROR: Not a directory in Smain!\n");
@@ -502,652 +1554,4327 @@ void handle_display(int client_sock, char *command) {
         // If stat fails, it might be due to an invalid path
         printf("ERROR: Invalid path or not a directory in Smain!\n");
     }
+    // Packed files are listed from the pack index, their directory need not exist on disk
+    if (pack_list_dir(full_path, &filter, local_files, BUFSIZE) > 0) {
+        path_exists = 1;
+    }
 
     // Prefix for error messages
     const char *error_prefix = "ERROR:";
 
-    // Construct the message to send
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "display %s", full_path);
+    // Construct the message to send, the stores apply the same filter
+    char message[CMD_BUFSIZE];
+    snprintf(message, sizeof(message), "display %s %s", full_path, options);
 
-    // Step 2: Retrieve .pdf files from Spdf server
-    get_file_names_from_server(connect_to_spdf, message, error_prefix, pdf_files, sizeof(pdf_files));
+    // Step 2: Combine the lists, starting with the local files if the path exists in Smain
+    int degraded = 0;
+    if (path_exists) {
+        strcat(combined_list, local_files);
+    }
 
-    // Step 3: Retrieve .txt files from Stext server
-    get_file_names_from_server(connect_to_stext, message, error_prefix, txt_files, sizeof(txt_files));
+    // Step 3: Retrieve the file names from every backend store and add them to the combined list
+    for (int i = 0; i < n_routes; i++) {
+        if (!first_route_of_store(i)) {
+            continue;
+        }
+        // Ask every shard of the store and merge their lists, unavailable shards are skipped
+        for (int e = 0; e < routes[i].n_endpoints; e++) {
+            if (get_file_names_from_server(&routes[i].endpoints[e], message, error_prefix, remote_files, BUFSIZE) < 0) {
+                degraded = 1;
+                continue;
+            }
+            append_unique_lines(combined_list, LIST_BUFSIZE, remote_files);
+        }
+    }
 
-    // Step 4: Combine the lists
-    char combined_list[3 * BUFSIZE] = "";
-    // If the path exists for c files, add .c files to the combined list
-    if (path_exists) {
-        strcat(combined_list, c_files);
+    // If some storage servers could not be asked, the list is served degraded with a warning
+    if (degraded && strlen(combined_list) > 0) {
+        strncat(combined_list, "WARNING: some storage servers are unavailable, the list may be incomplete\n",
+                LIST_BUFSIZE - strlen(combined_list) - 1);
     }
-    // Add .pdf and .txt files from the servers to the combined list
-    strcat(combined_list, pdf_files);
-    strcat(combined_list, txt_files);
 
     // If no files were found, send an error message to the client
     if(strlen(combined_list) == 0){
-        const char *error_message = "ERROR: No files found or given path doesnot exist!";
+        const char *error_message = degraded ? "ERROR: No files found, some storage servers are unavailable!"
+                                             : "ERROR: No files found or given path doesnot exist!";
         printf("%s\n",error_message);
         send(client_sock, error_message, strlen(error_message), 0);
     }else{
         // print and send the list of files to the client
         printf("List of files has been sent to Client\n");
-        send(client_sock,combined_list,strlen(combined_list),0);
+        send(client_sock, combined_list, strlen(combined_list), MSG_MORE);
+        // The end marker tells the client where a list of any length ends
+        send(client_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0);
     }
-    
+    pool_put(local_files);
+    pool_put(remote_files);
+    pool_put(combined_list);
 }
 
-// Function to connect to the Spdf server
-int connect_to_spdf() {
-    // variable to store the socket descriptor
-    int server_sock;
-    // structure to store the server's address information
-    struct sockaddr_in server_addr;
-
-    // Create a socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // Check if the socket creation was successful
-    if (server_sock < 0) {
-        perror("Spdf socket creation failed");
-        return -1;
+// Function to handle 'search' command, "search <dir> <text>": the files below the directory, Smain's own and those
+// of every store, are scanned for the text in parallel and a "<file>:<line>:<text of the line>" line is streamed
+// back for each matching line as it is found, files named relative to the directory. The lines end with END_CMD.
+void handle_search(int client_sock, char *command) {
+    // variables to store the pathname and full path
+    char pathname[256];
+    char full_path[PATH_BUFSIZE];
+    // Extract the pathname and the text to search for, which is the rest of the line and may contain spaces
+    int consumed = 0;
+    command[strcspn(command, "\r\n")] = '\0';
+    if (sscanf(command, "search %255s %n", pathname, &consumed) != 1 || command[consumed] == '\0') {
+        const char *error_message = "ERROR: Invalid search command!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
     }
+    const char *text = command + consumed;
 
-    // Set up the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8081);  // Port for Spdf
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    // Connect to the Spdf server
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        // Print an error message if the connection fails
-        perror("Connect to Spdf failed");
-        close(server_sock);
-        return -1;
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return;
     }
-
-    return server_sock;
-}
-
-// Function to connect to the Stext server
-int connect_to_stext() {
-    // variable to store the socket descriptor
-    int server_sock;
-    // structure to store the server's address information
-    struct sockaddr_in server_addr;
-
-    // Create a socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    // Check if the socket creation was successful
-    if (server_sock < 0) {
-        perror("Stext socket creation failed");
-        return -1;
+    if (pathname[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, pathname + 1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", pathname);
     }
 
-    // Set up the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(8082);  // Port for Stext
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    // Step 1: Search the local files, loose and packed
+    struct search_file *files = NULL;
+    int n_files = 0, capacity = 0;
+    collect_local_search(full_path, pathname, "", MAX_LIST_DEPTH, &files, &n_files, &capacity);
+    pack_collect_search(full_path, &files, &n_files, &capacity);
+    long long sent = run_search(client_sock, files, n_files, text);
+    free(files);
+    if (sent < 0) {
+        const char *error_message = "ERROR: Search failed!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
 
-    // Connect to the Stext server
-    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        // Print an error message if the connection fails
-        perror("Connect to Stext failed");
-        close(server_sock);
-        return -1;
+    // Step 2: Every backend store searches its own files, their lines are passed on as they arrive
+    char message[CMD_BUFSIZE];
+    snprintf(message, sizeof(message), "search %s %s", full_path, text);
+    char *remote_lines = NULL;
+    int degraded = 0;
+    for (int i = 0; i < n_routes; i++) {
+        if (!first_route_of_store(i)) {
+            continue;
+        }
+        for (int e = 0; e < routes[i].n_endpoints; e++) {
+            if (routes[i].replicas <= 1) {
+                // Each file is on one shard, so the shards' lines can be streamed without duplicates
+                long long relayed = relay_search_results(&routes[i].endpoints[e], message, client_sock);
+                if (relayed < 0) {
+                    degraded = 1;
+                } else {
+                    sent += relayed;
+                }
+                continue;
+            }
+            // Replicas find the same lines: their results are collected and merged without duplicates first
+            if (remote_lines == NULL && (remote_lines = pool_get(LIST_BUFSIZE)) != NULL) {
+                remote_lines[0] = '\0';
+            }
+            char *endpoint_lines = pool_get(BUFSIZE);
+            if (remote_lines == NULL || endpoint_lines == NULL
+                || get_file_names_from_server(&routes[i].endpoints[e], message, "ERROR:", endpoint_lines, BUFSIZE) < 0) {
+                degraded = 1;
+            } else {
+                append_unique_lines(remote_lines, LIST_BUFSIZE, endpoint_lines);
+            }
+            pool_put(endpoint_lines);
+        }
+        if (remote_lines != NULL && remote_lines[0] != '\0') {
+            send(client_sock, remote_lines, strlen(remote_lines), MSG_MORE);
+            sent += strlen(remote_lines);
+            remote_lines[0] = '\0';
+        }
     }
+    pool_put(remote_lines);
 
-    return server_sock;
+    // Nothing sent yet means no file matched, which is answered by an error alone
+    if (sent == 0) {
+        const char *error_message = degraded ? "ERROR: No matches found, some storage servers are unavailable!"
+                                             : "ERROR: No matches found!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+    if (degraded) {
+        const char *warning = "WARNING: some storage servers are unavailable, the results may be incomplete\n";
+        send(client_sock, warning, strlen(warning), MSG_MORE);
+    }
+    printf("Search results have been sent to Client\n");
+    send(client_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0);
 }
 
-
-// helper Function to send a file to a specified server for uploading file
-void send_file_to_server(int server_sock, int client_sock, char *command, char *filename, char *destination_path, char *file_data) {
-    // buffer to hold data
-    char buffer[BUFSIZE];
-    // store the number of bytes sent
-    ssize_t bytes_sent;
-    // buffer to hold the response from the server
-    char recv_buffer[BUFSIZE];
+// Function to handle 'query' command, "query <dir> <word> [word ...]": every store looks the files below the
+// directory that contain all the words up in its term index, without reading them, and the lists are merged like
+// those of display. Smain's own files are not in a term index, they are found with search.
+void handle_query(int client_sock, char *command) {
+    // variables to store the pathname and full path
+    char pathname[256];
+    char full_path[PATH_BUFSIZE];
+    // Extract the pathname and the words
+    int consumed = 0;
+    command[strcspn(command, "\r\n")] = '\0';
+    if (sscanf(command, "query %255s %n", pathname, &consumed) != 1 || command[consumed] == '\0') {
+        const char *error_message = "ERROR: Invalid query!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
 
     // Replace ~ with the value of the HOME environment variable
     const char *home_dir = getenv("HOME");
-    // Check if the HOME environment variable is available
     if (home_dir == NULL) {
-        // Print an error message if the HOME variable is not found
         fprintf(stderr, "Failed to get HOME environment variable\n");
         return;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home_dir, destination_path + 1, filename);
+    if (pathname[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, pathname + 1);
     } else {
-        snprintf(full_path, sizeof(full_path), "%s/%s", destination_path, filename);
+        snprintf(full_path, sizeof(full_path), "%s", pathname);
     }
-    
-    // Construct the message with the command and the full path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s\n", command, full_path);
 
-    // Calculate the total length of the message including file data
-    size_t total_length = strlen(message) + strlen(file_data) + 1; // +1 for null terminator
-    
-    // Allocate memory to hold the entire message (command + file path + file data)
-    char *complete_message = malloc(total_length);
-    if (complete_message == NULL) {
-        // Print an error message if memory allocation fails
+    char *remote_files = pool_get(BUFSIZE);     // List of files from one backend store
+    char *combined_list = pool_get(LIST_BUFSIZE);
+    if (remote_files == NULL || combined_list == NULL) {
         perror("Memory allocation failed");
+        const char *error_message = "ERROR: Server out of memory!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        pool_put(remote_files);
+        pool_put(combined_list);
         return;
     }
+    combined_list[0] = '\0';
 
-    // Copy the message and file data into the complete_message buffer
-    strcpy(complete_message, message);
-    // Append the file data to the complete_message buffer
-    strcat(complete_message, file_data);
+    // Ask every shard of every store once, replicas give the same files, which the merge drops
+    char message[CMD_BUFSIZE];
+    snprintf(message, sizeof(message), "query %s %s", full_path, command + consumed);
+    int degraded = 0;
+    for (int i = 0; i < n_routes; i++) {
+        if (!first_route_of_store(i)) {
+            continue;
+        }
+        for (int e = 0; e < routes[i].n_endpoints; e++) {
+            if (get_file_names_from_server(&routes[i].endpoints[e], message, "ERROR:", remote_files, BUFSIZE) < 0) {
+                degraded = 1;
+                continue;
+            }
+            append_unique_lines(combined_list, LIST_BUFSIZE, remote_files);
+        }
+    }
 
-    // Send the complete message (command, full path, and file data in one go)
-    printf("Sending request to server...\n");
-    bytes_sent = send(server_sock, complete_message, total_length - 1, 0); // -1 to exclude the null terminator
-    if (bytes_sent < 0) {
-        // Print an error message if sending fails
-        perror("Send failed");
-    }
-
-    // Receive and display the confirmation message
-    ssize_t bytes_received = recv(server_sock, recv_buffer, sizeof(recv_buffer) - 1, 0);
-    // Check if data was received from the server
-    if (bytes_received > 0) {
-        // Null-terminate the received data to make it a valid string
-        recv_buffer[bytes_received] = '\0';
-        printf("Server Responce: %s\nforwarding responce to client\n",recv_buffer);
-        // Forward the server response to the client
-        if (send(client_sock, recv_buffer, bytes_received, 0) < 0) {
-            // Print an error message if forwarding to the client fails
-            perror("Send to client failed");
-        }
-    } else if (bytes_received == 0) {
-        // Print a message if the connection was closed by the server
-        printf("Connection closed by server.\n");
-        exit(EXIT_SUCCESS);
+    if (degraded && strlen(combined_list) > 0) {
+        strncat(combined_list, "WARNING: some storage servers are unavailable, the list may be incomplete\n",
+                LIST_BUFSIZE - strlen(combined_list) - 1);
+    }
+    if (strlen(combined_list) == 0) {
+        const char *error_message = degraded ? "ERROR: No files found, some storage servers are unavailable!"
+                                             : "ERROR: No files found!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
     } else {
-        // Print an error message if there was an issue receiving data
-        perror("Error receiving data");
+        printf("Query results have been sent to Client\n");
+        send(client_sock, combined_list, strlen(combined_list), MSG_MORE);
+        send(client_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0);
     }
-
-    // Free allocated memory
-    free(complete_message);
+    pool_put(remote_files);
+    pool_put(combined_list);
 }
 
-
-// Function to receive a file from a client and save it to the specified destination for uploading file
-int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data) {
-    // a buffer to hold data temporarily
-    char buffer[BUFSIZE];
-    int file_fd;
-    // To store the number of bytes received
-    ssize_t bytes_received;
-    // buffer to hold the directory path
-    char dir_path[256];
- 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
-        return -1;
+// Function to add the local files below a directory to the files of a search, looking `depth` levels of
+// subdirectories further down; files below the directory are named relative to it ("sub/x.c")
+void collect_local_search(const char *dir_path, const char *pathname, const char *relative, int depth, struct search_file **files, int *n, int *capacity) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
     }
- 
-    // Create the full path for the file
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path + 1);
-    } else {
-        strncpy(full_path, destination_path, sizeof(full_path) - 1);
-        full_path[sizeof(full_path) - 1] = '\0';
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char entry_path[PATH_BUFSIZE], name[PATH_BUFSIZE];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat(entry_path, &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode))) {
+            if (depth > 0) {
+                char sub_relative[PATH_BUFSIZE];
+                if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                    collect_local_search(entry_path, pathname, sub_relative, depth - 1, files, n, capacity);
+                }
+            }
+            continue;
+        }
+        // Only files routed to the local store are Smain's to search
+        char route_path[PATH_BUFSIZE];
+        if (snprintf(route_path, sizeof(route_path), "%s/%s", pathname, name) >= (int)sizeof(route_path)) {
+            continue;
+        }
+        const struct route *r = route_for_path(route_path);
+        if (r != NULL && r->local && add_search_file(files, n, capacity, entry_path, name, 0, -1) < 0) {
+            break;
+        }
     }
- 
-    // Copy the destination path to dir_path
-    strncpy(dir_path, full_path, sizeof(dir_path) - 1);
-    dir_path[sizeof(dir_path) - 1] = '\0';
- 
-    // Ensure the destination directory exists by creating it if necessary
-    char command[BUFSIZE];
-    snprintf(command, sizeof(command), "mkdir -p %s", dir_path);
-    system(command);
- 
-    // Construct the full path for the file (path + file name)
-    char final_path[512];
-    snprintf(final_path, sizeof(final_path), "%s/%s", full_path, f_name);
- 
-    // Create the file at the specified path with read/write permissions
-    file_fd = open(final_path, O_CREAT | O_RDWR | O_TRUNC, 0777);
-    if (file_fd < 0) {
-        // Print an error message if file creation fails
-        perror("File creation failed");
+    closedir(dir);
+}
+
+// Function to send a search to one backend endpoint and pass the lines it finds on to the client as they arrive
+// Returns the number of bytes passed on, -1 when the endpoint was unreachable or timed out
+long long relay_search_results(const struct endpoint *ep, const char *message, int client_sock) {
+    int server_sock = connect_to_endpoint(ep);
+    if (server_sock < 0) {
+        printf("Failed to connect to server\n");
         return -1;
     }
- 
-    // Write the received file data into the newly created file
-    if (file_data) {
-        write(file_fd, file_data, strlen(file_data));
+    send(server_sock, message, strlen(message), MSG_NOSIGNAL);
+
+    // The store closes the connection after its last line; an error reply (no such directory) is not passed on
+    long long relayed = 0;
+    char buffer[PIPE_BUF];
+    ssize_t n;
+    while ((n = recv(server_sock, buffer, sizeof(buffer), 0)) != 0) {
+        if (n < 0) {
+            perror("Error receiving search results");
+            report_backend(ep, 0);
+            close(server_sock);
+            return relayed > 0 ? relayed : -1;
+        }
+        if (relayed == 0 && strncmp(buffer, "ERROR:", n < 6 ? n : 6) == 0) {
+            break;
+        }
+        send(client_sock, buffer, n, MSG_NOSIGNAL | MSG_MORE);
+        relayed += n;
+    }
+    report_backend(ep, 1);
+    close(server_sock);
+    return relayed;
+}
+
+// Function to read the predicates of a filtered display from the words after its path, returns -1 for an unknown
+// or invalid one
+int parse_list_filter(const char *options, struct list_filter *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->max_size = -1;
+    char words[PATH_BUFSIZE];
+    snprintf(words, sizeof(words), "%s", options);
+    char *saveptr;
+    for (char *word = strtok_r(words, " \t\r\n", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        char *value = strchr(word, '=');
+        char *end = NULL;
+        if (value == NULL || value[1] == '\0') {
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcmp(word, "name") == 0) {
+            snprintf(filter->glob, sizeof(filter->glob), "%s", value);
+            continue;
+        }
+        long long number = strtoll(value, &end, 10);
+        if (*end != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(word, "min") == 0) {
+            filter->min_size = number;
+        } else if (strcmp(word, "max") == 0) {
+            filter->max_size = number;
+        } else if (strcmp(word, "since") == 0) {
+            filter->since = number;
+        } else if (strcmp(word, "depth") == 0 && number <= MAX_LIST_DEPTH) {
+            filter->depth = (int)number;
+        } else {
+            return -1;
+        }
     }
-    
-    // Close the file after writing is complete
-    close(file_fd);
     return 0;
 }
 
+// Function to check whether the size and modification time of files must be read to apply a filter
+int filter_needs_stat(const struct list_filter *filter) {
+    return filter->min_size > 0 || filter->max_size >= 0 || filter->since > 0;
+}
 
-// Function to remove requested file by client from servers
-void remove_file_from_server(int sock, int client_sock, char *command, char *destination_path){
-    // Declare a buffer to hold the server's response
-    char recv_buffer[BUFSIZE];
+// Function to check a file (its name without the directory, size and modification time) against a filter
+int filter_match(const struct list_filter *filter, const char *name, long long size, long long mtime) {
+    return (filter->glob[0] == '\0' || fnmatch(filter->glob, name, 0) == 0)
+           && size >= filter->min_size && (filter->max_size < 0 || size <= filter->max_size)
+           && mtime >= filter->since;
+}
 
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
+// Function to add the local files of a directory that pass the filter to a list, looking `depth` levels of
+// subdirectories further down; files below the directory are listed relative to it ("sub/x.c")
+void list_local_dir(const char *dir_path, const char *pathname, const char *relative, int depth, const struct list_filter *filter, char *list, size_t list_size) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
         return;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
-    char full_path[BUFSIZE];
-    if (destination_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path+1);
-    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char entry_path[PATH_BUFSIZE], name[PATH_BUFSIZE];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
 
-    // Construct the message to send to the server, including the command and full file path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s", command, full_path);
-    
+        // The size and time are only read when the filter needs them (or the file system does not give the type)
+        struct stat entry_stat;
+        memset(&entry_stat, 0, sizeof(entry_stat));
+        int is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || (entry->d_type != DT_DIR && filter_needs_stat(filter))) {
+            if (stat(entry_path, &entry_stat) < 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(entry_stat.st_mode);
+        }
+        if (is_dir) {
+            if (depth > 0) {
+                char sub_relative[PATH_BUFSIZE];
+                if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                    list_local_dir(entry_path, pathname, sub_relative, depth - 1, filter, list, list_size);
+                }
+            }
+            continue;
+        }
+
+        // Check if the file is routed to the local store and passes the filter, then add it to the list
+        char route_path[PATH_BUFSIZE];
+        if (snprintf(route_path, sizeof(route_path), "%s/%s", pathname, name) >= (int)sizeof(route_path)) {
+            continue;
+        }
+        const struct route *r = route_for_path(route_path);
+        if (r != NULL && r->local && filter_match(filter, entry->d_name, (long long)entry_stat.st_size, (long long)entry_stat.st_mtime)
+            && strlen(list) + strlen(name) + 2 < list_size) {
+            strcat(list, name);
+            strcat(list, "\n");
+        }
+    }
+    // Close the directory after reading its contents
+    closedir(dir);
+}
+
+// Function to add a file (or a region of a file, size -1 for all of it) to the files of a search, growing the array
+// Returns -1 when no memory is left
+int add_search_file(struct search_file **files, int *n, int *capacity, const char *path, const char *name, long long offset, long long size) {
+    if (*n == *capacity) {
+        int grown_capacity = *capacity > 0 ? *capacity * 2 : 256;
+        struct search_file *grown = realloc(*files, grown_capacity * sizeof(struct search_file));
+        if (grown == NULL) {
+            return -1;
+        }
+        *files = grown;
+        *capacity = grown_capacity;
+    }
+    struct search_file *f = &(*files)[(*n)++];
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->offset = offset;
+    f->size = size;
+    return 0;
+}
+
+// Function to scan one file for the text and write a "<name>:<line>:<text of the line>" line to out_fd for each
+// matching line. Every line is written whole in one write of less than PIPE_BUF bytes, so the lines of workers
+// sharing the pipe never mix. Files with a NUL byte in their first block are taken as binary and skipped.
+void search_file_region(const struct search_file *f, const char *text, size_t text_len, int out_fd, struct search_state *state) {
+    int fd = open(f->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    long long size = f->size;
+    if (size < 0) {
+        struct stat file_stat;
+        size = fstat(fd, &file_stat) == 0 ? (long long)file_stat.st_size : 0;
+    }
+    if (size < (long long)text_len || size == 0) {
+        close(fd);
+        return;
+    }
+    // mmap needs a page aligned offset, a packed file starts anywhere in its segment
+    long long map_offset = f->offset & ~((long long)sysconf(_SC_PAGESIZE) - 1);
+    size_t map_len = (size_t)(size + (f->offset - map_offset));
+    char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    const char *data = map + (f->offset - map_offset);
+    const char *end = data + size;
+    if (memchr(data, '\0', size < SEARCH_BINARY_PROBE ? (size_t)size : SEARCH_BINARY_PROBE) != NULL) {
+        munmap(map, map_len);
+        return;
+    }
+
+    // memmem and memchr scan with the vector instructions of the CPU, the line number is counted between matches
+    const char *p = data;
+    const char *counted = data;
+    long long line = 1;
+    const char *hit;
+    while (p < end && (hit = memmem(p, end - p, text, text_len)) != NULL) {
+        const char *line_start = hit;
+        while (line_start > p && line_start[-1] != '\n') {
+            line_start--;
+        }
+        const char *line_end = memchr(hit, '\n', end - hit);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        for (const char *c = counted; (c = memchr(c, '\n', line_start - c)) != NULL; c++) {
+            line++;
+        }
+        counted = line_start;
+        if (__atomic_fetch_add(&state->matches, 1, __ATOMIC_RELAXED) >= SEARCH_MAX_MATCHES) {
+            break;
+        }
+
+        // The text of the line is cut to SEARCH_SNIPPET bytes, control characters are shown as spaces
+        char out[PIPE_BUF];
+        int len = snprintf(out, sizeof(out), "%s:%lld:", f->name, line);
+        size_t snippet = line_end - line_start;
+        if (snippet > SEARCH_SNIPPET) {
+            snippet = SEARCH_SNIPPET;
+        }
+        for (size_t i = 0; i < snippet; i++) {
+            unsigned char c = line_start[i];
+            out[len++] = (c < 0x20 || c == 0x7f) ? ' ' : c;
+        }
+        out[len++] = '\n';
+        if (write(out_fd, out, len) < 0) {
+            break;
+        }
+        p = line_end + 1;
+    }
+    munmap(map, map_len);
+}
+
+// Function to search the files for the text with one worker process per CPU core (at most SEARCH_MAX_JOBS), each
+// taking the next file from a shared counter, and stream the matching lines to the socket as they are found
+// Returns the number of bytes sent, -1 if the search could not be started
+long long run_search(int sock, const struct search_file *files, int n, const char *text) {
+    if (n == 0) {
+        return 0;
+    }
+    struct search_state *state = mmap(NULL, sizeof(struct search_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("Search state mmap failed");
+        return -1;
+    }
+    state->next = 0;
+    state->matches = 0;
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("Search pipe failed");
+        munmap(state, sizeof(struct search_state));
+        return -1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cores < 1 ? 1 : (cores > SEARCH_MAX_JOBS ? SEARCH_MAX_JOBS : (int)cores);
+    if (jobs > n) {
+        jobs = n;
+    }
+    size_t text_len = strlen(text);
+    pid_t pids[SEARCH_MAX_JOBS];
+    int started = 0;
+    for (int j = 0; j < jobs; j++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipe_fds[0]);
+            int i;
+            while ((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < n
+                   && __atomic_load_n(&state->matches, __ATOMIC_RELAXED) < SEARCH_MAX_MATCHES) {
+                search_file_region(&files[i], text, text_len, pipe_fds[1], state);
+            }
+            _exit(0);
+        } else if (pid > 0) {
+            pids[started++] = pid;
+        } else {
+            perror("Search worker fork failed");
+        }
+    }
+    close(pipe_fds[1]);
+
+    // Pass the lines on as they come, the pipe reaches end of file once every worker is done
+    long long sent = 0;
+    char buffer[PIPE_BUF];
+    ssize_t bytes_read;
+    while (started > 0 && (bytes_read = read(pipe_fds[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (send(sock, buffer, bytes_read, MSG_NOSIGNAL | MSG_MORE) < 0) {
+            break;
+        }
+        sent += bytes_read;
+    }
+    close(pipe_fds[0]);
+    for (int j = 0; j < started; j++) {
+        waitpid(pids[j], NULL, 0);
+    }
+    munmap(state, sizeof(struct search_state));
+    return sent;
+}
+
+// Function to connect to a single backend endpoint, failing fast while its circuit breaker is open
+// Only a failed connect is reported to the breaker: a backend that accepts connections may still hang or fail the
+// request, so the callers report a success once the backend's whole reply was received
+int connect_to_endpoint(const struct endpoint *ep) {
+    if (ep->stats != NULL && !breaker_allow(ep->stats)) {
+        printf("Backend %s:%d is unavailable (circuit open)\n", ep->host, ep->port);
+        return -1;
+    }
+    int server_sock = connect_with_timeout(ep);
+    if (server_sock < 0) {
+        report_backend(ep, 0);
+    }
+    return server_sock;
+}
+
+// Function to connect to a backend with a deadline, the socket gets send/receive timeouts so a hung
+// backend cannot block the Smain child forever
+int connect_with_timeout(const struct endpoint *ep) {
+    // variable to store the socket descriptor
+    int server_sock;
+
+    // A metadata command goes to the backend's priority lane, served by workers that bulk transfers never occupy;
+    // a backend started without one refuses the connection and the command takes the regular port. That is
+    // remembered, so the lane is only tried again every PRIORITY_LANE_RETRY_MS instead of on every command
+    if (session_lane && (ep->stats == NULL || now_us() >= __atomic_load_n(&ep->stats->no_lane_until_us, __ATOMIC_RELAXED))) {
+        char lane_path[sizeof(ep->unix_path) + 8];
+        size_t len = strlen(ep->unix_path);
+        if (len > 5 && strcmp(ep->unix_path + len - 5, ".sock") == 0) {
+            snprintf(lane_path, sizeof(lane_path), "%.*s.prio.sock", (int)(len - 5), ep->unix_path);
+            if ((server_sock = connect_unix(lane_path)) >= 0) {
+                set_io_timeouts(server_sock);
+                return server_sock;
+            }
+        }
+        if ((server_sock = connect_tcp(ep, ep->port + PRIORITY_PORT_OFFSET)) >= 0) {
+            return server_sock;
+        }
+        if (ep->stats != NULL) {
+            printf("Backend %s:%d has no priority lane, using its regular port\n", ep->host, ep->port);
+            __atomic_store_n(&ep->stats->no_lane_until_us, now_us() + (uint64_t)PRIORITY_LANE_RETRY_MS * 1000, __ATOMIC_RELAXED);
+        }
+    }
+
+    // A backend on this host is reached through its Unix-domain socket when the endpoint has one, which skips the
+    // loopback TCP stack; TCP is the fallback while the socket is missing
+    if (ep->unix_path[0] != '\0') {
+        server_sock = connect_unix(ep->unix_path);
+        if (server_sock >= 0) {
+            set_io_timeouts(server_sock);
+            return server_sock;
+        }
+    }
+    return connect_tcp(ep, ep->port);
+}
+
+// Function to connect to a backend over TCP on the given port, within connect_timeout_ms
+int connect_tcp(const struct endpoint *ep, int port) {
+    // variable to store the socket descriptor
+    int server_sock;
+    // structure to store the server's address information
+    struct sockaddr_in server_addr;
+
+    // Create a socket
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Check if the socket creation was successful
+    if (server_sock < 0) {
+        perror("Backend socket creation failed");
+        return -1;
+    }
+
+    // Set up the server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ep->host);
+
+    // Connect without blocking and wait for the connection up to the connect timeout
+    int flags = fcntl(server_sock, F_GETFL, 0);
+    fcntl(server_sock, F_SETFL, flags | O_NONBLOCK);
+    int result = connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (result < 0 && errno == EINPROGRESS) {
+        struct pollfd pfd = { .fd = server_sock, .events = POLLOUT };
+        result = poll(&pfd, 1, connect_timeout_ms);
+        if (result == 0) {
+            errno = ETIMEDOUT;
+            result = -1;
+        } else if (result > 0) {
+            // The outcome of the connection attempt is reported through SO_ERROR
+            int so_error = 0;
+            socklen_t len = sizeof(so_error);
+            getsockopt(server_sock, SOL_SOCKET, SO_ERROR, &so_error, &len);
+            errno = so_error;
+            result = so_error ? -1 : 0;
+        }
+    }
+    if (result < 0) {
+        // Print an error message if the connection fails
+        fprintf(stderr, "Connect to %s:%d failed: %s\n", ep->host, port, strerror(errno));
+        close(server_sock);
+        return -1;
+    }
+
+    // Back to blocking mode, with deadlines on every send and receive
+    fcntl(server_sock, F_SETFL, flags);
+    set_io_timeouts(server_sock);
+    tune_socket(server_sock);
+    return server_sock;
+}
+
+// Function to connect to the Unix-domain socket of a backend on this host
+// The connect completes at once or fails (EAGAIN when the backlog is full), so it needs no deadline of its own
+int connect_unix(const char *path) {
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    snprintf(server_addr.sun_path, sizeof(server_addr.sun_path), "%s", path);
+
+    int server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Backend socket creation failed");
+        return -1;
+    }
+    int flags = fcntl(server_sock, F_GETFL, 0);
+    fcntl(server_sock, F_SETFL, flags | O_NONBLOCK);
+    if (connect(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        fprintf(stderr, "Connect to %s failed: %s, trying TCP\n", path, strerror(errno));
+        close(server_sock);
+        return -1;
+    }
+    fcntl(server_sock, F_SETFL, flags);
+    return server_sock;
+}
+
+// Function to put the deadlines of backend traffic on a connected socket
+void set_io_timeouts(int sock) {
+    struct timeval tv = { .tv_sec = io_timeout_ms / 1000, .tv_usec = (io_timeout_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Function to tune a TCP connection for the request and reply traffic of the file system
+// Every exchange ends with a small write (a reply, a trailer, an end marker) followed by a read, which Nagle's
+// algorithm would hold back until the peer's delayed ACK (about 40 ms); with TCP_NODELAY it leaves at once, and the
+// pieces of one message are grouped with MSG_MORE instead. The buffer sizes are left to the kernel's autotuning,
+// which already sizes them from the measured RTT and bandwidth of the connection
+void tune_socket(int sock) {
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Function to log what TCP measured on a client connection when its session ends: the smoothed RTT, the congestion
+// window, the send buffer the kernel grew to and the retransmissions
+void report_connection(int sock) {
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    int send_buffer = 0;
+    socklen_t buffer_len = sizeof(send_buffer);
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0
+        || getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &send_buffer, &buffer_len) < 0) {
+        return;
+    }
+    printf("Session TCP: rtt %.2f ms, cwnd %u x %u bytes, send buffer %d bytes, %u retransmits\n",
+           info.tcpi_rtt / 1000.0, info.tcpi_snd_cwnd, info.tcpi_snd_mss, send_buffer, info.tcpi_total_retrans);
+}
+
+// Function to check whether a connection is a Unix-domain one, over which file descriptors can be passed
+int is_unix_socket(int sock) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    return getsockname(sock, (struct sockaddr*)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+// Function to check the circuit breaker of a backend before using it
+// An open breaker fails fast until its cooldown ends (or a half-open one), then a single caller is let through as a
+// trial; a trial whose outcome was never reported gives way to another one after a further cooldown
+int breaker_allow(struct backend_stats *st) {
+    int state = __atomic_load_n(&st->breaker_state, __ATOMIC_ACQUIRE);
+    if (state == BREAKER_CLOSED) {
+        return 1;
+    }
+    uint64_t now = now_us();
+    if (state == BREAKER_HALF_OPEN
+        || ((state == BREAKER_OPEN || state == BREAKER_TRIAL) && now >= __atomic_load_n(&st->open_until_us, __ATOMIC_RELAXED))) {
+        if (!__atomic_compare_exchange_n(&st->breaker_state, &state, BREAKER_TRIAL, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        __atomic_store_n(&st->open_until_us, now + (uint64_t)breaker_cooldown_ms * 1000, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+// Function to report the outcome of a backend operation to its circuit breaker
+// A success closes the breaker, repeated failures (or a failed trial) open it for the cooldown period
+void report_backend(const struct endpoint *ep, int ok) {
+    struct backend_stats *st = ep->stats;
+    if (st == NULL) {
+        return;
+    }
+    if (ok) {
+        __atomic_store_n(&st->consecutive_failures, 0, __ATOMIC_RELAXED);
+        if (__atomic_exchange_n(&st->breaker_state, BREAKER_CLOSED, __ATOMIC_ACQ_REL) != BREAKER_CLOSED) {
+            printf("Backend %s:%d is available again\n", ep->host, ep->port);
+        }
+        return;
+    }
+    int failures = __atomic_add_fetch(&st->consecutive_failures, 1, __ATOMIC_RELAXED);
+    int state = __atomic_load_n(&st->breaker_state, __ATOMIC_ACQUIRE);
+    if (state == BREAKER_TRIAL || state == BREAKER_HALF_OPEN || (state == BREAKER_CLOSED && failures >= breaker_failures)) {
+        __atomic_store_n(&st->open_until_us, now_us() + (uint64_t)breaker_cooldown_ms * 1000, __ATOMIC_RELAXED);
+        __atomic_store_n(&st->breaker_state, BREAKER_OPEN, __ATOMIC_RELEASE);
+        printf("Backend %s:%d marked unavailable after %d failure(s)\n", ep->host, ep->port, failures);
+    }
+}
+
+// Function to report the outcome of a health check ping to the circuit breaker of a backend
+// A failed ping counts like a failed request. A successful one never closes the breaker or clears the
+// request failures, as a backend that answers pings may still fail requests: it only moves an open breaker
+// whose cooldown is over to half-open, so the next request goes through as the trial
+void report_probe(const struct endpoint *ep, int ok) {
+    struct backend_stats *st = ep->stats;
+    if (st == NULL) {
+        return;
+    }
+    if (!ok) {
+        report_backend(ep, 0);
+        return;
+    }
+    int expected = BREAKER_OPEN;
+    if (now_us() >= __atomic_load_n(&st->open_until_us, __ATOMIC_RELAXED)
+        && __atomic_compare_exchange_n(&st->breaker_state, &expected, BREAKER_HALF_OPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        printf("Backend %s:%d answers pings again, trying a request\n", ep->host, ep->port);
+    }
+}
+
+// Function to probe a backend: it must accept the connection and answer "ping" with "pong" in time
+int probe_endpoint(const struct endpoint *ep) {
+    int sock = connect_with_timeout(ep);
+    if (sock < 0) {
+        return 0;
+    }
+    // Probes use the connect timeout as their whole deadline
+    struct timeval tv = { .tv_sec = connect_timeout_ms / 1000, .tv_usec = (connect_timeout_ms % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char reply[8] = "";
+    int ok = send(sock, "ping", 4, MSG_NOSIGNAL) == 4
+             && recv(sock, reply, sizeof(reply) - 1, 0) >= 4
+             && strncmp(reply, "pong", 4) == 0;
+    close(sock);
+    return ok;
+}
+
+// Function run by the health checker process: probes every backend periodically and feeds the circuit
+// breakers, so clients fail fast on a dead backend and it is used again as soon as it recovers
+void run_health_checker() {
+    // Stop together with the Smain parent
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while (1) {
+        for (int i = 0; i < n_routes; i++) {
+            for (int e = 0; e < routes[i].n_endpoints; e++) {
+                report_probe(&routes[i].endpoints[e], probe_endpoint(&routes[i].endpoints[e]));
+            }
+        }
+        usleep((useconds_t)health_interval_ms * 1000);
+    }
+}
+
+// Function to hash a key for the ring (FNV-1a followed by a murmur3 finalizer to spread similar paths)
+uint32_t hash_key(const char *key) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// qsort comparator for ring points
+static int compare_ring_points(const void *a, const void *b) {
+    uint32_t ha = ((const struct ring_point *)a)->hash;
+    uint32_t hb = ((const struct ring_point *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Function to build the consistent-hash ring of a route, with ring_vnodes points per endpoint
+int build_ring(struct route *r) {
+    free(r->ring);
+    r->ring = NULL;
+    r->ring_size = 0;
+    if (r->local || r->n_endpoints == 0) {
+        return 0;
+    }
+
+    r->ring = malloc(sizeof(struct ring_point) * r->n_endpoints * ring_vnodes);
+    if (r->ring == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    // Virtual nodes are placed by hashing "host:port#n", so adding a shard only moves the keys it takes over
+    for (int e = 0; e < r->n_endpoints; e++) {
+        for (int v = 0; v < ring_vnodes; v++) {
+            char vnode[128];
+            snprintf(vnode, sizeof(vnode), "%s:%d#%d", r->endpoints[e].host, r->endpoints[e].port, v);
+            r->ring[r->ring_size].hash = hash_key(vnode);
+            r->ring[r->ring_size].endpoint = e;
+            r->ring_size++;
+        }
+    }
+    qsort(r->ring, r->ring_size, sizeof(struct ring_point), compare_ring_points);
+    return 0;
+}
+
+// Function to normalize a path into its shard key, so "~/smain//x/" and "~/smain/x" hash the same
+void shard_key(const char *path, char *key, size_t key_size) {
+    size_t len = 0;
+    for (const char *p = path; *p && len + 1 < key_size; p++) {
+        if (*p == '/' && len > 0 && key[len - 1] == '/') {
+            continue;
+        }
+        key[len++] = *p;
+    }
+    while (len > 1 && key[len - 1] == '/') {
+        len--;
+    }
+    key[len] = '\0';
+}
+
+// Function to find the replicas of a path: the distinct endpoints met walking the ring clockwise
+// from the first point at or after the key's hash. The first replica is the owner. Returns the count.
+int replicas_of(const struct route *r, const char *path, int *replicas) {
+    if (r == NULL || r->ring_size == 0) {
+        return 0;
+    }
+    char key[512];
+    shard_key(path, key, sizeof(key));
+    uint32_t h = hash_key(key);
+
+    // Binary search for the first point with hash >= h, wrapping around to the start of the ring
+    int lo = 0, hi = r->ring_size;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (r->ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    int wanted = (r->replicas < r->n_endpoints) ? r->replicas : r->n_endpoints;
+    int n = 0;
+    for (int i = 0; i < r->ring_size && n < wanted; i++) {
+        int endpoint = r->ring[(lo + i) % r->ring_size].endpoint;
+        int seen = 0;
+        for (int j = 0; j < n; j++) {
+            if (replicas[j] == endpoint) {
+                seen = 1;
+                break;
+            }
+        }
+        if (!seen) {
+            replicas[n++] = endpoint;
+        }
+    }
+    return n;
+}
+
+// Helper function to append the lines of a file list that are not already in the combined list
+void append_unique_lines(char *list, size_t list_size, const char *lines) {
+    const char *line = lines;
+    while (*line) {
+        const char *end = strchr(line, '\n');
+        size_t len = (end != NULL) ? (size_t)(end - line) : strlen(line);
+        if (len > 0) {
+            // Look for the same name as a whole line of the list
+            int found = 0;
+            for (const char *p = list; *p; ) {
+                const char *p_end = strchr(p, '\n');
+                size_t p_len = (p_end != NULL) ? (size_t)(p_end - p) : strlen(p);
+                if (p_len == len && strncmp(p, line, len) == 0) {
+                    found = 1;
+                    break;
+                }
+                p += p_len + (p_end != NULL);
+            }
+            size_t used = strlen(list);
+            if (!found && used + len + 2 <= list_size) {
+                memcpy(list + used, line, len);
+                list[used + len] = '\n';
+                list[used + len + 1] = '\0';
+            }
+        }
+        line += len + (end != NULL);
+    }
+}
+
+// Helper function to check if a file name ends with the given extension
+int has_extension(const char *name, const char *ext) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && strcmp(dot, ext) == 0;
+}
+
+// Function to find the route for a path: the longest matching prefix route wins, otherwise the extension route
+const struct route *route_for_path(const char *path) {
+    const struct route *best = NULL;
+    size_t best_len = 0;
+
+    for (int i = 0; i < n_routes; i++) {
+        size_t len = strlen(routes[i].match);
+        if (routes[i].is_prefix && len > best_len && strncmp(path, routes[i].match, len) == 0) {
+            best = &routes[i];
+            best_len = len;
+        }
+    }
+    if (best != NULL) {
+        return best;
+    }
+
+    // Only the extension of the final path component is used, so "foo.c.txt" is a .txt file
+    const char *base = strrchr(path, '/');
+    base = (base != NULL) ? base + 1 : path;
+    const char *dot = strrchr(base, '.');
+    return (dot != NULL) ? route_for_ext(dot) : NULL;
+}
+
+// Function to find the route for an extension such as ".pdf"
+const struct route *route_for_ext(const char *ext) {
+    for (int i = 0; i < n_routes; i++) {
+        if (!routes[i].is_prefix && strcmp(routes[i].match, ext) == 0) {
+            return &routes[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to check if route i is the first route to a backend store, several routes can share a store
+// and a command that asks every store asks each one only once
+int first_route_of_store(int i) {
+    if (routes[i].local) {
+        return 0;
+    }
+    for (int j = 0; j < i; j++) {
+        if (!routes[j].local && strcmp(routes[j].store, routes[i].store) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to add a route to the table, endpoints is a space separated list of host:port or "local"
+int add_route(const char *match, const char *store, char *endpoints) {
+    if (n_routes >= MAX_ROUTES) {
+        fprintf(stderr, "Too many routes, ignoring %s\n", match);
+        return -1;
+    }
+    struct route *r = &routes[n_routes];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->match, sizeof(r->match), "%s", match);
+    snprintf(r->store, sizeof(r->store), "%s", store);
+    // Routes starting with a path are prefix routes, everything else is an extension
+    r->is_prefix = (match[0] == '~' || match[0] == '/');
+    // Files are kept once unless the route asks for replication
+    r->replicas = 1;
+    r->write_quorum = 1;
+
+    char *saveptr;
+    char *token = strtok_r(endpoints, " \t\r\n", &saveptr);
+    while (token != NULL) {
+        if (strcmp(token, "local") == 0) {
+            r->local = 1;
+        } else if (strncmp(token, "r=", 2) == 0) {
+            // r=<n>: number of copies kept of every file
+            r->replicas = atoi(token + 2);
+        } else if (strncmp(token, "w=", 2) == 0) {
+            // w=<n>: number of copies that must be written before an upload is acknowledged
+            r->write_quorum = atoi(token + 2);
+        } else if (r->n_endpoints < MAX_ENDPOINTS) {
+            // Split host:port, and the Unix-domain socket after '@'
+            struct endpoint *ep = &r->endpoints[r->n_endpoints];
+            char *at = strchr(token, '@');
+            if (at != NULL) {
+                *at = '\0';
+                if (at[1] == '\0' || strlen(at + 1) >= sizeof(ep->unix_path)) {
+                    fprintf(stderr, "Invalid Unix socket '%s' for route %s\n", at + 1, match);
+                    return -1;
+                }
+                snprintf(ep->unix_path, sizeof(ep->unix_path), "%s", at + 1);
+            }
+            char *colon = strrchr(token, ':');
+            if (colon == NULL || atoi(colon + 1) <= 0) {
+                fprintf(stderr, "Invalid endpoint '%s' for route %s\n", token, match);
+                return -1;
+            }
+            *colon = '\0';
+            snprintf(ep->host, sizeof(ep->host), "%s", token);
+            ep->port = atoi(colon + 1);
+            r->n_endpoints++;
+        }
+        token = strtok_r(NULL, " \t\r\n", &saveptr);
+    }
+
+    if (!r->local && r->n_endpoints == 0) {
+        fprintf(stderr, "Route %s has no endpoints\n", match);
+        return -1;
+    }
+    // The replication factor cannot exceed the number of endpoints, and the quorum cannot exceed the copies
+    if (r->replicas > r->n_endpoints && !r->local) {
+        r->replicas = r->n_endpoints;
+    }
+    if (r->replicas < 1 || r->write_quorum < 1 || r->write_quorum > r->replicas) {
+        fprintf(stderr, "Route %s has invalid replication settings r=%d w=%d\n", match, r->replicas, r->write_quorum);
+        return -1;
+    }
+    n_routes++;
+    return 0;
+}
+
+// Function to load the routing table from the config file
+// Each line is "route <.ext|~/prefix/> <store> <local | host:port ...>", '#' starts a comment.
+// Without a config file the original layout is used (.c local, .pdf on 8081, .txt on 8082).
+int load_routes(const char *config_path) {
+    FILE *fp = fopen(config_path, "r");
+    if (fp == NULL) {
+        char local_ep[] = "local", pdf_ep[] = "127.0.0.1:8081", txt_ep[] = "127.0.0.1:8082";
+        printf("No routing config at %s, using default routes\n", config_path);
+        add_route(".c", "smain", local_ep);
+        add_route(".pdf", "spdf", pdf_ep);
+        add_route(".txt", "stext", txt_ep);
+        return 0;
+    }
+
+    char line[1024];
+    int line_no = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_no++;
+        // Strip comments and skip blank lines
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        char keyword[32], match[256], store[64];
+        int consumed = 0;
+        if (sscanf(line, "%31s", keyword) != 1) {
+            continue;
+        }
+        // "vnodes <n>" sets the number of virtual nodes per endpoint on the hash rings
+        if (strcmp(keyword, "vnodes") == 0) {
+            if (sscanf(line, "%31s %d", keyword, &ring_vnodes) != 2 || ring_vnodes <= 0) {
+                fprintf(stderr, "%s:%d: invalid vnodes line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        // Backend failure handling: timeouts in milliseconds, and "breaker <failures> <cooldown_ms>"
+        int *setting = NULL;
+        if (strcmp(keyword, "connect_timeout_ms") == 0) {
+            setting = &connect_timeout_ms;
+        } else if (strcmp(keyword, "io_timeout_ms") == 0) {
+            setting = &io_timeout_ms;
+        } else if (strcmp(keyword, "health_interval_ms") == 0) {
+            setting = &health_interval_ms;
+        } else if (strcmp(keyword, "listen_backlog") == 0) {
+            // Admission control: backlog, session and transfer limits, queue length and waits
+            setting = &listen_backlog;
+        } else if (strcmp(keyword, "max_sessions") == 0) {
+            setting = &max_sessions;
+        } else if (strcmp(keyword, "max_transfers") == 0) {
+            setting = &max_transfers;
+        } else if (strcmp(keyword, "transfer_queue") == 0) {
+            setting = &transfer_queue;
+        } else if (strcmp(keyword, "transfer_wait_ms") == 0) {
+            setting = &transfer_wait_ms;
+        } else if (strcmp(keyword, "busy_retry_ms") == 0) {
+            setting = &busy_retry_ms;
+        } else if (strcmp(keyword, "priority_sessions") == 0) {
+            // Priority lanes: sessions kept for metadata commands, and whether backends are asked on their lanes
+            setting = &priority_sessions;
+        } else if (strcmp(keyword, "priority_lanes") == 0) {
+            setting = &priority_lanes;
+        } else if (strcmp(keyword, "pack_max_size") == 0) {
+            // Pack store: largest packed file (0 turns packing off), segment size, index size and compaction
+            setting = &pack_max_size;
+        } else if (strcmp(keyword, "pack_segment_size") == 0) {
+            setting = &pack_segment_size;
+        } else if (strcmp(keyword, "index_entries") == 0) {
+            setting = &index_entries;
+        } else if (strcmp(keyword, "pack_compact_percent") == 0) {
+            setting = &pack_compact_percent;
+        } else if (strcmp(keyword, "pack_compact_interval_ms") == 0) {
+            setting = &pack_compact_interval_ms;
+        } else if (strcmp(keyword, "buffer_hugepages") == 0) {
+            // Back the buffer pool with huge pages (1) or normal pages (0)
+            setting = &buffer_hugepages;
+        }
+        if (setting != NULL) {
+            if (sscanf(line, "%31s %d", keyword, setting) != 2 || *setting < 0 || (*setting == 0 && setting != &pack_max_size && setting != &buffer_hugepages
+                && setting != &priority_sessions && setting != &priority_lanes)
+                || (setting == &pack_compact_percent && pack_compact_percent > 100)
+                || (setting == &max_transfers && max_transfers > MAX_TRANSFER_SLOTS)) {
+                fprintf(stderr, "%s:%d: invalid %s line\n", config_path, line_no, keyword);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        // "upload_max_size <bytes>" bounds the body of an upload, which is held in memory until it is stored
+        if (strcmp(keyword, "upload_max_size") == 0) {
+            if (sscanf(line, "%31s %lld", keyword, &upload_max_size) != 2 || upload_max_size <= 0) {
+                fprintf(stderr, "%s:%d: invalid upload_max_size line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        // Bandwidth scheduler: "rate_total <bytes/s>", "rate_class <interactive|transfer|bulk> <weight> <bytes/s> <ops/s>"
+        // and "rate_client <bytes/s> <ops/s>", 0 for no limit
+        if (strcmp(keyword, "rate_total") == 0) {
+            if (sscanf(line, "%31s %lld", keyword, &rate_total) != 2 || rate_total < 0) {
+                fprintf(stderr, "%s:%d: invalid rate_total line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(keyword, "rate_class") == 0) {
+            static const char *class_names[RATE_CLASSES] = { "interactive", "transfer", "bulk" };
+            char name[32];
+            int weight, ops;
+            long long bytes;
+            int c = RATE_CLASSES;
+            if (sscanf(line, "%31s %31s %d %lld %d", keyword, name, &weight, &bytes, &ops) == 5) {
+                for (c = 0; c < RATE_CLASSES && strcmp(name, class_names[c]) != 0; c++) {
+                }
+            }
+            if (c == RATE_CLASSES || weight <= 0 || bytes < 0 || ops < 0) {
+                fprintf(stderr, "%s:%d: invalid rate_class line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            rate_class_weight[c] = weight;
+            rate_class_bytes[c] = bytes;
+            rate_class_ops[c] = ops;
+            continue;
+        }
+        if (strcmp(keyword, "rate_client") == 0) {
+            if (sscanf(line, "%31s %lld %d", keyword, &rate_client_bytes, &rate_client_ops) != 3 || rate_client_bytes < 0 || rate_client_ops < 0) {
+                fprintf(stderr, "%s:%d: invalid rate_client line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(keyword, "breaker") == 0) {
+            if (sscanf(line, "%31s %d %d", keyword, &breaker_failures, &breaker_cooldown_ms) != 3
+                || breaker_failures <= 0 || breaker_cooldown_ms <= 0) {
+                fprintf(stderr, "%s:%d: invalid breaker line\n", config_path, line_no);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(keyword, "route") != 0 || sscanf(line, "%31s %255s %63s %n", keyword, match, store, &consumed) != 3) {
+            fprintf(stderr, "%s:%d: invalid route line\n", config_path, line_no);
+            fclose(fp);
+            return -1;
+        }
+        if (add_route(match, store, line + consumed) < 0) {
+            fprintf(stderr, "%s:%d: invalid route\n", config_path, line_no);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    printf("Loaded %d routes from %s\n", n_routes, config_path);
+    return 0;
+}
+
+// Function to build the hash rings of all routes, once every endpoint and the vnode count are known
+int build_rings() {
+    for (int i = 0; i < n_routes; i++) {
+        if (build_ring(&routes[i]) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// helper Function to send a file to the replicas of a store for uploading file
+// All replicas are written in parallel and the client is answered as soon as the write quorum is reached
+void send_file_to_replicas(const struct route *r, const int *replicas, int n, int client_sock, char *command, char *filename, char *destination_path, char *file_data, size_t file_len, const char *options, uint32_t file_crc) {
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    // Check if the HOME environment variable is available
+    if (home_dir == NULL) {
+        // Print an error message if the HOME variable is not found
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        send(client_sock, "File upload failed", 18, 0);
+        return;
+    }
+    
+    // Construct the full path for the file (FilePath + file name)
+    char full_path[PATH_BUFSIZE];
+    if (destination_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s/%s/%s", home_dir, destination_path + 1, filename);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", destination_path, filename);
+    }
+    
+    // Construct the message with the command, the full path, the size of the file data and the command's options
+    char message[CMD_BUFSIZE];
+    snprintf(message, sizeof(message), "%s %s %zu%s\n", command, full_path, file_len, options);
+
+    // Calculate the total length of the message including file data and its CRC32C trailer
+    size_t total_length = strlen(message) + file_len + CRC_TRAILER_LEN + 1; // +1 for null terminator
+    
+    // Allocate memory to hold the entire message (command + file path + file data)
+    char *complete_message = pool_get(total_length);
+    if (complete_message == NULL) {
+        // Print an error message if memory allocation fails
+        perror("Memory allocation failed");
+        send(client_sock, "File upload failed", 18, 0);
+        return;
+    }
+
+    // Copy the message and file data into the complete_message buffer
+    strcpy(complete_message, message);
+    // Append the file data to the complete_message buffer, it may contain any bytes
+    if (file_len > 0) {
+        memcpy(complete_message + strlen(message), file_data, file_len);
+    }
+    // Each replica checks the data against the CRC32C the client sent before storing it
+    snprintf(complete_message + strlen(message) + file_len, CRC_TRAILER_LEN + 1, "CRC32C %08x", file_crc);
+
+    // Replicas on this host read the data and its trailer from one sealed memfd they map, instead of through the socket
+    int body_fd = -1;
+    for (int i = 0; i < n; i++) {
+        if (r->endpoints[replicas[i]].unix_path[0] != '\0') {
+            body_fd = create_body_memfd(complete_message + strlen(message), file_len + CRC_TRAILER_LEN);
+            break;
+        }
+    }
+
+    // Send the complete message to every replica at once and ack the client after the write quorum
+    printf("Sending request to %d %s replica(s), write quorum %d...\n", n, r->store, r->write_quorum);
+    char responses[MAX_ENDPOINTS][128];
+    int stored = replicate_request(r, replicas, n, complete_message, total_length - 1, strlen(message), body_fd, "File Uploaded successfully",
+                                   r->write_quorum, client_sock, "File Uploaded successfully.", "File upload failed", responses);
+    printf("File stored on %d of %d replica(s)\n", stored, n);
+
+    // Free allocated memory
+    if (body_fd >= 0) {
+        close(body_fd);
+    }
+    pool_put(complete_message);
+}
+
+// Function to put the body of an upload in a memfd sealed against changes, which the replicas on this host map
+// Returns the descriptor, or -1 if it could not be made (the body then goes through the socket)
+int create_body_memfd(const char *body, size_t body_len) {
+    int fd = memfd_create("dfs-upload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create failed");
+        return -1;
+    }
+    size_t written = 0;
+    while (written < body_len) {
+        ssize_t n = write(fd, body + written, body_len - written);
+        if (n <= 0) {
+            perror("memfd write failed");
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        perror("memfd sealing failed");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Function to send data with a file descriptor attached (SCM_RIGHTS) in a single message
+ssize_t send_with_fd(int sock, const char *data, size_t len, int fd) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+// Function to send one request to several replicas in parallel and collect their replies
+// Each reply (or "" for a replica that failed) is stored in responses. When quorum > 0 the client gets ok_reply
+// as soon as `quorum` replies start with ok_prefix, or fail_reply once the quorum can no longer be reached;
+// the remaining replicas are still completed before returning. Returns the number of ok replies.
+// With body_fd >= 0 (a memfd holding everything after the first header_len bytes of the message), Unix-domain
+// connections only get the header, with body_fd attached
+int replicate_request(const struct route *r, const int *replicas, int n, const char *message, size_t message_len, size_t header_len, int body_fd, const char *ok_prefix, int quorum, int client_sock, const char *ok_reply, const char *fail_reply, char responses[][128]) {
+    struct pollfd fds[MAX_ENDPOINTS];
+    size_t sent[MAX_ENDPOINTS];
+    int ok = 0, failed = 0, pending = 0, answered = (quorum <= 0);
+
+    // Connect to every replica and switch the sockets to non-blocking mode
+    for (int i = 0; i < n; i++) {
+        responses[i][0] = '\0';
+        sent[i] = 0;
+        fds[i].fd = connect_to_endpoint(&r->endpoints[replicas[i]]);
+        fds[i].events = POLLOUT;
+        if (fds[i].fd < 0) {
+            failed++;
+            continue;
+        }
+        fcntl(fds[i].fd, F_SETFL, fcntl(fds[i].fd, F_GETFL, 0) | O_NONBLOCK);
+        pending++;
+    }
+
+    while (1) {
+        // Answer the client as soon as the outcome is known, without waiting for slower replicas
+        if (!answered && ok >= quorum) {
+            send(client_sock, ok_reply, strlen(ok_reply), 0);
+            answered = 1;
+        } else if (!answered && n - failed < quorum) {
+            send(client_sock, fail_reply, strlen(fail_reply), 0);
+            answered = 1;
+        }
+        if (pending == 0) {
+            break;
+        }
+
+        int ready = poll(fds, n, io_timeout_ms);
+        if (ready <= 0) {
+            // Replicas that did not answer in time count as failed
+            perror("Replica request timed out");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            int done = 0;
+            if (fds[i].events == POLLOUT && (fds[i].revents & POLLOUT) && body_fd >= 0 && sent[i] == 0 && is_unix_socket(fds[i].fd)) {
+                // A backend on this host gets the header and maps the body from the memfd
+                if (send_with_fd(fds[i].fd, message, header_len, body_fd) == (ssize_t)header_len) {
+                    sent[i] = message_len;
+                    fds[i].events = POLLIN;
+                } else {
+                    done = 1;
+                }
+            } else if (fds[i].events == POLLOUT && (fds[i].revents & POLLOUT)) {
+                // Push as much of the request as the socket accepts, then wait for the reply
+                ssize_t bytes_sent = send(fds[i].fd, message + sent[i], message_len - sent[i], MSG_NOSIGNAL);
+                if (bytes_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    done = 1;
+                } else if (bytes_sent > 0) {
+                    sent[i] += bytes_sent;
+                }
+                if (sent[i] == message_len) {
+                    fds[i].events = POLLIN;
+                }
+            } else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t bytes_received = recv(fds[i].fd, responses[i], 127, 0);
+                responses[i][bytes_received > 0 ? bytes_received : 0] = '\0';
+                done = 1;
+            }
+            if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                done = 1;
+            }
+            if (done) {
+                if (strncmp(responses[i], ok_prefix, strlen(ok_prefix)) == 0) {
+                    ok++;
+                } else {
+                    failed++;
+                    printf("Replica %s:%d failed: %s\n", r->endpoints[replicas[i]].host, r->endpoints[replicas[i]].port,
+                           responses[i][0] ? responses[i] : "no response");
+                }
+                // A replica that answered (even with an error) is healthy, one that dropped the connection without
+                // answering counts against its circuit breaker
+                report_backend(&r->endpoints[replicas[i]], responses[i][0] != '\0');
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                pending--;
+            }
+        }
+    }
+
+    // Close replicas abandoned after a timeout
+    for (int i = 0; i < n; i++) {
+        if (fds[i].fd >= 0) {
+            report_backend(&r->endpoints[replicas[i]], 0);
+            close(fds[i].fd);
+            failed++;
+        }
+    }
+    if (!answered) {
+        const char *reply = (ok >= quorum) ? ok_reply : fail_reply;
+        send(client_sock, reply, strlen(reply), 0);
+    }
+    return ok;
+}
+
+
+// Function to receive a file from a client and save it to the specified destination for uploading file
+int receive_and_save_file(int sock, char *destination_path, char *f_name, char *file_data, size_t file_len, uint32_t file_crc) {
+    int file_fd;
+    // buffer to hold the directory path
+    char dir_path[256];
+ 
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+ 
+    // Create the full path for the file
+    char full_path[PATH_BUFSIZE];
+    if (destination_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path + 1);
+    } else {
+        strncpy(full_path, destination_path, sizeof(full_path) - 1);
+        full_path[sizeof(full_path) - 1] = '\0';
+    }
+ 
+    // Construct the full path for the file (path + file name)
+    char final_path[512];
+    snprintf(final_path, sizeof(final_path), "%s/%s", full_path, f_name);
+
+    // Small files are appended to the pack store when it is on, without creating a directory or a file
+    if (pack_put(final_path, file_data, file_len, file_crc) == 0) {
+        return 0;
+    }
+
+    // Copy the destination path to dir_path
+    strncpy(dir_path, full_path, sizeof(dir_path) - 1);
+    dir_path[sizeof(dir_path) - 1] = '\0';
+ 
+    // Ensure the destination directory exists by creating it if necessary
+    char command[CMD_BUFSIZE];
+    snprintf(command, sizeof(command), "mkdir -p %s", dir_path);
+    system(command);
+ 
+    // Create the file at the specified path with read/write permissions
+    file_fd = open(final_path, O_CREAT | O_RDWR | O_TRUNC, 0777);
+    if (file_fd < 0) {
+        // Print an error message if file creation fails
+        perror("File creation failed");
+        return -1;
+    }
+ 
+    // Write the received file data into the newly created file
+    if (file_data && file_len > 0 && write(file_fd, file_data, file_len) != (ssize_t)file_len) {
+        perror("File write failed");
+        close(file_fd);
+        return -1;
+    }
+    
+    // Close the file after writing is complete, recording it in the file index
+    struct stat file_stat;
+    int stat_ok = fstat(file_fd, &file_stat) == 0;
+    close(file_fd);
+    // The new file replaces a packed version of an earlier upload
+    pack_remove(final_path);
+    if (stat_ok) {
+        index_store_file(final_path, &file_stat, strong_hash(FNV_OFFSET, (const unsigned char *)file_data, file_len), file_crc);
+    } else {
+        index_forget(final_path);
+    }
+    return 0;
+}
+
+
+// Function to remove requested file by client from every replica of the store
+void remove_file_from_replicas(const struct route *r, const int *replicas, int n, int client_sock, char *command, char *destination_path){
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        send(client_sock, "File remove failed", 18, 0);
+        return;
+    }
+    
+    // Construct the full path for the file (FilePath + file name)
+    char full_path[PATH_BUFSIZE];
+    if (destination_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, destination_path+1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", destination_path);
+    }
+
+    // Construct the message to send to the servers, including the command and full file path
+    char message[CMD_BUFSIZE];
+    snprintf(message, sizeof(message), "%s %s", command, full_path);
+    
+    // Send the message to all replicas in parallel and wait for every one of them
+    printf("Sending request to %d %s replica(s)...\n", n, r->store);
+    char responses[MAX_ENDPOINTS][128];
+    int removed = replicate_request(r, replicas, n, message, strlen(message), strlen(message), -1, "File has been removed!", 0, client_sock, NULL, NULL, responses);
+
+    // The file is gone if any replica removed it; otherwise forward the first replica's answer
+    const char *reply = "File remove failed";
+    if (removed > 0) {
+        reply = "File has been removed!";
+    } else {
+        for (int i = 0; i < n; i++) {
+            if (responses[i][0] != '\0') {
+                reply = responses[i];
+                break;
+            }
+        }
+    }
+    printf("Removed from %d of %d replica(s)\nforwarding responce to client\n", removed, n);
+    if (send(client_sock, reply, strlen(reply), 0) < 0) {
+        // Print an error message if forwarding to the client fails
+        perror("Send to client failed");
+    }
+}
+
+// Function to delete a file and handle errors
+int delete_file(const char *file_path) {
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+
+    // new file path creation to replace ~
+    char full_path[PATH_BUFSIZE];
+    if (file_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
+    } else {
+        strncpy(full_path, file_path, sizeof(full_path) - 1);
+        full_path[sizeof(full_path) - 1] = '\0';
+    }
+
+    // A packed file is removed by a tombstone record in the pack store
+    int packed = pack_remove(full_path);
+    if (packed != 2) {
+        return packed;
+    }
+
+    // check if file exist or not, the file index answers without touching the disk
+    int indexed = index_get(full_path, NULL);
+    if (indexed == 0 || (indexed < 0 && access(full_path, F_OK) == -1)) {
+        return 2;
+    }
+
+    // delete the file at the specified path
+    if (unlink(full_path) == 0) {
+        index_forget(full_path);
+        return 0;
+    } else {
+        // Handle different errors that could occur during file deletion
+        switch (errno) {
+            case EACCES:
+                fprintf(stderr, "Permission denied: %s\n", full_path);
+                break;
+            case ENOENT:
+                fprintf(stderr, "File does not exist: %s\n", full_path);
+                break;
+            case EISDIR:
+                fprintf(stderr, "Path is a directory, not a file: %s\n", full_path);
+                break;
+            default:
+                fprintf(stderr, "Failed to delete file %s: %s\n", full_path, strerror(errno));
+        }
+        return -1;
+    }
+}
+
+// Function to send a file to the client for downloading
+void send_file_to_client(int client_sock, const char *file_path, const char *file_name, long long offset, long long length, const char *if_tag) {
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return;
+    }
+    // Construct the full path for the file
+    char full_path[PATH_BUFSIZE];
+    if (file_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", file_path);
+    }
+
+    // A packed file is read from its segment
+    if (pack_send_file(client_sock, full_path, file_name, offset, length, if_tag) != 2) {
+        return;
+    }
+
+    // The file index knows missing files, and the version of a cached copy, without opening the file
+    struct index_entry entry;
+    int indexed = index_get(full_path, &entry);
+    if (indexed == 1 && if_tag != NULL) {
+        struct stat file_stat;
+        char tag[64];
+        index_entry_stat(&entry, &file_stat);
+        version_tag(&file_stat, tag, sizeof(tag));
+        if (strcmp(if_tag, tag) == 0) {
+            send_not_modified(client_sock, tag);
+            return;
+        }
+    }
+
+    // Open the file for reading
+    int file_fd = indexed == 0 ? -1 : open(full_path, O_RDONLY);
+    if (file_fd < 0) {
+        perror("File open failed");
+        // Send rejction to the client
+        const char *success_message = "ERROR: File not found!";
+        printf("%s\n",success_message);
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("File stat failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        close(file_fd);
+        return;
+    }
+
+    // The CRC32C the file was uploaded with travels to the client, as long as the file was not rewritten since
+    long long stored_crc = -1;
+    if (indexed == 1 && entry.size == (long long)file_stat.st_size
+        && entry.mtime_ns == (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec) {
+        stored_crc = entry.crc;
+    }
+
+    // Send the header, the contents (or the requested range), the checksum and the end marker to the client
+    send_file_region(client_sock, file_fd, 0, &file_stat, file_name, offset, length, if_tag, stored_crc);
+    close(file_fd);
+}
+
+// Function to send an open file as "<name> <size>\n", the contents and the end marker
+// The size lets the receiver find the end of the file even when more replies follow on the connection
+int send_file_with_header(int sock, int file_fd, const char *file_name, long long offset, long long length, const char *if_tag) {
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("File stat failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+    return send_file_region(sock, file_fd, 0, &file_stat, file_name, offset, length, if_tag, -1);
+}
+
+// Function to send a file that starts at `base` in an open file (a packed file inside its segment) the same way,
+// file_stat gives the file's size and modification time. The data is followed by its CRC32C, computed while it
+// is sent; when the whole file is sent and stored_crc (the CRC32C it was uploaded with, -1 if unknown) is given,
+// the data goes out with sendfile and the stored CRC32C after it, so a file that changed on disk fails the
+// receiver's check
+int send_file_region(int sock, int file_fd, off_t base, const struct stat *file_stat, const char *file_name, long long offset, long long length, const char *if_tag, long long stored_crc) {
+    // A conditional request carries the version tag of the receiver's cached copy: if the file is
+    // unchanged, answer "NOT_MODIFIED <tag> 0" without data so the cached copy is used
+    char tag[64];
+    version_tag(file_stat, tag, sizeof(tag));
+    // A stripe of a striped download carries "if-match=<tag>", the version its first stripe came from: the
+    // stripe is refused if the file changed since (or this replica has another version), else it is a plain range
+    if (if_tag != NULL && strncmp(if_tag, "if-match=", 9) == 0) {
+        if (strcmp(if_tag + 9, tag) != 0) {
+            const char *error_message = "ERROR: File changed during the download!";
+            send(sock, error_message, strlen(error_message), 0);
+            return -1;
+        }
+        if_tag = NULL;
+    }
+    if (if_tag != NULL && strcmp(if_tag, tag) == 0) {
+        return send_not_modified(sock, tag);
+    }
+
+    // A range request (offset >= 0) gets "<name> <offset> <total size> <length>", clamped to the file,
+    // a whole file "<name> <size>"; either way the last field is the number of data bytes that follow.
+    // A conditional request also gets the current tag after the name, "<name> <tag> <offset> ..."
+    long long total = (long long)file_stat->st_size;
+    char header[512];
+    int header_len;
+    if (offset >= 0) {
+        if (offset > total) {
+            offset = total;
+        }
+        if (length < 0 || length > total - offset) {
+            length = total - offset;
+        }
+        if (if_tag != NULL) {
+            header_len = snprintf(header, sizeof(header), "%s %s %lld %lld %lld\n", file_name, tag, offset, total, length);
+        } else {
+            header_len = snprintf(header, sizeof(header), "%s %lld %lld %lld\n", file_name, offset, total, length);
+        }
+    } else {
+        offset = 0;
+        length = total;
+        header_len = snprintf(header, sizeof(header), "%s %lld\n", file_name, total);
+    }
+    int whole_file = (offset == 0 && length == total);
+    // MSG_MORE lets the header leave together with the data instead of waiting for its own ACK
+    if (send(sock, header, header_len, MSG_MORE) < 0) {
+        perror("Error sending file header");
+        return -1;
+    }
+
+    // The checksum of a whole file is known, so the kernel sends it straight from the page cache
+    if (whole_file && stored_crc >= 0) {
+        off_t position = base;
+        // Rate limited sessions send smaller pieces, so the scheduler can pace them
+        size_t piece = rate_enabled ? IO_BUFSIZE : IO_BUFSIZE * 16;
+        while (length > 0) {
+            ssize_t bytes_sent = sendfile(sock, file_fd, &position, length < (long long)piece ? (size_t)length : piece);
+            if (bytes_sent <= 0) {
+                perror("Error sending file");
+                return -1;
+            }
+            length -= bytes_sent;
+            rate_limit_bytes(bytes_sent);
+        }
+        if (send_crc_trailer(sock, (uint32_t)stored_crc) < 0) {
+            perror("Failed to send end marker");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Read the requested part of the file and send it, through a streaming buffer from the pool
+    char *buffer_content = pool_get(IO_BUFSIZE);
+    ssize_t bytes_read, bytes_sent;
+    uint32_t crc = 0;
+    if (buffer_content == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    while (length > 0) {
+        size_t want = length < IO_BUFSIZE ? (size_t)length : IO_BUFSIZE;
+        bytes_read = pread(file_fd, buffer_content, want, base + offset);
+        if (bytes_read <= 0) {
+            perror("Error reading file");
+            pool_put(buffer_content);
+            return -1;
+        }
+        crc = crc32c(crc, buffer_content, bytes_read);
+        // The trailer follows, so a last partial chunk waits to leave with it
+        bytes_sent = send(sock, buffer_content, bytes_read, MSG_MORE);
+        if (bytes_sent < 0) {
+            perror("Error sending file");
+            pool_put(buffer_content);
+            return -1;
+        }
+        rate_limit_bytes(bytes_sent);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    pool_put(buffer_content);
+
+    // Send the checksum and the end marker to indicate the end of the file transfer
+    if (send_crc_trailer(sock, crc) < 0) {
+        perror("Failed to send end marker");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to tell the receiver that its cached copy (with version tag `tag`) is current
+int send_not_modified(int sock, const char *tag) {
+    char reply[128];
+    int reply_len = snprintf(reply, sizeof(reply), "NOT_MODIFIED %s 0\nCRC32C %08x%s", tag, 0, CMD_END_MARKER);
+    if (send(sock, reply, reply_len, 0) < 0) {
+        perror("Error sending file header");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to build the version tag of a file from its modification time and size,
+// it changes whenever the file is rewritten
+void version_tag(const struct stat *file_stat, char *tag, size_t tag_size) {
+    snprintf(tag, tag_size, "%lld.%09ld-%lld", (long long)file_stat->st_mtim.tv_sec,
+             (long)file_stat->st_mtim.tv_nsec, (long long)file_stat->st_size);
+}
+
+// Function to prepare crc32c(): use the SSE4.2 crc32 instruction when the CPU has it, and build the
+// tables of the portable version (slicing by 8) for when it does not
+void crc32c_init() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// Function to run the CRC32C register over data with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// Function to continue a CRC32C (Castagnoli) over more data, starting from 0
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *data = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^ crc32c_table[5][(lo >> 16) & 0xff]
+              ^ crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+              ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+// Function to send the CRC32C trailer of a body and the end marker, in one piece
+int send_crc_trailer(int sock, uint32_t crc) {
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    int end_len = snprintf(end, sizeof(end), "CRC32C %08x%s", crc, CMD_END_MARKER);
+    return send(sock, end, end_len, 0) == end_len ? 0 : -1;
+}
+
+// Function to read the CRC32C from the CRC_TRAILER_LEN bytes of a trailer, returns -1 if it is malformed
+int parse_crc_trailer(const char *trailer, uint32_t *crc) {
+    char text[CRC_TRAILER_LEN + 1];
+    unsigned int value;
+    int consumed = 0;
+    memcpy(text, trailer, CRC_TRAILER_LEN);
+    text[CRC_TRAILER_LEN] = '\0';
+    if (sscanf(text, "CRC32C %8x%n", &value, &consumed) != 1 || consumed != CRC_TRAILER_LEN) {
+        return -1;
+    }
+    *crc = value;
+    return 0;
+}
+
+// Function to pick the block size of a delta signature, about the square root of the file size
+// like rsync: small enough to find the unchanged parts, large enough to keep the signature short
+int delta_block_size(long long file_size) {
+    long long block_size = DELTA_MIN_BLOCK;
+    while (block_size < DELTA_MAX_BLOCK && block_size * block_size < file_size) {
+        block_size *= 2;
+    }
+    return (int)block_size;
+}
+
+// Function to compute the rolling checksum of a block, the client slides it over its file one byte at a time
+uint32_t weak_checksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Function to continue a 64 bit FNV-1a hash over more data, used for blocks and whole files
+uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Function to send the signature of a file for a delta upload: "<block size> <file size> <file hash> <length>\n",
+// then per block a 4 byte rolling checksum and an 8 byte strong hash (network byte order), and the end marker
+int send_signature(int sock, int file_fd) {
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("File stat failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+    long long file_size = (long long)file_stat.st_size;
+    int block_size = delta_block_size(file_size);
+    size_t n_blocks = (size_t)((file_size + block_size - 1) / block_size);
+    size_t signature_len = n_blocks * 12;
+    unsigned char *signature = pool_get(signature_len + 1);
+    unsigned char *block = pool_get(block_size);
+    if (signature == NULL || block == NULL) {
+        perror("Memory allocation failed");
+        pool_put(signature);
+        pool_put(block);
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+
+    // Checksum every block, and the whole file so the upload can check it is applied to this version
+    uint64_t file_hash = FNV_OFFSET;
+    for (size_t i = 0; i < n_blocks; i++) {
+        size_t want = (i == n_blocks - 1) ? (size_t)(file_size - (long long)i * block_size) : (size_t)block_size;
+        if (pread(file_fd, block, want, (off_t)i * block_size) != (ssize_t)want) {
+            perror("Error reading file");
+            pool_put(signature);
+            pool_put(block);
+            const char *error_message = "ERROR: Error reading file!";
+            send(sock, error_message, strlen(error_message), 0);
+            return -1;
+        }
+        file_hash = strong_hash(file_hash, block, want);
+        uint32_t weak = weak_checksum(block, want);
+        uint64_t strong = strong_hash(FNV_OFFSET, block, want);
+        unsigned char *entry = signature + i * 12;
+        for (int b = 0; b < 4; b++) {
+            entry[b] = (unsigned char)(weak >> (24 - 8 * b));
+        }
+        for (int b = 0; b < 8; b++) {
+            entry[4 + b] = (unsigned char)(strong >> (56 - 8 * b));
+        }
+    }
+    pool_put(block);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), "%d %lld %016llx %zu\n", block_size, file_size,
+                              (unsigned long long)file_hash, signature_len);
+    int result = 0;
+    if (send(sock, header, header_len, MSG_MORE) < 0 || (signature_len > 0 && send(sock, signature, signature_len, MSG_MORE) < 0)
+        || send_crc_trailer(sock, crc32c(0, signature, signature_len)) < 0) {
+        perror("Error sending signature");
+        result = -1;
+    }
+    pool_put(signature);
+    return result;
+}
+
+// Function to rebuild a file from its current contents and a delta, then replace it atomically
+// The delta is a list of 'C' <first block> <count> records (copy blocks of the current file) and
+// 'L' <length> <data> records (new data), numbers in network byte order. Returns -1 without touching
+// the file when it is not the version the signature was made from or the result does not match new_hash
+int apply_delta(const char *file_path, const unsigned char *delta, size_t delta_len, int block_size,
+                uint64_t base_hash, uint64_t new_hash) {
+    int base_fd = open(file_path, O_RDONLY);
+    if (base_fd < 0) {
+        perror("File open failed");
+        return -1;
+    }
+    struct stat base_stat;
+    unsigned char *buffer = pool_get(IO_BUFSIZE);
+    if (fstat(base_fd, &base_stat) < 0 || buffer == NULL) {
+        perror("File stat failed");
+        pool_put(buffer);
+        close(base_fd);
+        return -1;
+    }
+    long long base_size = (long long)base_stat.st_size;
+
+    // The delta only makes sense against the exact file the client diffed against; the file index
+    // remembers the hash of the file as it was written, so it is only read again when that is unknown
+    struct index_entry entry;
+    uint64_t hash = FNV_OFFSET;
+    ssize_t bytes_read = 0;
+    if (index_get(file_path, &entry) == 1 && entry.segment < 0 && entry.hash != 0 && entry.size == base_size
+        && entry.mtime_ns == (long long)base_stat.st_mtim.tv_sec * 1000000000LL + base_stat.st_mtim.tv_nsec) {
+        hash = entry.hash;
+    } else {
+        while ((bytes_read = read(base_fd, buffer, IO_BUFSIZE)) > 0) {
+            hash = strong_hash(hash, buffer, bytes_read);
+        }
+    }
+    if (bytes_read < 0 || hash != base_hash) {
+        printf("Delta base mismatch for %s\n", file_path);
+        pool_put(buffer);
+        close(base_fd);
+        return -1;
+    }
+
+    // Write the new version next to the old one
+    char temp_path[PATH_BUFSIZE];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", file_path);
+    int out_fd = mkstemp(temp_path);
+    if (out_fd < 0) {
+        perror("Temporary file creation failed");
+        pool_put(buffer);
+        close(base_fd);
+        return -1;
+    }
+    hash = FNV_OFFSET;
+    uint32_t crc = 0;
+    size_t pos = 0;
+    int ok = 1;
+    while (ok && pos < delta_len) {
+        char op = delta[pos];
+        if (op == 'C' && pos + 9 <= delta_len) {
+            uint32_t first = ((uint32_t)delta[pos + 1] << 24) | ((uint32_t)delta[pos + 2] << 16) | ((uint32_t)delta[pos + 3] << 8) | delta[pos + 4];
+            uint32_t count = ((uint32_t)delta[pos + 5] << 24) | ((uint32_t)delta[pos + 6] << 16) | ((uint32_t)delta[pos + 7] << 8) | delta[pos + 8];
+            pos += 9;
+            long long offset = (long long)first * block_size;
+            long long remaining = (long long)count * block_size;
+            if (offset > base_size) {
+                ok = 0;
+                break;
+            }
+            if (remaining > base_size - offset) {
+                remaining = base_size - offset;
+            }
+            // Copy the blocks from the current file
+            while (ok && remaining > 0) {
+                size_t want = remaining < IO_BUFSIZE ? (size_t)remaining : IO_BUFSIZE;
+                bytes_read = pread(base_fd, buffer, want, offset);
+                if (bytes_read <= 0 || write(out_fd, buffer, bytes_read) != bytes_read) {
+                    ok = 0;
+                    break;
+                }
+                hash = strong_hash(hash, buffer, bytes_read);
+                crc = crc32c(crc, buffer, bytes_read);
+                offset += bytes_read;
+                remaining -= bytes_read;
+            }
+        } else if (op == 'L' && pos + 5 <= delta_len) {
+            uint32_t len = ((uint32_t)delta[pos + 1] << 24) | ((uint32_t)delta[pos + 2] << 16) | ((uint32_t)delta[pos + 3] << 8) | delta[pos + 4];
+            pos += 5;
+            // Write the new data carried by the delta
+            if (len > delta_len - pos || write(out_fd, delta + pos, len) != (ssize_t)len) {
+                ok = 0;
+                break;
+            }
+            hash = strong_hash(hash, delta + pos, len);
+            crc = crc32c(crc, delta + pos, len);
+            pos += len;
+        } else {
+            ok = 0;
+        }
+    }
+    pool_put(buffer);
+    close(base_fd);
+
+    // Keep the old file's permissions and swap the new version in with one rename
+    if (!ok || hash != new_hash) {
+        printf("Delta for %s did not produce the uploaded file\n", file_path);
+        ok = 0;
+    }
+    if (ok && fchmod(out_fd, base_stat.st_mode & 07777) < 0) {
+        ok = 0;
+    }
+    if (close(out_fd) < 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temp_path, file_path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    struct stat new_stat;
+    if (stat(file_path, &new_stat) == 0) {
+        index_store_file(file_path, &new_stat, new_hash, crc);
+    } else {
+        index_forget(file_path);
+    }
+    return 0;
+}
+
+// Function to receive one "\n" terminated line (a file header) without reading past it
+// Returns the line length without the newline, a reply that ends without a newline (an error
+// message followed by the backend closing the connection) is returned as it is, -1 on failure
+ssize_t recv_line(int sock, char *line, size_t line_size) {
+    size_t len = 0;
+    while (len < line_size - 1) {
+        // Look at what arrived and only take it up to the newline
+        ssize_t peeked = recv(sock, line + len, line_size - 1 - len, MSG_PEEK);
+        if (peeked < 0) {
+            return -1;
+        }
+        if (peeked == 0) {
+            break;
+        }
+        char *newline = memchr(line + len, '\n', peeked);
+        size_t take = newline ? (size_t)(newline - (line + len)) + 1 : (size_t)peeked;
+        if (recv(sock, line + len, take, 0) != (ssize_t)take) {
+            return -1;
+        }
+        len += take;
+        if (newline) {
+            line[len - 1] = '\0';
+            return len - 1;
+        }
+    }
+    line[len] = '\0';
+    return len > 0 ? (ssize_t)len : -1;
+}
+
+
+// Function to send a download request to the server, returns 0 on success
+int send_download_request(int server_sock, char *command, char *file_path, long long offset, long long length, const char *if_tag){
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+    
+    // Construct the full path for the file (FilePath + file name)
+    char full_path[PATH_BUFSIZE];
+    if (file_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path+1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", file_path);
+    }
+
+    // Construct the message to send to the server, including the command, full file path, the range and the tag if any
+    char message[CMD_BUFSIZE];
+    if (offset >= 0 && if_tag != NULL) {
+        snprintf(message, sizeof(message), "%s %s %lld %lld %s", command, full_path, offset, length, if_tag);
+    } else if (offset >= 0) {
+        snprintf(message, sizeof(message), "%s %s %lld %lld", command, full_path, offset, length);
+    } else {
+        snprintf(message, sizeof(message), "%s %s", command, full_path);
+    }
+    
     // Send the message to the server
-    printf("Sending request to server...\n");
-    if (send(sock, message, strlen(message), 0) == -1) {
+    printf("Sending download request to server..\n");
+    if (send(server_sock, message, strlen(message), 0) == -1) {
         // Print an error message if sending fails
         perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to forward the server's reply to a download request to the client, the outcome is reported to the
+// circuit breaker of the server's endpoint ep (NULL for none)
+// Returns 0 once the whole reply was passed on, -1 if the server failed or answered with an error (copied to
+// error_buffer) before anything was sent to the client, so another replica can be tried, and -2 if the transfer
+// broke after the header went out: the client's stream is then out of step and the caller ends the session
+int relay_download(const struct endpoint *ep, int server_sock, int client_sock, char *error_buffer, size_t error_size){
+    // Receive the "<name> <size>" header from the server
+    char header[320];
+    if (recv_line(server_sock, header, sizeof(header)) < 0) {
+        // Print an error message if receiving the header fails
+        perror("Error receiving file name");
+        if (ep != NULL) {
+            report_backend(ep, 0);
+        }
+        return -1;
+    }
+
+    // Errors such as "ERROR: File not found!" are left to the caller, which may ask another replica
+    if (strncmp(header, "ERROR:", 6) == 0) {
+        snprintf(error_buffer, error_size, "%s", header);
+        if (ep != NULL) {
+            report_backend(ep, 1);
+        }
+        return -1;
+    }
+    char *size_field = strrchr(header, ' ');
+    long long file_size;
+    if (size_field == NULL || sscanf(size_field, "%lld", &file_size) != 1 || file_size < 0) {
+        printf("Invalid file header from server: %s\n", header);
+        snprintf(error_buffer, error_size, "ERROR: Download Failed!");
+        if (ep != NULL) {
+            report_backend(ep, 0);
+        }
+        return -1;
+    }
+
+    // Send the header to the client, held back (MSG_MORE) to go out with the content that follows
+    strcat(header, "\n");
+    if (send(client_sock, header, strlen(header), MSG_MORE) == -1) {
+        // Print an error message if sending the header to the client fails
+        perror("send");
+    }
+
+    // Forward exactly the file content, checksumming it on the way
+    char *buffer = pool_get(IO_BUFSIZE);
+    long long remaining = file_size;
+    ssize_t content_received = 0;
+    uint32_t crc = 0;
+    while (buffer != NULL && remaining > 0) {
+        size_t want = remaining < IO_BUFSIZE ? (size_t)remaining : IO_BUFSIZE;
+        content_received = recv(server_sock, buffer, want, 0);
+        if (content_received <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, content_received);
+        // Forward the received content to the client, the trailer follows
+        ssize_t bytes_sent = send(client_sock, buffer, content_received, MSG_MORE);
+        if (bytes_sent < 0) {
+            // Print an error message if forwarding fails
+            perror("send");
+            break;
+        }
+        // Pacing the client side also paces the store, which TCP holds back while Smain waits
+        rate_limit_bytes(bytes_sent);
+        remaining -= content_received;
+    }
+    pool_put(buffer);
+    if (remaining > 0) {
+        // Print an error message if there was an issue receiving the file content
+        perror("Error receiving file content");
+        if (ep != NULL && content_received <= 0) {
+            report_backend(ep, 0);
+        }
+        return -2;
+    }
+
+    // Check the server's CRC32C trailer, then pass it on unchanged with the end marker: a body damaged
+    // between the store and Smain still fails the client's check
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    size_t end_len = CRC_TRAILER_LEN + strlen(CMD_END_MARKER);
+    uint32_t sent_crc;
+    if (recv(server_sock, end, end_len, MSG_WAITALL) != (ssize_t)end_len) {
+        perror("Error receiving file content");
+        if (ep != NULL) {
+            report_backend(ep, 0);
+        }
+        return -2;
+    }
+    if (ep != NULL) {
+        report_backend(ep, 1);
+    }
+    if (parse_crc_trailer(end, &sent_crc) < 0 || sent_crc != crc) {
+        printf("Checksum mismatch on the data received from the store: %s\n", header);
+    }
+    if (send(client_sock, end, end_len, 0) < 0) {
+        perror("send");
+        return -2;
+    }
+    return 0;
+}
+
+// Function to send a download request to a backend; a dfile request over a Unix-domain connection asks for the
+// file's descriptor instead ("dfd <path>") and Smain applies the range and tag itself, *pass_fd tells which was sent
+int request_download(int server_sock, char *command, char *file_path, long long offset, long long length, const char *if_tag, int *pass_fd) {
+    *pass_fd = (strcmp(command, "dfile") == 0 && is_unix_socket(server_sock));
+    if (*pass_fd) {
+        return send_download_request(server_sock, "dfd", file_path, -1, -1, NULL);
+    }
+    return send_download_request(server_sock, command, file_path, offset, length, if_tag);
+}
+
+// Function to serve a download from the descriptor a backend on this host passed back ("FD <crc>\n" with SCM_RIGHTS):
+// Smain sends the file to the client itself, so the contents do not cross a second socket
+// Returns -1 with the reason in error_buffer if no file came with the reply
+int relay_passed_file(int server_sock, int client_sock, const char *file_path, long long offset, long long length, const char *if_tag, char *error_buffer, size_t error_size) {
+    // The header and the descriptor arrive in one message
+    char header[64];
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(header) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t received = recvmsg(server_sock, &msg, MSG_CMSG_CLOEXEC);
+    int file_fd = -1;
+    struct cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&file_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    header[received > 0 ? received : 0] = '\0';
+
+    long long stored_crc;
+    struct stat file_stat;
+    if (file_fd < 0 || sscanf(header, "FD %lld", &stored_crc) != 1 || fstat(file_fd, &file_stat) < 0) {
+        printf("Invalid file descriptor reply from server: %s\n", header);
+        snprintf(error_buffer, error_size, "ERROR: Download Failed!");
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return -1;
+    }
+
+    // Send the header, the contents (or the requested range), the checksum and the end marker to the client
+    const char *file_name = strrchr(file_path, '/') + 1;
+    send_file_region(client_sock, file_fd, 0, &file_stat, file_name, offset, length, if_tag, stored_crc);
+    close(file_fd);
+    return 0;
+}
+
+// Function to map the shared backend statistics, before the first fork so every child sees the same counters
+int init_backend_stats() {
+    backend_stats = mmap(NULL, sizeof(struct backend_stats) * MAX_ROUTES * MAX_ENDPOINTS,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (backend_stats == MAP_FAILED) {
+        perror("Backend statistics mapping failed");
+        backend_stats = NULL;
+        return -1;
+    }
+    // Let every endpoint find its own statistics and circuit breaker
+    for (int i = 0; i < n_routes; i++) {
+        for (int e = 0; e < routes[i].n_endpoints; e++) {
+            routes[i].endpoints[e].stats = stats_for(&routes[i], e);
+        }
+    }
+    return 0;
+}
+
+// Function to find the shared statistics of an endpoint of a route
+struct backend_stats *stats_for(const struct route *r, int endpoint) {
+    return &backend_stats[(r - routes) * MAX_ENDPOINTS + endpoint];
+}
+
+// Helper function returning a monotonic timestamp in microseconds
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Function to record a first-byte latency sample: updates the EWMA (alpha 1/8) and the log2 histogram
+void record_latency(struct backend_stats *st, uint64_t latency_us) {
+    uint64_t old_ewma = __atomic_load_n(&st->ewma_us, __ATOMIC_RELAXED);
+    uint64_t new_ewma;
+    do {
+        new_ewma = (old_ewma == 0) ? latency_us : old_ewma - old_ewma / 8 + latency_us / 8;
+    } while (!__atomic_compare_exchange_n(&st->ewma_us, &old_ewma, new_ewma, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    int bucket = 63 - __builtin_clzll(latency_us | 1);
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&st->latency_hist[bucket], 1, __ATOMIC_RELAXED);
+
+    // Halve the histogram now and then so the percentile follows the backend's recent behaviour
+    if (__atomic_add_fetch(&st->samples, 1, __ATOMIC_RELAXED) % 4096 == 0) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            __atomic_store_n(&st->latency_hist[i], __atomic_load_n(&st->latency_hist[i], __ATOMIC_RELAXED) / 2, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Function to estimate the 95th percentile first-byte latency of a backend from its histogram
+uint64_t p95_latency_us(const struct backend_stats *st) {
+    if (__atomic_load_n(&st->samples, __ATOMIC_RELAXED) < HEDGE_MIN_SAMPLES) {
+        return HEDGE_DEFAULT_US;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += __atomic_load_n(&st->latency_hist[i], __ATOMIC_RELAXED);
+    }
+    uint64_t target = (total * 95 + 99) / 100, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&st->latency_hist[i], __ATOMIC_RELAXED);
+        if (total > 0 && seen >= target) {
+            // Use the upper edge of the bucket, but never hedge faster than the floor
+            uint64_t edge = 1ull << (i + 1);
+            return edge > HEDGE_FLOOR_US ? edge : HEDGE_FLOOR_US;
+        }
+    }
+    return HEDGE_DEFAULT_US;
+}
+
+// Function to order replicas best first by expected wait: EWMA latency times (outstanding requests + 1)
+// Backends without samples are assumed to take HEDGE_DEFAULT_US, ties keep the ring order (owner first)
+int rank_replicas(const struct route *r, int *replicas, int n) {
+    uint64_t score[MAX_ENDPOINTS];
+    for (int i = 0; i < n; i++) {
+        struct backend_stats *st = stats_for(r, replicas[i]);
+        uint64_t ewma = __atomic_load_n(&st->ewma_us, __ATOMIC_RELAXED);
+        int outstanding = __atomic_load_n(&st->outstanding, __ATOMIC_RELAXED);
+        score[i] = (ewma ? ewma : HEDGE_DEFAULT_US) * (uint64_t)(outstanding + 1);
+    }
+    // Insertion sort, n is at most MAX_ENDPOINTS
+    for (int i = 1; i < n; i++) {
+        uint64_t key_score = score[i];
+        int key = replicas[i], j = i - 1;
+        while (j >= 0 && score[j] > key_score) {
+            score[j + 1] = score[j];
+            replicas[j + 1] = replicas[j];
+            j--;
+        }
+        score[j + 1] = key_score;
+        replicas[j + 1] = key;
+    }
+    return n;
+}
+
+// Function to download a file from the best replica, hedging with a duplicate request to the next best
+// replica when the first byte has not arrived within the p95 latency of the first one; the loser is cancelled
+void hedged_download(int client_sock, const struct route *r, const int *replicas, int n, char *command, char *file_path, long long offset, long long length, const char *if_tag) {
+    int order[MAX_ENDPOINTS];
+    memcpy(order, replicas, sizeof(int) * n);
+    rank_replicas(r, order, n);
+
+    // At most two requests are in flight: the primary and its hedge
+    struct pollfd fds[2];
+    int in_flight[2];
+    // Set for requests that get the file's descriptor from a backend on this host instead of its contents
+    int pass_fd[2];
+    uint64_t started[2];
+    int active = 0, next = 0;
+    char error_message[256] = "ERROR: Storage server unavailable!";
+
+    while (active > 0 || next < n) {
+        // Start a request on the next replica if nothing is in flight (the previous one failed)
+        if (active == 0) {
+            int e = order[next++];
+            started[0] = now_us();
+            fds[0].fd = connect_to_endpoint(&r->endpoints[e]);
+            if (fds[0].fd < 0 || request_download(fds[0].fd, command, file_path, offset, length, if_tag, &pass_fd[0]) < 0) {
+                if (fds[0].fd >= 0) {
+                    close(fds[0].fd);
+                }
+                continue;
+            }
+            fds[0].events = POLLIN;
+            in_flight[0] = e;
+            active = 1;
+            __atomic_add_fetch(&stats_for(r, e)->outstanding, 1, __ATOMIC_RELAXED);
+        }
+
+        // Wait for the first byte; a lone request on a replicated file may be hedged after the p95 latency
+        int can_hedge = (active == 1 && next < n);
+        int timeout_ms = io_timeout_ms;
+        if (can_hedge) {
+            uint64_t deadline = started[0] + p95_latency_us(stats_for(r, in_flight[0]));
+            uint64_t now = now_us();
+            timeout_ms = (deadline > now) ? (int)((deadline - now + 999) / 1000) : 0;
+        }
+        int ready = poll(fds, active, timeout_ms);
+
+        if (ready == 0 && can_hedge) {
+            // Issue the hedged duplicate request to the next best replica
+            int e = order[next++];
+            started[1] = now_us();
+            fds[1].fd = connect_to_endpoint(&r->endpoints[e]);
+            if (fds[1].fd >= 0 && request_download(fds[1].fd, command, file_path, offset, length, if_tag, &pass_fd[1]) == 0) {
+                printf("Hedging %s read to %s:%d\n", r->store, r->endpoints[e].host, r->endpoints[e].port);
+                fds[1].events = POLLIN;
+                in_flight[1] = e;
+                active = 2;
+                __atomic_add_fetch(&stats_for(r, e)->outstanding, 1, __ATOMIC_RELAXED);
+            } else if (fds[1].fd >= 0) {
+                close(fds[1].fd);
+            }
+            continue;
+        }
+        if (ready <= 0) {
+            // No replica answered in time, cancel everything still in flight and count it against the backends;
+            // the latency recorded is at least the timeout, so a hung replica is not ranked as a fast one
+            uint64_t timeout_us = (uint64_t)io_timeout_ms * 1000;
+            for (int i = 0; i < active; i++) {
+                uint64_t waited = now_us() - started[i];
+                report_backend(&r->endpoints[in_flight[i]], 0);
+                record_latency(stats_for(r, in_flight[i]), waited > timeout_us ? waited : timeout_us);
+                __atomic_sub_fetch(&stats_for(r, in_flight[i])->outstanding, 1, __ATOMIC_RELAXED);
+                close(fds[i].fd);
+            }
+            active = 0;
+            snprintf(error_message, sizeof(error_message), "ERROR: Storage server timed out!");
+            break;
+        }
+
+        for (int i = 0; i < active; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            struct backend_stats *st = stats_for(r, in_flight[i]);
+            uint64_t first_byte_us = now_us() - started[i];
+
+            // Peek at the reply: an error (or a closed connection) drops this replica, anything else wins the race
+            char peek[8];
+            ssize_t peeked = recv(fds[i].fd, peek, 6, MSG_PEEK | MSG_WAITALL);
+            // Only a reply that arrived is a first-byte latency, a closed connection is not (and counts as a failure)
+            if (peeked > 0) {
+                record_latency(st, first_byte_us);
+            } else {
+                report_backend(&r->endpoints[in_flight[i]], 0);
+            }
+            int winner = (peeked == 6 && strncmp(peek, "ERROR:", 6) != 0);
+            if (winner) {
+                // Cancel the other request by closing its connection, its latency is unknown and not recorded
+                for (int j = 0; j < active; j++) {
+                    if (j != i) {
+                        __atomic_sub_fetch(&stats_for(r, in_flight[j])->outstanding, 1, __ATOMIC_RELAXED);
+                        close(fds[j].fd);
+                    }
+                }
+                if (!pass_fd[i]) {
+                    int relayed = relay_download(&r->endpoints[in_flight[i]], fds[i].fd, client_sock, error_message, sizeof(error_message));
+                    if (relayed == -1) {
+                        send(client_sock, error_message, strlen(error_message), 0);
+                    } else if (relayed == -2) {
+                        // The client got part of the file, end the session so it sees the failure instead of waiting
+                        shutdown(client_sock, SHUT_RDWR);
+                    }
+                } else if (relay_passed_file(fds[i].fd, client_sock, file_path, offset, length, if_tag, error_message, sizeof(error_message)) < 0) {
+                    report_backend(&r->endpoints[in_flight[i]], 0);
+                    send(client_sock, error_message, strlen(error_message), 0);
+                } else {
+                    report_backend(&r->endpoints[in_flight[i]], 1);
+                }
+                __atomic_sub_fetch(&st->outstanding, 1, __ATOMIC_RELAXED);
+                close(fds[i].fd);
+                return;
+            }
+
+            // Consume the error message (e.g. "ERROR: File not found!") and keep waiting for the other replicas
+            if (peeked > 0) {
+                relay_download(&r->endpoints[in_flight[i]], fds[i].fd, client_sock, error_message, sizeof(error_message));
+            }
+            __atomic_sub_fetch(&st->outstanding, 1, __ATOMIC_RELAXED);
+            close(fds[i].fd);
+            fds[i] = fds[active - 1];
+            in_flight[i] = in_flight[active - 1];
+            pass_fd[i] = pass_fd[active - 1];
+            started[i] = started[active - 1];
+            active--;
+            i--;
+        }
+    }
+
+    // No replica could serve the file
+    printf("%s\n", error_message);
+    send(client_sock, error_message, strlen(error_message), 0);
+}
+
+// Helper function to request server for file name for given path
+// Returns 0 when the server answered (even with no files) and -1 when it was unreachable or timed out
+int get_file_names_from_server(const struct endpoint *ep, const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size) {
+    // Clear the response buffer to ensure it's empty before receiving data
+    memset(response_buffer, 0, buffer_size);
+
+    // Establish a connection to the backend server
+    int server_sock = connect_to_endpoint(ep);
+    if (server_sock < 0) {
+        // Print an error message if the connection failed
+        printf("Failed to connect to server\n");
+        return -1;
+    }
+
+    // Send the message to the server
+    send(server_sock, message, strlen(message), MSG_NOSIGNAL);
+
+    // Receive the server's response into the response buffer until the server closes the connection, a
+    // recursive list can take several segments. Read response, leaving space for null terminator
+    size_t received = 0;
+    ssize_t n;
+    while (received < buffer_size - 1 && (n = recv(server_sock, response_buffer + received, buffer_size - 1 - received, 0)) != 0) {
+        if (n < 0) {
+            // A backend that accepted but did not answer in time counts as a failure
+            perror("Error receiving file names");
+            report_backend(ep, 0);
+            response_buffer[0] = '\0';
+            close(server_sock);
+            return -1;
+        }
+        received += (size_t)n;
+    }
+    // The whole reply arrived
+    report_backend(ep, 1);
+
+    // Check if the response starts with the error prefix
+    if (strncmp(response_buffer, error_prefix, strlen(error_prefix)) != 0) {
+        // If the response doesn't start with the error prefix, close the connection
+        close(server_sock);
+    } else {
+        // If the response starts with the error prefix, clear the buffer to indicate an error
+        response_buffer[0] = '\0';
+        close(server_sock);
+    }
+    return 0;
+}
+
+
+// Helper Function to create a tarball of the local files with the given extension and send it to the client
+void local_tar_file(int client_sock, const char *path, const char *ext, struct tar_delta *delta) {
+    // variables to hold the command for creating the tarball, the tarball name and the target path
+    char tar_cmd[CMD_BUFSIZE];
+    char tar_name[64];
+    char target_path[PATH_BUFSIZE];
+    char error_message[128];
+
+    // The tarball is sent as "c_files.tar" for .c
+    snprintf(tar_name, sizeof(tar_name), "%s_files.tar", ext + 1);
+
+    // A full tarball is built once for each version of the tree: while no file changed, dtar sends the cached one
+    // straight from the page cache with sendfile
+    long long generation = delta == NULL ? tree_generation() : -1;
+    uint32_t tar_crc;
+    if (generation >= 0 && tar_cache_lookup(ext, generation, target_path, sizeof(target_path), &tar_crc)) {
+        int cached = open(target_path, O_RDONLY);
+        struct stat cached_stat;
+        // A newer version may have replaced it in the meantime, then the tarball is built again
+        if (cached >= 0 && fstat(cached, &cached_stat) == 0) {
+            if (send_file_region(client_sock, cached, 0, &cached_stat, tar_name, -1, -1, NULL, tar_crc) < 0) {
+                perror("Failed to send tarball data");
+            }
+            close(cached);
+            printf("Cached tarball sent to client.\n");
+            return;
+        }
+        if (cached >= 0) {
+            close(cached);
+        }
+    }
+
+    // The tarball is built outside ~/smain, so display never lists it, under a name of its own so that concurrent
+    // dtars do not write the same file: in the cache directory, or in the temporary directory of an incremental dtar
+    if (delta != NULL) {
+        snprintf(target_path, sizeof(target_path), "%s/%s", delta->tmp_dir, tar_name);
+    } else {
+        snprintf(target_path, sizeof(target_path), "%s/%s.%d.tmp", tar_cache_dir, ext + 1, (int)getpid());
+    }
+
+    // Packed files go into the tarball first, streamed from their segments
+    int packed = 0;
+    if (file_index->active >= 0) {
+        int tar_fd = open(target_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        packed = tar_fd < 0 ? -1 : pack_write_tar(tar_fd, path, ext, delta);
+        if (tar_fd >= 0) {
+            close(tar_fd);
+        }
+        if (packed < 0) {
+            unlink(target_path);
+            const char *tar_error = "ERROR: Tar file creation failed!";
+            send(client_sock, tar_error, strlen(tar_error), 0);
+            return;
+        }
+    }
+
+    int loose = 0, result = 0;
+    if (delta != NULL) {
+        // An incremental tarball gets the loose files the delta wants, found by walking the directory, then the new
+        // manifest and the deleted files; it is sent even if nothing changed
+        char list_path[128];
+        snprintf(list_path, sizeof(list_path), "%s/list", delta->tmp_dir);
+        FILE *list = fopen(list_path, "w");
+        if (list == NULL) {
+            result = -1;
+        } else {
+            collect_tar_files(path, "", ext, delta, list);
+            loose = (ftell(list) > 0);
+            fclose(list);
+            if (loose) {
+                snprintf(tar_cmd, sizeof(tar_cmd), "tar -%sf %s --null -T %s 2>/dev/null", packed > 0 ? "r" : "c", target_path, list_path);
+                result = system(tar_cmd);
+            } else if (packed == 0) {
+                unlink(target_path);
+            }
+            unlink(list_path);
+        }
+        if (result == 0) {
+            result = append_tar_delta(delta, target_path);
+        }
+    } else {
+        // Check for the presence of matching files first
+        snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*%s' -print -quit", path, ext);
+        // Run the command to check for matching files and store the result
+        FILE *check = popen(tar_cmd, "r");
+        // If the check command fails, inform the client and exit the function
+        if (check == NULL) {
+            printf("ERROR: Failed to check for %s files.\n", ext);
+            unlink(target_path);
+            snprintf(error_message, sizeof(error_message), "ERROR: Failed to check for %s files!", ext);
+            send(client_sock, error_message, strlen(error_message), 0);
+            return;
+        }
+
+        // If no matching files are found, inform the client and exit the function
+        loose = (fgetc(check) != EOF);
+        pclose(check);
+        if (!loose && packed == 0) {
+            unlink(target_path);
+            printf("No %s files found.\n", ext);
+            snprintf(error_message, sizeof(error_message), "ERROR: No %s files found!", ext);
+            send(client_sock, error_message, strlen(error_message), 0);
+            return;
+        }
+
+        // If matching files are found, create the tarball using the find command and tar command,
+        // appending them after the packed files if there are any
+        if (loose) {
+            snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*%s' -print0 | tar -%sf %s --null -T - 2>/dev/null", path, ext, packed > 0 ? "r" : "c", target_path);
+            // Run the command to create the tarball
+            result = system(tar_cmd);
+        }
+    }
+    // If the tarball creation fails, inform the client and exit the function
+    if (result != 0) {
+        printf("ERROR: Failed to create tarball for %s files.\n", ext);
+        unlink(target_path);
+        const char *tar_error = "ERROR: Tar file creation failed!";
+        send(client_sock, tar_error, strlen(tar_error), 0);
+        return;
+    }
+
+    // Check if the tarball file was successfully created
+    if (access(target_path, F_OK) != 0) {
+        // Send rejction to the client
+        const char *success_message = "ERROR: Tar file creation failed!";
+        printf("%s\n",success_message);
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+
+    // Open the tarball file to read its contents, and checksum it once so that it is sent with sendfile
+    int tarball = open(target_path, O_RDONLY);
+    struct stat tar_stat;
+    if (tarball < 0 || fstat(tarball, &tar_stat) < 0 || file_crc32c(tarball, &tar_crc) < 0) {
+        // If the tarball file cannot be opened
+        printf("ERROR: Failed to open tarball file.\n");
+        if (tarball >= 0) {
+            close(tarball);
+        }
+        unlink(target_path);
+        // Send rejction to the client
+        const char *success_message = "ERROR: Tar file creation failed!";
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+    // The tarball is cached if no file changed while it was built, otherwise it is only kept open until it is sent
+    if (generation >= 0 && tree_generation() == generation) {
+        tar_cache_store(target_path, ext, generation, tar_crc);
+    } else {
+        unlink(target_path);
+    }
+
+    // Send the tarball name and size, its contents and the end-of-file marker to the client
+    if (send_file_region(client_sock, tarball, 0, &tar_stat, tar_name, -1, -1, NULL, tar_crc) < 0) {
+        perror("Failed to send tarball data");
+    }
+    // Close the tarball file after sending its contents
+    close(tarball);
+    printf("Tarball sent to client.\n");
+}
+
+// Function to request a tarball file from the server of endpoint ep and forward it to the client
+void request_tar_file(const struct endpoint *ep, int server_sock, int client_sock, char *path, const char *ext, long long since, const char *manifest, long long manifest_len){
+    // Send the command, server path and extension (and the options and manifest of an incremental dtar) to the server
+    printf("Sending tar file download request to server\n");
+    if (send_tar_request(server_sock, path, ext, since, manifest, manifest_len) < 0) {
+        // Print an error message if sending fails and let the client know
+        perror("send");
+        report_backend(ep, 0);
+        const char *error_message = "ERROR: Storage server unavailable!";
+        send(client_sock, error_message, strlen(error_message), 0);
         return;
     }
 
-    // Receive and display the confirmation message from the server
-    ssize_t bytes_received = recv(sock, recv_buffer, sizeof(recv_buffer) - 1, 0);
-    if (bytes_received > 0) {
-        //  Null-terminate the received data to make it a valid string
-        recv_buffer[bytes_received] = '\0';
-        printf("Server Responce: %s\nforwarding responce to client\n",recv_buffer);
-        // Forward the server's response to the client
-        if (send(client_sock, recv_buffer, bytes_received, 0) < 0) {
-            // Print an error message if forwarding to the client fails
-            perror("Send to client failed");
-        }
-    } else if (bytes_received == 0) {
-        // Print a message if the server closed the connection
-        printf("Connection closed by server.\n");
-        exit(EXIT_SUCCESS);
+    // Forward the tarball (or the server's error message) to the client
+    char error_message[256] = "ERROR: Tar file creation failed!";
+    int relayed = relay_download(ep, server_sock, client_sock, error_message, sizeof(error_message));
+    if (relayed == -1) {
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+    } else if (relayed == -2) {
+        // The client got part of the tarball, end the session so it sees the failure instead of waiting
+        printf("Tarball transfer of %s broke off\n", ext);
+        shutdown(client_sock, SHUT_RDWR);
     } else {
-        // Print an error message if there was an issue receiving data
-        perror("Error receiving data");
+        // Print a message indicating that the tarball was received and forwarded to the client
+        printf("Tarball of %s received and sent to client.\n", ext);
     }
 }
 
-// Function to delete a file and handle errors
-int delete_file(const char *file_path) {
-    // Replace ~ with the value of the HOME environment variable
+// Function to fetch the tarball of one shard into a local file, returns 0 on success
+// On failure the server's error message (or a generic one) is copied into error_buffer
+int fetch_tar_from_server(const struct endpoint *ep, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len, const char *out_path, char *error_buffer, size_t error_size) {
+    snprintf(error_buffer, error_size, "ERROR: Storage server unavailable!");
+
+    int server_sock = connect_to_endpoint(ep);
+    if (server_sock < 0) {
+        return -1;
+    }
+
+    // Ask the shard for its tarball of the requested extension
+    if (send_tar_request(server_sock, path, ext, since, manifest, manifest_len) < 0) {
+        perror("send");
+        report_backend(ep, 0);
+        close(server_sock);
+        return -1;
+    }
+
+    // The reply starts with the "<name> <size>" header, or is an error such as "ERROR: No .pdf files found!"
+    char header[320];
+    if (recv_line(server_sock, header, sizeof(header)) < 0) {
+        report_backend(ep, 0);
+        close(server_sock);
+        return -1;
+    }
+    if (strncmp(header, "ERROR:", 6) == 0) {
+        snprintf(error_buffer, error_size, "%s", header);
+        report_backend(ep, 1);
+        close(server_sock);
+        return -1;
+    }
+    char *size_field = strrchr(header, ' ');
+    long long remaining;
+    if (size_field == NULL || sscanf(size_field, "%lld", &remaining) != 1 || remaining < 0) {
+        snprintf(error_buffer, error_size, "ERROR: Tar file transfer failed!");
+        close(server_sock);
+        return -1;
+    }
+
+    int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (out_fd < 0) {
+        perror("Temporary tarball creation failed");
+        close(server_sock);
+        return -1;
+    }
+
+    // Receive exactly the announced number of bytes, then the CRC32C trailer and the end marker
+    char *buffer = pool_get(IO_BUFSIZE);
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    ssize_t bytes_received = 0;
+    uint32_t crc = 0, sent_crc;
+    while (buffer != NULL && remaining > 0) {
+        size_t want = remaining < IO_BUFSIZE ? (size_t)remaining : IO_BUFSIZE;
+        bytes_received = recv(server_sock, buffer, want, 0);
+        if (bytes_received <= 0 || write(out_fd, buffer, bytes_received) != bytes_received) {
+            perror("Temporary tarball write failed");
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes_received);
+        remaining -= bytes_received;
+    }
+    pool_put(buffer);
+    size_t marker_len = strlen(CMD_END_MARKER);
+    if (remaining > 0 || recv(server_sock, end, CRC_TRAILER_LEN + marker_len, MSG_WAITALL) != (ssize_t)(CRC_TRAILER_LEN + marker_len)
+        || memcmp(end + CRC_TRAILER_LEN, CMD_END_MARKER, marker_len) != 0) {
+        snprintf(error_buffer, error_size, "ERROR: Tar file transfer failed!");
+        report_backend(ep, 0);
+        close(server_sock);
+        close(out_fd);
+        return -1;
+    }
+    if (parse_crc_trailer(end, &sent_crc) < 0 || sent_crc != crc) {
+        snprintf(error_buffer, error_size, "ERROR: Tar file checksum mismatch!");
+        report_backend(ep, 0);
+        close(server_sock);
+        close(out_fd);
+        return -1;
+    }
+    // The whole tarball arrived
+    report_backend(ep, 1);
+    close(server_sock);
+    close(out_fd);
+    return 0;
+}
+
+// Function to collect the tarballs of every shard of a store, merge them and send the result to the client
+void merge_shard_tars(int client_sock, const struct route *r, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len) {
+    char merged_path[64] = "";
+    char shard_path[64];
+    char error_message[256] = "ERROR: Tar file creation failed!";
+    char tar_cmd[CMD_BUFSIZE];
+    int merged = 0;
+    // The shards that failed for another reason than having no matching files
+    int unavailable = 0;
+    // Each shard of an incremental dtar gets the lines of the manifest for the files it owns, otherwise it would
+    // report the other shards' files as deleted
+    char *shard_manifest = manifest_len >= 0 ? malloc(manifest_len + 1) : NULL;
+    if (manifest_len >= 0 && shard_manifest == NULL) {
+        perror("Memory allocation failed");
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+
+    for (int e = 0; e < r->n_endpoints; e++) {
+        // Each shard's tarball is received into a private temporary file
+        snprintf(shard_path, sizeof(shard_path), "/tmp/smain_dtar_XXXXXX");
+        int fd = mkstemp(shard_path);
+        if (fd < 0) {
+            perror("mkstemp");
+            break;
+        }
+        close(fd);
+
+        long long shard_len = -1;
+        if (shard_manifest != NULL) {
+            shard_len = 0;
+            for (const char *line = manifest; line < manifest + manifest_len; ) {
+                const char *end = memchr(line, '\n', manifest + manifest_len - line);
+                size_t line_len = end != NULL ? (size_t)(end - line) + 1 : (size_t)(manifest + manifest_len - line);
+                char route_path[PATH_BUFSIZE];
+                int replicas[MAX_ENDPOINTS], consumed = 0;
+                sscanf(line, "%*s %*s %n", &consumed);
+                snprintf(route_path, sizeof(route_path), "~/smain/%.*s", (int)(line_len - consumed - (end != NULL)), line + consumed);
+                int n = consumed > 0 ? replicas_of(r, route_path, replicas) : 0;
+                for (int i = 0; i < n; i++) {
+                    if (replicas[i] == e) {
+                        memcpy(shard_manifest + shard_len, line, line_len);
+                        shard_len += line_len;
+                        break;
+                    }
+                }
+                line += line_len;
+            }
+        }
+        if (fetch_tar_from_server(&r->endpoints[e], path, ext, since, shard_manifest, shard_len, shard_path, error_message, sizeof(error_message)) != 0) {
+            // A shard without matching files is skipped; one that could not be read is counted, its files
+            // are only missing from the tarball if every replica holding them failed as well
+            printf("Shard %s:%d: %s\n", r->endpoints[e].host, r->endpoints[e].port, error_message);
+            if (strncmp(error_message, "ERROR: No ", 10) != 0) {
+                unavailable++;
+            }
+            unlink(shard_path);
+            continue;
+        }
+
+        if (!merged) {
+            // The first tarball becomes the base of the merged archive
+            snprintf(merged_path, sizeof(merged_path), "%s", shard_path);
+            merged = 1;
+            // When every endpoint keeps a copy of every file, one endpoint's tarball is complete
+            if (r->replicas >= r->n_endpoints) {
+                break;
+            }
+        } else {
+            // A file with several replicas is in the tarball of each of them: drop the members the merged archive
+            // already has from the next tarball (except the per-shard manifest members of an incremental dtar),
+            // then append the rest of its members
+            snprintf(tar_cmd, sizeof(tar_cmd),
+                     "tar -tf %s > %s.names && { tar -tf %s | grep -Fxf %s.names | grep -v '^\\.dfs_' > %s.dups;"
+                     " [ ! -s %s.dups ] || tar --delete -f %s --verbatim-files-from -T %s.dups; }"
+                     " && tar -Af %s %s 2>/dev/null",
+                     merged_path, shard_path, shard_path, shard_path, shard_path,
+                     shard_path, shard_path, shard_path, merged_path, shard_path);
+            int result = system(tar_cmd);
+            char list_path[80];
+            snprintf(list_path, sizeof(list_path), "%s.names", shard_path);
+            unlink(list_path);
+            snprintf(list_path, sizeof(list_path), "%s.dups", shard_path);
+            unlink(list_path);
+            unlink(shard_path);
+            if (result != 0) {
+                printf("ERROR: Failed to merge shard tarballs.\n");
+                snprintf(error_message, sizeof(error_message), "ERROR: Tar file creation failed!");
+                unlink(merged_path);
+                merged = 0;
+                break;
+            }
+        }
+    }
+
+    free(shard_manifest);
+    // With as many shards down as there are replicas, some files may have no copy left in the tarball:
+    // fail the dtar rather than send an incomplete one
+    if (merged && unavailable >= r->replicas) {
+        snprintf(error_message, sizeof(error_message), "ERROR: Some storage servers are unavailable, the tarball would be incomplete!");
+        unlink(merged_path);
+        merged = 0;
+    }
+    // If no shard produced a tarball, forward the last error to the client
+    if (!merged) {
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+
+    // Send the merged tarball under the usual name
+    char tar_name[64];
+    snprintf(tar_name, sizeof(tar_name), "%s_files.tar", ext + 1);
+    send_file_to_client(client_sock, merged_path, tar_name, -1, -1, NULL);
+    unlink(merged_path);
+    printf("Merged tarball of %s sent to client.\n", r->store);
+}
+
+// Function to parse the options of an incremental dtar, "[since=<time>] [manifest=<bytes>]": since and manifest_len
+// are -1 when not given. Returns -1 if an option is invalid
+int parse_tar_options(const char *options, long long *since, long long *manifest_len) {
+    *since = -1;
+    *manifest_len = -1;
+    char words[PATH_BUFSIZE];
+    snprintf(words, sizeof(words), "%s", options);
+    char *saveptr;
+    for (char *word = strtok_r(words, " \t\r\n", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        char *value = strchr(word, '=');
+        char *end = NULL;
+        if (value == NULL || value[1] == '\0') {
+            return -1;
+        }
+        *value++ = '\0';
+        long long number = strtoll(value, &end, 10);
+        if (*end != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(word, "since") == 0) {
+            *since = number;
+        } else if (strcmp(word, "manifest") == 0) {
+            *manifest_len = number;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to send a dtar request to a backend: "dtar <path> <ext> [since=<time>] [manifest=<bytes>]", and for a
+// manifest a newline, the manifest and its CRC32C trailer. Returns 0 on success, -1 if the request could not be sent
+int send_tar_request(int server_sock, const char *path, const char *ext, long long since, const char *manifest, long long manifest_len) {
+    char message[CMD_BUFSIZE];
+    int len = snprintf(message, sizeof(message), "dtar %s %s", path, ext);
+    if (since >= 0) {
+        len += snprintf(message + len, sizeof(message) - len, " since=%lld", since);
+    }
+    if (manifest_len < 0) {
+        return send(server_sock, message, len, MSG_NOSIGNAL) == len ? 0 : -1;
+    }
+    len += snprintf(message + len, sizeof(message) - len, " manifest=%lld\n", manifest_len);
+    if (send(server_sock, message, len, MSG_NOSIGNAL | MSG_MORE) != len) {
+        return -1;
+    }
+    for (long long sent = 0; sent < manifest_len; ) {
+        ssize_t n = send(server_sock, manifest + sent, manifest_len - sent, MSG_NOSIGNAL | MSG_MORE);
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return send_crc_trailer(server_sock, crc32c(0, manifest, manifest_len));
+}
+
+static int compare_manifest_entries(const void *a, const void *b) {
+    return strcmp(((const struct manifest_entry *)a)->path, ((const struct manifest_entry *)b)->path);
+}
+
+// Function to set up an incremental dtar: load the manifest (manifest_len -1 for none) and create the temporary
+// directory where the new manifest is written while the files are walked. Returns 0 on success
+int begin_tar_delta(struct tar_delta *delta, const char *store_name, long long since, const char *manifest, long long manifest_len) {
+    memset(delta, 0, sizeof(*delta));
+    delta->since = since;
+    snprintf(delta->store, sizeof(delta->store), "%s", store_name);
+    snprintf(delta->tmp_dir, sizeof(delta->tmp_dir), "/tmp/smain_dtar_XXXXXX");
+    if (mkdtemp(delta->tmp_dir) == NULL) {
+        perror("mkdtemp");
+        delta->tmp_dir[0] = '\0';
+        return -1;
+    }
+    char current_path[192];
+    snprintf(current_path, sizeof(current_path), "%s/.dfs_manifest.%s", delta->tmp_dir, delta->store);
+    delta->current = fopen(current_path, "w");
+    if (delta->current == NULL) {
+        perror("Manifest creation failed");
+        end_tar_delta(delta);
+        return -1;
+    }
+    if (manifest_len < 0) {
+        return 0;
+    }
+
+    // One entry per "<size> <mtime> <path>" line, pointing into a copy of the text
+    delta->text = malloc(manifest_len + 1);
+    int capacity = 1;
+    for (long long i = 0; i < manifest_len; i++) {
+        capacity += (manifest[i] == '\n');
+    }
+    delta->entries = malloc(capacity * sizeof(struct manifest_entry));
+    if (delta->text == NULL || delta->entries == NULL) {
+        perror("Memory allocation failed");
+        end_tar_delta(delta);
+        return -1;
+    }
+    memcpy(delta->text, manifest, manifest_len);
+    delta->text[manifest_len] = '\0';
+    char *saveptr;
+    for (char *line = strtok_r(delta->text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        struct manifest_entry *e = &delta->entries[delta->n_entries];
+        int consumed = 0;
+        if (sscanf(line, "%lld %lld %n", &e->size, &e->mtime, &consumed) == 2 && consumed > 0 && line[consumed] != '\0') {
+            e->path = line + consumed;
+            e->seen = 0;
+            delta->n_entries++;
+        }
+    }
+    qsort(delta->entries, delta->n_entries, sizeof(struct manifest_entry), compare_manifest_entries);
+    // A manifest joined from the tarballs of several replicas lists their files more than once, keep one line each
+    int unique = 0;
+    for (int i = 0; i < delta->n_entries; i++) {
+        if (unique == 0 || strcmp(delta->entries[unique - 1].path, delta->entries[i].path) != 0) {
+            delta->entries[unique++] = delta->entries[i];
+        }
+    }
+    delta->n_entries = unique;
+    return 0;
+}
+
+// Function to decide whether a file (its path relative to the root) goes into an incremental tarball, the file is
+// added to the new manifest either way. Returns 1 if the file is new or changed
+int tar_delta_wants(struct tar_delta *delta, const char *relative, long long size, long long mtime) {
+    fprintf(delta->current, "%lld %lld %s\n", size, mtime, relative);
+    struct manifest_entry key = { .path = relative };
+    struct manifest_entry *e = delta->n_entries > 0
+        ? bsearch(&key, delta->entries, delta->n_entries, sizeof(struct manifest_entry), compare_manifest_entries) : NULL;
+    if (e != NULL) {
+        e->seen = 1;
+    }
+    if (delta->since >= 0 && mtime >= delta->since) {
+        return 1;
+    }
+    return delta->text != NULL && (e == NULL || e->size != size || e->mtime != mtime);
+}
+
+// Function to walk a directory for an incremental dtar, writing the files with the extension that the delta wants
+// to list (NUL separated, for tar -T)
+void collect_tar_files(const char *dir_path, const char *relative, const char *ext, struct tar_delta *delta, FILE *list) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char entry_path[PATH_BUFSIZE], name[PATH_BUFSIZE];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (stat(entry_path, &entry_stat) != 0) {
+            continue;
+        }
+        if (S_ISDIR(entry_stat.st_mode)) {
+            char sub_relative[PATH_BUFSIZE];
+            if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                collect_tar_files(entry_path, sub_relative, ext, delta, list);
+            }
+        } else if (S_ISREG(entry_stat.st_mode) && has_extension(entry->d_name, ext)
+                   && tar_delta_wants(delta, name, entry_stat.st_size, entry_stat.st_mtime)) {
+            fwrite(entry_path, 1, strlen(entry_path) + 1, list);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to add the new manifest and the files of the old one that are gone to an incremental tarball (created
+// if no file changed). Returns 0 on success
+int append_tar_delta(struct tar_delta *delta, const char *tar_path) {
+    char deleted_path[192], tar_cmd[CMD_BUFSIZE];
+    snprintf(deleted_path, sizeof(deleted_path), "%s/.dfs_deleted.%s", delta->tmp_dir, delta->store);
+    FILE *deleted = fopen(deleted_path, "w");
+    if (deleted == NULL || fclose(delta->current) != 0) {
+        perror("Manifest creation failed");
+        if (deleted != NULL) {
+            fclose(deleted);
+        }
+        delta->current = NULL;
+        return -1;
+    }
+    delta->current = NULL;
+    for (int i = 0; i < delta->n_entries; i++) {
+        if (!delta->entries[i].seen) {
+            fprintf(deleted, "%s\n", delta->entries[i].path);
+        }
+    }
+    fclose(deleted);
+    snprintf(tar_cmd, sizeof(tar_cmd), "tar -rf %s -C %s .dfs_manifest.%s .dfs_deleted.%s 2>/dev/null", tar_path, delta->tmp_dir, delta->store, delta->store);
+    return system(tar_cmd) == 0 ? 0 : -1;
+}
+
+// Function to free an incremental dtar and remove its temporary directory
+void end_tar_delta(struct tar_delta *delta) {
+    if (delta->current != NULL) {
+        fclose(delta->current);
+        delta->current = NULL;
+    }
+    if (delta->tmp_dir[0] != '\0') {
+        char path[192];
+        snprintf(path, sizeof(path), "%s/.dfs_manifest.%s", delta->tmp_dir, delta->store);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/.dfs_deleted.%s", delta->tmp_dir, delta->store);
+        unlink(path);
+        rmdir(delta->tmp_dir);
+        delta->tmp_dir[0] = '\0';
+    }
+    free(delta->text);
+    free(delta->entries);
+    delta->text = NULL;
+    delta->entries = NULL;
+}
+
+// Function to read the version of ~/smain that tarballs are cached at, -1 without a file index (nothing is cached)
+long long tree_generation() {
+    if (file_index == NULL) {
+        return -1;
+    }
+    index_lock();
+    long long generation = file_index->generation;
+    index_unlock();
+    return generation;
+}
+
+// Function to find the cached tarball of an extension built at a version of the tree, "<ext>.<version>.<crc32c>.tar"
+// in the cache directory, copying its path and CRC32C. Returns 1 if there is one
+int tar_cache_lookup(const char *ext, long long generation, char *cached_path, size_t path_size, uint32_t *crc) {
+    DIR *dir = opendir(tar_cache_dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s.%lld.", ext + 1, generation);
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        unsigned int value;
+        int consumed = 0;
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0 && sscanf(entry->d_name + prefix_len, "%8x.tar%n", &value, &consumed) == 1
+            && consumed == 12 && entry->d_name[prefix_len + consumed] == '\0') {
+            snprintf(cached_path, path_size, "%s/%s", tar_cache_dir, entry->d_name);
+            *crc = value;
+            found = 1;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// Function to make a tarball built in the cache directory the cached one of its extension at a version of the tree
+// and remove the older versions (a session still sending one keeps reading its open file)
+void tar_cache_store(const char *built_path, const char *ext, long long generation, uint32_t crc) {
+    char cached_path[PATH_BUFSIZE];
+    snprintf(cached_path, sizeof(cached_path), "%s/%s.%lld.%08x.tar", tar_cache_dir, ext + 1, generation, crc);
+    if (rename(built_path, cached_path) < 0) {
+        perror("Tarball cache update failed");
+        unlink(built_path);
+        return;
+    }
+    DIR *dir = opendir(tar_cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s.", ext + 1);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        long long version;
+        unsigned int value;
+        int consumed = 0;
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0
+            && sscanf(entry->d_name + prefix_len, "%lld.%8x.tar%n", &version, &value, &consumed) == 2
+            && consumed > 0 && entry->d_name[prefix_len + consumed] == '\0' && version < generation) {
+            char old_path[PATH_BUFSIZE];
+            snprintf(old_path, sizeof(old_path), "%s/%s", tar_cache_dir, entry->d_name);
+            unlink(old_path);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to compute the CRC32C of an open file. Returns 0 on success
+int file_crc32c(int file_fd, uint32_t *crc) {
+    char *buffer = pool_get(IO_BUFSIZE);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    *crc = 0;
+    off_t position = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = pread(file_fd, buffer, IO_BUFSIZE, position)) > 0) {
+        *crc = crc32c(*crc, buffer, bytes_read);
+        position += bytes_read;
+    }
+    pool_put(buffer);
+    return bytes_read < 0 ? -1 : 0;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// Function to map the file index before the first fork: the index of the previous run is used as it is when it
+// can be trusted, otherwise it is rebuilt from the pack segments and a parallel scan of ~/smain
+int init_file_index() {
     const char *home_dir = getenv("HOME");
     if (home_dir == NULL) {
         fprintf(stderr, "Failed to get HOME environment variable\n");
         return -1;
     }
+    snprintf(index_root, sizeof(index_root), "%s/smain", home_dir);
+    snprintf(pack_dir, sizeof(pack_dir), "%s/%s", home_dir, PACK_DIR);
+    if (pack_max_size > 0 && mkdir(pack_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Pack directory creation failed");
+        return -1;
+    }
+    snprintf(tar_cache_dir, sizeof(tar_cache_dir), "%s/%s", home_dir, TAR_CACHE_DIR);
+    if (mkdir(tar_cache_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Tarball cache directory creation failed");
+        return -1;
+    }
+    char index_path[PATH_BUFSIZE];
+    snprintf(index_path, sizeof(index_path), "%s/%s", home_dir, INDEX_FILE);
 
-    // new file path creation to replace ~
-    char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
-    } else {
-        strncpy(full_path, file_path, sizeof(full_path) - 1);
-        full_path[sizeof(full_path) - 1] = '\0';
+    // The index is a hash table kept at most half full, so lookups stay short
+    int capacity = 1;
+    while (capacity < 2 * index_entries) {
+        capacity <<= 1;
+    }
+    size_t map_size = sizeof(struct file_index) + (size_t)capacity * sizeof(struct index_entry);
+    int fd = open(index_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Index file open failed");
+        return -1;
     }
 
-    // check if file exist or not
-    if (access(full_path, F_OK) == -1) {
-        return 2;
+    // The previous index is trusted if it has this layout, no process died while changing it and the machine was
+    // not restarted since: the mapping reaches the disk in the background, so a machine crash can lose part of it
+    char boot_id[40];
+    read_boot_id(boot_id, sizeof(boot_id));
+    struct file_index header;
+    struct stat index_stat;
+    int trusted = (fstat(fd, &index_stat) == 0 && index_stat.st_size == (off_t)map_size
+                   && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+                   && header.magic == INDEX_MAGIC && header.version == INDEX_VERSION
+                   && header.entry_size == sizeof(struct index_entry) && header.capacity == capacity
+                   && !header.dirty && header.lock == 0 && strcmp(header.boot_id, boot_id) == 0);
+    // A rebuilt index starts from an empty (sparse) file
+    if (!trusted && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)map_size) < 0)) {
+        perror("Index file creation failed");
+        close(fd);
+        return -1;
+    }
+    file_index = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file_index == MAP_FAILED) {
+        perror("Index mapping failed");
+        file_index = NULL;
+        return -1;
+    }
+    if (trusted) {
+        printf("File index: %d files loaded from %s\n", file_index->count, index_path);
+        return 0;
     }
 
-    // delete the file at the specified path
-    if (unlink(full_path) == 0) {
+    // Rebuild: the index stays dirty until it is complete, so an interrupted rebuild is redone at the next start
+    uint64_t start = now_us();
+    file_index->magic = INDEX_MAGIC;
+    file_index->version = INDEX_VERSION;
+    file_index->entry_size = sizeof(struct index_entry);
+    file_index->capacity = capacity;
+    file_index->dirty = 1;
+    file_index->complete = 1;
+    snprintf(file_index->boot_id, sizeof(file_index->boot_id), "%s", boot_id);
+    file_index->active = -1;
+    // A rebuilt index counts on from the time, so the tarballs cached at the versions of an earlier one are never used
+    file_index->generation = (long long)time(NULL) * 1000000;
+    for (int i = 0; i < MAX_PACK_SEGMENTS; i++) {
+        file_index->segments[i].id = -1;
+    }
+    if (replay_pack_segments() < 0 || scan_into_index() < 0) {
+        return -1;
+    }
+    file_index->dirty = 0;
+    printf("File index: rebuilt with %d files in %llu ms%s\n", file_index->count, (unsigned long long)((now_us() - start) / 1000),
+           file_index->complete ? "" : ", some files did not fit (raise index_entries)");
+    return 0;
+}
+
+// Function to read the id of the current boot of the machine, empty if it is not available
+void read_boot_id(char *boot_id, size_t boot_id_size) {
+    boot_id[0] = '\0';
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (fp != NULL) {
+        if (fgets(boot_id, boot_id_size, fp) != NULL) {
+            boot_id[strcspn(boot_id, "\n")] = '\0';
+        }
+        fclose(fp);
+    }
+}
+
+// Function to add the files under ~/smain to the index, with INDEX_SCAN_WORKERS processes that each
+// take a share of the top-level entries (and everything below them)
+int scan_into_index() {
+    pid_t workers[INDEX_SCAN_WORKERS];
+    int failed = 0;
+    for (int w = 0; w < INDEX_SCAN_WORKERS; w++) {
+        workers[w] = fork();
+        if (workers[w] == 0) {
+            scan_directory(index_root, w);
+            exit(0);
+        } else if (workers[w] < 0) {
+            perror("Index scan fork failed");
+            failed = 1;
+        }
+    }
+    for (int w = 0; w < INDEX_SCAN_WORKERS; w++) {
+        int status;
+        if (workers[w] > 0 && (waitpid(workers[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            reclaim_index_lock(workers[w]);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "File index scan of %s failed\n", index_root);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add the regular files under a directory to the index, share >= 0 picks every
+// INDEX_SCAN_WORKERS-th entry of the directory (the top level of a parallel scan), -1 takes all
+void scan_directory(const char *dir_path, int share) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    int i = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (share >= 0 && i++ % INDEX_SCAN_WORKERS != share) {
+            continue;
+        }
+        char path[PATH_BUFSIZE];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        struct stat file_stat;
+        if (lstat(path, &file_stat) < 0) {
+            continue;
+        }
+        if (S_ISDIR(file_stat.st_mode)) {
+            scan_directory(path, -1);
+        } else if (S_ISREG(file_stat.st_mode) && strlen(path) < INDEX_PATH_MAX) {
+            long long mtime_ns = (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+            index_lock();
+            // A packed copy written after this file was left behind by an interrupted upload and wins
+            struct index_entry *e = index_lookup(path, 0);
+            if (e == NULL || e->segment < 0 || e->mtime_ns < mtime_ns) {
+                index_set(path, -1, 0, (long long)file_stat.st_size, mtime_ns, 0, -1);
+            }
+            index_unlock();
+        }
+    }
+    closedir(dir);
+}
+
+// Function to rebuild the pack store part of the index from the segments on disk, in the order they were written
+int replay_pack_segments() {
+    DIR *dir = opendir(pack_dir);
+    if (dir == NULL) {
         return 0;
-    } else {
-        // Handle different errors that could occur during file deletion
-        switch (errno) {
-            case EACCES:
-                fprintf(stderr, "Permission denied: %s\n", full_path);
-                break;
-            case ENOENT:
-                fprintf(stderr, "File does not exist: %s\n", full_path);
-                break;
-            case EISDIR:
-                fprintf(stderr, "Path is a directory, not a file: %s\n", full_path);
-                break;
-            default:
-                fprintf(stderr, "Failed to delete file %s: %s\n", full_path, strerror(errno));
+    }
+    int ids[MAX_PACK_SEGMENTS];
+    int n_ids = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int id, consumed = 0;
+        if (sscanf(entry->d_name, "segment-%d.pack%n", &id, &consumed) != 1 || entry->d_name[consumed] != '\0' || id < 0) {
+            continue;
+        }
+        if (n_ids == MAX_PACK_SEGMENTS) {
+            fprintf(stderr, "More than %d pack segments in %s\n", MAX_PACK_SEGMENTS, pack_dir);
+            closedir(dir);
+            return -1;
+        }
+        ids[n_ids++] = id;
+    }
+    closedir(dir);
+    qsort(ids, n_ids, sizeof(int), compare_ints);
+    for (int i = 0; i < n_ids; i++) {
+        if (file_index->segments[ids[i] % MAX_PACK_SEGMENTS].id >= 0) {
+            fprintf(stderr, "Pack segments %d and %d share a slot\n", file_index->segments[ids[i] % MAX_PACK_SEGMENTS].id, ids[i]);
+            return -1;
+        }
+        if (replay_pack_segment(ids[i]) < 0) {
+            return -1;
         }
+    }
+    // New records go after the last record of the newest segment
+    if (n_ids > 0) {
+        file_index->active = ids[n_ids - 1];
+        file_index->next_id = ids[n_ids - 1] + 1;
+    }
+    return 0;
+}
+
+// Function to apply the records of one segment to the index
+// A record cut short by a crash ends the segment: it is truncated there so new records follow the last good one
+int replay_pack_segment(int id) {
+    char segment_path[PATH_BUFSIZE];
+    pack_segment_path(id, segment_path, sizeof(segment_path));
+    int fd = open(segment_path, O_RDWR);
+    if (fd < 0) {
+        perror("Pack segment open failed");
+        return -1;
+    }
+    struct stat segment_stat;
+    if (fstat(fd, &segment_stat) < 0) {
+        perror("Pack segment stat failed");
+        close(fd);
         return -1;
     }
+    struct pack_segment *seg = &file_index->segments[id % MAX_PACK_SEGMENTS];
+    seg->id = id;
+    seg->live = 0;
+
+    long long pos = 0, end = (long long)segment_stat.st_size;
+    struct pack_record record;
+    char path[INDEX_PATH_MAX];
+    while (pos < end) {
+        if (read_pack_record(fd, pos, end, &record, path) < 0) {
+            printf("Pack segment %d: dropping %lld bytes of a partial record\n", id, end - pos);
+            if (ftruncate(fd, pos) < 0) {
+                perror("Pack segment truncate failed");
+            }
+            break;
+        }
+        long long data_offset = pos + sizeof(record) + record.path_len;
+        if ((record.type & ~PACK_HAS_CRC) == PACK_PUT) {
+            long long crc = (record.type & PACK_HAS_CRC) ? (long long)record.crc : -1;
+            if (index_set(path, id, data_offset, (long long)record.data_len, record.mtime_ns, 0, crc) < 0) {
+                fprintf(stderr, "File index full, raise index_entries: %s is not served\n", path);
+            }
+        } else {
+            struct index_entry *e = index_lookup(path, 0);
+            if (e != NULL) {
+                index_drop(e);
+            }
+        }
+        pos = data_offset + (long long)record.data_len;
+    }
+    seg->size = pos;
+    close(fd);
+    return 0;
 }
 
-// Function to send a file to the client for downloading
-void send_file_to_client(int client_sock, const char *file_path, const char *file_name) {
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
-        return;
+// Function to read and check the record header and path at pos in a segment of `end` bytes
+int read_pack_record(int fd, long long pos, long long end, struct pack_record *record, char *path) {
+    if (end - pos < (long long)sizeof(*record) || pread(fd, record, sizeof(*record), pos) != (ssize_t)sizeof(*record)) {
+        return -1;
     }
-    // Construct the full path for the file
-    char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
-    } else {
-        snprintf(full_path, sizeof(full_path), "%s", file_path);
+    uint32_t type = record->type & ~PACK_HAS_CRC;
+    if (record->magic != PACK_MAGIC || (type != PACK_PUT && type != PACK_DELETE)
+        || record->path_len == 0 || record->path_len >= INDEX_PATH_MAX
+        || (long long)record->data_len > end - pos - (long long)sizeof(*record) - record->path_len) {
+        return -1;
     }
+    if (pread(fd, path, record->path_len, pos + sizeof(*record)) != (ssize_t)record->path_len) {
+        return -1;
+    }
+    path[record->path_len] = '\0';
+    return 0;
+}
 
-    // Open the file for reading
-    int file_fd = open(full_path, O_RDONLY);
-    if (file_fd < 0) {
-        perror("File open failed");
-        // Send rejction to the client
-        const char *success_message = "ERROR: File not found!";
-        printf("%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+// Function to build the file name of a segment
+void pack_segment_path(int id, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/segment-%06d.pack", pack_dir, id);
+}
+
+// Function to find the table slot of a segment, NULL if the segment does not exist (any more)
+struct pack_segment *pack_segment_of(int id) {
+    if (id < 0 || file_index->segments[id % MAX_PACK_SEGMENTS].id != id) {
+        return NULL;
     }
+    return &file_index->segments[id % MAX_PACK_SEGMENTS];
+}
 
-    // Send the file name to the client
-    send(client_sock, file_name, strlen(file_name), 0);
+// Function to get the size of the segment record that holds the file of an index entry
+long long pack_record_size(const struct index_entry *e) {
+    return (long long)sizeof(struct pack_record) + (long long)strlen(e->path) + e->size;
+}
 
-    // Read the file and send its contents to the client
-    char buffer_content[BUFSIZE];
-    ssize_t bytes_read,bytes_sent;
-    while ((bytes_read = read(file_fd, buffer_content, sizeof(buffer_content))) > 0) {
-        bytes_sent = send(client_sock, buffer_content, bytes_read, 0);
-        if (bytes_sent < 0) {
-            perror("Error sending file");
+// Function to find the index entry of a file, call with the index lock held
+// With insert, a path that is not indexed gets the free slot its entry would go into (state not INDEX_SLOT_USED);
+// NULL when the file is not indexed (or the table has no room)
+struct index_entry *index_lookup(const char *path, int insert) {
+    uint32_t mask = (uint32_t)file_index->capacity - 1;
+    uint32_t i = hash_key(path) & mask;
+    struct index_entry *slot = NULL;
+    for (int probes = 0; probes < file_index->capacity; probes++, i = (i + 1) & mask) {
+        struct index_entry *e = &file_index->entries[i];
+        if (e->state == INDEX_SLOT_FREE) {
+            if (slot == NULL) {
+                slot = e;
+            }
             break;
         }
+        if (e->state == INDEX_SLOT_REMOVED) {
+            // Removed entries keep the probe chains intact, the first one can be reused by an insert
+            if (slot == NULL) {
+                slot = e;
+            }
+        } else if (strcmp(e->path, path) == 0) {
+            return e;
+        }
     }
-    if (bytes_read < 0) {
-        perror("Error reading file");
+    return insert ? slot : NULL;
+}
+
+// Function to point the index entry of a file at its new version, adding the entry if needed; call with the index lock held
+// Returns -1 when the index has no room for another file
+int index_set(const char *path, int segment, long long offset, long long size, long long mtime_ns, uint64_t hash, long long crc) {
+    file_index->generation++;
+    struct index_entry *e = index_lookup(path, 1);
+    if (e != NULL && e->state != INDEX_SLOT_USED && file_index->count + file_index->removed + 1 > file_index->capacity * 3 / 4) {
+        index_rehash();
+        e = index_lookup(path, 1);
     }
-    close(file_fd);
+    if (e == NULL || (e->state != INDEX_SLOT_USED && file_index->count >= index_entries)) {
+        file_index->complete = 0;
+        return -1;
+    }
+    if (e->state == INDEX_SLOT_USED) {
+        // The older version of a packed file becomes dead space in its segment
+        if (e->segment >= 0) {
+            pack_segment_of(e->segment)->live -= pack_record_size(e);
+        }
+    } else {
+        if (e->state == INDEX_SLOT_REMOVED) {
+            file_index->removed--;
+        }
+        snprintf(e->path, sizeof(e->path), "%s", path);
+        e->state = INDEX_SLOT_USED;
+        file_index->count++;
+    }
+    e->segment = segment;
+    e->offset = offset;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    e->hash = hash;
+    e->crc = crc;
+    if (segment >= 0) {
+        pack_segment_of(segment)->live += pack_record_size(e);
+    }
+    return 0;
+}
 
-    // Send the end marker to indicate the end of the file transfer
-    if (send(client_sock, CMD_END_MARKER, strlen(CMD_END_MARKER), 0) == -1) {
-        perror("Failed to send end marker");
+// Function to remove an entry from the index, call with the index lock held
+void index_drop(struct index_entry *e) {
+    file_index->generation++;
+    if (e->segment >= 0) {
+        pack_segment_of(e->segment)->live -= pack_record_size(e);
     }
+    e->state = INDEX_SLOT_REMOVED;
+    file_index->count--;
+    file_index->removed++;
+}
 
+// Function to rebuild the index without its removed entries once they make the probe chains long,
+// call with the index lock held
+void index_rehash() {
+    struct index_entry *live = malloc((size_t)(file_index->count > 0 ? file_index->count : 1) * sizeof(struct index_entry));
+    if (live == NULL) {
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < file_index->capacity; i++) {
+        if (file_index->entries[i].state == INDEX_SLOT_USED) {
+            live[n++] = file_index->entries[i];
+        }
+    }
+    memset(file_index->entries, 0, (size_t)file_index->capacity * sizeof(struct index_entry));
+    file_index->removed = 0;
+    for (int i = 0; i < n; i++) {
+        *index_lookup(live[i].path, 1) = live[i];
+    }
+    free(live);
 }
 
+// Function to turn a path into its index key, with repeated slashes collapsed ("/home/u//smain/a.c" is /home/u/smain/a.c)
+void index_key(const char *path, char *key, size_t key_size) {
+    size_t len = 0;
+    for (; *path != '\0' && len < key_size - 1; path++) {
+        if (*path != '/' || len == 0 || key[len - 1] != '/') {
+            key[len++] = *path;
+        }
+    }
+    key[len] = '\0';
+}
 
-// Function to send a download request to the server and handle the file transfer
-void send_download_request(int server_sock, int client_sock, char *command, char *file_path){
-    // Replace ~ with the value of the HOME environment variable
-    const char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        fprintf(stderr, "Failed to get HOME environment variable\n");
-        return;
+// Function to look a local file up in the index, copying its entry to found (when not NULL)
+// Returns 1 if it is indexed, 0 if it does not exist, -1 if the index cannot tell (not a file under ~/smain,
+// a path too long for the index, or some files did not fit into the index) and the file system has to be asked
+int index_get(const char *path, struct index_entry *found) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    size_t root_len = strlen(index_root);
+    if (file_index == NULL || strncmp(full_path, index_root, root_len) != 0 || full_path[root_len] != '/'
+        || strlen(full_path) >= INDEX_PATH_MAX) {
+        return -1;
     }
-    
-    // Construct the full path for the file (FilePath + file name)
-    char full_path[BUFSIZE];
-    if (file_path[0] == '~') {
-        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path+1);
+    index_lock();
+    struct index_entry *e = index_lookup(full_path, 0);
+    int result = (e != NULL) ? 1 : (file_index->complete ? 0 : -1);
+    if (e != NULL && found != NULL) {
+        *found = *e;
     }
+    index_unlock();
+    return result;
+}
 
-    // Construct the message to send to the server, including the command and full file path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "%s %s", command, full_path);
-    
-    // Send the message to the server
-    printf("Sending download request to server..\n");
-    if (send(server_sock, message, strlen(message), 0) == -1) {
-        // Print an error message if sending fails
-        perror("send");
+// Function to record a regular file that was just written under ~/smain, with the hash of its contents
+void index_store_file(const char *path, const struct stat *file_stat, uint64_t hash, long long crc) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    size_t root_len = strlen(index_root);
+    if (file_index == NULL || strncmp(full_path, index_root, root_len) != 0 || full_path[root_len] != '/'
+        || strlen(full_path) >= INDEX_PATH_MAX) {
         return;
     }
+    // index_set marks the index incomplete when the file does not fit
+    index_lock();
+    index_set(full_path, -1, 0, (long long)file_stat->st_size,
+              (long long)file_stat->st_mtim.tv_sec * 1000000000LL + file_stat->st_mtim.tv_nsec, hash, crc);
+    index_unlock();
+}
 
-    // Receive the file name from the server
-    char file_name[256];
-    ssize_t bytes_received = recv(server_sock, file_name, sizeof(file_name) - 1, 0);
-    if (bytes_received <= 0) {
-        // Print an error message if receiving the file name fails
-        perror("Error receiving file name");
+// Function to remove a regular file that was just deleted from the index
+void index_forget(const char *path) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    if (file_index == NULL) {
         return;
     }
-    // Null-terminate the file name
-    file_name[bytes_received] = '\0'; 
-
-    //send the file name to the client
-    if (send(client_sock, file_name, strlen(file_name), 0) == -1) {
-        // Print an error message if sending the file name to the client fails
-        perror("send");
+    index_lock();
+    struct index_entry *e = index_lookup(full_path, 0);
+    if (e != NULL) {
+        index_drop(e);
+    } else {
+        // A file the index could not hold still changes the tree
+        file_index->generation++;
     }
+    index_unlock();
+}
 
+// Function to fill in the stat of an indexed file: its size and modification time (which give its version tag)
+void index_entry_stat(const struct index_entry *e, struct stat *file_stat) {
+    memset(file_stat, 0, sizeof(*file_stat));
+    file_stat->st_size = e->size;
+    file_stat->st_mtim.tv_sec = e->mtime_ns / 1000000000LL;
+    file_stat->st_mtim.tv_nsec = e->mtime_ns % 1000000000LL;
+}
 
-    // Receive the file content from the server and forward it to the client
-    char buffer[BUFSIZE];
-    ssize_t content_received;
-    // Keep receiving content until there's no more left to receive
-    while ((content_received = recv(server_sock, buffer, sizeof(buffer), 0)) > 0) {
-        // Forward the received content to the client
-        ssize_t bytes_sent = send(client_sock, buffer, content_received, 0);
-        if (bytes_sent < 0) {
-            // Print an error message if forwarding fails
-            perror("send");
-            break;
-        }
-
-        // Check for the end marker in the buffer to detect the end of the file content
-        if (content_received < BUFSIZE) {
-            if (memcmp(buffer + content_received - strlen(CMD_END_MARKER), CMD_END_MARKER, strlen(CMD_END_MARKER)) == 0) {
-                // Break the loop if the end of the content is reached
-                break;
-            }
+// Function to take the index lock, shared by all Smain processes (the holder's pid, 0 when free)
+void index_lock() {
+    pid_t self = getpid();
+    useconds_t backoff = 50;
+    pid_t expected = 0;
+    while (!__atomic_compare_exchange_n(&file_index->lock, &expected, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = 0;
+        usleep(backoff);
+        if (backoff < 2000) {
+            backoff *= 2;
         }
     }
-    if (content_received < 0) {
-        // Print an error message if there was an issue receiving the file content
-        perror("Error receiving file content");
-    }
 }
 
+// Function to give the index lock back
+void index_unlock() {
+    __atomic_store_n(&file_index->lock, 0, __ATOMIC_RELEASE);
+}
 
-// Helper function to request server for file name for given path
-void get_file_names_from_server(int (*connect_func)(), const char *message, const char *error_prefix, char *response_buffer, size_t buffer_size) {
-    // Establish a connection to the server using the provided connect function
-    int server_sock = connect_func();
-    if (server_sock < 0) {
-        // Print an error message if the connection failed
-        printf("Failed to connect to server\n");
-        response_buffer[0] = '\0'; // Clear the buffer on connection failure
-        return;
+// Function used by the parent to free the index lock of a child that exited (or crashed) while holding it
+// The child may have left an entry half written, so the index is rebuilt at the next start
+void reclaim_index_lock(pid_t pid) {
+    if (file_index != NULL) {
+        pid_t expected = pid;
+        if (__atomic_compare_exchange_n(&file_index->lock, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            printf("Process %d died holding the file index lock, the index will be rebuilt at the next start\n", (int)pid);
+            file_index->dirty = 1;
+        }
     }
+}
 
-    // Send the message to the server
-    send(server_sock, message, strlen(message), 0);
-
-    // Clear the response buffer to ensure it's empty before receiving data
-    memset(response_buffer, 0, buffer_size);
+// Function to append a record to the active segment, starting a new segment when it is full; call with the pack lock held
+// Returns the offset of the record's data in the active segment, or -1 if it could not be written
+long long pack_append(uint32_t type, const char *path, const char *data, size_t len, long long mtime_ns, long long crc) {
+    // Each process keeps the active segment open between appends
+    static int segment_fd = -1, segment_fd_id = -1;
+    struct pack_record record = {PACK_MAGIC, type, (uint32_t)strlen(path), 0, mtime_ns, len};
+    // A put keeps the CRC32C the file was uploaded with
+    if (crc >= 0) {
+        record.type |= PACK_HAS_CRC;
+        record.crc = (uint32_t)crc;
+    }
+    long long record_len = (long long)sizeof(record) + record.path_len + (long long)len;
 
-    // Receive the server's response into the response buffer
-    // Read response, leaving space for null terminator
-    recv(server_sock, response_buffer, buffer_size - 1, 0); 
+    struct pack_segment *seg = pack_segment_of(file_index->active);
+    if (seg == NULL || (seg->size > 0 && seg->size + record_len > pack_segment_size)) {
+        // Seal the active segment and start the next one, unless its table slot is still taken
+        seg = &file_index->segments[file_index->next_id % MAX_PACK_SEGMENTS];
+        if (seg->id >= 0) {
+            printf("Pack store: all %d segments in use\n", MAX_PACK_SEGMENTS);
+            return -1;
+        }
+        seg->id = file_index->next_id++;
+        seg->size = 0;
+        seg->live = 0;
+        file_index->active = seg->id;
+    }
+    if (segment_fd_id != seg->id) {
+        char segment_path[PATH_BUFSIZE];
+        pack_segment_path(seg->id, segment_path, sizeof(segment_path));
+        if (segment_fd >= 0) {
+            close(segment_fd);
+        }
+        segment_fd = open(segment_path, O_WRONLY | O_CREAT, 0644);
+        segment_fd_id = segment_fd >= 0 ? seg->id : -1;
+        if (segment_fd < 0) {
+            perror("Pack segment open failed");
+            return -1;
+        }
+    }
 
-    // Check if the response starts with the error prefix
-    if (strncmp(response_buffer, error_prefix, strlen(error_prefix)) != 0) {
-        // If the response doesn't start with the error prefix, close the connection
-        close(server_sock);
-    } else {
-        // If the response starts with the error prefix, clear the buffer to indicate an error
-        response_buffer[0] = '\0';
-        close(server_sock);
+    // Header, path and data go out in one write at the end of the segment
+    struct iovec iov[3] = {
+        {&record, sizeof(record)},
+        {(void *)path, record.path_len},
+        {(void *)data, len}
+    };
+    if (pwritev(segment_fd, iov, data != NULL ? 3 : 2, seg->size) != record_len) {
+        perror("Pack segment write failed");
+        if (ftruncate(segment_fd, seg->size) < 0) {
+            perror("Pack segment truncate failed");
+        }
+        return -1;
     }
+    long long data_offset = seg->size + (long long)sizeof(record) + record.path_len;
+    seg->size += record_len;
+    return data_offset;
 }
 
+// Function to store a small uploaded file in the pack store instead of a file of its own
+// Returns 0 once it is packed, -1 if it has to be saved as a regular file (store off, file too large, store full)
+int pack_put(const char *path, const char *data, size_t len, uint32_t crc) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    size_t root_len = strlen(index_root);
+    if (file_index == NULL || pack_max_size <= 0 || len > (size_t)pack_max_size || strlen(full_path) >= INDEX_PATH_MAX
+        || strncmp(full_path, index_root, root_len) != 0 || full_path[root_len] != '/') {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long mtime_ns = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
 
-// Helper Function to create a tarball of .c files and send it to the client
-void c_tar_file(int client_sock, const char *path) {
-    // variables to hold the command for creating the tarball and the target path
-    char tar_cmd[BUFSIZE];
-    char target_path[BUFSIZE];
+    index_lock();
+    // Only append the record if the index has room for the file
+    struct index_entry *e = index_lookup(full_path, 1);
+    long long data_offset = -1;
+    if (e != NULL && (e->state == INDEX_SLOT_USED || file_index->count < index_entries)) {
+        data_offset = pack_append(PACK_PUT, full_path, data, len, mtime_ns, crc);
+    }
+    if (data_offset < 0 || index_set(full_path, file_index->active, data_offset, (long long)len, mtime_ns,
+                                     strong_hash(FNV_OFFSET, (const unsigned char *)data, len), crc) < 0) {
+        index_unlock();
+        return -1;
+    }
+    index_unlock();
 
-    // Create the full path for the tarball file, which will be stored in the given path
-    snprintf(target_path,sizeof(target_path), "%s/%s",path,TAR_FILE_PATH);
+    // The packed copy replaces the regular file of an earlier upload
+    unlink(full_path);
+    return 0;
+}
 
-    // Check for the presence of .c files first
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.c' -print -quit", path);
-    // Run the command to check for .c files and store the result
-    FILE *check = popen(tar_cmd, "r");
-    // If the check command fails, inform the client and exit the function
-    if (check == NULL) {
-        printf("ERROR: Failed to check for .c files.\n");
-        const char *error_message = "ERROR: Failed to check for .c files!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        return;
+// Function to remove a packed file by appending a tombstone record
+// Returns 0 when removed, 2 if the file is not packed and -1 on failure
+int pack_remove(const char *path) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    if (file_index == NULL) {
+        return 2;
     }
-
-    // If no .c files are found, inform the client and exit the function
-    if (fgetc(check) == EOF) {
-        printf("No .c files found.\n");
-        const char *error_message = "ERROR: No .c files found!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        pclose(check);
-        return;
+    index_lock();
+    struct index_entry *e = index_lookup(full_path, 0);
+    if (e == NULL || e->segment < 0) {
+        index_unlock();
+        return 2;
+    }
+    if (pack_append(PACK_DELETE, full_path, NULL, 0, e->mtime_ns, -1) < 0) {
+        index_unlock();
+        return -1;
     }
-    // Close the check command as .c files were found
-    pclose(check);
+    index_drop(e);
+    index_unlock();
+    return 0;
+}
 
-    // If .c files are found, create the tarball using the find command and tar command
-    snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*.c' -print0 | tar -cf %s --null -T - 2>/dev/null", path, target_path);
-    // Run the command to create the tarball
-    int result = system(tar_cmd);
-    // If the tarball creation fails, inform the client and exit the function
-    if (result != 0) {
-        printf("ERROR: Failed to create tarball for .c files.\n");
-        const char *error_message = "ERROR: Tar file creation failed!";
-        send(client_sock, error_message, strlen(error_message), 0);
-        return;
+// Function to send a packed file (or a range of it) to the client straight from its segment
+// Returns 2 if the file is not packed, otherwise it was answered (0 when sent, -1 on failure)
+int pack_send_file(int sock, const char *path, const char *file_name, long long offset, long long length, const char *if_tag) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[PATH_BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    if (file_index == NULL) {
+        return 2;
+    }
+    index_lock();
+    struct index_entry *e = index_lookup(full_path, 0);
+    if (e == NULL || e->segment < 0) {
+        index_unlock();
+        return 2;
+    }
+    struct index_entry found = *e;
+    // Open the segment before unlocking: the compactor may delete it afterwards, the open descriptor still reads it
+    char segment_path[PATH_BUFSIZE];
+    pack_segment_path(found.segment, segment_path, sizeof(segment_path));
+    int segment_fd = open(segment_path, O_RDONLY);
+    index_unlock();
+    if (segment_fd < 0) {
+        perror("Pack segment open failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
     }
 
-    // send tar filename to client
-    send(client_sock, TAR_FILE_PATH, strlen(TAR_FILE_PATH), 0);
+    // The file's size and upload time stand in for the stat of a regular file (and give its version tag)
+    struct stat file_stat;
+    index_entry_stat(&found, &file_stat);
+    int result = send_file_region(sock, segment_fd, found.offset, &file_stat, file_name, offset, length, if_tag, found.crc);
+    close(segment_fd);
+    return result;
+}
 
-    // Check if the tarball file was successfully created
-    if (access(target_path, F_OK) != 0) {
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        printf("%s\n",success_message);
-        send(client_sock, success_message, strlen(success_message), 0);
-        return;
+// Function to add the names of the packed files in a directory to a "\n" separated list
+// Returns the number of files found
+int pack_list_dir(const char *dir, const struct list_filter *filter, char *list, size_t list_size) {
+    // Nothing to list without packed files, the regular files are listed from their directory
+    if (file_index == NULL || file_index->active < 0) {
+        return 0;
     }
+    size_t dir_len = strlen(dir);
+    int found = 0;
+    index_lock();
+    for (int i = 0; i < file_index->capacity; i++) {
+        const struct index_entry *e = &file_index->entries[i];
+        if (e->state != INDEX_SLOT_USED || e->segment < 0 || strncmp(e->path, dir, dir_len) != 0 || e->path[dir_len] != '/') {
+            continue;
+        }
+        // Files in subdirectories are listed up to the filter's depth, relative to the directory
+        const char *name = e->path + dir_len + 1;
+        int level = 0;
+        for (const char *c = name; *c != '\0'; c++) {
+            level += (*c == '/');
+        }
+        if (level > filter->depth || !filter_match(filter, strrchr(e->path, '/') + 1, e->size, e->mtime_ns / 1000000000LL)) {
+            continue;
+        }
+        found++;
+        if (strlen(list) + strlen(e->path + dir_len + 1) + 2 < list_size) {
+            strcat(list, e->path + dir_len + 1);
+            strcat(list, "\n");
+        }
+    }
+    index_unlock();
+    return found;
+}
 
-    // Open the tarball file to read its contents
-    FILE *tarball = fopen(target_path, "rb");
-    if (tarball == NULL) {
-        // If the tarball file cannot be opened
-        printf("ERROR: Failed to open tarball file.\n");
-        // Send rejction to the client
-        const char *success_message = "ERROR: Tar file creation failed!";
-        send(client_sock, success_message, strlen(success_message), 0);
+// Function to add the packed files below a directory to the files of a search, as regions of their segments
+// (a segment the compactor deletes before the search opens it is skipped)
+void pack_collect_search(const char *dir, struct search_file **files, int *n, int *capacity) {
+    if (file_index == NULL || file_index->active < 0) {
         return;
     }
-
-    // Declare a buffer to hold the file content as it is read
-    char file_buffer[1024];
-    size_t bytes_read;
-    // Read the tarball file and send its contents to the client
-    while ((bytes_read = fread(file_buffer, 1, sizeof(file_buffer), tarball)) > 0) {
-        // Send the read data to the client
-        ssize_t bytes_sent = send(client_sock, file_buffer, bytes_read, 0);
-        // If sending the data fails, inform the client and exit the function
-        if (bytes_sent < 0) {
-            perror("Failed to send tarball data");
-            // Send rejction to the client
-            const char *success_message = "ERROR: Tar file creation failed!";
-            send(client_sock, success_message, strlen(success_message), 0);
-            fclose(tarball);
-            return;
+    size_t dir_len = strlen(dir);
+    index_lock();
+    for (int i = 0; i < file_index->capacity; i++) {
+        const struct index_entry *e = &file_index->entries[i];
+        if (e->state != INDEX_SLOT_USED || e->segment < 0 || strncmp(e->path, dir, dir_len) != 0 || e->path[dir_len] != '/') {
+            continue;
+        }
+        char segment_path[PATH_BUFSIZE];
+        pack_segment_path(e->segment, segment_path, sizeof(segment_path));
+        if (add_search_file(files, n, capacity, segment_path, e->path + dir_len + 1, e->offset, e->size) < 0) {
+            break;
         }
     }
+    index_unlock();
+}
 
-    // Send an end-of-file marker to signal the end of the file content
-    const char *end_marker = "END_CMD";
-    send(client_sock, end_marker, strlen(end_marker), 0);
-    // Close the tarball file after sending its contents
-    fclose(tarball);
-    printf("Tarball sent to client.\n");
+static int compare_index_entries(const void *a, const void *b) {
+    const struct index_entry *ea = a, *eb = b;
+    if (ea->segment != eb->segment) {
+        return ea->segment < eb->segment ? -1 : 1;
+    }
+    return (ea->offset > eb->offset) - (ea->offset < eb->offset);
 }
 
-// Function to request a tarball file from a server and forward it to the client
-void request_tar_file(int server_sock, int client_sock, char *path){
-    // Construct the message to send to the server, including the command and server path
-    char message[BUFSIZE];
-    snprintf(message, sizeof(message), "dtar %s", path);
+// Function to write the packed files with an extension under a directory into a tar archive, followed by
+// the end-of-archive blocks (tar -r appends after them). The files are read in segment order, so every
+// segment is read sequentially. With a delta, only the files it wants are written. Returns the number of files
+// written, -1 on failure
+int pack_write_tar(int tar_fd, const char *dir, const char *ext, struct tar_delta *delta) {
+    if (file_index == NULL || file_index->active < 0) {
+        return 0;
+    }
+    size_t dir_len = strlen(dir);
+    index_lock();
+    struct index_entry *files = malloc((size_t)(file_index->count > 0 ? file_index->count : 1) * sizeof(struct index_entry));
+    int *segment_fds = malloc((size_t)(file_index->count > 0 ? file_index->count : 1) * sizeof(int));
+    if (files == NULL || segment_fds == NULL) {
+        index_unlock();
+        free(files);
+        free(segment_fds);
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < file_index->capacity; i++) {
+        const struct index_entry *e = &file_index->entries[i];
+        if (e->state == INDEX_SLOT_USED && e->segment >= 0 && strncmp(e->path, dir, dir_len) == 0 && e->path[dir_len] == '/'
+            && has_extension(e->path, ext)
+            && (delta == NULL || tar_delta_wants(delta, e->path + dir_len + 1, e->size, e->mtime_ns / 1000000000LL))) {
+            files[n++] = *e;
+        }
+    }
+    qsort(files, n, sizeof(struct index_entry), compare_index_entries);
+    // Open each segment once, before unlocking, so compaction cannot delete one from under us
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        segment_fds[i] = -1;
+        if (i == 0 || files[i].segment != files[i - 1].segment) {
+            char segment_path[PATH_BUFSIZE];
+            pack_segment_path(files[i].segment, segment_path, sizeof(segment_path));
+            segment_fds[i] = open(segment_path, O_RDONLY);
+            if (segment_fds[i] < 0) {
+                perror("Pack segment open failed");
+                ok = 0;
+            }
+        }
+    }
+    index_unlock();
 
-    // Send the message to the server
-    printf("Sending tar file download request to server\n");
-    if (send(server_sock, message, strlen(message), 0) == -1) {
-        // Print an error message if sending fails
-        perror("send");
-        return;
+    char *buffer = pool_get(IO_BUFSIZE);
+    int segment_fd = -1;
+    if (buffer == NULL) {
+        ok = 0;
     }
+    for (int i = 0; ok && i < n; i++) {
+        if (segment_fds[i] >= 0) {
+            segment_fd = segment_fds[i];
+        }
+        // Names are stored like tar stores absolute paths, without the leading '/'
+        const char *name = files[i].path + (files[i].path[0] == '/');
+        if (write_tar_header(tar_fd, name, files[i].size, files[i].mtime_ns / 1000000000LL) < 0) {
+            ok = 0;
+            break;
+        }
+        long long offset = files[i].offset, remaining = files[i].size;
+        while (remaining > 0) {
+            size_t want = remaining < IO_BUFSIZE ? (size_t)remaining : IO_BUFSIZE;
+            ssize_t bytes_read = pread(segment_fd, buffer, want, offset);
+            if (bytes_read <= 0 || write(tar_fd, buffer, bytes_read) != bytes_read) {
+                ok = 0;
+                break;
+            }
+            offset += bytes_read;
+            remaining -= bytes_read;
+        }
+        // File data is padded to whole 512 byte blocks
+        size_t padding = (512 - files[i].size % 512) % 512;
+        memset(buffer, 0, padding);
+        if (ok && padding > 0 && write(tar_fd, buffer, padding) != (ssize_t)padding) {
+            ok = 0;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (segment_fds[i] >= 0) {
+            close(segment_fds[i]);
+        }
+    }
+    free(files);
+    free(segment_fds);
 
-    // Receive the file name from the server
-    char file_name[256];
-    ssize_t bytes_received = recv(server_sock, file_name, sizeof(file_name) - 1, 0);
-    // If receiving the file name fails, print an error message and exit
-    if (bytes_received <= 0) {
-        // Print an error message if receiving the file name fails
-        perror("Error receiving file name");
-        return;
+    // Two zero blocks end the archive
+    if (ok) {
+        memset(buffer, 0, 1024);
     }
-    // Null-terminate the received file name string
-    file_name[bytes_received] = '\0'; 
+    if (!ok || write(tar_fd, buffer, 1024) != 1024) {
+        printf("ERROR: Failed to write packed files to the tarball\n");
+        pool_put(buffer);
+        return -1;
+    }
+    pool_put(buffer);
+    return n;
+}
 
-    //send the file name to the client
-    if (send(client_sock, file_name, strlen(file_name), 0) == -1) {
-        // Print an error message if sending the file name to the client fails
-        perror("send");
+// Function to write the ustar header of a regular file; a name too long for the header is written
+// before it as a GNU long name entry, which GNU tar and bsdtar both read
+int write_tar_header(int tar_fd, const char *name, long long size, long long mtime) {
+    size_t name_len = strlen(name);
+    if (name_len >= 100) {
+        char long_name[2 * 512];
+        memset(long_name, 0, sizeof(long_name));
+        memcpy(long_name, name, name_len);
+        size_t blocks = (name_len + 1 + 511) / 512;
+        if (write_tar_block(tar_fd, "././@LongLink", (long long)name_len + 1, 0, 'L') < 0
+            || write(tar_fd, long_name, blocks * 512) != (ssize_t)(blocks * 512)) {
+            return -1;
+        }
     }
+    return write_tar_block(tar_fd, name, size, mtime, '0');
+}
 
-    // buffer to hold the file content received from the server
-    char buffer_data[BUFSIZE];
-    ssize_t content_received;
-    // Keep receiving file content from the server and forward it to the client
-    while ((content_received = recv(server_sock, buffer_data, sizeof(buffer_data), 0)) > 0) {
-        // Send the received content to the client
-        ssize_t bytes_sent = send(client_sock, buffer_data, content_received, 0);
-        // If sending the content fails, print an error message and exit
-        if (bytes_sent < 0) {
-            // Print an error message if forwarding fails
-            perror("send");
-            break;
+// Function to write one 512 byte tar header block
+int write_tar_block(int tar_fd, const char *name, long long size, long long mtime, char type) {
+    char header[512];
+    memset(header, 0, sizeof(header));
+    size_t name_len = strlen(name);
+    memcpy(header, name, name_len < 100 ? name_len : 99);
+    snprintf(header + 100, 8, "%07o", 0644);
+    snprintf(header + 108, 8, "%07o", (unsigned)getuid());
+    snprintf(header + 116, 8, "%07o", (unsigned)getgid());
+    snprintf(header + 124, 12, "%011llo", size);
+    snprintf(header + 136, 12, "%011llo", mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    // The checksum is the byte sum of the header with its own field counted as spaces
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+    return write(tar_fd, header, sizeof(header)) == (ssize_t)sizeof(header) ? 0 : -1;
+}
+
+// Function run by the compactor process: every pack_compact_interval_ms it rewrites the sealed segments whose
+// live records fell below pack_compact_percent of their size, then deletes them
+void run_compactor() {
+    // Exit together with the parent
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while (1) {
+        usleep((useconds_t)pack_compact_interval_ms * 1000);
+        for (int i = 0; i < MAX_PACK_SEGMENTS; i++) {
+            index_lock();
+            struct pack_segment seg = file_index->segments[i];
+            int sealed = (seg.id >= 0 && seg.id != file_index->active);
+            index_unlock();
+            if (sealed && seg.live * 100 < seg.size * pack_compact_percent) {
+                compact_pack_segment(seg.id);
+            }
         }
+    }
+}
 
-        // Check for the end marker in the buffer_data to detect the end of the file content
-        if (content_received < BUFSIZE) {
-            if (memcmp(buffer_data + content_received - strlen(CMD_END_MARKER), CMD_END_MARKER, strlen(CMD_END_MARKER)) == 0) {
-                // Break the loop if the end of the content is reached
-                break;
+// Function to copy the live records of a sealed segment to the active segment and delete it
+// A tombstone is carried over only while an older segment may still hold the file it removed
+int compact_pack_segment(int id) {
+    char segment_path[PATH_BUFSIZE];
+    pack_segment_path(id, segment_path, sizeof(segment_path));
+    int fd = open(segment_path, O_RDONLY);
+    if (fd < 0) {
+        perror("Pack segment open failed");
+        return -1;
+    }
+    struct stat segment_stat;
+    if (fstat(fd, &segment_stat) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    long long pos = 0, end = (long long)segment_stat.st_size, moved = 0;
+    struct pack_record record;
+    char path[INDEX_PATH_MAX];
+    int ok = 1;
+    // A sealed segment is never written again, so it is read without the lock; each record is moved under it
+    while (ok && pos < end && read_pack_record(fd, pos, end, &record, path) == 0) {
+        long long data_offset = pos + sizeof(record) + record.path_len;
+        index_lock();
+        struct index_entry *e = index_lookup(path, 0);
+        if ((record.type & ~PACK_HAS_CRC) == PACK_PUT && e != NULL && e->segment == id && e->offset == data_offset) {
+            // Still the current version of the file: copy it forward, with the CRC32C it was uploaded with
+            char *data = pool_get(e->size > 0 ? (size_t)e->size : 1);
+            long long new_offset = -1;
+            if (data != NULL && pread(fd, data, e->size, data_offset) == (ssize_t)e->size) {
+                if (e->crc >= 0 && crc32c(0, data, e->size) != (uint32_t)e->crc) {
+                    printf("Pack store: checksum mismatch for %s in segment %d\n", path, id);
+                }
+                new_offset = pack_append(PACK_PUT, path, data, e->size, e->mtime_ns, e->crc);
+            }
+            pool_put(data);
+            if (new_offset >= 0) {
+                pack_segment_of(id)->live -= pack_record_size(e);
+                e->segment = file_index->active;
+                e->offset = new_offset;
+                pack_segment_of(e->segment)->live += pack_record_size(e);
+                moved++;
+            } else {
+                ok = 0;
+            }
+        } else if (record.type == PACK_DELETE && (e == NULL || e->segment < 0)) {
+            int older = 0;
+            for (int i = 0; i < MAX_PACK_SEGMENTS; i++) {
+                if (file_index->segments[i].id >= 0 && file_index->segments[i].id < id) {
+                    older = 1;
+                    break;
+                }
+            }
+            if (older && pack_append(PACK_DELETE, path, NULL, 0, record.mtime_ns, -1) < 0) {
+                ok = 0;
             }
         }
+        index_unlock();
+        pos = data_offset + (long long)record.data_len;
     }
-    // If receiving the content fails, print an error message
-    if (content_received < 0) {
-        // Print an error message if there was an issue receiving the file content
-        perror("Error receiving file content");
-    }else{
-        // Print a message indicating that the file was successfully received and forwarded to the client
-        printf("'%s' received and send to client.\n",file_name);
+    close(fd);
+    if (!ok) {
+        printf("Pack store: compaction of segment %d stopped\n", id);
+        return -1;
     }
-}
\ No newline at end of file
+
+    // Nothing in the segment is referenced any more, readers that opened it keep their descriptors
+    index_lock();
+    struct pack_segment *seg = pack_segment_of(id);
+    if (seg != NULL && seg->live == 0) {
+        seg->id = -1;
+        unlink(segment_path);
+    }
+    index_unlock();
+    printf("Pack store: compacted segment %d, %lld files moved\n", id, moved);
+    return 0;
+}
@@ -0,0 +1,3933 @@
+// File sealing
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Define constants for the buffer size and the store configuration limits
+#define BUFSIZE 102400
+#define CMD_END_MARKER "END_CMD"
+// Every sized body (an upload, a file, a tarball or a signature) is followed by "CRC32C <8 hex digits>",
+// the CRC32C of the body, checked by each hop that receives it
+#define CRC_TRAILER_LEN 15
+#define MAX_EXTS 16
+// Delta uploads: signature block sizes (a power of two between these) and the FNV-1a constants of the strong hash
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 65536
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+// File index kept in ~/.<store>_index for up to INDEX_ENTRIES files, INDEX_SCAN_WORKERS processes rebuild it
+#define INDEX_MAGIC 0x49534644
+#define INDEX_VERSION 4
+#define INDEX_ENTRIES 262144
+#define INDEX_SCAN_WORKERS 8
+#define INDEX_PATH_MAX 256
+// States of an index slot
+#define INDEX_SLOT_FREE 0
+#define INDEX_SLOT_USED 1
+#define INDEX_SLOT_REMOVED 2
+// Stores one Sstore process can host, and the worker processes they share (see -w)
+#define MAX_STORES 16
+#define DEFAULT_WORKERS 32
+#define MAX_WORKERS 256
+// The priority lane of a store (see -m) listens on its port plus this offset and on <dir>/<store>.prio.sock
+#define PRIORITY_PORT_OFFSET 1000
+// Largest upload (and dtar manifest) accepted, see -l; keep it at least Smain's upload_max_size
+#define DEFAULT_UPLOAD_MAX_SIZE (1024LL * 1024 * 1024)
+// Deepest subdirectory level a filtered display or a search may descend to
+#define MAX_LIST_DEPTH 16
+// Search: at most one worker process per CPU core up to SEARCH_MAX_JOBS, at most SEARCH_MAX_MATCHES lines
+// reported, each showing up to SEARCH_SNIPPET bytes of its text; files with a NUL in the first SEARCH_BINARY_PROBE
+// bytes are skipped as binary
+#define SEARCH_MAX_JOBS 16
+#define SEARCH_MAX_MATCHES 10000
+#define SEARCH_SNIPPET 200
+#define SEARCH_BINARY_PROBE 4096
+// Term index (see init_term_index): files with this extension are indexed, by terms of at most TERM_MAX - 1
+// characters; the update log becomes a segment past TERM_LOG_MAX bytes, and the segments are merged into one once
+// there are more than TERM_MAX_SEGMENTS. A query may name up to QUERY_MAX_TERMS terms.
+#define TERM_INDEX_EXT ".txt"
+#define TERM_MAX 32
+#define TERM_MAGIC 0x54534644
+#define TERM_LOG_MAX (4 * 1024 * 1024)
+#define TERM_MAX_SEGMENTS 8
+#define QUERY_MAX_TERMS 16
+
+// A file in the index: its path, size, modification time, the hash of its contents (0 when unknown),
+// the CRC32C it was uploaded with (-1 when unknown) and its document in the term index (-1 when none)
+struct index_entry {
+    char path[INDEX_PATH_MAX];
+    int state;
+    long long size;
+    long long mtime_ns;
+    uint64_t hash;
+    long long crc;
+    long long doc_id;
+};
+
+// The file index, a file mapped by all Sstore processes so it survives restarts: the lock (pid of the holder,
+// 0 when free) and an open-addressed hash table of `capacity` entries by path. `dirty` is set when a process
+// died holding the lock, `complete` is cleared when a file did not fit (lookups that miss then ask the file
+// system), and boot_id names the boot it was last used in. `generation` is the version of the store, raised by
+// every upload and removal, that cached tarballs are built at.
+struct file_index {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    int capacity;
+    int dirty;
+    int complete;
+    char boot_id[40];
+    pid_t lock;
+    int count;
+    int removed;
+    long long generation;
+    struct index_entry entries[];
+};
+
+// A store given on the command line as "<port> <store> [ext ...]": the store name replaces "smain" in paths
+// (~/smain/a.pdf is kept as ~/spdf/a.pdf), the extensions restrict what display and dtar report (all files
+// if none are given). Every store listens on its own port and has its own file index of ~/<store>, mapped
+// before the first fork. With -u <dir>, a store also listens on the Unix-domain socket <dir>/<store>.sock, for a
+// Smain on the same host. With -m <workers>, every store also has a priority lane: a second pair of listeners,
+// served by workers of their own, that Smain uses for metadata commands so they never wait behind transfers.
+// Full tarballs built by dtar are cached in ~/.<store>_tarcache until the store changes.
+struct store {
+    int port;
+    char name[64];
+    char exts[MAX_EXTS][32];
+    int n_exts;
+    int listen_sock;
+    int unix_sock;
+    char unix_path[108];
+    int priority_sock;
+    int priority_unix_sock;
+    char priority_unix_path[108];
+    struct file_index *index;
+    char index_root[512];
+    char terms_dir[512];
+    char tar_cache_dir[512];
+};
+
+// The term index of a store, in ~/.<store>_terms: every indexed file is a document, numbered by its record in
+// "docs" (its path, and whether it is live). A new document appends its sorted terms to "log", which is turned
+// into an immutable segment file "seg.<n>" once it grows large: a header, the compressed posting list (sorted doc
+// ids) of every term, and the table of the terms, sorted for binary search. A deleted document stays in the
+// posting lists, queries skip it, until the segments are merged.
+struct term_doc {
+    char path[INDEX_PATH_MAX];
+    int32_t live;
+    int32_t reserved;
+};
+
+struct term_log_record {
+    uint32_t magic;
+    uint32_t doc_id;
+    uint32_t length;
+};
+
+struct term_segment_header {
+    uint32_t magic;
+    uint32_t n_terms;
+    uint64_t table_offset;
+};
+
+struct term_entry {
+    char term[TERM_MAX];
+    uint64_t offset;
+    uint32_t length;
+    uint32_t count;
+};
+
+// A segment mapped for reading, and one being written
+struct term_segment {
+    void *map;
+    size_t size;
+    uint32_t n_terms;
+    const struct term_entry *table;
+};
+
+struct term_writer {
+    char path[1024];
+    FILE *fp;
+    size_t pos;
+    struct term_entry *table;
+    size_t n_terms;
+    size_t capacity;
+};
+
+// A (term, document) pair of the update log
+struct term_posting {
+    const char *term;
+    uint32_t doc_id;
+};
+
+// Predicates of a filtered display, "display <dir> [name=<glob>] [min=<bytes>] [max=<bytes>] [since=<time>] [depth=<n>]":
+// only files whose name matches the shell pattern, whose size is within the bounds and that were modified at or after
+// `since` (seconds since the epoch) are listed, looking `depth` levels of subdirectories below the directory
+struct list_filter {
+    char glob[256];
+    long long min_size;
+    long long max_size;
+    long long since;
+    int depth;
+};
+
+// A file of a search: the file the bytes are in, the name it is reported by, and where it lies in the file
+// (size -1 for a whole regular file; a packed file is a region of its pack segment)
+struct search_file {
+    char path[512];
+    char name[256];
+    long long offset;
+    long long size;
+};
+
+// Shared by the workers of a search: the next file to scan and the number of matching lines found
+struct search_state {
+    int next;
+    int matches;
+};
+
+// A file of the client's last backup, from the manifest of an incremental dtar
+struct manifest_entry {
+    const char *path;
+    long long size;
+    long long mtime;
+    int seen;
+};
+
+// An incremental dtar, "dtar <path> <ext> [since=<time>] [manifest=<bytes>]" with the manifest after a newline: one
+// "<size> <mtime> <path>" line per file of the client's last backup (path relative to the store's root), sorted by
+// path once loaded. Only files modified at or after `since`, or missing from the manifest or with another size or
+// mtime, are archived, followed by the members .dfs_manifest.<store> (the files there are now) and
+// .dfs_deleted.<store> (the files of the old manifest that are gone).
+struct tar_delta {
+    long long since;
+    char *text;
+    struct manifest_entry *entries;
+    int n_entries;
+    char store[64];
+    char tmp_dir[64];
+    FILE *current;
+};
+
+// The stores of this process, served by one pool of workers, and the store of the connection being handled
+struct store stores[MAX_STORES];
+int n_stores = 0;
+struct store *store = NULL;
+int n_workers = DEFAULT_WORKERS;
+// Directory of the Unix-domain sockets of the stores, none if empty
+char unix_dir[64] = "";
+pid_t worker_pids[MAX_WORKERS];
+// Workers of the priority lanes, which only serve metadata commands; set in those workers
+int n_priority_workers = 0;
+pid_t priority_pids[MAX_WORKERS];
+int worker_priority = 0;
+long long upload_max_size = DEFAULT_UPLOAD_MAX_SIZE;
+// CRC32C: set when the CPU has the SSE4.2 crc32 instruction, otherwise the slicing-by-8 tables are used
+int crc32c_hw = 0;
+uint32_t crc32c_table[8][256];
+
+// Function prototypes
+void handle_client(int client_sock);
+char* create_store_path(const char *destination_path);
+int matches_store_ext(const char *file_name);
+int delete_file(const char *file_path);
+void handle_ufile(int client_sock, char *command, char *file_data, size_t file_len, uint32_t file_crc);
+void handle_dfile(int client_sock, char *command);
+void handle_dfd(int client_sock, char *command);
+void handle_rmfile(int client_sock, char *command);
+void handle_dtar(int client_sock, char *command);
+void handle_display(int client_sock, char *command);
+int parse_list_filter(const char *options, struct list_filter *filter);
+int filter_needs_stat(const struct list_filter *filter);
+int filter_match(const struct list_filter *filter, const char *name, long long size, long long mtime);
+void list_store_dir(const char *dir_path, const char *relative, int depth, const struct list_filter *filter, char *list, size_t list_size);
+void handle_search(int client_sock, char *command);
+void collect_store_search(const char *dir_path, const char *relative, int depth, struct search_file **files, int *n, int *capacity);
+int add_search_file(struct search_file **files, int *n, int *capacity, const char *path, const char *name, long long offset, long long size);
+void search_file_region(const struct search_file *f, const char *text, size_t text_len, int out_fd, struct search_state *state);
+long long run_search(int sock, const struct search_file *files, int n, const char *text);
+void send_file_back_to_smain(int smain_sock, const char *file_path, const char *file_name, long long offset, long long length, const char *if_tag);
+int send_file_with_header(int sock, int file_fd, const char *file_name, long long offset, long long length, const char *if_tag, long long stored_crc);
+void version_tag(const struct stat *file_stat, char *tag, size_t tag_size);
+void store_tar_file(int client_sock, const char *path, const char *ext, struct tar_delta *delta);
+int parse_tar_options(const char *options, long long *since, long long *manifest_len);
+int begin_tar_delta(struct tar_delta *delta, const char *store_name, long long since, const char *manifest, long long manifest_len);
+int tar_delta_wants(struct tar_delta *delta, const char *relative, long long size, long long mtime);
+void collect_tar_files(const char *dir_path, const char *relative, const char *ext, struct tar_delta *delta, FILE *list);
+int append_tar_delta(struct tar_delta *delta, const char *tar_path);
+void end_tar_delta(struct tar_delta *delta);
+long long tree_generation();
+int tar_cache_lookup(const char *ext, long long generation, char *cached_path, size_t path_size, uint32_t *crc);
+void tar_cache_store(const char *built_path, const char *ext, long long generation, uint32_t crc);
+int file_crc32c(int file_fd, uint32_t *crc);
+void handle_dsig(int client_sock, char *command);
+void handle_udelta(int client_sock, char *command, char *delta, size_t delta_len);
+int delta_block_size(long long file_size);
+uint32_t weak_checksum(const unsigned char *data, size_t len);
+uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len);
+int send_signature(int sock, int file_fd);
+int apply_delta(const char *file_path, const unsigned char *delta, size_t delta_len, int block_size, uint64_t base_hash, uint64_t new_hash);
+int send_not_modified(int sock, const char *tag);
+void crc32c_init();
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int send_crc_trailer(int sock, uint32_t crc);
+int parse_crc_trailer(const char *trailer, uint32_t *crc);
+int init_file_index();
+void read_boot_id(char *boot_id, size_t boot_id_size);
+int scan_into_index();
+void scan_directory(const char *dir_path, int share);
+struct index_entry *index_lookup(const char *path, int insert);
+void index_rehash();
+void index_key(const char *path, char *key, size_t key_size);
+int index_get(const char *full_path, struct index_entry *found);
+void index_store_file(const char *full_path, const struct stat *file_stat, uint64_t hash, long long crc);
+void index_forget(const char *full_path);
+void index_set_doc(const char *path, long long doc_id);
+int init_term_index(int index_rebuilt);
+int tokenize_terms(const char *data, size_t len, char **terms, size_t *terms_len);
+void term_index_path(const char *name, char *path, size_t path_size);
+int term_index_lock(int operation);
+void term_doc_kill(long long doc_id);
+struct term_doc *term_map_docs(long long *n_docs);
+void term_index_add(const char *path, const char *data, size_t len);
+void term_index_file(const char *path);
+void term_index_remove(const char *path);
+int term_segment_open(int number, struct term_segment *seg);
+void term_segment_close(struct term_segment *seg);
+int term_list_segments(int *numbers, int max);
+const struct term_entry *term_segment_find(const struct term_segment *seg, const char *term);
+uint32_t term_decode_postings(const struct term_segment *seg, const struct term_entry *entry, uint32_t *ids);
+int term_writer_begin(struct term_writer *w);
+int term_writer_add(struct term_writer *w, const char *term, const uint32_t *ids, uint32_t n, const struct term_doc *docs, long long n_docs);
+int term_writer_finish(struct term_writer *w, int number);
+void term_flush_log();
+void term_merge_segments();
+long long term_lookup(const char *term, const struct term_segment *segs, int n_segments, const char *log, size_t log_len, uint32_t **ids);
+void handle_query(int client_sock, char *command);
+void index_entry_stat(const struct index_entry *e, struct stat *file_stat);
+void index_lock();
+void index_unlock();
+void reclaim_index_lock(pid_t pid);
+int open_store_socket(int port);
+int open_unix_socket(const char *path);
+void tune_socket(int sock);
+int is_metadata_command(const char *command);
+void worker_main(int priority);
+pid_t spawn_worker(int priority);
+
+// This function handles one command of a connected client (Smain) for the current store, the caller closes the connection
+void handle_client(int client_sock) {
+    // Buffer to store data received from the client
+    char buffer[BUFSIZE];
+    // Variable to hold the number of bytes received
+    ssize_t bytes_received;
+    // Pointer to store the command part of the message
+    char *command;
+    // Pointer to store the file data part of the message
+    char *file_data;
+    // A Smain on the same host may attach a sealed memfd holding the data of an upload
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    int body_fd = -1;
+
+    // Receive the combined message (command and possibly file data) from the client(Smain)
+    bytes_received = recvmsg(client_sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = bytes_received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&body_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (bytes_received > 0) {
+        buffer[bytes_received] = '\0'; // Null-terminate the received data
+
+        // Only uploads carry a memfd
+        if (body_fd >= 0 && strncmp(buffer, "ufile", 5) != 0 && strncmp(buffer, "udelta", 6) != 0) {
+            close(body_fd);
+            body_fd = -1;
+        }
+
+        // The priority lane is kept free for metadata commands, anything else belongs on the regular port
+        if (worker_priority && strncmp(buffer, "ping", 4) != 0 && !is_metadata_command(buffer)) {
+            const char *error_message = "ERROR: The priority lane only serves display, rmfile and query";
+            printf("%s\n", error_message);
+            send(client_sock, error_message, strlen(error_message), 0);
+            if (body_fd >= 0) {
+                close(body_fd);
+            }
+            return;
+        }
+
+        // Determine which command was sent by the client and handle it accordingly
+        if (strncmp(buffer, "ping", 4) == 0) {
+            // Health check from Smain, answer without logging
+            send(client_sock, "pong", 4, 0);
+        } else if (strncmp(buffer, "ufile", 5) == 0 || strncmp(buffer, "udelta", 6) == 0) {
+            // Locate the newline character that separates the command from the file data
+            char *delimiter = strstr(buffer, "\n");
+            if (delimiter == NULL) {
+                printf("Invalid message format\n");
+                if (body_fd >= 0) {
+                    close(body_fd);
+                }
+                return;
+            }
+            // Null-terminate the command
+            *delimiter = '\0';
+            // Extract the file data
+            file_data = delimiter + 1;
+            size_t file_len = bytes_received - (file_data - buffer);
+
+            // "ufile <path> <size>" (and "udelta <path> <size> ...") announces the size of the data, receive the part that
+            // did not fit and the CRC32C trailer that follows it
+            char *body = NULL;
+            void *body_map = MAP_FAILED;
+            unsigned long long announced;
+            if (sscanf(buffer, "%*s %*s %llu", &announced) != 1) {
+                printf("Invalid message format\n");
+                send(client_sock, "File upload failed", 18, 0);
+                if (body_fd >= 0) {
+                    close(body_fd);
+                }
+                return;
+            }
+            // The size is not trusted: a larger body is neither buffered nor mapped
+            if (announced > (unsigned long long)upload_max_size || announced > SIZE_MAX - CRC_TRAILER_LEN - 1) {
+                char error_message[128];
+                snprintf(error_message, sizeof(error_message), "ERROR: Upload too large, the limit is %lld bytes!", upload_max_size);
+                printf("%s\n", error_message);
+                send(client_sock, error_message, strlen(error_message), 0);
+                if (body_fd >= 0) {
+                    close(body_fd);
+                }
+                return;
+            }
+            size_t needed = announced + CRC_TRAILER_LEN;
+            if (body_fd >= 0) {
+                // The data and its trailer are in the memfd, sealed so they cannot change while they are checked and stored
+                struct stat body_stat;
+                int seals = fcntl(body_fd, F_GET_SEALS);
+                if (seals >= 0 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK)
+                    && fstat(body_fd, &body_stat) == 0 && (size_t)body_stat.st_size >= needed) {
+                    body_map = mmap(NULL, needed, PROT_READ, MAP_SHARED, body_fd, 0);
+                }
+                close(body_fd);
+                if (body_map == MAP_FAILED) {
+                    printf("Invalid upload memfd\n");
+                    send(client_sock, "File upload failed", 18, 0);
+                    return;
+                }
+                file_data = body_map;
+                file_len = needed;
+            } else if (needed > file_len) {
+                body = malloc(needed + 1);
+                if (body == NULL) {
+                    perror("Memory allocation failed");
+                    send(client_sock, "File upload failed", 18, 0);
+                    return;
+                }
+                memcpy(body, file_data, file_len);
+                while (file_len < needed) {
+                    ssize_t n = recv(client_sock, body + file_len, needed - file_len, 0);
+                    if (n <= 0) {
+                        break;
+                    }
+                    file_len += n;
+                }
+                if (file_len < needed) {
+                    printf("Upload data truncated\n");
+                    send(client_sock, "File upload failed", 18, 0);
+                    free(body);
+                    return;
+                }
+                file_data = body;
+            }
+
+            // Only data that arrived as the client read it is stored
+            uint32_t sent_crc, file_crc;
+            file_len = announced;
+            file_crc = crc32c(0, file_data, file_len);
+            if (parse_crc_trailer(file_data + file_len, &sent_crc) < 0 || sent_crc != file_crc) {
+                const char *error_message = "ERROR: Upload checksum mismatch!";
+                printf("%s\n", error_message);
+                send(client_sock, error_message, strlen(error_message), 0);
+            } else if (strncmp(buffer, "udelta", 6) == 0) {
+                // Handle the 'udelta' command, which rebuilds a file from its stored copy and a delta
+                printf("Delta upload request\n");
+                handle_udelta(client_sock, buffer, file_data, file_len);
+            } else {
+                // Handle the 'ufile' command, which uploads a file
+                printf("File Upload request\n");
+                handle_ufile(client_sock, buffer, file_data, file_len, file_crc);
+            }
+            free(body);
+            if (body_map != MAP_FAILED) {
+                munmap(body_map, needed);
+            }
+
+        } else if (strncmp(buffer, "dfile", 5) == 0) {
+            // Handle the 'dfile' command, which downloads a file
+            printf("File download request\n");
+            handle_dfile(client_sock, buffer);
+        } else if (strncmp(buffer, "dfd", 3) == 0) {
+            // Handle the 'dfd' command, which hands the open file to Smain instead of its contents
+            printf("File descriptor request\n");
+            handle_dfd(client_sock, buffer);
+        } else if (strncmp(buffer, "rmfile", 6) == 0) {
+            // Handle the 'rmfile' command, which removes a file
+            printf("File remove request\n");
+            handle_rmfile(client_sock, buffer);
+        } else if (strncmp(buffer, "dtar", 4) == 0) {
+            // Handle the 'dtar' command, which download file of given extension to Tar
+            printf("TarFile download request\n");
+            handle_dtar(client_sock, buffer);
+        } else if (strncmp(buffer, "display", 7) == 0) {
+            // Handle the 'display' command, which shows files in a directory
+            printf("Display Files request\n");
+            handle_display(client_sock, buffer);
+        } else if (strncmp(buffer, "search", 6) == 0) {
+            // Handle the 'search' command, which finds the lines of the files in a directory that contain a text
+            printf("Search request\n");
+            handle_search(client_sock, buffer);
+        } else if (strncmp(buffer, "query", 5) == 0) {
+            // Handle the 'query' command, which looks up the files containing some words in the term index
+            printf("Query request\n");
+            handle_query(client_sock, buffer);
+        } else if (strncmp(buffer, "dsig", 4) == 0) {
+            // Handle the 'dsig' command, which sends the block signature of a file for a delta upload
+            printf("File signature request\n");
+            handle_dsig(client_sock, buffer);
+        } else {
+            // If the command is unknown, print an error message
+            printf("Unknown command: %s\n", buffer);
+        }
+    } else {
+        // Handle the case where no data is received or an error occurred
+        if (bytes_received == 0) {
+            printf("Connection closed by peer\n");
+        } else {
+            perror("Receive command failed");
+        }
+    }
+}
+
+// This function handles the 'ufile' command to upload a file to the server
+void handle_ufile(int client_sock, char *command, char *file_data, size_t file_len, uint32_t file_crc) {
+    // Buffer to store the destination file path
+    char destination_path[1024];
+    // File descriptor for the file being created
+    int file_fd;
+
+    // Extract the destination path from the 'ufile' command and check for error and send that error to Smain(client)
+    int parsed = sscanf(command, "ufile %s", destination_path);
+    if (parsed < 1) {
+        printf("Command parsing failed\n");
+        send(client_sock, "File upload failed", 18, 0);
+        return;
+    }
+
+    // Create a new file path by modifying the destination path(Replace smain with the store name)
+    char *new_file_path = create_store_path(destination_path);
+    if (new_file_path != NULL) {
+        // Ensure the destination directory exists
+        char *last_slash = strrchr(new_file_path, '/');
+        if (last_slash != NULL) {   
+            // Temporarily remove the last part of the path
+            *last_slash = '\0';
+            char command_buf[BUFSIZE];
+            // Create the directory if it does not exist, if fails print it and send error to client(Smain)
+            snprintf(command_buf, sizeof(command_buf), "mkdir -p %s", new_file_path);
+            if (system(command_buf) != 0) {
+                perror("Directory creation failed");
+                send(client_sock, "File upload failed", 18, 0);
+                free(new_file_path);
+                return;
+            }
+            // Restore the original path
+            *last_slash = '/';  
+        }
+
+        // Create the file for writing, if error encounter print and send it to the Smain(Client)
+        file_fd = open(new_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (file_fd < 0) {
+            perror("File creation failed");
+            send(client_sock, "File upload failed", 18, 0);
+            close(file_fd);
+            free(new_file_path);
+            return;
+        }
+
+        // Write the file data to the file, if error encounter print and send it to the Smain(Client)
+        if (file_len > 0 && write(file_fd, file_data, file_len) != (ssize_t)file_len) {
+            perror("File write failed");
+            send(client_sock, "File upload failed", 18, 0);
+            close(file_fd);
+            free(new_file_path);
+            return;
+        }
+
+        // Close the file after writing the data, recording it in the file index
+        struct stat file_stat;
+        if (fstat(file_fd, &file_stat) == 0) {
+            index_store_file(new_file_path, &file_stat, strong_hash(FNV_OFFSET, (const unsigned char *)file_data, file_len), file_crc);
+            term_index_add(new_file_path, file_data, file_len);
+        } else {
+            index_forget(new_file_path);
+        }
+        close(file_fd);
+
+        // Send confirmation to the client
+        const char *success_message = "File Uploaded successfully.";
+        printf("Sending responce to Smain.\n%s\n",success_message);
+        send(client_sock, success_message, strlen(success_message), 0);
+
+        // Free the memory allocated for the new file path
+        free(new_file_path);
+    }else{
+        // Send an error message to the client if file uploading faile
+        const char *failed_message = "File uploading failed!";
+        printf("%s\n",failed_message);
+        send(client_sock, failed_message, strlen(failed_message), 0);
+    }
+}
+
+
+// function to handle the 'dfile' command, which would download a file from the server
+void handle_dfile(int client_sock, char *command) {
+    // Buffer to store the file path
+    char file_path[1024];
+    // Buffer to store data for transmission
+    char buffer[BUFSIZE];
+    // File descriptor for the file being read
+    int file_fd;
+    // Variable to store the number of bytes read
+    ssize_t bytes_read;
+
+    // Ensure command string is properly null-terminated
+    command[strcspn(command, "\r\n")] = '\0';
+
+    // Optional byte range "dfile <path> <offset> <length>" of a striped download, and the
+    // version tag of the client's cached copy for a conditional download, or "if-match=<tag>" for a stripe
+    long long offset = -1, length = -1;
+    char if_tag[64];
+
+    // Extract the file path (and the range and tag) from the command
+    int parsed = sscanf(command, "dfile %1023s %lld %lld %63s", file_path, &offset, &length, if_tag);
+    if (parsed >= 1 && (parsed < 3 || offset < 0)) {
+        offset = -1;
+        length = -1;
+        parsed = 1;
+    }
+    if (parsed < 1) {
+        printf("Command parsing failed!\n");
+        // Send rejction to the client
+        const char *success_message = "ERROR: Command parsing failed!";
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *new_file_path = create_store_path(file_path);
+
+    // Extract the file name from the full file path
+    char *file_name = strrchr(file_path, '/') + 1;
+
+    // Send the requested file back to the client
+    send_file_back_to_smain(client_sock, new_file_path, file_name, offset, length, parsed == 4 ? if_tag : NULL);
+
+    // Free the memory allocated for the new file path
+    free(new_file_path);
+}
+
+// Function to handle the 'dfd' command of a Smain on the same host: the stored file is opened and its descriptor
+// passed over the Unix-domain socket (SCM_RIGHTS) with "FD <crc>\n", the CRC32C it was uploaded with (-1 if
+// unknown), so Smain sends it to its client itself; ranges and conditional requests are then handled by Smain
+void handle_dfd(int client_sock, char *command) {
+    // Buffer to store the file path
+    char file_path[1024];
+    struct sockaddr_storage local_addr;
+    socklen_t addr_len = sizeof(local_addr);
+
+    // Descriptors can only be passed to a process on this host
+    if (getsockname(client_sock, (struct sockaddr*)&local_addr, &addr_len) < 0 || local_addr.ss_family != AF_UNIX) {
+        const char *error_message = "ERROR: dfd needs a Unix-domain connection!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+    command[strcspn(command, "\r\n")] = '\0';
+    if (sscanf(command, "dfd %1023s", file_path) != 1) {
+        printf("Command parsing failed!\n");
+        const char *error_message = "ERROR: Command parsing failed!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+
+    // Open the file of this store, the file index knows missing files without opening them
+    char *full_path = create_store_path(file_path);
+    if (full_path == NULL) {
+        return;
+    }
+    struct index_entry entry;
+    int indexed = index_get(full_path, &entry);
+    int file_fd = indexed == 0 ? -1 : open(full_path, O_RDONLY);
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
+        perror("File not found!");
+        const char *error_message = "ERROR: File not found!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        free(full_path);
+        return;
+    }
+    free(full_path);
+
+    // The CRC32C the file was uploaded with goes along, as long as the file was not rewritten since
+    long long stored_crc = -1;
+    if (indexed == 1 && entry.size == (long long)file_stat.st_size
+        && entry.mtime_ns == (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec) {
+        stored_crc = entry.crc;
+    }
+
+    // The descriptor travels with the header, in a single message
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "FD %lld\n", stored_crc);
+    struct iovec iov = { .iov_base = header, .iov_len = header_len };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(int));
+    if (sendmsg(client_sock, &msg, 0) < 0) {
+        perror("Error passing file descriptor");
+    }
+    close(file_fd);
+}
+
+// function to handle the 'dsig' command: send the block signature of a stored file for a delta upload
+void handle_dsig(int client_sock, char *command) {
+    // Buffer to store the file path
+    char file_path[1024];
+
+    // Extract the file path from the command
+    if (sscanf(command, "dsig %1023s", file_path) != 1) {
+        printf("Command parsing failed!\n");
+        const char *error_message = "ERROR: Command parsing failed!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+
+    // Open the file in this store (replace smain with the store name) and send its signature
+    char *new_file_path = create_store_path(file_path);
+    int file_fd = (new_file_path != NULL && index_get(new_file_path, NULL) != 0) ? open(new_file_path, O_RDONLY) : -1;
+    if (file_fd < 0) {
+        const char *error_message = "ERROR: File not found!";
+        send(client_sock, error_message, strlen(error_message), 0);
+    } else {
+        send_signature(client_sock, file_fd);
+        close(file_fd);
+    }
+    free(new_file_path);
+}
+
+// function to handle the 'udelta' command: "udelta <path> <size> <block size> <old hash> <new hash>" followed by
+// the delta, which rebuilds the new version of the file from the stored one
+void handle_udelta(int client_sock, char *command, char *delta, size_t delta_len) {
+    // Buffer to store the destination file path and the delta parameters
+    char destination_path[1024];
+    int block_size;
+    unsigned long long base_hash, new_hash;
+
+    // Extract the path and the delta parameters, and apply the delta to the copy in this store
+    char *new_file_path = NULL;
+    if (sscanf(command, "udelta %1023s %*s %d %llx %llx", destination_path, &block_size, &base_hash, &new_hash) == 4
+        && block_size > 0 && (new_file_path = create_store_path(destination_path)) != NULL
+        && apply_delta(new_file_path, (const unsigned char *)delta, delta_len, block_size, base_hash, new_hash) == 0) {
+        const char *success_message = "File Uploaded successfully.";
+        printf("Sending responce to Smain.\n%s\n", success_message);
+        send(client_sock, success_message, strlen(success_message), 0);
+    } else {
+        printf("Delta upload failed\n");
+        send(client_sock, "File upload failed", 18, 0);
+    }
+    free(new_file_path);
+}
+
+// function to handle the 'rmfile' command, which would remove a file from the server
+void handle_rmfile(int client_sock, char *command) {
+    // Buffer to store the file path
+    char file_path[1024];
+    // Buffer to store data for transmission
+    char buffer[BUFSIZE];
+    // File descriptor for the file being read
+    int file_fd;
+    // Variable to store the number of bytes read
+    ssize_t bytes_read;
+
+    // Ensure command string is properly null-terminated
+    command[strcspn(command, "\r\n")] = '\0';
+
+    // Extract the file path from the 'rmfile' command, and print error if any
+    if (sscanf(command, "rmfile %s", file_path) != 1) {
+        printf("Command parsing failed\n");
+        return;
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *new_file_path = create_store_path(file_path);
+    if(new_file_path != NULL){
+        // check if file exist or not, the file index answers without touching the disk
+        int indexed = index_get(new_file_path, NULL);
+        if (indexed == 0 || (indexed < 0 && access(new_file_path, F_OK) == -1)) {
+            // Send rejction to the client
+            const char *success_message = "File not found!";
+            printf("%s\n",success_message);
+            send(client_sock, success_message, strlen(success_message), 0);
+            free(new_file_path);
+            return;
+        }
+
+        // if exist then delete
+        if (delete_file(new_file_path) != 0) {
+            // Send rejction to the client
+            const char *success_message = "File remove Failed!";
+            printf("%s\n",success_message);
+            send(client_sock, success_message, strlen(success_message), 0);
+        }else{
+            // Send confirmation to the client
+            const char *success_message = "File has been removed!";
+            printf("%s\n",success_message);
+            send(client_sock, success_message, strlen(success_message), 0);
+        }
+        free(new_file_path);
+    }else{
+        // Send rejction to the client
+        const char *success_message = "ERROR: File remove Failed!";
+        printf("%s\n",success_message);
+        send(client_sock, success_message, strlen(success_message), 0);
+    }
+}
+
+// Function to handle the 'dtar' command from the client(Smain)
+void handle_dtar(int client_sock, char *command) {
+    char path[BUFSIZE];
+    char ext[32] = "";
+    // The manifest of an incremental dtar follows the command line
+    char *received = strchr(command, '\n');
+    if (received != NULL) {
+        *received++ = '\0';
+    }
+    // Extract the file path, the requested extension and the options from the command using sscanf
+    int consumed = 0;
+    sscanf(command, "dtar %s %31s %n", path, ext, &consumed);
+    long long since, manifest_len;
+    if (parse_tar_options(consumed > 0 ? command + consumed : "", &since, &manifest_len) < 0 || (manifest_len >= 0 && received == NULL)
+        || manifest_len > upload_max_size) {
+        const char *error_message = "ERROR: Invalid dtar options!";
+        printf("%s\n", error_message);
+        send(client_sock, error_message, strlen(error_message), 0);
+        return;
+    }
+    // Older requests carry no extension, fall back to the first extension of the store
+    if (ext[0] == '\0') {
+        if (store->n_exts == 0) {
+            const char *error_message = "ERROR: Invalid Extention Format!";
+            send(client_sock, error_message, strlen(error_message), 0);
+            return;
+        }
+        snprintf(ext, sizeof(ext), "%s", store->exts[0]);
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *new_file_path = create_store_path(path);
+
+    // Check if the full_path exists and is a directory
+    struct stat path_stat;
+    if (new_file_path == NULL || stat(new_file_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
+        // If the path doesn't exist or isn't a directory, inform the client(Smain) and exit the function
+        printf("ERROR: Server directory does not exist, expected : %s\n", new_file_path ? new_file_path : path);
+        const char *error_message = "ERROR: Server directory does not exist!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        free(new_file_path);
+        return;
+    }
+    if (since < 0 && manifest_len < 0) {
+        // If the path is valid, create a tarball of the matching files and send it to the client(Smain)
+        store_tar_file(client_sock, new_file_path, ext, NULL);
+        free(new_file_path);
+        return;
+    }
+
+    // Receive the rest of the manifest and its CRC32C trailer
+    char *manifest = NULL;
+    size_t needed = manifest_len + CRC_TRAILER_LEN, have = 0;
+    if (manifest_len >= 0) {
+        manifest = malloc(needed + 1);
+        if (manifest != NULL) {
+            have = strlen(received) < needed ? strlen(received) : needed;
+            memcpy(manifest, received, have);
+            while (have < needed) {
+                ssize_t n = recv(client_sock, manifest + have, needed - have, 0);
+                if (n <= 0) {
+                    break;
+                }
+                have += n;
+            }
+        }
+        uint32_t sent_crc;
+        if (manifest == NULL || have < needed || parse_crc_trailer(manifest + manifest_len, &sent_crc) < 0
+            || sent_crc != crc32c(0, manifest, manifest_len)) {
+            const char *error_message = "ERROR: Manifest checksum mismatch!";
+            printf("%s\n", error_message);
+            send(client_sock, error_message, strlen(error_message), 0);
+            free(manifest);
+            free(new_file_path);
+            return;
+        }
+    }
+
+    // An incremental tarball only holds the files that changed since the manifest or the time
+    struct tar_delta delta;
+    if (begin_tar_delta(&delta, store->name, since, manifest, manifest_len) < 0) {
+        const char *error_message = "ERROR: Tar file creation failed!";
+        send(client_sock, error_message, strlen(error_message), 0);
+    } else {
+        store_tar_file(client_sock, new_file_path, ext, &delta);
+        end_tar_delta(&delta);
+    }
+    free(manifest);
+    free(new_file_path);
+}
+
+// function to handle the 'display' command, "display <dir>" optionally followed by the predicates of a filter
+// (see struct list_filter) that only the matching files are listed for
+void handle_display(int client_sock, char *command) {
+    // Buffer to store the directory path
+    char dir_path[1024];
+    // Structure to store information about the directory
+    struct stat path_stat;
+
+    // Ensure command string is properly null-terminated
+    command[strcspn(command, "\r\n")] = '\0';
+
+    // Extract the file path and the filter from the 'display' command, and print error if any
+    struct list_filter filter;
+    int consumed = 0;
+    if (sscanf(command, "display %1023s %n", dir_path, &consumed) != 1) {
+        printf("Command parsing failed\n");
+        return;
+    }
+    if (parse_list_filter(command + consumed, &filter) < 0) {
+        const char *error_message = "ERROR: Invalid display filter!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        printf("%s\n",error_message);
+        return;
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *new_dir_path = create_store_path(dir_path);
+
+    // Check if the given path is a valid (Exist)
+    if (new_dir_path == NULL || stat(new_dir_path, &path_stat) != 0) {
+        // Error in stat, path might not exist
+        const char *error_message = "ERROR: Invalid path or not a directory!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        printf("%s\n",error_message);
+        free(new_dir_path);
+        return;
+    }
+
+    // Check if the path is a directory
+    if (!S_ISDIR(path_stat.st_mode)) {
+        // Path exists but is not a directory
+        const char *error_message = "ERROR: Not a directory!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        printf("%s\n",error_message);
+        free(new_dir_path);
+        return;
+    }
+
+    // Buffer to store the list of files of this store that pass the filter
+    char store_files[BUFSIZE] = "";
+    list_store_dir(new_dir_path, "", filter.depth, &filter, store_files, sizeof(store_files));
+    free(new_dir_path);
+
+    // If no files were found, send an error message to the client
+    if(strlen(store_files) == 0){
+        const char *error_message = "ERROR: No files found or given path doesnot exist!";
+        printf("%s\n",error_message);
+    }else{
+        // Print the list of files
+        printf("%s\n",store_files);
+        // Send the list to the client(Smain)
+        send(client_sock, store_files, strlen(store_files), 0);
+    }
+}
+
+// function to handle the 'search' command, "search <dir> <text>": the files of this store below the directory are
+// scanned for the text in parallel and a "<file>:<line>:<text of the line>" line is streamed back for each matching
+// line, files named relative to the directory; the connection is closed after the last one
+void handle_search(int client_sock, char *command) {
+    // Buffer to store the directory path
+    char dir_path[1024];
+    struct stat path_stat;
+
+    // Ensure command string is properly null-terminated
+    command[strcspn(command, "\r\n")] = '\0';
+
+    // Extract the directory and the text, which is the rest of the line, and print error if any
+    int consumed = 0;
+    if (sscanf(command, "search %1023s %n", dir_path, &consumed) != 1 || command[consumed] == '\0') {
+        printf("Command parsing failed\n");
+        return;
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *new_dir_path = create_store_path(dir_path);
+    if (new_dir_path == NULL || stat(new_dir_path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode)) {
+        const char *error_message = "ERROR: Invalid path or not a directory!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        printf("%s\n",error_message);
+        free(new_dir_path);
+        return;
+    }
+
+    // Collect the files of this store and scan them
+    struct search_file *files = NULL;
+    int n_files = 0, capacity = 0;
+    collect_store_search(new_dir_path, "", MAX_LIST_DEPTH, &files, &n_files, &capacity);
+    free(new_dir_path);
+    long long sent = run_search(client_sock, files, n_files, command + consumed);
+    free(files);
+    printf("Search of %d files sent %lld bytes\n", n_files, sent);
+}
+
+// Function to add the files of this store below a directory to the files of a search, looking `depth` levels of
+// subdirectories further down; files below the directory are named relative to it ("sub/x.txt")
+void collect_store_search(const char *dir_path, const char *relative, int depth, struct search_file **files, int *n, int *capacity) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char entry_path[1024], name[1024];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && stat(entry_path, &entry_stat) == 0 && S_ISDIR(entry_stat.st_mode))) {
+            if (depth > 0) {
+                char sub_relative[1024];
+                if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                    collect_store_search(entry_path, sub_relative, depth - 1, files, n, capacity);
+                }
+            }
+            continue;
+        }
+        if (matches_store_ext(entry->d_name) && add_search_file(files, n, capacity, entry_path, name, 0, -1) < 0) {
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+// Function to read the predicates of a filtered display from the words after its path, returns -1 for an unknown
+// or invalid one
+int parse_list_filter(const char *options, struct list_filter *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->max_size = -1;
+    char words[1024];
+    snprintf(words, sizeof(words), "%s", options);
+    char *saveptr;
+    for (char *word = strtok_r(words, " \t\r\n", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        char *value = strchr(word, '=');
+        char *end = NULL;
+        if (value == NULL || value[1] == '\0') {
+            return -1;
+        }
+        *value++ = '\0';
+        if (strcmp(word, "name") == 0) {
+            snprintf(filter->glob, sizeof(filter->glob), "%s", value);
+            continue;
+        }
+        long long number = strtoll(value, &end, 10);
+        if (*end != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(word, "min") == 0) {
+            filter->min_size = number;
+        } else if (strcmp(word, "max") == 0) {
+            filter->max_size = number;
+        } else if (strcmp(word, "since") == 0) {
+            filter->since = number;
+        } else if (strcmp(word, "depth") == 0 && number <= MAX_LIST_DEPTH) {
+            filter->depth = (int)number;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to check whether the size and modification time of files must be read to apply a filter
+int filter_needs_stat(const struct list_filter *filter) {
+    return filter->min_size > 0 || filter->max_size >= 0 || filter->since > 0;
+}
+
+// Function to check a file (its name without the directory, size and modification time) against a filter
+int filter_match(const struct list_filter *filter, const char *name, long long size, long long mtime) {
+    return (filter->glob[0] == '\0' || fnmatch(filter->glob, name, 0) == 0)
+           && size >= filter->min_size && (filter->max_size < 0 || size <= filter->max_size)
+           && mtime >= filter->since;
+}
+
+// Function to add the files of this store in a directory that pass the filter to a list, looking `depth` levels
+// of subdirectories further down; files below the directory are listed relative to it ("sub/x.txt")
+void list_store_dir(const char *dir_path, const char *relative, int depth, const struct list_filter *filter, char *list, size_t list_size) {
+    // Open the directory
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    // Read through the directory and find the files of this store
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char entry_path[1024], name[1024];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+
+        // The size and time are only read when the filter needs them (or the file system does not give the type)
+        struct stat entry_stat;
+        memset(&entry_stat, 0, sizeof(entry_stat));
+        int is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || (entry->d_type != DT_DIR && filter_needs_stat(filter))) {
+            if (stat(entry_path, &entry_stat) < 0) {
+                continue;
+            }
+            is_dir = S_ISDIR(entry_stat.st_mode);
+        }
+        if (is_dir) {
+            if (depth > 0) {
+                char sub_relative[1024];
+                if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                    list_store_dir(entry_path, sub_relative, depth - 1, filter, list, list_size);
+                }
+            }
+            continue;
+        }
+        if (matches_store_ext(entry->d_name) && filter_match(filter, entry->d_name, (long long)entry_stat.st_size, (long long)entry_stat.st_mtime)
+            && strlen(list) + strlen(name) + 2 < list_size) {
+            strcat(list, name);
+            strcat(list, "\n");
+        }
+    }
+    // Close the directory after reading
+    closedir(dir);
+}
+
+// Function to add a file (or a region of a file, size -1 for all of it) to the files of a search, growing the array
+// Returns -1 when no memory is left
+int add_search_file(struct search_file **files, int *n, int *capacity, const char *path, const char *name, long long offset, long long size) {
+    if (*n == *capacity) {
+        int grown_capacity = *capacity > 0 ? *capacity * 2 : 256;
+        struct search_file *grown = realloc(*files, grown_capacity * sizeof(struct search_file));
+        if (grown == NULL) {
+            return -1;
+        }
+        *files = grown;
+        *capacity = grown_capacity;
+    }
+    struct search_file *f = &(*files)[(*n)++];
+    snprintf(f->path, sizeof(f->path), "%s", path);
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->offset = offset;
+    f->size = size;
+    return 0;
+}
+
+// Function to scan one file for the text and write a "<name>:<line>:<text of the line>" line to out_fd for each
+// matching line. Every line is written whole in one write of less than PIPE_BUF bytes, so the lines of workers
+// sharing the pipe never mix. Files with a NUL byte in their first block are taken as binary and skipped.
+void search_file_region(const struct search_file *f, const char *text, size_t text_len, int out_fd, struct search_state *state) {
+    int fd = open(f->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    long long size = f->size;
+    if (size < 0) {
+        struct stat file_stat;
+        size = fstat(fd, &file_stat) == 0 ? (long long)file_stat.st_size : 0;
+    }
+    if (size < (long long)text_len || size == 0) {
+        close(fd);
+        return;
+    }
+    // mmap needs a page aligned offset, a packed file starts anywhere in its segment
+    long long map_offset = f->offset & ~((long long)sysconf(_SC_PAGESIZE) - 1);
+    size_t map_len = (size_t)(size + (f->offset - map_offset));
+    char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_offset);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    const char *data = map + (f->offset - map_offset);
+    const char *end = data + size;
+    if (memchr(data, '\0', size < SEARCH_BINARY_PROBE ? (size_t)size : SEARCH_BINARY_PROBE) != NULL) {
+        munmap(map, map_len);
+        return;
+    }
+
+    // memmem and memchr scan with the vector instructions of the CPU, the line number is counted between matches
+    const char *p = data;
+    const char *counted = data;
+    long long line = 1;
+    const char *hit;
+    while (p < end && (hit = memmem(p, end - p, text, text_len)) != NULL) {
+        const char *line_start = hit;
+        while (line_start > p && line_start[-1] != '\n') {
+            line_start--;
+        }
+        const char *line_end = memchr(hit, '\n', end - hit);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        for (const char *c = counted; (c = memchr(c, '\n', line_start - c)) != NULL; c++) {
+            line++;
+        }
+        counted = line_start;
+        if (__atomic_fetch_add(&state->matches, 1, __ATOMIC_RELAXED) >= SEARCH_MAX_MATCHES) {
+            break;
+        }
+
+        // The text of the line is cut to SEARCH_SNIPPET bytes, control characters are shown as spaces
+        char out[PIPE_BUF];
+        int len = snprintf(out, sizeof(out), "%s:%lld:", f->name, line);
+        size_t snippet = line_end - line_start;
+        if (snippet > SEARCH_SNIPPET) {
+            snippet = SEARCH_SNIPPET;
+        }
+        for (size_t i = 0; i < snippet; i++) {
+            unsigned char c = line_start[i];
+            out[len++] = (c < 0x20 || c == 0x7f) ? ' ' : c;
+        }
+        out[len++] = '\n';
+        if (write(out_fd, out, len) < 0) {
+            break;
+        }
+        p = line_end + 1;
+    }
+    munmap(map, map_len);
+}
+
+// Function to search the files for the text with one worker process per CPU core (at most SEARCH_MAX_JOBS), each
+// taking the next file from a shared counter, and stream the matching lines to the socket as they are found
+// Returns the number of bytes sent, -1 if the search could not be started
+long long run_search(int sock, const struct search_file *files, int n, const char *text) {
+    if (n == 0) {
+        return 0;
+    }
+    struct search_state *state = mmap(NULL, sizeof(struct search_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED) {
+        perror("Search state mmap failed");
+        return -1;
+    }
+    state->next = 0;
+    state->matches = 0;
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0) {
+        perror("Search pipe failed");
+        munmap(state, sizeof(struct search_state));
+        return -1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int jobs = cores < 1 ? 1 : (cores > SEARCH_MAX_JOBS ? SEARCH_MAX_JOBS : (int)cores);
+    if (jobs > n) {
+        jobs = n;
+    }
+    size_t text_len = strlen(text);
+    pid_t pids[SEARCH_MAX_JOBS];
+    int started = 0;
+    for (int j = 0; j < jobs; j++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipe_fds[0]);
+            int i;
+            while ((i = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED)) < n
+                   && __atomic_load_n(&state->matches, __ATOMIC_RELAXED) < SEARCH_MAX_MATCHES) {
+                search_file_region(&files[i], text, text_len, pipe_fds[1], state);
+            }
+            _exit(0);
+        } else if (pid > 0) {
+            pids[started++] = pid;
+        } else {
+            perror("Search worker fork failed");
+        }
+    }
+    close(pipe_fds[1]);
+
+    // Pass the lines on as they come, the pipe reaches end of file once every worker is done
+    long long sent = 0;
+    char buffer[PIPE_BUF];
+    ssize_t bytes_read;
+    while (started > 0 && (bytes_read = read(pipe_fds[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (send(sock, buffer, bytes_read, MSG_NOSIGNAL | MSG_MORE) < 0) {
+            break;
+        }
+        sent += bytes_read;
+    }
+    close(pipe_fds[0]);
+    for (int j = 0; j < started; j++) {
+        waitpid(pids[j], NULL, 0);
+    }
+    munmap(state, sizeof(struct search_state));
+    return sent;
+}
+
+// Function to delete a file and handle errors
+int delete_file(const char *file_path) {
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+
+    // new file path creation to replace ~
+    char full_path[BUFSIZE];
+    if (file_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
+    } else {
+        strncpy(full_path, file_path, sizeof(full_path) - 1);
+        full_path[sizeof(full_path) - 1] = '\0';
+    }
+
+    // Create a new file path by modifying the file path(Replace smain with the store name)
+    char *store_path = create_store_path(full_path);
+    if (store_path != NULL) {
+        // delete the file
+        if (unlink(store_path) == 0) {
+            term_index_remove(store_path);
+            index_forget(store_path);
+            free(store_path);
+            return 0;
+        } else {
+            // Handle error based on errno
+            switch (errno) {
+                case EACCES:
+                    fprintf(stderr, "Permission denied: %s\n", full_path);
+                    break;
+                case ENOENT:
+                    fprintf(stderr, "File does not exist: %s\n", full_path);
+                    break;
+                case EISDIR:
+                    fprintf(stderr, "Path is a directory, not a file: %s\n", full_path);
+                    break;
+                default:
+                    fprintf(stderr, "Failed to delete file %s: %s\n", full_path, strerror(errno));
+            }
+            // Free the allocated memory
+            free(store_path);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+// helper function used to send data of requested doenload file to the client(Smain)
+void send_file_back_to_smain(int smain_sock, const char *file_path, const char *file_name, long long offset, long long length, const char *if_tag) {
+    // Replace ~ with the value of the HOME environment variable
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return;
+    }
+
+    // Construct the full path for the file
+    char full_path[BUFSIZE];
+    if (file_path[0] == '~') {
+        snprintf(full_path, sizeof(full_path), "%s%s", home_dir, file_path + 1);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", file_path);
+    }
+
+    // The file index knows missing files, and the version of a cached copy, without opening the file
+    struct index_entry entry;
+    int indexed = index_get(full_path, &entry);
+    if (indexed == 1 && if_tag != NULL) {
+        struct stat file_stat;
+        char tag[64];
+        index_entry_stat(&entry, &file_stat);
+        version_tag(&file_stat, tag, sizeof(tag));
+        if (strcmp(if_tag, tag) == 0) {
+            send_not_modified(smain_sock, tag);
+            return;
+        }
+    }
+
+    // Open the file for reading
+    int file_fd = indexed == 0 ? -1 : open(full_path, O_RDONLY);
+    if (file_fd < 0) {
+        perror("File not found!");
+        // Send rejction to the client
+        const char *success_message = "ERROR: File not found!";
+        send(smain_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+
+    // The CRC32C the file was uploaded with goes along, as long as the file was not rewritten since
+    struct stat file_stat;
+    long long stored_crc = -1;
+    if (indexed == 1 && fstat(file_fd, &file_stat) == 0 && entry.size == (long long)file_stat.st_size
+        && entry.mtime_ns == (long long)file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec) {
+        stored_crc = entry.crc;
+    }
+
+    // Send the file name and size, its contents (or the requested range), the checksum and the end marker
+    send_file_with_header(smain_sock, file_fd, file_name, offset, length, if_tag, stored_crc);
+    close(file_fd);
+}
+
+// Function to send an open file as "<name> <size>\n", the contents, their CRC32C trailer and the end marker.
+// When the whole file is sent and stored_crc (the CRC32C it was uploaded with, -1 if unknown) is given, the
+// data goes out with sendfile and the stored one goes in the trailer, so a file that changed on disk fails the
+// receiver's check
+int send_file_with_header(int sock, int file_fd, const char *file_name, long long offset, long long length, const char *if_tag, long long stored_crc) {
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("File stat failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+
+    // A conditional request carries the version tag of the receiver's cached copy: if the file is
+    // unchanged, answer "NOT_MODIFIED <tag> 0" without data so the cached copy is used
+    char tag[64];
+    version_tag(&file_stat, tag, sizeof(tag));
+    // A stripe of a striped download carries "if-match=<tag>", the version its first stripe came from: the
+    // stripe is refused if the file changed since (or this replica has another version), else it is a plain range
+    if (if_tag != NULL && strncmp(if_tag, "if-match=", 9) == 0) {
+        if (strcmp(if_tag + 9, tag) != 0) {
+            const char *error_message = "ERROR: File changed during the download!";
+            send(sock, error_message, strlen(error_message), 0);
+            return -1;
+        }
+        if_tag = NULL;
+    }
+    if (if_tag != NULL && strcmp(if_tag, tag) == 0) {
+        return send_not_modified(sock, tag);
+    }
+
+    // A range request (offset >= 0) gets "<name> <offset> <total size> <length>", clamped to the file,
+    // a whole file "<name> <size>"; either way the last field is the number of data bytes that follow.
+    // A conditional request also gets the current tag after the name, "<name> <tag> <offset> ..."
+    long long total = (long long)file_stat.st_size;
+    char header[512];
+    int header_len;
+    if (offset >= 0) {
+        if (offset > total) {
+            offset = total;
+        }
+        if (length < 0 || length > total - offset) {
+            length = total - offset;
+        }
+        if (if_tag != NULL) {
+            header_len = snprintf(header, sizeof(header), "%s %s %lld %lld %lld\n", file_name, tag, offset, total, length);
+        } else {
+            header_len = snprintf(header, sizeof(header), "%s %lld %lld %lld\n", file_name, offset, total, length);
+        }
+    } else {
+        offset = 0;
+        length = total;
+        header_len = snprintf(header, sizeof(header), "%s %lld\n", file_name, total);
+    }
+    int whole_file = (offset == 0 && length == total);
+    // MSG_MORE lets the header leave together with the data instead of waiting for its own ACK
+    if (send(sock, header, header_len, MSG_MORE) < 0) {
+        perror("Error sending file header");
+        return -1;
+    }
+
+    // The checksum of a whole file is known, so the kernel sends it straight from the page cache
+    if (whole_file && stored_crc >= 0) {
+        off_t position = 0;
+        while (length > 0) {
+            ssize_t bytes_sent = sendfile(sock, file_fd, &position, length < BUFSIZE * 16 ? (size_t)length : BUFSIZE * 16);
+            if (bytes_sent <= 0) {
+                perror("Error sending file");
+                return -1;
+            }
+            length -= bytes_sent;
+        }
+        if (send_crc_trailer(sock, (uint32_t)stored_crc) < 0) {
+            perror("Failed serve request");
+            return -1;
+        }
+        return 0;
+    }
+
+    // Read the requested part of the file and send it
+    char buffer_content[BUFSIZE];
+    ssize_t bytes_read, bytes_sent;
+    uint32_t crc = 0;
+    while (length > 0) {
+        size_t want = length < (long long)sizeof(buffer_content) ? (size_t)length : sizeof(buffer_content);
+        bytes_read = pread(file_fd, buffer_content, want, offset);
+        if (bytes_read <= 0) {
+            perror("Error reading file");
+            return -1;
+        }
+        crc = crc32c(crc, buffer_content, bytes_read);
+        // The trailer follows, so a last partial chunk waits to leave with it
+        bytes_sent = send(sock, buffer_content, bytes_read, MSG_MORE);
+        if (bytes_sent < 0) {
+            perror("Error sending file");
+            return -1;
+        }
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+
+    // Send the checksum and the end marker
+    if (send_crc_trailer(sock, crc) < 0) {
+        perror("Failed serve request");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to tell the receiver that its cached copy (with version tag `tag`) is current
+int send_not_modified(int sock, const char *tag) {
+    char reply[128];
+    int reply_len = snprintf(reply, sizeof(reply), "NOT_MODIFIED %s 0\nCRC32C %08x%s", tag, 0, CMD_END_MARKER);
+    if (send(sock, reply, reply_len, 0) < 0) {
+        perror("Error sending file header");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to build the version tag of a file from its modification time and size,
+// it changes whenever the file is rewritten
+void version_tag(const struct stat *file_stat, char *tag, size_t tag_size) {
+    snprintf(tag, tag_size, "%lld.%09ld-%lld", (long long)file_stat->st_mtim.tv_sec,
+             (long)file_stat->st_mtim.tv_nsec, (long long)file_stat->st_size);
+}
+
+// Function to prepare crc32c(): use the SSE4.2 crc32 instruction when the CPU has it, and build the
+// tables of the portable version (slicing by 8) for when it does not
+void crc32c_init() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// Function to run the CRC32C register over data with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// Function to continue a CRC32C (Castagnoli) over more data, starting from 0
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *data = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^ crc32c_table[5][(lo >> 16) & 0xff]
+              ^ crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+              ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+// Function to send the CRC32C trailer of a body and the end marker, in one piece
+int send_crc_trailer(int sock, uint32_t crc) {
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    int end_len = snprintf(end, sizeof(end), "CRC32C %08x%s", crc, CMD_END_MARKER);
+    return send(sock, end, end_len, 0) == end_len ? 0 : -1;
+}
+
+// Function to read the CRC32C from the CRC_TRAILER_LEN bytes of a trailer, returns -1 if it is malformed
+int parse_crc_trailer(const char *trailer, uint32_t *crc) {
+    char text[CRC_TRAILER_LEN + 1];
+    unsigned int value;
+    int consumed = 0;
+    memcpy(text, trailer, CRC_TRAILER_LEN);
+    text[CRC_TRAILER_LEN] = '\0';
+    if (sscanf(text, "CRC32C %8x%n", &value, &consumed) != 1 || consumed != CRC_TRAILER_LEN) {
+        return -1;
+    }
+    *crc = value;
+    return 0;
+}
+
+// Function to pick the block size of a delta signature, about the square root of the file size
+// like rsync: small enough to find the unchanged parts, large enough to keep the signature short
+int delta_block_size(long long file_size) {
+    long long block_size = DELTA_MIN_BLOCK;
+    while (block_size < DELTA_MAX_BLOCK && block_size * block_size < file_size) {
+        block_size *= 2;
+    }
+    return (int)block_size;
+}
+
+// Function to compute the rolling checksum of a block, the client slides it over its file one byte at a time
+uint32_t weak_checksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Function to continue a 64 bit FNV-1a hash over more data, used for blocks and whole files
+uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Function to send the signature of a file for a delta upload: "<block size> <file size> <file hash> <length>\n",
+// then per block a 4 byte rolling checksum and an 8 byte strong hash (network byte order), and the end marker
+int send_signature(int sock, int file_fd) {
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        perror("File stat failed");
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+    long long file_size = (long long)file_stat.st_size;
+    int block_size = delta_block_size(file_size);
+    size_t n_blocks = (size_t)((file_size + block_size - 1) / block_size);
+    size_t signature_len = n_blocks * 12;
+    unsigned char *signature = malloc(signature_len + 1);
+    unsigned char *block = malloc(block_size);
+    if (signature == NULL || block == NULL) {
+        perror("Memory allocation failed");
+        free(signature);
+        free(block);
+        const char *error_message = "ERROR: Error reading file!";
+        send(sock, error_message, strlen(error_message), 0);
+        return -1;
+    }
+
+    // Checksum every block, and the whole file so the upload can check it is applied to this version
+    uint64_t file_hash = FNV_OFFSET;
+    for (size_t i = 0; i < n_blocks; i++) {
+        size_t want = (i == n_blocks - 1) ? (size_t)(file_size - (long long)i * block_size) : (size_t)block_size;
+        if (pread(file_fd, block, want, (off_t)i * block_size) != (ssize_t)want) {
+            perror("Error reading file");
+            free(signature);
+            free(block);
+            const char *error_message = "ERROR: Error reading file!";
+            send(sock, error_message, strlen(error_message), 0);
+            return -1;
+        }
+        file_hash = strong_hash(file_hash, block, want);
+        uint32_t weak = weak_checksum(block, want);
+        uint64_t strong = strong_hash(FNV_OFFSET, block, want);
+        unsigned char *entry = signature + i * 12;
+        for (int b = 0; b < 4; b++) {
+            entry[b] = (unsigned char)(weak >> (24 - 8 * b));
+        }
+        for (int b = 0; b < 8; b++) {
+            entry[4 + b] = (unsigned char)(strong >> (56 - 8 * b));
+        }
+    }
+    free(block);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header), "%d %lld %016llx %zu\n", block_size, file_size,
+                              (unsigned long long)file_hash, signature_len);
+    int result = 0;
+    if (send(sock, header, header_len, MSG_MORE) < 0 || (signature_len > 0 && send(sock, signature, signature_len, MSG_MORE) < 0)
+        || send_crc_trailer(sock, crc32c(0, signature, signature_len)) < 0) {
+        perror("Error sending signature");
+        result = -1;
+    }
+    free(signature);
+    return result;
+}
+
+// Function to rebuild a file from its current contents and a delta, then replace it atomically
+// The delta is a list of 'C' <first block> <count> records (copy blocks of the current file) and
+// 'L' <length> <data> records (new data), numbers in network byte order. Returns -1 without touching
+// the file when it is not the version the signature was made from or the result does not match new_hash
+int apply_delta(const char *file_path, const unsigned char *delta, size_t delta_len, int block_size,
+                uint64_t base_hash, uint64_t new_hash) {
+    int base_fd = open(file_path, O_RDONLY);
+    if (base_fd < 0) {
+        perror("File open failed");
+        return -1;
+    }
+    struct stat base_stat;
+    unsigned char *buffer = malloc(BUFSIZE);
+    if (fstat(base_fd, &base_stat) < 0 || buffer == NULL) {
+        perror("File stat failed");
+        free(buffer);
+        close(base_fd);
+        return -1;
+    }
+    long long base_size = (long long)base_stat.st_size;
+
+    // The delta only makes sense against the exact file the client diffed against; the file index
+    // remembers the hash of the file as it was written, so it is only read again when that is unknown
+    struct index_entry entry;
+    uint64_t hash = FNV_OFFSET;
+    ssize_t bytes_read = 0;
+    if (index_get(file_path, &entry) == 1 && entry.hash != 0 && entry.size == base_size
+        && entry.mtime_ns == (long long)base_stat.st_mtim.tv_sec * 1000000000LL + base_stat.st_mtim.tv_nsec) {
+        hash = entry.hash;
+    } else {
+        while ((bytes_read = read(base_fd, buffer, BUFSIZE)) > 0) {
+            hash = strong_hash(hash, buffer, bytes_read);
+        }
+    }
+    if (bytes_read < 0 || hash != base_hash) {
+        printf("Delta base mismatch for %s\n", file_path);
+        free(buffer);
+        close(base_fd);
+        return -1;
+    }
+
+    // Write the new version next to the old one
+    char temp_path[BUFSIZE];
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", file_path);
+    int out_fd = mkstemp(temp_path);
+    if (out_fd < 0) {
+        perror("Temporary file creation failed");
+        free(buffer);
+        close(base_fd);
+        return -1;
+    }
+    hash = FNV_OFFSET;
+    uint32_t crc = 0;
+    size_t pos = 0;
+    int ok = 1;
+    while (ok && pos < delta_len) {
+        char op = delta[pos];
+        if (op == 'C' && pos + 9 <= delta_len) {
+            uint32_t first = ((uint32_t)delta[pos + 1] << 24) | ((uint32_t)delta[pos + 2] << 16) | ((uint32_t)delta[pos + 3] << 8) | delta[pos + 4];
+            uint32_t count = ((uint32_t)delta[pos + 5] << 24) | ((uint32_t)delta[pos + 6] << 16) | ((uint32_t)delta[pos + 7] << 8) | delta[pos + 8];
+            pos += 9;
+            long long offset = (long long)first * block_size;
+            long long remaining = (long long)count * block_size;
+            if (offset > base_size) {
+                ok = 0;
+                break;
+            }
+            if (remaining > base_size - offset) {
+                remaining = base_size - offset;
+            }
+            // Copy the blocks from the current file
+            while (ok && remaining > 0) {
+                size_t want = remaining < BUFSIZE ? (size_t)remaining : BUFSIZE;
+                bytes_read = pread(base_fd, buffer, want, offset);
+                if (bytes_read <= 0 || write(out_fd, buffer, bytes_read) != bytes_read) {
+                    ok = 0;
+                    break;
+                }
+                hash = strong_hash(hash, buffer, bytes_read);
+                crc = crc32c(crc, buffer, bytes_read);
+                offset += bytes_read;
+                remaining -= bytes_read;
+            }
+        } else if (op == 'L' && pos + 5 <= delta_len) {
+            uint32_t len = ((uint32_t)delta[pos + 1] << 24) | ((uint32_t)delta[pos + 2] << 16) | ((uint32_t)delta[pos + 3] << 8) | delta[pos + 4];
+            pos += 5;
+            // Write the new data carried by the delta
+            if (len > delta_len - pos || write(out_fd, delta + pos, len) != (ssize_t)len) {
+                ok = 0;
+                break;
+            }
+            hash = strong_hash(hash, delta + pos, len);
+            crc = crc32c(crc, delta + pos, len);
+            pos += len;
+        } else {
+            ok = 0;
+        }
+    }
+    free(buffer);
+    close(base_fd);
+
+    // Keep the old file's permissions and swap the new version in with one rename
+    if (!ok || hash != new_hash) {
+        printf("Delta for %s did not produce the uploaded file\n", file_path);
+        ok = 0;
+    }
+    if (ok && fchmod(out_fd, base_stat.st_mode & 07777) < 0) {
+        ok = 0;
+    }
+    if (close(out_fd) < 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temp_path, file_path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    struct stat new_stat;
+    if (stat(file_path, &new_stat) == 0) {
+        index_store_file(file_path, &new_stat, new_hash, crc);
+        term_index_file(file_path);
+    } else {
+        index_forget(file_path);
+    }
+    return 0;
+}
+
+// Function to create a tarball of the files with the given extension and send it to the client
+void store_tar_file(int client_sock, const char *path, const char *ext, struct tar_delta *delta) {
+    // variables to hold the command for creating the tarball, the tarball name and the target path
+    char tar_cmd[BUFSIZE];
+    char tar_name[64];
+    char target_path[BUFSIZE];
+    char error_message[128];
+
+    // The tarball is sent as "pdf_files.tar" for .pdf
+    snprintf(tar_name, sizeof(tar_name), "%s_files.tar", ext + 1);
+
+    // A full tarball of the whole store is built once for each version of the store: while no file changed, dtar
+    // sends the cached one straight from the page cache with sendfile
+    long long generation = (delta == NULL && strcmp(path, store->index_root) == 0) ? tree_generation() : -1;
+    uint32_t tar_crc;
+    if (generation >= 0 && tar_cache_lookup(ext, generation, target_path, sizeof(target_path), &tar_crc)) {
+        // A newer version may have replaced it in the meantime, then the tarball is built again
+        int cached = open(target_path, O_RDONLY);
+        if (cached >= 0) {
+            if (send_file_with_header(client_sock, cached, tar_name, -1, -1, NULL, tar_crc) < 0) {
+                perror("Failed to send tarball data");
+            }
+            close(cached);
+            printf("Cached tarball sent to Smain.\n");
+            return;
+        }
+    }
+
+    // The tarball is built outside ~/<store>, so display never lists it, under a name of its own so that concurrent
+    // dtars do not write the same file: in the cache directory, or in the temporary directory of an incremental dtar
+    if (delta != NULL) {
+        snprintf(target_path, sizeof(target_path), "%s/%s", delta->tmp_dir, tar_name);
+    } else {
+        snprintf(target_path, sizeof(target_path), "%s/%s.%d.tmp", store->tar_cache_dir, ext + 1, (int)getpid());
+    }
+
+    int result = 0;
+    if (delta != NULL) {
+        // An incremental tarball gets the files the delta wants, found by walking the directory, then the new
+        // manifest and the deleted files; it is sent even if nothing changed
+        char list_path[128];
+        snprintf(list_path, sizeof(list_path), "%s/list", delta->tmp_dir);
+        FILE *list = fopen(list_path, "w");
+        if (list == NULL) {
+            result = -1;
+        } else {
+            collect_tar_files(path, "", ext, delta, list);
+            int changed = (ftell(list) > 0);
+            fclose(list);
+            unlink(target_path);
+            if (changed) {
+                snprintf(tar_cmd, sizeof(tar_cmd), "tar -cf %s --null -T %s 2>/dev/null", target_path, list_path);
+                result = system(tar_cmd);
+            }
+            unlink(list_path);
+        }
+        if (result == 0) {
+            result = append_tar_delta(delta, target_path);
+        }
+        if (result != 0) {
+            printf("ERROR: Failed to create incremental tarball for %s files.\n", ext);
+            unlink(target_path);
+            const char *tar_error = "ERROR: Tar file creation failed!";
+            send(client_sock, tar_error, strlen(tar_error), 0);
+            return;
+        }
+    } else {
+        // Check for the presence of matching files first
+        snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*%s' -print -quit", path, ext);
+        // Run the command to check for matching files and store the result
+        FILE *check = popen(tar_cmd, "r");
+        // If the check command fails, inform the client(Smain) and exit the function
+        if (check == NULL) {
+            printf("ERROR: Failed to check for %s files.\n", ext);
+            snprintf(error_message, sizeof(error_message), "ERROR: Failed to check for %s files!", ext);
+            send(client_sock, error_message, strlen(error_message), 0);
+            return;
+        }
+
+        // If no matching files found, send error to client(Smain)
+        if (fgetc(check) == EOF) {
+            printf("No %s files found.\n", ext);
+            snprintf(error_message, sizeof(error_message), "ERROR: No %s files found!", ext);
+            send(client_sock, error_message, strlen(error_message), 0);
+            pclose(check);
+            return;
+        }
+        pclose(check);
+
+        // Create the tarball if matching files are found
+        snprintf(tar_cmd, sizeof(tar_cmd), "find %s -name '*%s' -print0 | tar -cf %s --null -T - 2>/dev/null", path, ext, target_path);
+        result = system(tar_cmd);
+        // If the tarball creation fails, inform the client(Smain) and exit the function
+        if (result != 0) {
+            printf("ERROR: Failed to create tarball for %s files.\n", ext);
+            unlink(target_path);
+            const char *tar_error = "ERROR: Tar file creation failed!";
+            send(client_sock, tar_error, strlen(tar_error), 0);
+            return;
+        }
+    }
+
+    // Check if the tarball file was successfully created
+    if (access(target_path, F_OK) != 0) {
+        printf("No %s files found or failed to create tarball.\n", ext);
+        // Send rejction to the client
+        const char *success_message = "ERROR: Tar file creation failed!";
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+
+    // Open the tarball file to read its contents, and checksum it once so that it is sent with sendfile
+    int tarball = open(target_path, O_RDONLY);
+    // If the tarball file cannot be opened, inform the client(Smain)
+    if (tarball < 0 || file_crc32c(tarball, &tar_crc) < 0) {
+        printf("Failed to open tarball file.\n");
+        if (tarball >= 0) {
+            close(tarball);
+        }
+        unlink(target_path);
+        // Send rejction to the client
+        const char *success_message = "ERROR: Tar file creation failed!";
+        send(client_sock, success_message, strlen(success_message), 0);
+        return;
+    }
+    // The tarball is cached if no file changed while it was built, otherwise it is only kept open until it is sent
+    if (generation >= 0 && tree_generation() == generation) {
+        tar_cache_store(target_path, ext, generation, tar_crc);
+    } else {
+        unlink(target_path);
+    }
+
+    // Send the tarball name and size, its contents and the end-of-file marker
+    if (send_file_with_header(client_sock, tarball, tar_name, -1, -1, NULL, tar_crc) < 0) {
+        perror("Failed to send tarball data");
+    }
+    close(tarball);
+    printf("Tarball sent to Smain.\n");
+}
+
+// Function to parse the options of an incremental dtar, "[since=<time>] [manifest=<bytes>]": since and manifest_len
+// are -1 when not given. Returns -1 if an option is invalid
+int parse_tar_options(const char *options, long long *since, long long *manifest_len) {
+    *since = -1;
+    *manifest_len = -1;
+    char words[1024];
+    snprintf(words, sizeof(words), "%s", options);
+    char *saveptr;
+    for (char *word = strtok_r(words, " \t\r\n", &saveptr); word != NULL; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        char *value = strchr(word, '=');
+        char *end = NULL;
+        if (value == NULL || value[1] == '\0') {
+            return -1;
+        }
+        *value++ = '\0';
+        long long number = strtoll(value, &end, 10);
+        if (*end != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(word, "since") == 0) {
+            *since = number;
+        } else if (strcmp(word, "manifest") == 0) {
+            *manifest_len = number;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_manifest_entries(const void *a, const void *b) {
+    return strcmp(((const struct manifest_entry *)a)->path, ((const struct manifest_entry *)b)->path);
+}
+
+// Function to set up an incremental dtar: load the manifest (manifest_len -1 for none) and create the temporary
+// directory where the new manifest is written while the files are walked. Returns 0 on success
+int begin_tar_delta(struct tar_delta *delta, const char *store_name, long long since, const char *manifest, long long manifest_len) {
+    memset(delta, 0, sizeof(*delta));
+    delta->since = since;
+    snprintf(delta->store, sizeof(delta->store), "%s", store_name);
+    snprintf(delta->tmp_dir, sizeof(delta->tmp_dir), "/tmp/sstore_dtar_XXXXXX");
+    if (mkdtemp(delta->tmp_dir) == NULL) {
+        perror("mkdtemp");
+        delta->tmp_dir[0] = '\0';
+        return -1;
+    }
+    char current_path[192];
+    snprintf(current_path, sizeof(current_path), "%s/.dfs_manifest.%s", delta->tmp_dir, delta->store);
+    delta->current = fopen(current_path, "w");
+    if (delta->current == NULL) {
+        perror("Manifest creation failed");
+        end_tar_delta(delta);
+        return -1;
+    }
+    if (manifest_len < 0) {
+        return 0;
+    }
+
+    // One entry per "<size> <mtime> <path>" line, pointing into a copy of the text
+    delta->text = malloc(manifest_len + 1);
+    int capacity = 1;
+    for (long long i = 0; i < manifest_len; i++) {
+        capacity += (manifest[i] == '\n');
+    }
+    delta->entries = malloc(capacity * sizeof(struct manifest_entry));
+    if (delta->text == NULL || delta->entries == NULL) {
+        perror("Memory allocation failed");
+        end_tar_delta(delta);
+        return -1;
+    }
+    memcpy(delta->text, manifest, manifest_len);
+    delta->text[manifest_len] = '\0';
+    char *saveptr;
+    for (char *line = strtok_r(delta->text, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr)) {
+        struct manifest_entry *e = &delta->entries[delta->n_entries];
+        int consumed = 0;
+        if (sscanf(line, "%lld %lld %n", &e->size, &e->mtime, &consumed) == 2 && consumed > 0 && line[consumed] != '\0') {
+            e->path = line + consumed;
+            e->seen = 0;
+            delta->n_entries++;
+        }
+    }
+    qsort(delta->entries, delta->n_entries, sizeof(struct manifest_entry), compare_manifest_entries);
+    // A manifest joined from the tarballs of several replicas lists their files more than once, keep one line each
+    int unique = 0;
+    for (int i = 0; i < delta->n_entries; i++) {
+        if (unique == 0 || strcmp(delta->entries[unique - 1].path, delta->entries[i].path) != 0) {
+            delta->entries[unique++] = delta->entries[i];
+        }
+    }
+    delta->n_entries = unique;
+    return 0;
+}
+
+// Function to decide whether a file (its path relative to the root) goes into an incremental tarball, the file is
+// added to the new manifest either way. Returns 1 if the file is new or changed
+int tar_delta_wants(struct tar_delta *delta, const char *relative, long long size, long long mtime) {
+    fprintf(delta->current, "%lld %lld %s\n", size, mtime, relative);
+    struct manifest_entry key = { .path = relative };
+    struct manifest_entry *e = delta->n_entries > 0
+        ? bsearch(&key, delta->entries, delta->n_entries, sizeof(struct manifest_entry), compare_manifest_entries) : NULL;
+    if (e != NULL) {
+        e->seen = 1;
+    }
+    if (delta->since >= 0 && mtime >= delta->since) {
+        return 1;
+    }
+    return delta->text != NULL && (e == NULL || e->size != size || e->mtime != mtime);
+}
+
+// Function to walk a store directory for an incremental dtar, writing the files with the extension that the delta wants
+// to list (NUL separated, for tar -T)
+void collect_tar_files(const char *dir_path, const char *relative, const char *ext, struct tar_delta *delta, FILE *list) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        // Files are matched by the end of their name, like find -name '*<ext>'
+        size_t name_len = strlen(entry->d_name), ext_len = strlen(ext);
+        char entry_path[1024], name[1024];
+        // Entries whose path does not fit are skipped rather than read under a truncated name
+        if (snprintf(entry_path, sizeof(entry_path), "%s/%s", dir_path, entry->d_name) >= (int)sizeof(entry_path)
+            || snprintf(name, sizeof(name), "%s%s", relative, entry->d_name) >= (int)sizeof(name)) {
+            continue;
+        }
+        struct stat entry_stat;
+        if (stat(entry_path, &entry_stat) != 0) {
+            continue;
+        }
+        if (S_ISDIR(entry_stat.st_mode)) {
+            char sub_relative[1024];
+            if (snprintf(sub_relative, sizeof(sub_relative), "%s/", name) < (int)sizeof(sub_relative)) {
+                collect_tar_files(entry_path, sub_relative, ext, delta, list);
+            }
+        } else if (S_ISREG(entry_stat.st_mode) && name_len >= ext_len && strcmp(entry->d_name + name_len - ext_len, ext) == 0
+                   && tar_delta_wants(delta, name, entry_stat.st_size, entry_stat.st_mtime)) {
+            fwrite(entry_path, 1, strlen(entry_path) + 1, list);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to add the new manifest and the files of the old one that are gone to an incremental tarball (created
+// if no file changed). Returns 0 on success
+int append_tar_delta(struct tar_delta *delta, const char *tar_path) {
+    char deleted_path[192], tar_cmd[1024];
+    snprintf(deleted_path, sizeof(deleted_path), "%s/.dfs_deleted.%s", delta->tmp_dir, delta->store);
+    FILE *deleted = fopen(deleted_path, "w");
+    if (deleted == NULL || fclose(delta->current) != 0) {
+        perror("Manifest creation failed");
+        if (deleted != NULL) {
+            fclose(deleted);
+        }
+        delta->current = NULL;
+        return -1;
+    }
+    delta->current = NULL;
+    for (int i = 0; i < delta->n_entries; i++) {
+        if (!delta->entries[i].seen) {
+            fprintf(deleted, "%s\n", delta->entries[i].path);
+        }
+    }
+    fclose(deleted);
+    snprintf(tar_cmd, sizeof(tar_cmd), "tar -rf %s -C %s .dfs_manifest.%s .dfs_deleted.%s 2>/dev/null", tar_path, delta->tmp_dir, delta->store, delta->store);
+    return system(tar_cmd) == 0 ? 0 : -1;
+}
+
+// Function to free an incremental dtar and remove its temporary directory
+void end_tar_delta(struct tar_delta *delta) {
+    if (delta->current != NULL) {
+        fclose(delta->current);
+        delta->current = NULL;
+    }
+    if (delta->tmp_dir[0] != '\0') {
+        char path[192];
+        snprintf(path, sizeof(path), "%s/.dfs_manifest.%s", delta->tmp_dir, delta->store);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/.dfs_deleted.%s", delta->tmp_dir, delta->store);
+        unlink(path);
+        rmdir(delta->tmp_dir);
+        delta->tmp_dir[0] = '\0';
+    }
+    free(delta->text);
+    free(delta->entries);
+    delta->text = NULL;
+    delta->entries = NULL;
+}
+
+// Function to read the version of the store that tarballs are cached at, -1 without a file index (nothing is cached)
+long long tree_generation() {
+    if (store->index == NULL) {
+        return -1;
+    }
+    index_lock();
+    long long generation = store->index->generation;
+    index_unlock();
+    return generation;
+}
+
+// Function to find the cached tarball of an extension built at a version of the store, "<ext>.<version>.<crc32c>.tar"
+// in the cache directory, copying its path and CRC32C. Returns 1 if there is one
+int tar_cache_lookup(const char *ext, long long generation, char *cached_path, size_t path_size, uint32_t *crc) {
+    DIR *dir = opendir(store->tar_cache_dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s.%lld.", ext + 1, generation);
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(dir)) != NULL) {
+        unsigned int value;
+        int consumed = 0;
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0 && sscanf(entry->d_name + prefix_len, "%8x.tar%n", &value, &consumed) == 1
+            && consumed == 12 && entry->d_name[prefix_len + consumed] == '\0') {
+            snprintf(cached_path, path_size, "%s/%s", store->tar_cache_dir, entry->d_name);
+            *crc = value;
+            found = 1;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+// Function to make a tarball built in the cache directory the cached one of its extension at a version of the store
+// and remove the older versions (a worker still sending one keeps reading its open file)
+void tar_cache_store(const char *built_path, const char *ext, long long generation, uint32_t crc) {
+    char cached_path[BUFSIZE];
+    snprintf(cached_path, sizeof(cached_path), "%s/%s.%lld.%08x.tar", store->tar_cache_dir, ext + 1, generation, crc);
+    if (rename(built_path, cached_path) < 0) {
+        perror("Tarball cache update failed");
+        unlink(built_path);
+        return;
+    }
+    DIR *dir = opendir(store->tar_cache_dir);
+    if (dir == NULL) {
+        return;
+    }
+    char prefix[64];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s.", ext + 1);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        long long version;
+        unsigned int value;
+        int consumed = 0;
+        if (strncmp(entry->d_name, prefix, prefix_len) == 0
+            && sscanf(entry->d_name + prefix_len, "%lld.%8x.tar%n", &version, &value, &consumed) == 2
+            && consumed > 0 && entry->d_name[prefix_len + consumed] == '\0' && version < generation) {
+            char old_path[BUFSIZE];
+            snprintf(old_path, sizeof(old_path), "%s/%s", store->tar_cache_dir, entry->d_name);
+            unlink(old_path);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to compute the CRC32C of an open file. Returns 0 on success
+int file_crc32c(int file_fd, uint32_t *crc) {
+    char buffer[BUFSIZE];
+    *crc = 0;
+    off_t position = 0;
+    ssize_t bytes_read;
+    while ((bytes_read = pread(file_fd, buffer, sizeof(buffer), position)) > 0) {
+        *crc = crc32c(*crc, buffer, bytes_read);
+        position += bytes_read;
+    }
+    return bytes_read < 0 ? -1 : 0;
+}
+
+// helper function to create path for this store by replacing smain with the store name
+char* create_store_path(const char *destination_path) {
+    // Pointer to store the position of "smain" in the path
+    char *pos;
+    // Calculate the size of the new path, the store name may be longer than "smain"
+    size_t new_path_size = strlen(destination_path) + strlen(store->name) + 1;
+    // Allocate memory for the new path 
+    char *new_path = malloc(new_path_size);
+
+    // Check if memory allocation was successful
+    if (new_path == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        // Return NULL if memory allocation fails
+        return NULL;
+    }
+
+    // Find the position of "smain" in the original path
+    pos = strstr(destination_path, "smain");
+    if (pos != NULL) {
+        // If "smain" is found, copy the part before "smain" into the new path
+        // Calculate the length of the prefix before "smain"
+        size_t prefix_len = pos - destination_path;
+        // Copy the prefix to the new path
+        strncpy(new_path, destination_path, prefix_len);
+        // Null-terminate the string
+        new_path[prefix_len] = '\0';
+
+        // Append the store name to new_path
+        strcat(new_path, store->name);
+
+        // Append the rest of the original path after "smain" to the new path
+        strcat(new_path, pos + strlen("smain"));
+    } else {
+        // If "smain" is not found, simply copy the original path to the new path
+        strcpy(new_path, destination_path);
+    }
+    // Return the newly created path
+    return new_path;
+}
+
+// Function to open the persistent file index of this store (~/.<store>_index) and trust it if it is still
+// valid, otherwise rebuild it by scanning ~/<store>; called before the first fork
+// Returns 0 when the index was loaded, 1 when it was rebuilt and -1 on failure
+int init_file_index() {
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+    snprintf(store->index_root, sizeof(store->index_root), "%s/%s", home_dir, store->name);
+    snprintf(store->tar_cache_dir, sizeof(store->tar_cache_dir), "%s/.%s_tarcache", home_dir, store->name);
+    if (mkdir(store->tar_cache_dir, 0755) < 0 && errno != EEXIST) {
+        perror("Tarball cache directory creation failed");
+        return -1;
+    }
+    char index_path[BUFSIZE];
+    snprintf(index_path, sizeof(index_path), "%s/.%s_index", home_dir, store->name);
+
+    // The index is a hash table kept at most half full, so lookups stay short
+    int capacity = 1;
+    while (capacity < 2 * INDEX_ENTRIES) {
+        capacity <<= 1;
+    }
+    size_t map_size = sizeof(struct file_index) + (size_t)capacity * sizeof(struct index_entry);
+    int fd = open(index_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Index file open failed");
+        return -1;
+    }
+
+    // The previous index is trusted if it has this layout, no process died while changing it and the machine was
+    // not restarted since (the mapping reaches the disk in the background)
+    char boot_id[40];
+    read_boot_id(boot_id, sizeof(boot_id));
+    struct file_index header;
+    struct stat index_stat;
+    int trusted = (fstat(fd, &index_stat) == 0 && index_stat.st_size == (off_t)map_size
+                   && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+                   && header.magic == INDEX_MAGIC && header.version == INDEX_VERSION
+                   && header.entry_size == sizeof(struct index_entry) && header.capacity == capacity
+                   && !header.dirty && header.lock == 0 && strcmp(header.boot_id, boot_id) == 0);
+    if (!trusted && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)map_size) < 0)) {
+        perror("Index file creation failed");
+        close(fd);
+        return -1;
+    }
+    store->index = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (store->index == MAP_FAILED) {
+        perror("Index mapping failed");
+        store->index = NULL;
+        return -1;
+    }
+    if (trusted) {
+        printf("File index: %d files loaded from %s\n", store->index->count, index_path);
+        return 0;
+    }
+
+    // Rebuild: the index stays dirty until it is complete, so an interrupted rebuild is redone at the next start
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    store->index->magic = INDEX_MAGIC;
+    store->index->version = INDEX_VERSION;
+    store->index->entry_size = sizeof(struct index_entry);
+    store->index->capacity = capacity;
+    store->index->dirty = 1;
+    store->index->complete = 1;
+    snprintf(store->index->boot_id, sizeof(store->index->boot_id), "%s", boot_id);
+    // A rebuilt index counts on from the time, so the tarballs cached at the versions of an earlier one are never used
+    store->index->generation = (long long)time(NULL) * 1000000;
+    if (scan_into_index() < 0) {
+        return -1;
+    }
+    store->index->dirty = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("File index: rebuilt with %d files in %lld ms%s\n", store->index->count,
+           (long long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000,
+           store->index->complete ? "" : ", some files did not fit");
+    return 1;
+}
+
+// Function to read the id of the current boot of the machine, empty if it is not available
+void read_boot_id(char *boot_id, size_t boot_id_size) {
+    boot_id[0] = '\0';
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (fp != NULL) {
+        if (fgets(boot_id, boot_id_size, fp) != NULL) {
+            boot_id[strcspn(boot_id, "\n")] = '\0';
+        }
+        fclose(fp);
+    }
+}
+
+// Function to add the files under ~/<store> to the index, with INDEX_SCAN_WORKERS processes that each
+// take a share of the top-level entries (and everything below them)
+int scan_into_index() {
+    pid_t workers[INDEX_SCAN_WORKERS];
+    int failed = 0;
+    for (int w = 0; w < INDEX_SCAN_WORKERS; w++) {
+        workers[w] = fork();
+        if (workers[w] == 0) {
+            scan_directory(store->index_root, w);
+            exit(0);
+        } else if (workers[w] < 0) {
+            perror("Index scan fork failed");
+            failed = 1;
+        }
+    }
+    for (int w = 0; w < INDEX_SCAN_WORKERS; w++) {
+        int status;
+        if (workers[w] > 0 && (waitpid(workers[w], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+            reclaim_index_lock(workers[w]);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "File index scan of %s failed\n", store->index_root);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add the regular files under a directory to the index, share >= 0 picks every
+// INDEX_SCAN_WORKERS-th entry of the directory (the top level of a parallel scan), -1 takes all
+void scan_directory(const char *dir_path, int share) {
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    int i = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (share >= 0 && i++ % INDEX_SCAN_WORKERS != share) {
+            continue;
+        }
+        char path[BUFSIZE];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+        struct stat file_stat;
+        if (lstat(path, &file_stat) < 0) {
+            continue;
+        }
+        if (S_ISDIR(file_stat.st_mode)) {
+            scan_directory(path, -1);
+        } else if (S_ISREG(file_stat.st_mode)) {
+            index_store_file(path, &file_stat, 0, -1);
+        }
+    }
+    closedir(dir);
+}
+
+// Function to find the index entry of a file, call with the index lock held
+// With insert, a path that is not indexed gets the free slot its entry would go into (state not INDEX_SLOT_USED);
+// NULL when the file is not indexed (or the table has no room)
+struct index_entry *index_lookup(const char *path, int insert) {
+    uint32_t mask = (uint32_t)store->index->capacity - 1;
+    uint32_t i = (uint32_t)strong_hash(FNV_OFFSET, (const unsigned char *)path, strlen(path)) & mask;
+    struct index_entry *slot = NULL;
+    for (int probes = 0; probes < store->index->capacity; probes++, i = (i + 1) & mask) {
+        struct index_entry *e = &store->index->entries[i];
+        if (e->state == INDEX_SLOT_FREE) {
+            if (slot == NULL) {
+                slot = e;
+            }
+            break;
+        }
+        if (e->state == INDEX_SLOT_REMOVED) {
+            // Removed entries keep the probe chains intact, the first one can be reused by an insert
+            if (slot == NULL) {
+                slot = e;
+            }
+        } else if (strcmp(e->path, path) == 0) {
+            return e;
+        }
+    }
+    return insert ? slot : NULL;
+}
+
+// Function to rebuild the index without its removed entries once they make the probe chains long,
+// call with the index lock held
+void index_rehash() {
+    struct index_entry *live = malloc((size_t)(store->index->count > 0 ? store->index->count : 1) * sizeof(struct index_entry));
+    if (live == NULL) {
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < store->index->capacity; i++) {
+        if (store->index->entries[i].state == INDEX_SLOT_USED) {
+            live[n++] = store->index->entries[i];
+        }
+    }
+    memset(store->index->entries, 0, (size_t)store->index->capacity * sizeof(struct index_entry));
+    store->index->removed = 0;
+    for (int i = 0; i < n; i++) {
+        *index_lookup(live[i].path, 1) = live[i];
+    }
+    free(live);
+}
+
+// Function to turn a path into its index key, with repeated slashes collapsed ("/home/u//smain/a.c" is /home/u/smain/a.c)
+void index_key(const char *path, char *key, size_t key_size) {
+    size_t len = 0;
+    for (; *path != '\0' && len < key_size - 1; path++) {
+        if (*path != '/' || len == 0 || key[len - 1] != '/') {
+            key[len++] = *path;
+        }
+    }
+    key[len] = '\0';
+}
+
+// Function to look a file of this store up in the index, copying its entry to found (when not NULL)
+// Returns 1 if it is indexed, 0 if it does not exist, -1 if the index cannot tell (not a file under
+// ~/<store>, a path too long for the index, or some files did not fit) and the file system has to be asked
+int index_get(const char *path, struct index_entry *found) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    size_t root_len = strlen(store->index_root);
+    if (store->index == NULL || strncmp(full_path, store->index_root, root_len) != 0 || full_path[root_len] != '/'
+        || strlen(full_path) >= INDEX_PATH_MAX) {
+        return -1;
+    }
+    index_lock();
+    struct index_entry *e = index_lookup(full_path, 0);
+    int result = (e != NULL) ? 1 : (store->index->complete ? 0 : -1);
+    if (e != NULL && found != NULL) {
+        *found = *e;
+    }
+    index_unlock();
+    return result;
+}
+
+// Function to record a file that was just written under ~/<store>, with the hash of its contents (0 if unknown)
+// and the CRC32C it was uploaded with (-1 if unknown)
+void index_store_file(const char *path, const struct stat *file_stat, uint64_t hash, long long crc) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    size_t root_len = strlen(store->index_root);
+    if (store->index == NULL || strncmp(full_path, store->index_root, root_len) != 0 || full_path[root_len] != '/'
+        || strlen(full_path) >= INDEX_PATH_MAX) {
+        return;
+    }
+    index_lock();
+    store->index->generation++;
+    struct index_entry *e = index_lookup(full_path, 1);
+    if (e != NULL && e->state != INDEX_SLOT_USED && store->index->count + store->index->removed + 1 > store->index->capacity * 3 / 4) {
+        index_rehash();
+        e = index_lookup(full_path, 1);
+    }
+    if (e == NULL || (e->state != INDEX_SLOT_USED && store->index->count >= INDEX_ENTRIES)) {
+        // Lookups that miss have to ask the file system from now on
+        store->index->complete = 0;
+    } else {
+        if (e->state != INDEX_SLOT_USED) {
+            if (e->state == INDEX_SLOT_REMOVED) {
+                store->index->removed--;
+            }
+            snprintf(e->path, sizeof(e->path), "%s", full_path);
+            e->state = INDEX_SLOT_USED;
+            e->doc_id = -1;
+            store->index->count++;
+        }
+        e->size = (long long)file_stat->st_size;
+        e->mtime_ns = (long long)file_stat->st_mtim.tv_sec * 1000000000LL + file_stat->st_mtim.tv_nsec;
+        e->hash = hash;
+        e->crc = crc;
+    }
+    index_unlock();
+}
+
+// Function to remove a file that was just deleted from the index
+void index_forget(const char *path) {
+    // Index keys have no repeated slashes, whichever way the path was put together
+    char full_path[BUFSIZE];
+    index_key(path, full_path, sizeof(full_path));
+    if (store->index == NULL) {
+        return;
+    }
+    index_lock();
+    store->index->generation++;
+    struct index_entry *e = index_lookup(full_path, 0);
+    if (e != NULL) {
+        e->state = INDEX_SLOT_REMOVED;
+        store->index->count--;
+        store->index->removed++;
+    }
+    index_unlock();
+}
+
+// Function to fill in the stat of an indexed file: its size and modification time (which give its version tag)
+void index_entry_stat(const struct index_entry *e, struct stat *file_stat) {
+    memset(file_stat, 0, sizeof(*file_stat));
+    file_stat->st_size = e->size;
+    file_stat->st_mtim.tv_sec = e->mtime_ns / 1000000000LL;
+    file_stat->st_mtim.tv_nsec = e->mtime_ns % 1000000000LL;
+}
+
+// Function to take the index lock, shared by all Sstore processes (the holder's pid, 0 when free)
+void index_lock() {
+    pid_t self = getpid();
+    useconds_t backoff = 50;
+    pid_t expected = 0;
+    while (!__atomic_compare_exchange_n(&store->index->lock, &expected, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        expected = 0;
+        usleep(backoff);
+        if (backoff < 2000) {
+            backoff *= 2;
+        }
+    }
+}
+
+// Function to give the index lock back
+void index_unlock() {
+    __atomic_store_n(&store->index->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Function used by the parent to free the index locks a child that exited (or crashed) was holding
+// The child may have left an entry half written, so the index is rebuilt at the next start
+void reclaim_index_lock(pid_t pid) {
+    for (int i = 0; i < n_stores; i++) {
+        struct file_index *index = stores[i].index;
+        pid_t expected = pid;
+        if (index != NULL && __atomic_compare_exchange_n(&index->lock, &expected, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            printf("Process %d died holding the file index lock of %s, the index will be rebuilt at the next start\n",
+                   (int)pid, stores[i].name);
+            index->dirty = 1;
+        }
+    }
+}
+
+// Function to check whether a byte belongs to a term: ASCII letters and digits
+static int is_term_char(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+static int compare_terms(const void *a, const void *b) {
+    return strcmp((const char *)a, (const char *)b);
+}
+
+// Function to split text into its terms: runs of ASCII letters and digits, lowercased, of 2 to TERM_MAX - 1
+// characters (longer runs are skipped). The distinct terms are written sorted and NUL-terminated one after the
+// other into a malloc'ed buffer. Returns the number of terms, -1 if no memory is left
+int tokenize_terms(const char *data, size_t len, char **terms, size_t *terms_len) {
+    // The distinct terms are collected in an open-addressed hash set of TERM_MAX byte slots
+    size_t capacity = 1024, count = 0;
+    char *slots = calloc(capacity, TERM_MAX);
+    if (slots == NULL) {
+        return -1;
+    }
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && !is_term_char(data[i])) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && is_term_char(data[i])) {
+            i++;
+        }
+        size_t term_len = i - start;
+        if (term_len < 2 || term_len >= TERM_MAX) {
+            continue;
+        }
+        char term[TERM_MAX];
+        for (size_t k = 0; k < term_len; k++) {
+            term[k] = data[start + k] | ((data[start + k] >= 'A' && data[start + k] <= 'Z') ? 0x20 : 0);
+        }
+        term[term_len] = '\0';
+
+        // Keep the set at most half full, growing it by rehashing into twice the slots
+        if (2 * (count + 1) > capacity) {
+            char *grown = calloc(2 * capacity, TERM_MAX);
+            if (grown == NULL) {
+                free(slots);
+                return -1;
+            }
+            for (size_t s = 0; s < capacity; s++) {
+                char *old = slots + s * TERM_MAX;
+                if (old[0] != '\0') {
+                    size_t h = strong_hash(FNV_OFFSET, (const unsigned char *)old, strlen(old)) & (2 * capacity - 1);
+                    while (grown[h * TERM_MAX] != '\0') {
+                        h = (h + 1) & (2 * capacity - 1);
+                    }
+                    memcpy(grown + h * TERM_MAX, old, TERM_MAX);
+                }
+            }
+            free(slots);
+            slots = grown;
+            capacity *= 2;
+        }
+        size_t h = strong_hash(FNV_OFFSET, (const unsigned char *)term, term_len) & (capacity - 1);
+        while (slots[h * TERM_MAX] != '\0' && strcmp(slots + h * TERM_MAX, term) != 0) {
+            h = (h + 1) & (capacity - 1);
+        }
+        if (slots[h * TERM_MAX] == '\0') {
+            memcpy(slots + h * TERM_MAX, term, term_len + 1);
+            count++;
+        }
+    }
+
+    // Move the terms to the front, sort them and pack them
+    size_t n = 0, packed_len = 0;
+    for (size_t s = 0; s < capacity; s++) {
+        if (slots[s * TERM_MAX] != '\0') {
+            memmove(slots + n * TERM_MAX, slots + s * TERM_MAX, TERM_MAX);
+            packed_len += strlen(slots + n * TERM_MAX) + 1;
+            n++;
+        }
+    }
+    qsort(slots, n, TERM_MAX, compare_terms);
+    *terms = malloc(packed_len > 0 ? packed_len : 1);
+    if (*terms == NULL) {
+        free(slots);
+        return -1;
+    }
+    *terms_len = 0;
+    for (size_t s = 0; s < n; s++) {
+        size_t term_len = strlen(slots + s * TERM_MAX) + 1;
+        memcpy(*terms + *terms_len, slots + s * TERM_MAX, term_len);
+        *terms_len += term_len;
+    }
+    free(slots);
+    return (int)n;
+}
+
+// Function to build the path of a file of this store's term index
+void term_index_path(const char *name, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%s", store->terms_dir, name);
+}
+
+// Function to take the term index lock of this store, LOCK_SH for queries and LOCK_EX for changes
+// Returns the descriptor to close to give it back, -1 on failure. The kernel gives the lock of a process that
+// died back on its own, so a crashed worker never leaves it taken.
+int term_index_lock(int operation) {
+    char lock_path[1024];
+    term_index_path("lock", lock_path, sizeof(lock_path));
+    int fd = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Term index lock open failed");
+        return -1;
+    }
+    while (flock(fd, operation) < 0) {
+        if (errno != EINTR) {
+            perror("Term index lock failed");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Function to mark a document as deleted, its postings are dropped at the next merge; call with the lock held
+void term_doc_kill(long long doc_id) {
+    char docs_path[1024];
+    term_index_path("docs", docs_path, sizeof(docs_path));
+    int fd = open(docs_path, O_WRONLY);
+    int32_t dead = 0;
+    if (fd < 0 || pwrite(fd, &dead, sizeof(dead), doc_id * (off_t)sizeof(struct term_doc) + offsetof(struct term_doc, live)) != sizeof(dead)) {
+        perror("Term index document update failed");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Function to map the document table of the term index read-only, *n_docs is set to its number of documents
+// Returns NULL when there are none (or it cannot be mapped)
+struct term_doc *term_map_docs(long long *n_docs) {
+    char docs_path[1024];
+    term_index_path("docs", docs_path, sizeof(docs_path));
+    *n_docs = 0;
+    int fd = open(docs_path, O_RDONLY);
+    struct stat docs_stat;
+    if (fd < 0 || fstat(fd, &docs_stat) < 0 || docs_stat.st_size < (off_t)sizeof(struct term_doc)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    *n_docs = docs_stat.st_size / (off_t)sizeof(struct term_doc);
+    struct term_doc *docs = mmap(NULL, *n_docs * sizeof(struct term_doc), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (docs == MAP_FAILED) {
+        *n_docs = 0;
+        return NULL;
+    }
+    return docs;
+}
+
+// Function to record the terms of a text file of this store that was just written: it becomes a new document
+// (the file's previous one, if any, is marked deleted) and its terms are appended to the update log, which is
+// turned into a segment once it is larger than TERM_LOG_MAX. Files without an entry in the file index, and files
+// other than TERM_INDEX_EXT ones, are not indexed.
+void term_index_add(const char *path, const char *data, size_t len) {
+    const char *dot = strrchr(path, '.');
+    struct index_entry found;
+    if (store->terms_dir[0] == '\0' || dot == NULL || strcmp(dot, TERM_INDEX_EXT) != 0 || index_get(path, &found) != 1) {
+        return;
+    }
+    char *terms;
+    size_t terms_len;
+    int n_terms = tokenize_terms(data, len, &terms, &terms_len);
+    if (n_terms < 0) {
+        perror("Term index tokenizing failed");
+        return;
+    }
+    int lock_fd = term_index_lock(LOCK_EX);
+    if (lock_fd < 0) {
+        free(terms);
+        return;
+    }
+
+    // The file's document id is read again under the lock, another worker may have just replaced it
+    char docs_path[1024], log_path[1024];
+    term_index_path("docs", docs_path, sizeof(docs_path));
+    term_index_path("log", log_path, sizeof(log_path));
+    int docs_fd = open(docs_path, O_RDWR | O_CREAT, 0644);
+    int log_fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    struct stat docs_stat, log_stat;
+    if (index_get(path, &found) == 1 && docs_fd >= 0 && log_fd >= 0 && fstat(docs_fd, &docs_stat) == 0) {
+        if (found.doc_id >= 0) {
+            term_doc_kill(found.doc_id);
+        }
+        struct term_doc doc;
+        memset(&doc, 0, sizeof(doc));
+        snprintf(doc.path, sizeof(doc.path), "%s", found.path);
+        doc.live = 1;
+        long long doc_id = docs_stat.st_size / (off_t)sizeof(struct term_doc);
+        struct term_log_record record = { TERM_MAGIC, (uint32_t)doc_id, (uint32_t)terms_len };
+        if (pwrite(docs_fd, &doc, sizeof(doc), doc_id * (off_t)sizeof(struct term_doc)) != sizeof(doc)
+            || write(log_fd, &record, sizeof(record)) != sizeof(record) || write(log_fd, terms, terms_len) != (ssize_t)terms_len) {
+            perror("Term index update failed");
+        } else {
+            index_set_doc(found.path, doc_id);
+        }
+        if (fstat(log_fd, &log_stat) == 0 && log_stat.st_size > TERM_LOG_MAX) {
+            term_flush_log();
+        }
+    } else {
+        perror("Term index open failed");
+    }
+    if (docs_fd >= 0) {
+        close(docs_fd);
+    }
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    close(lock_fd);
+    free(terms);
+}
+
+// Function to index the terms of a file of this store that is already on disk
+void term_index_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    char *data = file_stat.st_size > 0 ? mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    term_index_add(path, data, data != NULL ? (size_t)file_stat.st_size : 0);
+    if (data != NULL) {
+        munmap(data, file_stat.st_size);
+    }
+}
+
+// Function to drop a file of this store that is being deleted from the term index, before it leaves the file index
+void term_index_remove(const char *path) {
+    struct index_entry found;
+    if (store->terms_dir[0] == '\0' || index_get(path, &found) != 1 || found.doc_id < 0) {
+        return;
+    }
+    // The document id is read again under the lock, a merge may have renumbered the documents meanwhile
+    int lock_fd = term_index_lock(LOCK_EX);
+    if (lock_fd >= 0) {
+        if (index_get(path, &found) == 1 && found.doc_id >= 0) {
+            term_doc_kill(found.doc_id);
+        }
+        close(lock_fd);
+    }
+}
+
+// Function to open a segment of the term index by its number, mapping it read-only; returns -1 if it is not valid
+int term_segment_open(int number, struct term_segment *seg) {
+    char name[32], path[1024];
+    snprintf(name, sizeof(name), "seg.%d", number);
+    term_index_path(name, path, sizeof(path));
+    memset(seg, 0, sizeof(*seg));
+    int fd = open(path, O_RDONLY);
+    struct stat seg_stat;
+    if (fd < 0 || fstat(fd, &seg_stat) < 0 || seg_stat.st_size < (off_t)sizeof(struct term_segment_header)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    seg->size = seg_stat.st_size;
+    seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        return -1;
+    }
+    const struct term_segment_header *header = seg->map;
+    if (header->magic != TERM_MAGIC || header->table_offset > seg->size
+        || (seg->size - header->table_offset) / sizeof(struct term_entry) < header->n_terms) {
+        printf("Term index segment %s is damaged, skipping it\n", path);
+        munmap(seg->map, seg->size);
+        seg->map = NULL;
+        return -1;
+    }
+    seg->n_terms = header->n_terms;
+    seg->table = (const struct term_entry *)((const char *)seg->map + header->table_offset);
+    return 0;
+}
+
+void term_segment_close(struct term_segment *seg) {
+    if (seg->map != NULL) {
+        munmap(seg->map, seg->size);
+        seg->map = NULL;
+    }
+}
+
+static int compare_doc_ids(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_ints(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to list the numbers of the segments of the term index, oldest first (at most max)
+int term_list_segments(int *numbers, int max) {
+    DIR *dir = opendir(store->terms_dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && n < max) {
+        int number;
+        char rest;
+        if (sscanf(entry->d_name, "seg.%d%c", &number, &rest) == 1) {
+            numbers[n++] = number;
+        }
+    }
+    closedir(dir);
+    qsort(numbers, n, sizeof(int), compare_ints);
+    return n;
+}
+
+// Function to find a term in a segment by binary search of its sorted term table, NULL if it is not there
+const struct term_entry *term_segment_find(const struct term_segment *seg, const char *term) {
+    uint32_t low = 0, high = seg->n_terms;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int cmp = strncmp(seg->table[mid].term, term, TERM_MAX);
+        if (cmp == 0) {
+            return &seg->table[mid];
+        } else if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+// Function to decode the posting list of a term into ids (room for entry->count of them): each id is stored as
+// its difference to the one before, in 7-bit groups with the high bit set on all but the last. Returns the count.
+uint32_t term_decode_postings(const struct term_segment *seg, const struct term_entry *entry, uint32_t *ids) {
+    const unsigned char *p = (const unsigned char *)seg->map + entry->offset;
+    const unsigned char *end = p + entry->length;
+    if (entry->offset > seg->size || entry->length > seg->size - entry->offset) {
+        return 0;
+    }
+    uint32_t n = 0, id = 0;
+    while (p < end && n < entry->count) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (p < end && shift < 35) {
+            delta |= (uint32_t)(*p & 0x7f) << shift;
+            shift += 7;
+            if ((*p++ & 0x80) == 0) {
+                break;
+            }
+        }
+        id += delta;
+        ids[n++] = id;
+    }
+    return n;
+}
+
+// Function to start writing a new segment into a temporary file, the terms have to be added in sorted order
+int term_writer_begin(struct term_writer *w) {
+    memset(w, 0, sizeof(*w));
+    term_index_path("seg.tmp", w->path, sizeof(w->path));
+    w->fp = fopen(w->path, "w");
+    if (w->fp == NULL) {
+        perror("Term index segment creation failed");
+        return -1;
+    }
+    // The header is written again with the real values once the term table is in place
+    struct term_segment_header header = { TERM_MAGIC, 0, 0 };
+    fwrite(&header, sizeof(header), 1, w->fp);
+    w->pos = sizeof(header);
+    return 0;
+}
+
+// Function to add a term with its sorted doc ids to a new segment, leaving out the deleted documents (docs is NULL
+// when the ids are known to be live)
+int term_writer_add(struct term_writer *w, const char *term, const uint32_t *ids, uint32_t n, const struct term_doc *docs, long long n_docs) {
+    if (w->n_terms == w->capacity) {
+        size_t capacity = w->capacity > 0 ? w->capacity * 2 : 1024;
+        struct term_entry *grown = realloc(w->table, capacity * sizeof(struct term_entry));
+        if (grown == NULL) {
+            return -1;
+        }
+        w->table = grown;
+        w->capacity = capacity;
+    }
+    struct term_entry *entry = &w->table[w->n_terms];
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->term, sizeof(entry->term), "%s", term);
+    entry->offset = w->pos;
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if ((docs != NULL && (ids[i] >= n_docs || !docs[ids[i]].live)) || (entry->count > 0 && ids[i] == previous)) {
+            continue;
+        }
+        unsigned char bytes[5];
+        int len = 0;
+        uint32_t delta = ids[i] - previous;
+        do {
+            bytes[len] = delta & 0x7f;
+            delta >>= 7;
+            if (delta != 0) {
+                bytes[len] |= 0x80;
+            }
+            len++;
+        } while (delta != 0);
+        fwrite(bytes, 1, len, w->fp);
+        w->pos += len;
+        entry->length += len;
+        entry->count++;
+        previous = ids[i];
+    }
+    // A term left without documents is not kept
+    if (entry->count > 0) {
+        w->n_terms++;
+    }
+    return 0;
+}
+
+// Function to finish a new segment: the term table goes after the postings, and the segment is renamed into place
+// as number `number`. Returns -1 (and removes the temporary file) on failure.
+int term_writer_finish(struct term_writer *w, int number) {
+    struct term_segment_header header = { TERM_MAGIC, w->n_terms, (uint64_t)w->pos };
+    int ok = fwrite(w->table, sizeof(struct term_entry), w->n_terms, w->fp) == w->n_terms
+             && fseek(w->fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, w->fp) == 1
+             && fflush(w->fp) == 0 && fsync(fileno(w->fp)) == 0;
+    ok = (fclose(w->fp) == 0) && ok;
+    free(w->table);
+    char name[32], path[1024];
+    snprintf(name, sizeof(name), "seg.%d", number);
+    term_index_path(name, path, sizeof(path));
+    if (!ok || rename(w->path, path) < 0) {
+        perror("Term index segment write failed");
+        unlink(w->path);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_term_postings(const void *a, const void *b) {
+    const struct term_posting *x = a, *y = b;
+    int cmp = strcmp(x->term, y->term);
+    return cmp != 0 ? cmp : (x->doc_id > y->doc_id) - (x->doc_id < y->doc_id);
+}
+
+// Function to turn the update log into a new segment and empty it, merging all segments into one once there are
+// more than TERM_MAX_SEGMENTS; call with the term index lock taken with LOCK_EX
+void term_flush_log() {
+    char log_path[1024];
+    term_index_path("log", log_path, sizeof(log_path));
+    int log_fd = open(log_path, O_RDWR);
+    struct stat log_stat;
+    if (log_fd < 0 || fstat(log_fd, &log_stat) < 0 || log_stat.st_size == 0) {
+        if (log_fd >= 0) {
+            close(log_fd);
+        }
+        return;
+    }
+    char *log = mmap(NULL, log_stat.st_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+    long long n_docs;
+    struct term_doc *docs = term_map_docs(&n_docs);
+    if (log == MAP_FAILED || docs == NULL) {
+        perror("Term index log mapping failed");
+        if (log != MAP_FAILED) {
+            munmap(log, log_stat.st_size);
+        }
+        close(log_fd);
+        return;
+    }
+
+    // Every (term, document) pair of the log, sorted by term and then document
+    size_t n_pairs = 0;
+    for (size_t pos = 0; pos + sizeof(struct term_log_record) <= (size_t)log_stat.st_size; ) {
+        const struct term_log_record *record = (const struct term_log_record *)(log + pos);
+        const char *terms = log + pos + sizeof(*record);
+        if (record->magic != TERM_MAGIC || record->length > log_stat.st_size - pos - sizeof(*record)) {
+            break;
+        }
+        for (size_t t = 0; t < record->length; t += strlen(terms + t) + 1) {
+            n_pairs++;
+        }
+        pos += sizeof(*record) + record->length;
+    }
+    struct term_posting *pairs = malloc((n_pairs > 0 ? n_pairs : 1) * sizeof(struct term_posting));
+    uint32_t *ids = malloc((n_pairs > 0 ? n_pairs : 1) * sizeof(uint32_t));
+    struct term_writer w;
+    int numbers[TERM_MAX_SEGMENTS * 2];
+    int n_segments = term_list_segments(numbers, TERM_MAX_SEGMENTS * 2);
+    int flushed = 0;
+    if (pairs != NULL && ids != NULL && term_writer_begin(&w) == 0) {
+        size_t n = 0;
+        for (size_t pos = 0; n < n_pairs; ) {
+            const struct term_log_record *record = (const struct term_log_record *)(log + pos);
+            const char *terms = log + pos + sizeof(*record);
+            for (size_t t = 0; t < record->length; t += strlen(terms + t) + 1) {
+                pairs[n].term = terms + t;
+                pairs[n++].doc_id = record->doc_id;
+            }
+            pos += sizeof(*record) + record->length;
+        }
+        qsort(pairs, n_pairs, sizeof(struct term_posting), compare_term_postings);
+        for (size_t i = 0; i < n_pairs; ) {
+            size_t j = i;
+            while (j < n_pairs && strcmp(pairs[j].term, pairs[i].term) == 0) {
+                ids[j - i] = pairs[j].doc_id;
+                j++;
+            }
+            term_writer_add(&w, pairs[i].term, ids, (uint32_t)(j - i), docs, n_docs);
+            i = j;
+        }
+        flushed = term_writer_finish(&w, n_segments > 0 ? numbers[n_segments - 1] + 1 : 1) == 0;
+    }
+    free(pairs);
+    free(ids);
+    munmap(log, log_stat.st_size);
+    munmap(docs, n_docs * sizeof(struct term_doc));
+
+    // The log is only emptied once its segment is in place; a query in between finds the terms twice, which the
+    // union of the posting lists absorbs
+    if (flushed && ftruncate(log_fd, 0) < 0) {
+        perror("Term index log truncation failed");
+    }
+    close(log_fd);
+    if (flushed && n_segments + 1 > TERM_MAX_SEGMENTS) {
+        term_merge_segments();
+    }
+}
+
+// Function to merge all segments of the term index into one, dropping deleted documents: the term tables are
+// walked together in sorted order and the posting lists of each term are combined. A segment that cannot be read
+// is left in place. When every segment was merged and the log is empty, the merged segment holds the only
+// references to the documents, so the document table is compacted: the live documents are numbered again from 0
+// and the deleted ones dropped, which keeps the table (and the 32-bit ids) from growing with every upload.
+// Call with LOCK_EX held
+void term_merge_segments() {
+    int numbers[TERM_MAX_SEGMENTS * 2];
+    int n_segments = term_list_segments(numbers, TERM_MAX_SEGMENTS * 2);
+    struct term_segment segs[TERM_MAX_SEGMENTS * 2];
+    uint32_t cursors[TERM_MAX_SEGMENTS * 2];
+    long long n_docs;
+    struct term_doc *docs = term_map_docs(&n_docs);
+    if (n_segments < 2 || docs == NULL) {
+        if (docs != NULL) {
+            munmap(docs, n_docs * sizeof(struct term_doc));
+        }
+        return;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int unreadable = 0;
+    for (int s = 0; s < n_segments; s++) {
+        if (term_segment_open(numbers[s], &segs[s]) < 0) {
+            unreadable++;
+        }
+        cursors[s] = 0;
+    }
+    if (n_segments - unreadable < 2) {
+        for (int s = 0; s < n_segments; s++) {
+            term_segment_close(&segs[s]);
+        }
+        munmap(docs, n_docs * sizeof(struct term_doc));
+        return;
+    }
+
+    // The new id of every document (UINT32_MAX for deleted ones), and the compacted table written beside the old one
+    char log_path[1024], docs_path[1024], compact_path[1024];
+    term_index_path("log", log_path, sizeof(log_path));
+    term_index_path("docs", docs_path, sizeof(docs_path));
+    term_index_path("docs.tmp", compact_path, sizeof(compact_path));
+    struct stat log_stat;
+    uint32_t *renumber = NULL;
+    long long n_live = 0;
+    if (unreadable == 0 && (stat(log_path, &log_stat) < 0 || log_stat.st_size == 0)) {
+        renumber = malloc((size_t)n_docs * sizeof(uint32_t));
+        FILE *compact = renumber != NULL ? fopen(compact_path, "w") : NULL;
+        int written = compact != NULL;
+        for (long long id = 0; written && id < n_docs; id++) {
+            renumber[id] = docs[id].live ? (uint32_t)n_live++ : UINT32_MAX;
+            written = !docs[id].live || fwrite(&docs[id], sizeof(struct term_doc), 1, compact) == 1;
+        }
+        if (compact != NULL) {
+            written = fflush(compact) == 0 && fsync(fileno(compact)) == 0 && written;
+            written = fclose(compact) == 0 && written;
+        }
+        if (!written) {
+            // Merge without compacting
+            perror("Term index document table compaction failed");
+            unlink(compact_path);
+            free(renumber);
+            renumber = NULL;
+        }
+    }
+
+    struct term_writer w;
+    int ok = term_writer_begin(&w) == 0;
+    size_t ids_capacity = 0;
+    uint32_t *ids = NULL;
+    while (ok) {
+        // The smallest term any segment is at comes next
+        const char *term = NULL;
+        size_t total = 0;
+        for (int s = 0; s < n_segments; s++) {
+            if (segs[s].map != NULL && cursors[s] < segs[s].n_terms
+                && (term == NULL || strncmp(segs[s].table[cursors[s]].term, term, TERM_MAX) < 0)) {
+                term = segs[s].table[cursors[s]].term;
+            }
+        }
+        if (term == NULL) {
+            break;
+        }
+        for (int s = 0; s < n_segments; s++) {
+            if (segs[s].map != NULL && cursors[s] < segs[s].n_terms && strncmp(segs[s].table[cursors[s]].term, term, TERM_MAX) == 0) {
+                total += segs[s].table[cursors[s]].count;
+            }
+        }
+        if (total > ids_capacity) {
+            uint32_t *grown = realloc(ids, total * sizeof(uint32_t));
+            if (grown == NULL) {
+                ok = 0;
+                break;
+            }
+            ids = grown;
+            ids_capacity = total;
+        }
+        char current[TERM_MAX];
+        snprintf(current, sizeof(current), "%.*s", TERM_MAX - 1, term);
+        uint32_t n = 0;
+        for (int s = 0; s < n_segments; s++) {
+            if (segs[s].map != NULL && cursors[s] < segs[s].n_terms && strncmp(segs[s].table[cursors[s]].term, current, TERM_MAX) == 0) {
+                n += term_decode_postings(&segs[s], &segs[s].table[cursors[s]], ids + n);
+                cursors[s]++;
+            }
+        }
+        qsort(ids, n, sizeof(uint32_t), compare_doc_ids);
+        if (renumber != NULL) {
+            // Renumbering keeps the order of the ids, the deleted documents are left out here
+            uint32_t live = 0;
+            for (uint32_t i = 0; i < n; i++) {
+                if (ids[i] < n_docs && renumber[ids[i]] != UINT32_MAX) {
+                    ids[live++] = renumber[ids[i]];
+                }
+            }
+            n = live;
+        }
+        ok = term_writer_add(&w, current, ids, n, renumber != NULL ? NULL : docs, n_docs) == 0;
+    }
+    free(ids);
+    if (ok) {
+        ok = term_writer_finish(&w, numbers[n_segments - 1] + 1) == 0;
+    } else if (w.fp != NULL) {
+        fclose(w.fp);
+        free(w.table);
+        unlink(w.path);
+    }
+
+    // The compacted table replaces the old one together with the merged segment, and the files get their new ids
+    if (renumber != NULL && ok && rename(compact_path, docs_path) == 0) {
+        index_lock();
+        for (int i = 0; store->index != NULL && i < store->index->capacity; i++) {
+            struct index_entry *e = &store->index->entries[i];
+            if (e->state == INDEX_SLOT_USED && e->doc_id >= 0) {
+                e->doc_id = (e->doc_id < n_docs && renumber[e->doc_id] != UINT32_MAX) ? (long long)renumber[e->doc_id] : -1;
+            }
+        }
+        index_unlock();
+        printf("Term index: %lld of %lld documents of %s kept\n", n_live, n_docs, store->name);
+    } else if (renumber != NULL) {
+        unlink(compact_path);
+    }
+    free(renumber);
+
+    // Queries that still have the old segments mapped keep reading them until they unmap them; a segment that could
+    // not be read was not merged and stays
+    for (int s = 0; s < n_segments; s++) {
+        if (ok && segs[s].map != NULL) {
+            char name[32], path[1024];
+            snprintf(name, sizeof(name), "seg.%d", numbers[s]);
+            term_index_path(name, path, sizeof(path));
+            unlink(path);
+        }
+        term_segment_close(&segs[s]);
+    }
+    munmap(docs, n_docs * sizeof(struct term_doc));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Term index: merged %d segments of %s in %lld ms\n", n_segments, store->name,
+           (long long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+// Function to collect the documents containing a term from the segments and the update log, as a sorted array of
+// distinct doc ids in *ids (malloc'ed). Returns the count, -1 if no memory is left
+long long term_lookup(const char *term, const struct term_segment *segs, int n_segments, const char *log, size_t log_len, uint32_t **ids) {
+    size_t total = 0;
+    for (int s = 0; s < n_segments; s++) {
+        const struct term_entry *entry = segs[s].map != NULL ? term_segment_find(&segs[s], term) : NULL;
+        total += entry != NULL ? entry->count : 0;
+    }
+    size_t log_hits = 0;
+    for (size_t pos = 0; pos + sizeof(struct term_log_record) <= log_len; ) {
+        const struct term_log_record *record = (const struct term_log_record *)(log + pos);
+        if (record->magic != TERM_MAGIC || record->length > log_len - pos - sizeof(*record)) {
+            break;
+        }
+        log_hits++;
+        pos += sizeof(*record) + record->length;
+    }
+    *ids = malloc((total + log_hits > 0 ? total + log_hits : 1) * sizeof(uint32_t));
+    if (*ids == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (int s = 0; s < n_segments; s++) {
+        const struct term_entry *entry = segs[s].map != NULL ? term_segment_find(&segs[s], term) : NULL;
+        if (entry != NULL) {
+            n += term_decode_postings(&segs[s], entry, *ids + n);
+        }
+    }
+    // The terms of a log record are sorted, so the scan of a record stops at the first larger one
+    for (size_t pos = 0; pos + sizeof(struct term_log_record) <= log_len; ) {
+        const struct term_log_record *record = (const struct term_log_record *)(log + pos);
+        const char *terms = log + pos + sizeof(*record);
+        if (record->magic != TERM_MAGIC || record->length > log_len - pos - sizeof(*record)) {
+            break;
+        }
+        for (size_t t = 0; t < record->length; t += strlen(terms + t) + 1) {
+            int cmp = strcmp(terms + t, term);
+            if (cmp >= 0) {
+                if (cmp == 0) {
+                    (*ids)[n++] = record->doc_id;
+                }
+                break;
+            }
+        }
+        pos += sizeof(*record) + record->length;
+    }
+    qsort(*ids, n, sizeof(uint32_t), compare_doc_ids);
+    size_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (distinct == 0 || (*ids)[i] != (*ids)[distinct - 1]) {
+            (*ids)[distinct++] = (*ids)[i];
+        }
+    }
+    return (long long)distinct;
+}
+
+// function to handle the 'query' command, "query <dir> <word> [word ...]": the files of this store below the
+// directory that contain every word are looked up in the term index and listed relative to the directory, without
+// reading any file. The words are split into terms the way the files are.
+void handle_query(int client_sock, char *command) {
+    // Buffer to store the directory path
+    char dir_path[1024];
+
+    // Ensure command string is properly null-terminated
+    command[strcspn(command, "\r\n")] = '\0';
+
+    // Extract the directory and the words, and print error if any
+    int consumed = 0;
+    if (sscanf(command, "query %1023s %n", dir_path, &consumed) != 1) {
+        printf("Command parsing failed\n");
+        return;
+    }
+    char *terms;
+    size_t terms_len;
+    int n_terms = tokenize_terms(command + consumed, strlen(command + consumed), &terms, &terms_len);
+    char *new_dir_path = create_store_path(dir_path);
+    if (n_terms <= 0 || n_terms > QUERY_MAX_TERMS || new_dir_path == NULL || store->terms_dir[0] == '\0') {
+        const char *error_message = "ERROR: Invalid query!";
+        send(client_sock, error_message, strlen(error_message), 0);
+        printf("%s\n", error_message);
+        if (n_terms >= 0) {
+            free(terms);
+        }
+        free(new_dir_path);
+        return;
+    }
+    // Documents are recorded by their index key, so the directory is compared in that form
+    char dir_key[1024];
+    index_key(new_dir_path, dir_key, sizeof(dir_key));
+    free(new_dir_path);
+    size_t dir_len = strlen(dir_key);
+    while (dir_len > 1 && dir_key[dir_len - 1] == '/') {
+        dir_key[--dir_len] = '\0';
+    }
+
+    // The segments and the log are read under a shared lock, so no merge removes them meanwhile
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int lock_fd = term_index_lock(LOCK_SH);
+    int numbers[TERM_MAX_SEGMENTS * 2];
+    int n_segments = lock_fd >= 0 ? term_list_segments(numbers, TERM_MAX_SEGMENTS * 2) : 0;
+    struct term_segment segs[TERM_MAX_SEGMENTS * 2];
+    for (int s = 0; s < n_segments; s++) {
+        term_segment_open(numbers[s], &segs[s]);
+    }
+    char log_path[1024];
+    term_index_path("log", log_path, sizeof(log_path));
+    int log_fd = lock_fd >= 0 ? open(log_path, O_RDONLY) : -1;
+    struct stat log_stat;
+    char *log = NULL;
+    size_t log_len = 0;
+    if (log_fd >= 0 && fstat(log_fd, &log_stat) == 0 && log_stat.st_size > 0) {
+        log = mmap(NULL, log_stat.st_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+        log_len = log == MAP_FAILED ? 0 : (size_t)log_stat.st_size;
+    }
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    long long n_docs;
+    struct term_doc *docs = lock_fd >= 0 ? term_map_docs(&n_docs) : NULL;
+
+    // Intersect the documents of every term, starting from the first term's
+    uint32_t *matches = NULL;
+    long long n_matches = 0;
+    const char *term = terms;
+    for (int t = 0; t < n_terms && (t == 0 || n_matches > 0); t++, term += strlen(term) + 1) {
+        uint32_t *ids;
+        long long n = term_lookup(term, segs, n_segments, log_len > 0 ? log : NULL, log_len, &ids);
+        if (n < 0) {
+            n_matches = 0;
+            break;
+        }
+        if (t == 0) {
+            matches = ids;
+            n_matches = n;
+            continue;
+        }
+        long long kept = 0, i = 0, j = 0;
+        while (i < n_matches && j < n) {
+            if (matches[i] == ids[j]) {
+                matches[kept++] = matches[i];
+                i++;
+                j++;
+            } else if (matches[i] < ids[j]) {
+                i++;
+            } else {
+                j++;
+            }
+        }
+        n_matches = kept;
+        free(ids);
+    }
+
+    // Buffer to store the list of the live matching files below the directory
+    char store_files[BUFSIZE] = "";
+    int found = 0;
+    for (long long i = 0; docs != NULL && i < n_matches; i++) {
+        const struct term_doc *doc = matches[i] < n_docs ? &docs[matches[i]] : NULL;
+        if (doc == NULL || !doc->live || strncmp(doc->path, dir_key, dir_len) != 0 || doc->path[dir_len] != '/') {
+            continue;
+        }
+        found++;
+        if (strlen(store_files) + strlen(doc->path + dir_len + 1) + 2 < sizeof(store_files)) {
+            strcat(store_files, doc->path + dir_len + 1);
+            strcat(store_files, "\n");
+        }
+    }
+    free(matches);
+    free(terms);
+    if (docs != NULL) {
+        munmap(docs, n_docs * sizeof(struct term_doc));
+    }
+    if (log_len > 0) {
+        munmap(log, log_len);
+    }
+    for (int s = 0; s < n_segments; s++) {
+        term_segment_close(&segs[s]);
+    }
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Query of %d term(s) found %d file(s) in %lld us\n", n_terms, found,
+           (long long)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    // Send the list to the client(Smain), which merges the lists of all stores
+    if (strlen(store_files) > 0) {
+        send(client_sock, store_files, strlen(store_files), 0);
+    }
+}
+
+// Function to record the term index document of an indexed file
+void index_set_doc(const char *path, long long doc_id) {
+    if (store->index == NULL) {
+        return;
+    }
+    index_lock();
+    struct index_entry *e = index_lookup(path, 0);
+    if (e != NULL) {
+        e->doc_id = doc_id;
+    }
+    index_unlock();
+}
+
+// Function to open the term index of this store in ~/.<store>_terms before the first fork. A new term index is
+// filled from the text files already in the store; when the file index was rebuilt (and so lost the document ids
+// of the files), the documents are attached to their files again, and those whose file is gone are marked deleted.
+int init_term_index(int index_rebuilt) {
+    const char *home_dir = getenv("HOME");
+    if (home_dir == NULL) {
+        fprintf(stderr, "Failed to get HOME environment variable\n");
+        return -1;
+    }
+    snprintf(store->terms_dir, sizeof(store->terms_dir), "%s/.%s_terms", home_dir, store->name);
+    int created = (mkdir(store->terms_dir, 0755) == 0);
+    if (!created && errno != EEXIST) {
+        perror("Term index directory creation failed");
+        store->terms_dir[0] = '\0';
+        return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (!created && index_rebuilt) {
+        int lock_fd = term_index_lock(LOCK_EX);
+        long long n_docs;
+        struct term_doc *docs = term_map_docs(&n_docs);
+        int attached = 0;
+        for (long long id = 0; docs != NULL && id < n_docs; id++) {
+            if (!docs[id].live) {
+                continue;
+            }
+            index_lock();
+            struct index_entry *e = index_lookup(docs[id].path, 0);
+            long long replaced = -1;
+            if (e != NULL) {
+                // A later document of the same file wins, the ids grow with every upload
+                replaced = e->doc_id;
+                e->doc_id = id;
+                attached++;
+            }
+            index_unlock();
+            if (e == NULL) {
+                term_doc_kill(id);
+            } else if (replaced >= 0) {
+                term_doc_kill(replaced);
+                attached--;
+            }
+        }
+        if (docs != NULL) {
+            munmap(docs, n_docs * sizeof(struct term_doc));
+        }
+        if (lock_fd >= 0) {
+            close(lock_fd);
+        }
+        printf("Term index: %d documents attached to the rebuilt file index of %s\n", attached, store->name);
+    } else if (created) {
+        // Copy the paths of the text files first, indexing one takes the file index lock again
+        int n = 0;
+        char (*paths)[INDEX_PATH_MAX] = malloc((size_t)(store->index->count > 0 ? store->index->count : 1) * INDEX_PATH_MAX);
+        if (paths == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        index_lock();
+        for (int i = 0; i < store->index->capacity && n < store->index->count; i++) {
+            const struct index_entry *e = &store->index->entries[i];
+            const char *dot = strrchr(e->path, '.');
+            if (e->state == INDEX_SLOT_USED && dot != NULL && strcmp(dot, TERM_INDEX_EXT) == 0) {
+                memcpy(paths[n++], e->path, INDEX_PATH_MAX);
+            }
+        }
+        index_unlock();
+        for (int i = 0; i < n; i++) {
+            term_index_file(paths[i]);
+        }
+        free(paths);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("Term index: built for %d text files of %s in %lld ms\n", n, store->name,
+               (long long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+    }
+    return 0;
+}
+
+// helper function to check if a file belongs to this store based on its extension
+int matches_store_ext(const char *file_name) {
+    // A store without extensions accepts every file
+    if (store->n_exts == 0) {
+        return 1;
+    }
+    const char *dot = strrchr(file_name, '.');
+    if (dot == NULL) {
+        return 0;
+    }
+    for (int i = 0; i < store->n_exts; i++) {
+        if (strcmp(dot, store->exts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to create the listening socket of a store, non-blocking so a worker that lost the race for a
+// connection to another worker goes back to waiting instead of blocking in accept
+int open_store_socket(int port) {
+    struct sockaddr_in server_addr;
+
+    // Create a socket for the store
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Configure the server address
+    server_addr.sin_family = AF_INET;
+    // Set the port number, converting to network byte order
+    server_addr.sin_port = htons(port);
+    // Accept connections
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    // Zero out the rest of the structure
+    memset(server_addr.sin_zero, '\0', sizeof(server_addr.sin_zero));
+
+    // A restarted store may take the port over right away, while connections of the last run are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Bind the socket to the specified port and address
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_sock);
+        return -1;
+    }
+
+    // Listen for incoming connections, with a backlog of 10 pending connections
+    if (listen(server_sock, 10) < 0 || fcntl(server_sock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("Listen failed");
+        close(server_sock);
+        return -1;
+    }
+    return server_sock;
+}
+
+// Function to turn off Nagle's algorithm on a connection from Smain: replies end with a small write that would
+// otherwise wait for Smain's delayed ACK, the pieces of one reply are grouped with MSG_MORE instead
+void tune_socket(int sock) {
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Function to create a Unix-domain listening socket of a store (<unix_dir>/<store>.sock), replacing a socket
+// file left behind by an earlier run
+int open_unix_socket(const char *path) {
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(server_addr.sun_path)) {
+        fprintf(stderr, "Unix socket path %s is too long\n", path);
+        return -1;
+    }
+    snprintf(server_addr.sun_path, sizeof(server_addr.sun_path), "%s", path);
+
+    int server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    unlink(path);
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_sock);
+        return -1;
+    }
+    if (listen(server_sock, 10) < 0 || fcntl(server_sock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("Listen failed");
+        close(server_sock);
+        return -1;
+    }
+    return server_sock;
+}
+
+// Function to tell the metadata commands (display, rmfile, query), the only ones served on the priority lanes
+int is_metadata_command(const char *command) {
+    return strncmp(command, "display", 7) == 0 || strncmp(command, "rmfile", 6) == 0 || strncmp(command, "query", 5) == 0;
+}
+
+// Function run by every worker process: wait for a connection on any store's port and handle its command,
+// so a busy store uses the workers the other stores leave idle. Priority workers wait on the priority lanes instead.
+void worker_main(int priority) {
+    // The TCP listener of store i is fds[i], its Unix-domain listener (if any) fds[n_stores + i]
+    struct pollfd fds[2 * MAX_STORES];
+    struct sockaddr_in client_addr;
+    socklen_t addr_size;
+    int n_fds = 0;
+
+    // A client that goes away mid-transfer fails the send instead of killing the worker
+    signal(SIGPIPE, SIG_IGN);
+    worker_priority = priority;
+    for (int i = 0; i < n_stores; i++) {
+        fds[i].fd = priority ? stores[i].priority_sock : stores[i].listen_sock;
+        fds[i].events = POLLIN;
+        fds[n_stores + i].fd = priority ? stores[i].priority_unix_sock : stores[i].unix_sock;
+        fds[n_stores + i].events = POLLIN;
+    }
+    n_fds = unix_dir[0] != '\0' ? 2 * n_stores : n_stores;
+    while (1) {
+        if (poll(fds, n_fds, -1) < 0) {
+            if (errno != EINTR) {
+                perror("Poll failed");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
+        for (int f = 0; f < n_fds; f++) {
+            if (!(fds[f].revents & POLLIN)) {
+                continue;
+            }
+            int i = f % n_stores;
+            // Accept a client connection, another worker may have taken it already
+            addr_size = sizeof(client_addr);
+            int client_sock = accept(fds[f].fd, f < n_stores ? (struct sockaddr*)&client_addr : NULL, f < n_stores ? &addr_size : NULL);
+            if (client_sock < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("Accept failed");
+                }
+                continue;
+            }
+
+            if (f < n_stores) {
+                printf("Connection accepted from %s:%d for store '%s'\n", inet_ntoa(client_addr.sin_addr),
+                       ntohs(client_addr.sin_port), stores[i].name);
+                tune_socket(client_sock);
+            } else {
+                printf("Connection accepted on %s for store '%s'\n", priority ? stores[i].priority_unix_path : stores[i].unix_path, stores[i].name);
+            }
+            // Handle the command for this store, then close the connection
+            store = &stores[i];
+            handle_client(client_sock);
+            close(client_sock);
+        }
+    }
+}
+
+// Function to start a worker process (of the priority lanes if priority is set), retrying while fork fails
+pid_t spawn_worker(int priority) {
+    while (1) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            worker_main(priority);
+            exit(0);
+        } else if (pid > 0) {
+            return pid;
+        }
+        perror("Fork failed");
+        sleep(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // Read the store configuration from the command line: "[-w workers] [-m priority_workers] [-u dir] [-l upload_max_size]
+    // <port> <store> [ext ...]", more stores follow after a "+" and are all served by the same workers
+    int arg = 1;
+    while (arg + 1 < argc && (strcmp(argv[arg], "-w") == 0 || strcmp(argv[arg], "-m") == 0 || strcmp(argv[arg], "-u") == 0
+                              || strcmp(argv[arg], "-l") == 0)) {
+        if (strcmp(argv[arg], "-w") == 0) {
+            n_workers = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-m") == 0) {
+            n_priority_workers = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-l") == 0) {
+            upload_max_size = atoll(argv[arg + 1]);
+        } else {
+            if (snprintf(unix_dir, sizeof(unix_dir), "%s", argv[arg + 1]) >= (int)sizeof(unix_dir)) {
+                fprintf(stderr, "Socket directory %s is too long\n", argv[arg + 1]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        arg += 2;
+    }
+    while (arg + 1 < argc && n_stores < MAX_STORES && atoi(argv[arg]) > 0) {
+        struct store *st = &stores[n_stores++];
+        st->port = atoi(argv[arg]);
+        snprintf(st->name, sizeof(st->name), "%s", argv[arg + 1]);
+        st->listen_sock = -1;
+        st->unix_sock = -1;
+        st->priority_sock = -1;
+        st->priority_unix_sock = -1;
+        for (arg += 2; arg < argc && strcmp(argv[arg], "+") != 0; arg++) {
+            if (st->n_exts < MAX_EXTS) {
+                snprintf(st->exts[st->n_exts++], sizeof(st->exts[0]), "%s", argv[arg]);
+            }
+        }
+        arg++;
+    }
+    if (n_stores == 0 || arg < argc || n_workers <= 0 || n_workers > MAX_WORKERS || n_priority_workers < 0 || n_priority_workers > MAX_WORKERS
+        || upload_max_size <= 0) {
+        fprintf(stderr, "Usage: %s [-w workers] [-m priority_workers] [-u socket_dir] [-l upload_max_size] <port> <store> [ext ...] [+ <port> <store> [ext ...]] ...\n", argv[0]);
+        fprintf(stderr, "Example: %s 8081 spdf .pdf + 8082 stext .txt\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // Pick the CRC32C implementation
+    crc32c_init();
+
+    // Open every store's port, and load (or rebuild) its file index before the first fork, so every worker shares it
+    for (int i = 0; i < n_stores; i++) {
+        store = &stores[i];
+        int rebuilt = 0;
+        // A socket path that does not fit sun_path would be bound truncated, under a name Smain never connects to
+        if (unix_dir[0] != '\0' && snprintf(store->unix_path, sizeof(store->unix_path), "%s/%s.sock", unix_dir, store->name)
+                                        >= (int)sizeof(store->unix_path)) {
+            fprintf(stderr, "Unix socket path %s/%s.sock is too long\n", unix_dir, store->name);
+            exit(EXIT_FAILURE);
+        }
+        if (n_priority_workers > 0 && unix_dir[0] != '\0'
+            && snprintf(store->priority_unix_path, sizeof(store->priority_unix_path), "%s/%s.prio.sock", unix_dir, store->name)
+                   >= (int)sizeof(store->priority_unix_path)) {
+            fprintf(stderr, "Unix socket path %s/%s.prio.sock is too long\n", unix_dir, store->name);
+            exit(EXIT_FAILURE);
+        }
+        if ((store->listen_sock = open_store_socket(store->port)) < 0
+            || (unix_dir[0] != '\0' && (store->unix_sock = open_unix_socket(store->unix_path)) < 0)
+            || (n_priority_workers > 0 && (store->priority_sock = open_store_socket(store->port + PRIORITY_PORT_OFFSET)) < 0)
+            || (n_priority_workers > 0 && unix_dir[0] != '\0' && (store->priority_unix_sock = open_unix_socket(store->priority_unix_path)) < 0)
+            || (rebuilt = init_file_index()) < 0 || init_term_index(rebuilt) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Sstore server for store '%s' is listening on port %d\n", store->name, store->port);
+        if (store->unix_sock >= 0) {
+            printf("Sstore server for store '%s' is listening on %s\n", store->name, store->unix_path);
+        }
+        if (store->priority_sock >= 0) {
+            printf("Priority lane of store '%s' is listening on port %d%s%s\n", store->name, store->port + PRIORITY_PORT_OFFSET,
+                   store->priority_unix_sock >= 0 ? " and " : "", store->priority_unix_sock >= 0 ? store->priority_unix_path : "");
+        }
+    }
+    store = NULL;
+
+    // Start the workers, shared by all stores, and the priority workers, and replace any that exits
+    for (int w = 0; w < n_workers; w++) {
+        worker_pids[w] = spawn_worker(0);
+    }
+    for (int w = 0; w < n_priority_workers; w++) {
+        priority_pids[w] = spawn_worker(1);
+    }
+    printf("%d workers (and %d priority workers) serve %d store(s)\n", n_workers, n_priority_workers, n_stores);
+    while (1) {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0) {
+            if (errno != EINTR) {
+                perror("Wait failed");
+                sleep(1);
+            }
+            continue;
+        }
+        // Free the index locks if the worker died holding one
+        reclaim_index_lock(pid);
+        for (int w = 0; w < n_workers; w++) {
+            if (worker_pids[w] == pid) {
+                printf("Worker %d exited, starting a new one\n", (int)pid);
+                worker_pids[w] = spawn_worker(0);
+            }
+        }
+        for (int w = 0; w < n_priority_workers; w++) {
+            if (priority_pids[w] == pid) {
+                printf("Priority worker %d exited, starting a new one\n", (int)pid);
+                priority_pids[w] = spawn_worker(1);
+            }
+        }
+    }
+    return 0;
+}
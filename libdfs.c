@@ -0,0 +1,1564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "libdfs.h"
+
+// Size of the chunks used to stream file data
+#define DFS_BUFSIZE 65536
+// Marker that ends a file or a file list sent by Smain
+#define CMD_END_MARKER "END_CMD"
+// Every sized body (an upload, a file, a tarball or a signature) is followed by "CRC32C <8 hex digits>"
+#define CRC_TRAILER_LEN 15
+#define DFS_PATH_MAX 1024
+// How often a request is retried when Smain answers "ERROR: Server busy, retry after N ms"
+#define DFS_BUSY_RETRIES 5
+// Result of a request that lost its connection (it is retried once on a new connection)
+#define DFS_CONN_FAILED -2
+// Result of a download that continues as stripes on other connections, completed by the last stripe
+#define DFS_PENDING -3
+// Downloads larger than this are fetched in stripes of this size over the connections of the pool
+#define DFS_STRIPE_SIZE (4LL * 1024 * 1024)
+// Uploads of files at least this large first try a delta against the copy already on the server
+#define DFS_DELTA_MIN (32LL * 1024)
+// Result of a delta upload that cannot be used (no copy on the server, or no saving): upload the whole file
+#define DFS_FALLBACK 1
+// FNV-1a constants of the strong hash shared with the servers
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Request types, DFS_RANGE is one stripe of a striped download
+enum dfs_op { DFS_UPLOAD, DFS_DOWNLOAD, DFS_REMOVE, DFS_TAR, DFS_LIST, DFS_RANGE, DFS_SEARCH, DFS_QUERY };
+
+// A striped download in progress: every stripe writes its range into the shared ".part" file with pwrite
+struct dfs_stripes {
+    pthread_mutex_t lock;
+    int fd;
+    long long total;
+    int pending;
+    int failed;
+    char error[256];
+    char part_path[2 * DFS_PATH_MAX + 8];
+    // Version tag of the file the first stripe came from, every other stripe must come from the same version
+    char tag[64];
+    // The download request, completed once the last stripe arrived, and its client (for the cache)
+    struct dfs_future *parent;
+    struct dfs_client *client;
+};
+
+// A request and its result, shared by the caller and the worker that runs it
+struct dfs_future {
+    enum dfs_op op;
+    // The file, directory or extension the request is about, and where downloads go
+    char target[DFS_PATH_MAX];
+    char remote_dir[DFS_PATH_MAX];
+    char local_dir[DFS_PATH_MAX];
+    dfs_callback callback;
+    void *callback_arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int status;
+    // One reference for the caller and one for the worker, the last one frees the future
+    int refs;
+    char *message;
+    char local_path[2 * DFS_PATH_MAX];
+    // Version tag of the downloaded file and whether it was copied from the local cache
+    char tag[64];
+    int from_cache;
+    // Byte range and shared state of a DFS_RANGE stripe
+    long long offset;
+    long long length;
+    // Incremental DFS_TAR: only files modified at or after `since` (-1 for any time) or that differ from the local
+    // manifest file in remote_dir (none when empty)
+    long long since;
+    struct dfs_stripes *stripes;
+    // Next request in the client's queue
+    struct dfs_future *next;
+};
+
+// A worker thread and the connection it reuses for every request it runs, the priority worker only runs
+// metadata requests
+struct dfs_worker {
+    struct dfs_client *client;
+    pthread_t thread;
+    int sock;
+    int priority;
+};
+
+// A pool of connections to one Smain server with the queues of requests waiting for a worker: metadata requests
+// (list, remove, query) wait in the priority queue, which every worker serves first, and have a connection of
+// their own so they never wait behind transfers
+struct dfs_client {
+    char host[64];
+    int port;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dfs_future *head;
+    struct dfs_future *tail;
+    struct dfs_future *priority_head;
+    struct dfs_future *priority_tail;
+    int closing;
+    long long stripe_size;
+    long long delta_min;
+    // Directory of the download cache, empty when caching is off
+    char cache_dir[DFS_PATH_MAX];
+    int n_workers;
+    struct dfs_worker *workers;
+    int has_priority_worker;
+    struct dfs_worker priority_worker;
+};
+
+// CRC32C: set up once per process, with the SSE4.2 crc32 instruction when the CPU has it and the
+// slicing-by-8 tables otherwise
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hw = 0;
+static uint32_t crc32c_table[8][256];
+
+// Function prototypes
+static int dfs_connect(const char *host, int port);
+static void *dfs_worker_main(void *arg);
+static void dfs_execute(struct dfs_worker *worker, dfs_future *future);
+static void dfs_complete(dfs_future *future, int status);
+static dfs_future *dfs_create(enum dfs_op op, const char *target, const char *remote_dir, const char *local_dir, dfs_callback callback, void *arg);
+static dfs_future *dfs_submit(dfs_client *client, enum dfs_op op, const char *target, const char *remote_dir, const char *local_dir, dfs_callback callback, void *arg);
+static int send_tar_manifest(int sock, dfs_future *future, const char *command, int command_len);
+static void set_message(dfs_future *future, const char *message, size_t len);
+static int send_all(int sock, const void *data, size_t len, int flags);
+static int recv_reply(int sock, dfs_future *future);
+static ssize_t recv_line(int sock, char *line, size_t line_size);
+static int is_error_reply(int sock);
+static int do_upload(dfs_client *client, int sock, dfs_future *future);
+static int do_delta_upload(int sock, dfs_future *future, int file_fd, long long file_size);
+static unsigned char *build_delta(const unsigned char *data, long long size, const unsigned char *signature, long long base_size,
+                                  int block_size, size_t *delta_len);
+static uint32_t weak_checksum(const unsigned char *data, size_t len);
+static uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len);
+static void crc32c_init(void);
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+static int parse_crc_trailer(const char *trailer, uint32_t *crc);
+static int recv_exact(int sock, void *buffer, size_t len);
+static int do_simple(int sock, dfs_future *future, const char *command, const char *ok_prefix);
+static int do_receive_file(dfs_client *client, int sock, dfs_future *future, const char *command);
+static int do_range(int sock, dfs_future *future);
+static int parse_file_header(char *header, long long *offset, long long *total, long long *size);
+static int recv_to_file(int sock, dfs_future *future, int file_fd, long long offset, long long size, int *write_failed);
+static void dfs_enqueue(dfs_client *client, dfs_future *future);
+static int is_priority_op(enum dfs_op op);
+static void stripe_finished(struct dfs_stripes *stripes, dfs_future *range, int status);
+static int do_list(int sock, dfs_future *future);
+static void cache_entry_path(dfs_client *client, const char *remote_file, char *path, size_t path_size);
+static int cache_lookup(dfs_client *client, const char *remote_file, char *tag, size_t tag_size);
+static int cache_restore(dfs_client *client, dfs_future *future);
+static void cache_store(dfs_client *client, dfs_future *future);
+static int copy_data(int src_fd, int dst_fd);
+
+// Function to open the connection pool, the first connection is made right away to report an unreachable server
+dfs_client *dfs_open(const char *host, int port, int connections) {
+    if (connections < 1) {
+        connections = 1;
+    }
+    pthread_once(&crc32c_once, crc32c_init);
+    dfs_client *client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+    snprintf(client->host, sizeof(client->host), "%s", host);
+    client->port = port;
+    client->stripe_size = DFS_STRIPE_SIZE;
+    client->delta_min = DFS_DELTA_MIN;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->cond, NULL);
+    client->workers = calloc(connections, sizeof(struct dfs_worker));
+    if (client->workers == NULL) {
+        free(client);
+        return NULL;
+    }
+
+    // Connect every worker up front, one that fails now connects again on its first request
+    for (int i = 0; i < connections; i++) {
+        client->workers[i].client = client;
+        client->workers[i].sock = dfs_connect(host, port);
+        if (i == 0 && client->workers[i].sock < 0) {
+            free(client->workers);
+            free(client);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < connections; i++) {
+        if (pthread_create(&client->workers[i].thread, NULL, dfs_worker_main, &client->workers[i]) != 0) {
+            perror("Worker thread creation failed");
+            // Run with the workers that started, close the connections of the others
+            for (int j = i; j < connections; j++) {
+                if (client->workers[j].sock >= 0) {
+                    close(client->workers[j].sock);
+                }
+            }
+            break;
+        }
+        client->n_workers++;
+    }
+    if (client->n_workers == 0) {
+        free(client->workers);
+        free(client);
+        return NULL;
+    }
+
+    // The priority worker's connection is made on its first request
+    client->priority_worker.client = client;
+    client->priority_worker.sock = -1;
+    client->priority_worker.priority = 1;
+    if (pthread_create(&client->priority_worker.thread, NULL, dfs_worker_main, &client->priority_worker) == 0) {
+        client->has_priority_worker = 1;
+    }
+    return client;
+}
+
+// Function to drain the queue, stop the workers and close their connections
+void dfs_close(dfs_client *client) {
+    pthread_mutex_lock(&client->lock);
+    client->closing = 1;
+    pthread_cond_broadcast(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+
+    for (int i = 0; i < client->n_workers; i++) {
+        pthread_join(client->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < client->n_workers; i++) {
+        if (client->workers[i].sock >= 0) {
+            close(client->workers[i].sock);
+        }
+    }
+    if (client->has_priority_worker) {
+        pthread_join(client->priority_worker.thread, NULL);
+        if (client->priority_worker.sock >= 0) {
+            close(client->priority_worker.sock);
+        }
+    }
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->cond);
+    free(client->workers);
+    free(client);
+}
+
+// Function to change the stripe size of large downloads, 0 downloads every file over a single connection
+void dfs_set_stripe_size(dfs_client *client, long long bytes) {
+    client->stripe_size = bytes > 0 ? bytes : 0;
+}
+
+// Function to change the size from which uploads are sent as deltas, 0 always uploads whole files
+void dfs_set_delta_min(dfs_client *client, long long bytes) {
+    client->delta_min = bytes > 0 ? bytes : 0;
+}
+
+// Function to turn on the download cache in dir (created if missing), or turn it off with NULL
+int dfs_set_cache_dir(dfs_client *client, const char *dir) {
+    if (dir == NULL) {
+        client->cache_dir[0] = '\0';
+        return 0;
+    }
+    struct stat dir_stat;
+    if (mkdir(dir, 0700) < 0 && (stat(dir, &dir_stat) < 0 || !S_ISDIR(dir_stat.st_mode))) {
+        return -1;
+    }
+    snprintf(client->cache_dir, sizeof(client->cache_dir), "%s", dir);
+    return 0;
+}
+
+// Public request functions, each one queues the request and returns without waiting for it
+dfs_future *dfs_upload(dfs_client *client, const char *local_file, const char *remote_dir, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_UPLOAD, local_file, remote_dir, NULL, callback, arg);
+}
+
+dfs_future *dfs_download(dfs_client *client, const char *remote_file, const char *local_dir, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_DOWNLOAD, remote_file, NULL, local_dir, callback, arg);
+}
+
+dfs_future *dfs_remove(dfs_client *client, const char *remote_file, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_REMOVE, remote_file, NULL, NULL, callback, arg);
+}
+
+dfs_future *dfs_tar(dfs_client *client, const char *ext, const char *local_dir, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_TAR, ext, NULL, local_dir, callback, arg);
+}
+
+// The manifest's path travels in the future's remote_dir, which a tarball does not otherwise use
+dfs_future *dfs_tar_incremental(dfs_client *client, const char *ext, long long since, const char *manifest_file, const char *local_dir, dfs_callback callback, void *arg) {
+    dfs_future *future = dfs_create(DFS_TAR, ext, manifest_file, local_dir, callback, arg);
+    if (future != NULL) {
+        future->since = since >= 0 ? since : -1;
+        dfs_enqueue(client, future);
+    }
+    return future;
+}
+
+dfs_future *dfs_list(dfs_client *client, const char *remote_dir, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_LIST, remote_dir, NULL, NULL, callback, arg);
+}
+
+// The filter travels in the future's remote_dir, which a listing does not otherwise use
+dfs_future *dfs_list_filtered(dfs_client *client, const char *remote_dir, const char *filter, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_LIST, remote_dir, filter, NULL, callback, arg);
+}
+
+// A search is answered like a listing, its text travels in remote_dir as well
+dfs_future *dfs_search(dfs_client *client, const char *remote_dir, const char *text, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_SEARCH, remote_dir, text, NULL, callback, arg);
+}
+
+dfs_future *dfs_query(dfs_client *client, const char *remote_dir, const char *words, dfs_callback callback, void *arg) {
+    return dfs_submit(client, DFS_QUERY, remote_dir, words, NULL, callback, arg);
+}
+
+// Function to wait for a request to complete
+int dfs_wait(dfs_future *future) {
+    pthread_mutex_lock(&future->lock);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->lock);
+    }
+    int status = future->status;
+    pthread_mutex_unlock(&future->lock);
+    return status;
+}
+
+// Function to check whether a request completed without blocking
+int dfs_done(dfs_future *future) {
+    pthread_mutex_lock(&future->lock);
+    int done = future->done;
+    pthread_mutex_unlock(&future->lock);
+    return done;
+}
+
+// Accessors for the results, only meaningful in the callback or once the request completed
+const char *dfs_message(dfs_future *future) {
+    return future->message != NULL ? future->message : "";
+}
+
+int dfs_from_cache(dfs_future *future) {
+    return future->from_cache;
+}
+
+const char *dfs_local_path(dfs_future *future) {
+    return future->local_path;
+}
+
+// Function to drop one reference to a future, the last reference frees it
+void dfs_release(dfs_future *future) {
+    pthread_mutex_lock(&future->lock);
+    int refs = --future->refs;
+    pthread_mutex_unlock(&future->lock);
+    if (refs == 0) {
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->cond);
+        free(future->message);
+        free(future);
+    }
+}
+
+// Function to create a request and append it to the client's queue
+static dfs_future *dfs_submit(dfs_client *client, enum dfs_op op, const char *target, const char *remote_dir, const char *local_dir, dfs_callback callback, void *arg) {
+    dfs_future *future = dfs_create(op, target, remote_dir, local_dir, callback, arg);
+    if (future != NULL) {
+        dfs_enqueue(client, future);
+    }
+    return future;
+}
+
+// Function to create a request, not queued yet
+static dfs_future *dfs_create(enum dfs_op op, const char *target, const char *remote_dir, const char *local_dir, dfs_callback callback, void *arg) {
+    dfs_future *future = calloc(1, sizeof(*future));
+    if (future == NULL) {
+        return NULL;
+    }
+    future->op = op;
+    snprintf(future->target, sizeof(future->target), "%s", target);
+    snprintf(future->remote_dir, sizeof(future->remote_dir), "%s", remote_dir ? remote_dir : "");
+    snprintf(future->local_dir, sizeof(future->local_dir), "%s", local_dir ? local_dir : ".");
+    future->callback = callback;
+    future->callback_arg = arg;
+    future->refs = 2;
+    future->since = -1;
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    return future;
+}
+
+// Function to tell the metadata requests, which go to the priority queue
+static int is_priority_op(enum dfs_op op) {
+    return op == DFS_LIST || op == DFS_REMOVE || op == DFS_QUERY;
+}
+
+// Function to append a request to its queue and wake the workers
+static void dfs_enqueue(dfs_client *client, dfs_future *future) {
+    pthread_mutex_lock(&client->lock);
+    struct dfs_future **head = is_priority_op(future->op) ? &client->priority_head : &client->head;
+    struct dfs_future **tail = is_priority_op(future->op) ? &client->priority_tail : &client->tail;
+    if (*tail != NULL) {
+        (*tail)->next = future;
+    } else {
+        *head = future;
+    }
+    *tail = future;
+    // Every worker waits on the same condition, but only some of them may take this request
+    pthread_cond_broadcast(&client->cond);
+    pthread_mutex_unlock(&client->lock);
+}
+
+// Worker thread: take requests from the queues one at a time, metadata requests first, and run them on this
+// worker's connection; the priority worker only takes metadata requests
+static void *dfs_worker_main(void *arg) {
+    struct dfs_worker *worker = arg;
+    dfs_client *client = worker->client;
+
+    while (1) {
+        pthread_mutex_lock(&client->lock);
+        while (client->priority_head == NULL && (worker->priority || client->head == NULL) && !client->closing) {
+            pthread_cond_wait(&client->cond, &client->lock);
+        }
+        struct dfs_future **head = client->priority_head != NULL ? &client->priority_head : &client->head;
+        struct dfs_future **tail = client->priority_head != NULL ? &client->priority_tail : &client->tail;
+        dfs_future *future = *head;
+        if (future == NULL || (worker->priority && head != &client->priority_head)) {
+            // Closing and nothing left to do
+            pthread_mutex_unlock(&client->lock);
+            break;
+        }
+        *head = future->next;
+        if (*head == NULL) {
+            *tail = NULL;
+        }
+        future->next = NULL;
+        pthread_mutex_unlock(&client->lock);
+
+        dfs_execute(worker, future);
+    }
+    return NULL;
+}
+
+// Function to run one request: reconnects when the connection was lost and backs off when Smain is busy
+static void dfs_execute(struct dfs_worker *worker, dfs_future *future) {
+    dfs_client *client = worker->client;
+    int result = -1;
+    int reconnected = 0;
+
+    for (int attempt = 0; attempt <= DFS_BUSY_RETRIES; attempt++) {
+        if (worker->sock < 0) {
+            worker->sock = dfs_connect(client->host, client->port);
+            if (worker->sock < 0) {
+                const char *error_message = "ERROR: Cannot connect to the server!";
+                set_message(future, error_message, strlen(error_message));
+                result = -1;
+                break;
+            }
+        }
+
+        switch (future->op) {
+            case DFS_UPLOAD:
+                result = do_upload(client, worker->sock, future);
+                break;
+            case DFS_DOWNLOAD:
+                result = do_receive_file(client, worker->sock, future, "dfile");
+                break;
+            case DFS_REMOVE:
+                result = do_simple(worker->sock, future, "rmfile", "File has been removed");
+                break;
+            case DFS_TAR:
+                result = do_receive_file(client, worker->sock, future, "dtar");
+                break;
+            case DFS_LIST:
+            case DFS_SEARCH:
+            case DFS_QUERY:
+                result = do_list(worker->sock, future);
+                break;
+            case DFS_RANGE:
+                result = do_range(worker->sock, future);
+                break;
+        }
+
+        // A lost connection (Smain restarted, or closed an idle session) is retried once on a new one
+        if (result == DFS_CONN_FAILED) {
+            close(worker->sock);
+            worker->sock = -1;
+            if (reconnected) {
+                const char *error_message = "ERROR: Connection to the server lost!";
+                set_message(future, error_message, strlen(error_message));
+                result = -1;
+                break;
+            }
+            reconnected = 1;
+            attempt--;
+            continue;
+        }
+
+        // Smain is overloaded: wait as long as it asked and try again on a fresh connection
+        int retry_ms;
+        if (result < 0 && future->message != NULL
+            && sscanf(future->message, "ERROR: Server busy, retry after %d ms", &retry_ms) == 1 && attempt < DFS_BUSY_RETRIES) {
+            close(worker->sock);
+            worker->sock = -1;
+            usleep((useconds_t)retry_ms * 1000);
+            continue;
+        }
+        break;
+    }
+    // A striped download is completed by its last stripe
+    if (result == DFS_PENDING) {
+        return;
+    }
+    dfs_complete(future, result < 0 ? -1 : 0);
+}
+
+// Function to run the callback of a finished request, wake its waiters and drop the worker's reference
+// The callback runs first, so a caller returning from dfs_wait() knows the callback is done too
+static void dfs_complete(dfs_future *future, int status) {
+    // A stripe has no caller, it only reports to its download
+    if (future->op == DFS_RANGE) {
+        stripe_finished(future->stripes, future, status);
+        dfs_release(future);
+        return;
+    }
+    future->status = status;
+    if (future->callback != NULL) {
+        future->callback(future, future->callback_arg);
+    }
+
+    pthread_mutex_lock(&future->lock);
+    future->done = 1;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->lock);
+    dfs_release(future);
+}
+
+// Function to connect to Smain, returns the socket or -1
+static int dfs_connect(const char *host, int port) {
+    struct sockaddr_in server_addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Configure the server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(host);
+
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Connect failed");
+        close(sock);
+        return -1;
+    }
+    // Requests end with a small write followed by a read, which must not wait for a delayed ACK; the pieces of
+    // one request are grouped with MSG_MORE instead
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+// Function to store the reply of a request as a string
+static void set_message(dfs_future *future, const char *message, size_t len) {
+    free(future->message);
+    future->message = malloc(len + 1);
+    if (future->message != NULL) {
+        memcpy(future->message, message, len);
+        future->message[len] = '\0';
+    }
+}
+
+// Function to send a whole buffer, returns 0 on success and -1 when the connection failed
+// flags may add MSG_MORE to the pieces of a message that are followed by more of it
+static int send_all(int sock, const void *data, size_t len, int flags) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t sent = send(sock, p, len, MSG_NOSIGNAL | flags);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Function to receive a short reply (a confirmation or an error) sent by Smain in one piece
+static int recv_reply(int sock, dfs_future *future) {
+    char buffer[4096];
+    ssize_t bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    if (bytes_received <= 0) {
+        return DFS_CONN_FAILED;
+    }
+    set_message(future, buffer, bytes_received);
+    return 0;
+}
+
+// Function to receive one "\n" terminated header line without reading past it
+static ssize_t recv_line(int sock, char *line, size_t line_size) {
+    size_t len = 0;
+    while (len < line_size - 1) {
+        // Look at what arrived and only take it up to the newline
+        ssize_t peeked = recv(sock, line + len, line_size - 1 - len, MSG_PEEK);
+        if (peeked <= 0) {
+            return -1;
+        }
+        char *newline = memchr(line + len, '\n', peeked);
+        size_t take = newline ? (size_t)(newline - (line + len)) + 1 : (size_t)peeked;
+        if (recv(sock, line + len, take, 0) != (ssize_t)take) {
+            return -1;
+        }
+        len += take;
+        if (newline) {
+            line[len - 1] = '\0';
+            return len - 1;
+        }
+    }
+    return -1;
+}
+
+// Function to check, without consuming it, whether the next reply is an "ERROR: ..." message
+// Returns 1 for an error, 0 otherwise and -1 when the connection failed
+static int is_error_reply(int sock) {
+    char peek[6];
+    ssize_t peeked = recv(sock, peek, sizeof(peek), MSG_PEEK | MSG_WAITALL);
+    if (peeked <= 0) {
+        return -1;
+    }
+    return peeked == sizeof(peek) && memcmp(peek, "ERROR:", 6) == 0;
+}
+
+// Function to send an incremental dtar with the manifest file in remote_dir: the command, " manifest=<size>" and the
+// end marker, then the manifest and its CRC32C trailer. Returns -1 if the manifest cannot be read
+static int send_tar_manifest(int sock, dfs_future *future, const char *command, int command_len) {
+    int file_fd = open(future->remote_dir, O_RDONLY);
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
+        char error_message[DFS_PATH_MAX + 64];
+        int len = snprintf(error_message, sizeof(error_message), "ERROR: Cannot open %s: %s", future->remote_dir, strerror(errno));
+        set_message(future, error_message, len);
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return -1;
+    }
+    char header[DFS_PATH_MAX + 256];
+    int header_len = snprintf(header, sizeof(header), "%.*s manifest=%lld %s", command_len, command, (long long)file_stat.st_size, CMD_END_MARKER);
+    int result = send_all(sock, header, header_len, MSG_MORE) == 0 ? 0 : DFS_CONN_FAILED;
+    char *buffer = malloc(DFS_BUFSIZE);
+    long long remaining = file_stat.st_size;
+    uint32_t crc = 0;
+    while (result == 0 && buffer != NULL && remaining > 0) {
+        ssize_t bytes_read = read(file_fd, buffer, remaining < DFS_BUFSIZE ? remaining : DFS_BUFSIZE);
+        if (bytes_read <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes_read);
+        if (send_all(sock, buffer, bytes_read, MSG_MORE) < 0) {
+            result = DFS_CONN_FAILED;
+        }
+        remaining -= bytes_read;
+    }
+    free(buffer);
+    close(file_fd);
+    if (result == 0 && remaining > 0) {
+        // The announced size can no longer be delivered, drop the connection rather than desynchronise it
+        const char *error_message = "ERROR: Reading the manifest failed!";
+        set_message(future, error_message, strlen(error_message));
+        return DFS_CONN_FAILED;
+    }
+    char trailer[CRC_TRAILER_LEN + 1];
+    snprintf(trailer, sizeof(trailer), "CRC32C %08x", crc);
+    if (result == 0 && send_all(sock, trailer, CRC_TRAILER_LEN, 0) < 0) {
+        result = DFS_CONN_FAILED;
+    }
+    return result;
+}
+
+// Function to upload a file: "ufile <name> <dir> <size> END_CMD" followed by exactly <size> bytes and their CRC32C trailer
+static int do_upload(dfs_client *client, int sock, dfs_future *future) {
+    int file_fd = open(future->target, O_RDONLY);
+    if (file_fd < 0) {
+        char error_message[DFS_PATH_MAX + 64];
+        int len = snprintf(error_message, sizeof(error_message), "ERROR: Cannot open %s: %s", future->target, strerror(errno));
+        set_message(future, error_message, len);
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) < 0) {
+        char error_message[DFS_PATH_MAX + 64];
+        int len = snprintf(error_message, sizeof(error_message), "ERROR: Cannot stat %s: %s", future->target, strerror(errno));
+        set_message(future, error_message, len);
+        close(file_fd);
+        return -1;
+    }
+
+    // A large file is first offered as a delta against the server's copy, if it has one
+    if (client->delta_min > 0 && file_stat.st_size >= client->delta_min) {
+        int result = do_delta_upload(sock, future, file_fd, (long long)file_stat.st_size);
+        if (result != DFS_FALLBACK) {
+            close(file_fd);
+            return result;
+        }
+    }
+
+    // The buffer is taken before anything is sent, so a failure leaves the connection as it was
+    char *buffer = malloc(DFS_BUFSIZE);
+    if (buffer == NULL) {
+        const char *error_message = "ERROR: Out of memory!";
+        set_message(future, error_message, strlen(error_message));
+        close(file_fd);
+        return -1;
+    }
+
+    // Send the command, then stream exactly the announced number of bytes in chunks, checksumming them on the way
+    char header[3 * DFS_PATH_MAX];
+    int header_len = snprintf(header, sizeof(header), "ufile %s %s %lld %s", future->target, future->remote_dir,
+                              (long long)file_stat.st_size, CMD_END_MARKER);
+    int result = send_all(sock, header, header_len, MSG_MORE) == 0 ? 0 : DFS_CONN_FAILED;
+    long long remaining = file_stat.st_size;
+    uint32_t crc = 0;
+    while (result == 0 && remaining > 0) {
+        ssize_t bytes_read = read(file_fd, buffer, remaining < DFS_BUFSIZE ? remaining : DFS_BUFSIZE);
+        if (bytes_read <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes_read);
+        if (send_all(sock, buffer, bytes_read, MSG_MORE) < 0) {
+            result = DFS_CONN_FAILED;
+        }
+        remaining -= bytes_read;
+    }
+    free(buffer);
+    close(file_fd);
+    if (result != 0) {
+        return result;
+    }
+    if (remaining > 0) {
+        // The file shrank or could not be read: the announced size can no longer be delivered, drop the connection
+        // rather than desynchronise it
+        const char *error_message = "ERROR: Reading the local file failed!";
+        set_message(future, error_message, strlen(error_message));
+        return DFS_CONN_FAILED;
+    }
+    char trailer[CRC_TRAILER_LEN + 1];
+    snprintf(trailer, sizeof(trailer), "CRC32C %08x", crc);
+    if (send_all(sock, trailer, CRC_TRAILER_LEN, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+
+    // Wait for the confirmation
+    result = recv_reply(sock, future);
+    if (result != 0) {
+        return result;
+    }
+    return strncmp(future->message, "File Uploaded successfully", 26) == 0 ? 0 : -1;
+}
+
+// Function to upload a file as a delta (rsync style): fetch the signature of the server's copy with
+// "dsig <dir>/<name>", find the blocks of the local file that the server already has, and send only
+// "udelta <name> <dir> <size> <block size> <old hash> <new hash> END_CMD" and the delta
+// Returns DFS_FALLBACK when the whole file has to be uploaded instead
+static int do_delta_upload(int sock, dfs_future *future, int file_fd, long long file_size) {
+    const char *name = strrchr(future->target, '/') ? strrchr(future->target, '/') + 1 : future->target;
+    char message[3 * DFS_PATH_MAX];
+    int len = snprintf(message, sizeof(message), "dsig %s/%s", future->remote_dir, name);
+    if (send_all(sock, message, len, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+
+    // No copy on the server (or any other error) means a normal upload, except when Smain is busy
+    int error = is_error_reply(sock);
+    if (error < 0) {
+        return DFS_CONN_FAILED;
+    } else if (error) {
+        int result = recv_reply(sock, future);
+        if (result != 0) {
+            return result;
+        }
+        return strncmp(future->message, "ERROR: Server busy", 18) == 0 ? -1 : DFS_FALLBACK;
+    }
+
+    // "<block size> <file size> <file hash> <length>\n", 12 bytes per block, the CRC32C trailer and the end marker
+    char header[256];
+    int block_size;
+    long long base_size, signature_len;
+    unsigned long long base_hash;
+    if (recv_line(sock, header, sizeof(header)) < 0
+        || sscanf(header, "%d %lld %llx %lld", &block_size, &base_size, &base_hash, &signature_len) != 4
+        || block_size <= 0 || base_size < 0 || signature_len != (base_size + block_size - 1) / block_size * 12) {
+        return DFS_CONN_FAILED;
+    }
+    unsigned char *signature = malloc(signature_len + 1);
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    size_t marker_len = strlen(CMD_END_MARKER);
+    uint32_t sent_crc;
+    if (signature == NULL || recv_exact(sock, signature, signature_len) < 0
+        || recv_exact(sock, end, CRC_TRAILER_LEN + marker_len) < 0
+        || memcmp(end + CRC_TRAILER_LEN, CMD_END_MARKER, marker_len) != 0) {
+        free(signature);
+        return DFS_CONN_FAILED;
+    }
+    // A damaged signature would build a wrong delta, upload the whole file instead
+    if (parse_crc_trailer(end, &sent_crc) < 0 || sent_crc != crc32c(0, signature, signature_len)) {
+        free(signature);
+        return DFS_FALLBACK;
+    }
+
+    // Compare the local file with the signature
+    unsigned char *data = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file_fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+        free(signature);
+        return DFS_FALLBACK;
+    }
+    size_t delta_len = 0;
+    unsigned char *delta = build_delta(data, file_size, signature, base_size, block_size, &delta_len);
+    uint64_t new_hash = strong_hash(FNV_OFFSET, data, file_size);
+    munmap(data, file_size);
+    free(signature);
+    if (delta == NULL || (long long)delta_len >= file_size) {
+        // Nothing in common worth sending a delta for
+        free(delta);
+        return DFS_FALLBACK;
+    }
+
+    // Send the delta with its CRC32C trailer and wait for the confirmation
+    len = snprintf(message, sizeof(message), "udelta %s %s %zu %d %016llx %016llx %s", future->target, future->remote_dir,
+                   delta_len, block_size, base_hash, (unsigned long long)new_hash, CMD_END_MARKER);
+    char trailer[CRC_TRAILER_LEN + 1];
+    snprintf(trailer, sizeof(trailer), "CRC32C %08x", crc32c(0, delta, delta_len));
+    int result = (send_all(sock, message, len, MSG_MORE) < 0 || send_all(sock, delta, delta_len, MSG_MORE) < 0
+                  || send_all(sock, trailer, CRC_TRAILER_LEN, 0) < 0) ? DFS_CONN_FAILED : 0;
+    free(delta);
+    if (result == 0) {
+        result = recv_reply(sock, future);
+    }
+    if (result != 0) {
+        return result;
+    }
+    if (strncmp(future->message, "File Uploaded successfully", 26) == 0) {
+        return 0;
+    }
+    // The server's copy changed in between (or a replica holds another version): upload the whole file
+    return strncmp(future->message, "ERROR: Server busy", 18) == 0 ? -1 : DFS_FALLBACK;
+}
+
+// Function to build the delta of a file against a signature: slide the rolling checksum over the file and,
+// where it matches a block of the server's copy whose strong hash matches too, send a copy record instead
+// of the data. Records are 'C' <first block> <count> and 'L' <length> <data>, numbers in network byte order
+static unsigned char *build_delta(const unsigned char *data, long long size, const unsigned char *signature, long long base_size,
+                                  int block_size, size_t *delta_len) {
+    // Index the full sized blocks of the server's copy by rolling checksum, chaining blocks that share one
+    size_t n_blocks = (size_t)(base_size / block_size);
+    size_t table_size = 1;
+    while (table_size < 2 * n_blocks) {
+        table_size <<= 1;
+    }
+    long *heads = malloc(table_size * sizeof(long));
+    long *chain = malloc((n_blocks + 1) * sizeof(long));
+    // Every copy record covers a whole block, so the records never add more than 16 bytes per block
+    size_t capacity = (size_t)size + 16 * ((size_t)size / block_size + 4);
+    unsigned char *delta = malloc(capacity);
+    if (heads == NULL || chain == NULL || delta == NULL) {
+        free(heads);
+        free(chain);
+        free(delta);
+        return NULL;
+    }
+    for (size_t i = 0; i < table_size; i++) {
+        heads[i] = -1;
+    }
+    for (size_t i = 0; i < n_blocks; i++) {
+        const unsigned char *entry = signature + i * 12;
+        uint32_t weak = ((uint32_t)entry[0] << 24) | ((uint32_t)entry[1] << 16) | ((uint32_t)entry[2] << 8) | entry[3];
+        size_t bucket = weak & (table_size - 1);
+        chain[i] = heads[bucket];
+        heads[bucket] = (long)i;
+    }
+
+    size_t out = 0;
+    long long pos = 0, literal_start = 0;
+    // Index of the last copy record in the delta, extended while matches follow each other
+    long last_copy = -1;
+    uint32_t a = 0, b = 0;
+    // weak_checksum() keeps a and b to 16 bits each, which is all the rolling update below needs
+    if (n_blocks > 0 && size >= block_size) {
+        uint32_t weak = weak_checksum(data, block_size);
+        a = weak & 0xffff;
+        b = weak >> 16;
+    }
+    while (n_blocks > 0 && pos + block_size <= size) {
+        uint32_t weak = (a & 0xffff) | (b << 16);
+        long match = -1;
+        uint64_t strong = 0;
+        int strong_done = 0;
+        for (long i = heads[weak & (table_size - 1)]; i >= 0; i = chain[i]) {
+            const unsigned char *entry = signature + i * 12;
+            if ((((uint32_t)entry[0] << 24) | ((uint32_t)entry[1] << 16) | ((uint32_t)entry[2] << 8) | entry[3]) != weak) {
+                continue;
+            }
+            if (!strong_done) {
+                strong = strong_hash(FNV_OFFSET, data + pos, block_size);
+                strong_done = 1;
+            }
+            uint64_t expected = 0;
+            for (int k = 0; k < 8; k++) {
+                expected = (expected << 8) | entry[4 + k];
+            }
+            if (expected == strong) {
+                match = i;
+                break;
+            }
+        }
+
+        if (match < 0) {
+            // Slide the window one byte: drop data[pos], take data[pos + block_size]
+            if (pos + block_size < size) {
+                a = a - data[pos] + data[pos + block_size];
+                b = b - (uint32_t)block_size * data[pos] + a;
+            }
+            pos++;
+            continue;
+        }
+
+        // Flush the data before the match, then copy the block (joining it to the previous copy if it follows it)
+        while (literal_start < pos) {
+            uint32_t len = (pos - literal_start) > 0x40000000 ? 0x40000000 : (uint32_t)(pos - literal_start);
+            delta[out] = 'L';
+            for (int k = 0; k < 4; k++) {
+                delta[out + 1 + k] = (unsigned char)(len >> (24 - 8 * k));
+            }
+            memcpy(delta + out + 5, data + literal_start, len);
+            out += 5 + len;
+            literal_start += len;
+            last_copy = -1;
+        }
+        uint32_t first = 0, count = 0;
+        if (last_copy >= 0) {
+            first = ((uint32_t)delta[last_copy + 1] << 24) | ((uint32_t)delta[last_copy + 2] << 16) | ((uint32_t)delta[last_copy + 3] << 8) | delta[last_copy + 4];
+            count = ((uint32_t)delta[last_copy + 5] << 24) | ((uint32_t)delta[last_copy + 6] << 16) | ((uint32_t)delta[last_copy + 7] << 8) | delta[last_copy + 8];
+        }
+        if (last_copy >= 0 && first + count == (uint32_t)match) {
+            count++;
+        } else {
+            last_copy = (long)out;
+            delta[out] = 'C';
+            out += 9;
+            first = (uint32_t)match;
+            count = 1;
+            for (int k = 0; k < 4; k++) {
+                delta[last_copy + 1 + k] = (unsigned char)(first >> (24 - 8 * k));
+            }
+        }
+        for (int k = 0; k < 4; k++) {
+            delta[last_copy + 5 + k] = (unsigned char)(count >> (24 - 8 * k));
+        }
+        pos += block_size;
+        literal_start = pos;
+        if (pos + block_size <= size) {
+            uint32_t next = weak_checksum(data + pos, block_size);
+            a = next & 0xffff;
+            b = next >> 16;
+        }
+    }
+
+    // The rest of the file is new data
+    while (literal_start < size) {
+        uint32_t len = (size - literal_start) > 0x40000000 ? 0x40000000 : (uint32_t)(size - literal_start);
+        delta[out] = 'L';
+        for (int k = 0; k < 4; k++) {
+            delta[out + 1 + k] = (unsigned char)(len >> (24 - 8 * k));
+        }
+        memcpy(delta + out + 5, data + literal_start, len);
+        out += 5 + len;
+        literal_start += len;
+    }
+    free(heads);
+    free(chain);
+    *delta_len = out;
+    return delta;
+}
+
+// Function to compute the rolling checksum of a block, as the servers do for their signatures
+static uint32_t weak_checksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Function to continue a 64 bit FNV-1a hash over more data
+static uint64_t strong_hash(uint64_t hash, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// Function to build the CRC32C tables and check for the SSE4.2 crc32 instruction, run once by dfs_open
+static void crc32c_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// Function to run the CRC32C register over data with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        len--;
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// Function to continue a CRC32C (Castagnoli) over more data, starting from 0, as the servers do
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *data = buf;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = (uint32_t)data[4] | (uint32_t)data[5] << 8 | (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^ crc32c_table[5][(lo >> 16) & 0xff]
+              ^ crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+              ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+// Function to read the CRC32C from the CRC_TRAILER_LEN bytes of a trailer, returns -1 if it is malformed
+static int parse_crc_trailer(const char *trailer, uint32_t *crc) {
+    char text[CRC_TRAILER_LEN + 1];
+    unsigned int value;
+    int consumed = 0;
+    memcpy(text, trailer, CRC_TRAILER_LEN);
+    text[CRC_TRAILER_LEN] = '\0';
+    if (sscanf(text, "CRC32C %8x%n", &value, &consumed) != 1 || consumed != CRC_TRAILER_LEN) {
+        return -1;
+    }
+    *crc = value;
+    return 0;
+}
+
+// Function to receive exactly len bytes, returns 0 on success
+static int recv_exact(int sock, void *buffer, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (char *)buffer + received, len - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// Function to run a command answered by a single short reply, successful when it starts with ok_prefix
+static int do_simple(int sock, dfs_future *future, const char *command, const char *ok_prefix) {
+    char message[DFS_PATH_MAX + 16];
+    int len = snprintf(message, sizeof(message), "%s %s", command, future->target);
+    if (send_all(sock, message, len, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+    int result = recv_reply(sock, future);
+    if (result != 0) {
+        return result;
+    }
+    return strncmp(future->message, ok_prefix, strlen(ok_prefix)) == 0 ? 0 : -1;
+}
+
+// Function to download a file or a tarball: the reply is "<name> <size>\n", the data and the end marker
+// The data goes to a ".part" file that is renamed once the whole file arrived. A file download asks for
+// the first stripe only; when the file turns out to be larger, the other stripes are queued for the
+// other connections of the pool and the last one to arrive completes the download
+static int do_receive_file(dfs_client *client, int sock, dfs_future *future, const char *command) {
+    char message[DFS_PATH_MAX + 128];
+    int striped = (future->op == DFS_DOWNLOAD && client->stripe_size > 0);
+    // With the cache on, a download is conditional on the tag of the cached copy ("-" when there is none)
+    // and the reply carries the tag of the file, stored with the copy in the cache. A striped download
+    // always asks for the tag, the other stripes are only accepted from the same version of the file
+    int conditional = (future->op == DFS_DOWNLOAD && client->cache_dir[0] != '\0');
+    char cached_tag[64] = "-";
+    int len;
+    if (conditional || striped) {
+        if (conditional) {
+            cache_lookup(client, future->target, cached_tag, sizeof(cached_tag));
+        }
+        len = snprintf(message, sizeof(message), "%s %s 0 %lld %s", command, future->target,
+                       striped ? client->stripe_size : -1LL, cached_tag);
+    } else {
+        len = snprintf(message, sizeof(message), "%s %s", command, future->target);
+    }
+    // An incremental tarball: the time and the manifest of the last backup follow the extension
+    if (future->op == DFS_TAR && future->since >= 0) {
+        len += snprintf(message + len, sizeof(message) - len, " since=%lld", future->since);
+    }
+    if (future->op == DFS_TAR && future->remote_dir[0] != '\0') {
+        int result = send_tar_manifest(sock, future, message, len);
+        if (result != 0) {
+            return result;
+        }
+    } else if (send_all(sock, message, len, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+
+    int error = is_error_reply(sock);
+    if (error < 0) {
+        return DFS_CONN_FAILED;
+    } else if (error) {
+        int result = recv_reply(sock, future);
+        return result != 0 ? result : -1;
+    }
+
+    // Parse the header, only the last path component of the name is used locally
+    char header[DFS_PATH_MAX];
+    long long offset, total, size;
+    if (recv_line(sock, header, sizeof(header)) < 0) {
+        return DFS_CONN_FAILED;
+    }
+    // "NOT_MODIFIED <tag> 0" and the end marker: the cached copy is current
+    if (conditional && strncmp(header, "NOT_MODIFIED ", 13) == 0) {
+        int write_failed = 0;
+        int result = recv_to_file(sock, future, -1, 0, 0, &write_failed);
+        return result != 0 ? result : cache_restore(client, future);
+    }
+    if (parse_file_header(header, &offset, &total, &size) < 0 || offset != 0) {
+        return DFS_CONN_FAILED;
+    }
+    // The tag follows the name in the reply to a conditional or striped download
+    char *tag_field = strrchr(header, ' ');
+    future->tag[0] = '\0';
+    if ((conditional || striped) && tag_field != NULL) {
+        snprintf(future->tag, sizeof(future->tag), "%s", tag_field + 1);
+        *tag_field = '\0';
+    }
+    char *name = strrchr(header, '/') ? strrchr(header, '/') + 1 : header;
+    char part_path[2 * DFS_PATH_MAX + 8];
+    snprintf(future->local_path, sizeof(future->local_path), "%s/%s", future->local_dir, name);
+    snprintf(part_path, sizeof(part_path), "%s.part", future->local_path);
+    set_message(future, name, strlen(name));
+
+    // Receive exactly the announced bytes, the connection stays usable even if the local file cannot be written
+    int file_fd = open(part_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    int write_failed = (file_fd < 0);
+    int result = recv_to_file(sock, future, file_fd, 0, size, &write_failed);
+    if (result == 0 && !write_failed && size < total) {
+        // Fetch the rest of the file in stripes over the pool, each one written in place
+        struct dfs_stripes *stripes = calloc(1, sizeof(*stripes));
+        if (stripes != NULL) {
+            pthread_mutex_init(&stripes->lock, NULL);
+            stripes->fd = file_fd;
+            stripes->total = total;
+            stripes->parent = future;
+            stripes->client = client;
+            snprintf(stripes->tag, sizeof(stripes->tag), "%s", future->tag);
+            snprintf(stripes->part_path, sizeof(stripes->part_path), "%s", part_path);
+            stripes->pending = (int)((total - size + client->stripe_size - 1) / client->stripe_size);
+            for (long long next = size; next < total; next += client->stripe_size) {
+                dfs_future *range = calloc(1, sizeof(*range));
+                if (range == NULL) {
+                    // Count the stripes that will never run as failed
+                    stripe_finished(stripes, NULL, -1);
+                    continue;
+                }
+                range->op = DFS_RANGE;
+                snprintf(range->target, sizeof(range->target), "%s", future->target);
+                range->offset = next;
+                range->length = (total - next < client->stripe_size) ? total - next : client->stripe_size;
+                range->stripes = stripes;
+                range->refs = 1;
+                pthread_mutex_init(&range->lock, NULL);
+                pthread_cond_init(&range->cond, NULL);
+                dfs_enqueue(client, range);
+            }
+            return DFS_PENDING;
+        }
+        write_failed = 1;
+    }
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    if (result != 0) {
+        unlink(part_path);
+        future->local_path[0] = '\0';
+        return result;
+    }
+    if (write_failed || size != total || rename(part_path, future->local_path) < 0) {
+        char error_message[3 * DFS_PATH_MAX];
+        len = snprintf(error_message, sizeof(error_message), "ERROR: Cannot write %s!", future->local_path);
+        set_message(future, error_message, len);
+        unlink(part_path);
+        future->local_path[0] = '\0';
+        return -1;
+    }
+    cache_store(client, future);
+    return 0;
+}
+
+// Function to fetch one stripe of a striped download and write it in place
+static int do_range(int sock, dfs_future *future) {
+    struct dfs_stripes *stripes = future->stripes;
+    char message[DFS_PATH_MAX + 64];
+    // "if-match=<tag>" makes the server refuse the stripe if the file is no longer the version of the first stripe
+    // (overwritten since, or a replica that lags behind), so stripes of two versions never end up in one file
+    int len = snprintf(message, sizeof(message), "dfile %s %lld %lld if-match=%s", future->target, future->offset,
+                       future->length, stripes->tag);
+    if (send_all(sock, message, len, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+
+    int error = is_error_reply(sock);
+    if (error < 0) {
+        return DFS_CONN_FAILED;
+    } else if (error) {
+        int result = recv_reply(sock, future);
+        return result != 0 ? result : -1;
+    }
+
+    char header[DFS_PATH_MAX];
+    long long offset, total, size;
+    if (recv_line(sock, header, sizeof(header)) < 0 || parse_file_header(header, &offset, &total, &size) < 0) {
+        return DFS_CONN_FAILED;
+    }
+    int write_failed = 0;
+    int result = recv_to_file(sock, future, stripes->fd, offset, size, &write_failed);
+    if (result != 0) {
+        return result;
+    }
+    // The server checked the version, the range must still be the one that was asked for
+    if (write_failed || offset != future->offset || size != future->length || total != stripes->total) {
+        const char *error_message = "ERROR: File changed during the download!";
+        set_message(future, error_message, strlen(error_message));
+        return -1;
+    }
+    return 0;
+}
+
+// Function to account for a finished stripe, the last one completes the download
+static void stripe_finished(struct dfs_stripes *stripes, dfs_future *range, int status) {
+    pthread_mutex_lock(&stripes->lock);
+    if (status < 0 && !stripes->failed) {
+        stripes->failed = 1;
+        snprintf(stripes->error, sizeof(stripes->error), "%s",
+                 (range != NULL && range->message != NULL) ? range->message : "ERROR: Striped download failed!");
+    }
+    int last = (--stripes->pending == 0);
+    pthread_mutex_unlock(&stripes->lock);
+    if (!last) {
+        return;
+    }
+
+    dfs_future *download = stripes->parent;
+    close(stripes->fd);
+    if (!stripes->failed && rename(stripes->part_path, download->local_path) < 0) {
+        stripes->failed = 1;
+        snprintf(stripes->error, sizeof(stripes->error), "ERROR: Cannot write the downloaded file!");
+    }
+    if (stripes->failed) {
+        unlink(stripes->part_path);
+        download->local_path[0] = '\0';
+        set_message(download, stripes->error, strlen(stripes->error));
+    } else {
+        cache_store(stripes->client, download);
+    }
+    int status_all = stripes->failed ? -1 : 0;
+    pthread_mutex_destroy(&stripes->lock);
+    free(stripes);
+    dfs_complete(download, status_all);
+}
+
+// Function to split a file header in place: "<name> <size>" for a whole file or
+// "<name> <offset> <total> <size>" for a range; header is left holding the name
+static int parse_file_header(char *header, long long *offset, long long *total, long long *size) {
+    long long fields[3];
+    int n = 0;
+    while (n < 3) {
+        char *space = strrchr(header, ' ');
+        if (space == NULL || sscanf(space + 1, "%lld", &fields[n]) != 1 || fields[n] < 0) {
+            break;
+        }
+        *space = '\0';
+        n++;
+    }
+    if (n == 1) {
+        *offset = 0;
+        *total = *size = fields[0];
+        return 0;
+    } else if (n == 3) {
+        *size = fields[0];
+        *total = fields[1];
+        *offset = fields[2];
+        return 0;
+    }
+    return -1;
+}
+
+// Function to receive size bytes followed by their CRC32C trailer and the end marker, writing them at offset
+// with pwrite. write_failed is set (and the data still consumed) when the local file cannot be written;
+// data that does not match its checksum fails the request with an error message in future
+static int recv_to_file(int sock, dfs_future *future, int file_fd, long long offset, long long size, int *write_failed) {
+    char *buffer = malloc(DFS_BUFSIZE);
+    if (buffer == NULL) {
+        // The reply cannot be consumed, give up the connection
+        return DFS_CONN_FAILED;
+    }
+    if (file_fd < 0) {
+        *write_failed = 1;
+    }
+    uint32_t crc = 0, sent_crc;
+    while (size > 0) {
+        size_t want = size < DFS_BUFSIZE ? (size_t)size : DFS_BUFSIZE;
+        ssize_t bytes_received = recv(sock, buffer, want, 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes_received);
+        if (!*write_failed && pwrite(file_fd, buffer, bytes_received, offset) != bytes_received) {
+            *write_failed = 1;
+        }
+        offset += bytes_received;
+        size -= bytes_received;
+    }
+    free(buffer);
+
+    // The data must be followed by its checksum and the end marker
+    char end[CRC_TRAILER_LEN + sizeof(CMD_END_MARKER)];
+    size_t end_len = CRC_TRAILER_LEN + strlen(CMD_END_MARKER);
+    if (size > 0 || recv(sock, end, end_len, MSG_WAITALL) != (ssize_t)end_len
+        || memcmp(end + CRC_TRAILER_LEN, CMD_END_MARKER, end_len - CRC_TRAILER_LEN) != 0) {
+        return DFS_CONN_FAILED;
+    }
+    if (parse_crc_trailer(end, &sent_crc) < 0 || sent_crc != crc) {
+        const char *error_message = "ERROR: Checksum mismatch, the download is corrupted!";
+        set_message(future, error_message, strlen(error_message));
+        return -1;
+    }
+    return 0;
+}
+
+// Function to list a directory, with the filter if one was given, search or query it: the file names (or matching
+// lines) are followed by the end marker, errors are sent alone
+static int do_list(int sock, dfs_future *future) {
+    char message[2 * DFS_PATH_MAX + 16];
+    const char *command = future->op == DFS_SEARCH ? "search" : (future->op == DFS_QUERY ? "query" : "display");
+    int len = snprintf(message, sizeof(message), "%s %s%s%s", command, future->target,
+                       future->remote_dir[0] != '\0' ? " " : "", future->remote_dir);
+    if (send_all(sock, message, len, 0) < 0) {
+        return DFS_CONN_FAILED;
+    }
+
+    int error = is_error_reply(sock);
+    if (error < 0) {
+        return DFS_CONN_FAILED;
+    } else if (error) {
+        int result = recv_reply(sock, future);
+        return result != 0 ? result : -1;
+    }
+
+    // Collect the list until it ends with the marker
+    size_t marker_len = strlen(CMD_END_MARKER);
+    size_t capacity = DFS_BUFSIZE, used = 0;
+    char *list = malloc(capacity);
+    while (list != NULL) {
+        if (used == capacity) {
+            char *grown = realloc(list, capacity * 2);
+            if (grown == NULL) {
+                break;
+            }
+            list = grown;
+            capacity *= 2;
+        }
+        ssize_t bytes_received = recv(sock, list + used, capacity - used, 0);
+        if (bytes_received <= 0) {
+            break;
+        }
+        used += bytes_received;
+        if (used >= marker_len && memcmp(list + used - marker_len, CMD_END_MARKER, marker_len) == 0) {
+            set_message(future, list, used - marker_len);
+            free(list);
+            return 0;
+        }
+    }
+    free(list);
+    return DFS_CONN_FAILED;
+}
+
+// Function to build the path of the cache entry of a remote file, named by the FNV-1a hash of its path
+static void cache_entry_path(dfs_client *client, const char *remote_file, char *path, size_t path_size) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const char *c = remote_file; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    snprintf(path, path_size, "%s/%016llx", client->cache_dir, hash);
+}
+
+// Function to find the cached copy of a remote file, returns 0 and its tag if there is one
+// A cache entry is one file: a "<tag> <remote path>" line followed by the contents
+static int cache_lookup(dfs_client *client, const char *remote_file, char *tag, size_t tag_size) {
+    char entry_path[DFS_PATH_MAX + 32];
+    cache_entry_path(client, remote_file, entry_path, sizeof(entry_path));
+    FILE *entry = fopen(entry_path, "r");
+    if (entry == NULL) {
+        return -1;
+    }
+    char line[DFS_PATH_MAX + 80];
+    int found = 0;
+    if (fgets(line, sizeof(line), entry) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        // Check the path too, two paths may share a hash
+        char *path = strchr(line, ' ');
+        if (path != NULL && strcmp(path + 1, remote_file) == 0 && (size_t)(path - line) < tag_size) {
+            memcpy(tag, line, path - line);
+            tag[path - line] = '\0';
+            found = 1;
+        }
+    }
+    fclose(entry);
+    return found ? 0 : -1;
+}
+
+// Function to copy the cached copy of a downloaded file to its destination after a "not modified" reply
+static int cache_restore(dfs_client *client, dfs_future *future) {
+    const char *name = strrchr(future->target, '/') ? strrchr(future->target, '/') + 1 : future->target;
+    char entry_path[DFS_PATH_MAX + 32];
+    char part_path[2 * DFS_PATH_MAX + 8];
+    cache_entry_path(client, future->target, entry_path, sizeof(entry_path));
+    snprintf(future->local_path, sizeof(future->local_path), "%s/%s", future->local_dir, name);
+    snprintf(part_path, sizeof(part_path), "%s.part", future->local_path);
+    set_message(future, name, strlen(name));
+
+    // Skip the entry's header line and copy the contents
+    int entry_fd = open(entry_path, O_RDONLY);
+    char line[DFS_PATH_MAX + 80];
+    ssize_t line_len = entry_fd < 0 ? -1 : pread(entry_fd, line, sizeof(line), 0);
+    char *newline = line_len > 0 ? memchr(line, '\n', line_len) : NULL;
+    if (newline == NULL) {
+        // The entry went away since the request was sent, download the file again
+        if (entry_fd >= 0) {
+            close(entry_fd);
+        }
+        unlink(entry_path);
+        return DFS_CONN_FAILED;
+    }
+    lseek(entry_fd, newline + 1 - line, SEEK_SET);
+    int file_fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int result = (file_fd < 0) ? -1 : copy_data(entry_fd, file_fd);
+    close(entry_fd);
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    if (result < 0 || rename(part_path, future->local_path) < 0) {
+        char error_message[3 * DFS_PATH_MAX];
+        int len = snprintf(error_message, sizeof(error_message), "ERROR: Cannot write %s!", future->local_path);
+        set_message(future, error_message, len);
+        unlink(part_path);
+        future->local_path[0] = '\0';
+        return -1;
+    }
+    future->from_cache = 1;
+    return 0;
+}
+
+// Function to keep a copy of a downloaded file in the cache, with the tag it was sent with
+// The entry is written to a temporary file and renamed, so readers never see half an entry
+static void cache_store(dfs_client *client, dfs_future *future) {
+    if (client->cache_dir[0] == '\0' || future->op != DFS_DOWNLOAD || future->tag[0] == '\0') {
+        return;
+    }
+    char entry_path[DFS_PATH_MAX + 32];
+    char temp_path[DFS_PATH_MAX + 48];
+    cache_entry_path(client, future->target, entry_path, sizeof(entry_path));
+    snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", entry_path);
+    int entry_fd = mkstemp(temp_path);
+    if (entry_fd < 0) {
+        return;
+    }
+    int file_fd = open(future->local_path, O_RDONLY);
+    char header[DFS_PATH_MAX + 80];
+    int header_len = snprintf(header, sizeof(header), "%s %s\n", future->tag, future->target);
+    int result = (file_fd < 0 || write(entry_fd, header, header_len) != header_len) ? -1 : copy_data(file_fd, entry_fd);
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    if (close(entry_fd) < 0 || result < 0 || rename(temp_path, entry_path) < 0) {
+        unlink(temp_path);
+    }
+}
+
+// Function to copy the rest of one file to another, returns 0 on success
+static int copy_data(int src_fd, int dst_fd) {
+    char *buffer = malloc(DFS_BUFSIZE);
+    if (buffer == NULL) {
+        return -1;
+    }
+    ssize_t bytes_read;
+    int result = 0;
+    while ((bytes_read = read(src_fd, buffer, DFS_BUFSIZE)) > 0) {
+        if (write(dst_fd, buffer, bytes_read) != bytes_read) {
+            result = -1;
+            break;
+        }
+    }
+    if (bytes_read < 0) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
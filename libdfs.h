@@ -0,0 +1,75 @@
+#ifndef LIBDFS_H
+#define LIBDFS_H
+
+#include <stddef.h>
+
+// libdfs: asynchronous client library for the distributed file system
+//
+// A client keeps a pool of connections to Smain, each served by its own worker thread, so many
+// uploads and downloads can be in flight from one process while connections are reused across
+// requests. Every call queues the request and returns a future right away; wait on the future
+// with dfs_wait(), poll it with dfs_done(), or pass a callback that runs on the worker thread
+// once the request completed. Build with: gcc -c libdfs.c -pthread
+
+// A connection pool to one Smain server
+typedef struct dfs_client dfs_client;
+// The pending or completed result of one request
+typedef struct dfs_future dfs_future;
+// Completion callback, called once from a worker thread; the future stays valid during the call
+typedef void (*dfs_callback)(dfs_future *future, void *arg);
+
+// Open `connections` connections to Smain at host:port (at least one), NULL if none can be made; one more
+// connection is opened on first use for list, remove and query requests, which never wait behind transfers
+dfs_client *dfs_open(const char *host, int port, int connections);
+// Finish the queued requests, then close the connections and free the client
+void dfs_close(dfs_client *client);
+// Files larger than `bytes` (4 MB by default) are downloaded in stripes of that size, fetched in
+// parallel over the connections of the pool and written in place; 0 turns striping off
+void dfs_set_stripe_size(dfs_client *client, long long bytes);
+// Keep downloaded files in a local cache in dir (created if missing), NULL turns the cache off; later
+// downloads of a cached file only ask whether it changed and copy the cached copy if it did not
+int dfs_set_cache_dir(dfs_client *client, const char *dir);
+// Files of at least `bytes` (32 KB by default) that the server already has a copy of are uploaded as
+// a delta against that copy, sending only the changed blocks; 0 always uploads whole files
+void dfs_set_delta_min(dfs_client *client, long long bytes);
+
+// Upload a local file into a directory of the file system ("ufile")
+dfs_future *dfs_upload(dfs_client *client, const char *local_file, const char *remote_dir, dfs_callback callback, void *arg);
+// Download a file ("dfile") into local_dir (the current directory when NULL)
+dfs_future *dfs_download(dfs_client *client, const char *remote_file, const char *local_dir, dfs_callback callback, void *arg);
+// Remove a file ("rmfile")
+dfs_future *dfs_remove(dfs_client *client, const char *remote_file, dfs_callback callback, void *arg);
+// Download the tarball of every file with an extension ("dtar") into local_dir (the current directory when NULL)
+dfs_future *dfs_tar(dfs_client *client, const char *ext, const char *local_dir, dfs_callback callback, void *arg);
+// Download only the files with an extension that changed since an earlier dtar: files modified at or after `since`
+// (epoch seconds, -1 for none) and files whose size or mtime differ from manifest_file (NULL for none), the
+// ".dfs_manifest.<store>" member of that earlier tarball; ".dfs_deleted.<store>" members list the removed files
+dfs_future *dfs_tar_incremental(dfs_client *client, const char *ext, long long since, const char *manifest_file, const char *local_dir, dfs_callback callback, void *arg);
+// List the files of a directory ("display")
+dfs_future *dfs_list(dfs_client *client, const char *remote_dir, dfs_callback callback, void *arg);
+// List only the files of a directory that pass a filter, applied by the servers before the list is sent:
+// space separated "name=<glob>", "min=<bytes>", "max=<bytes>", "since=<epoch seconds>" and "depth=<levels of
+// subdirectories>" (files below the directory are listed relative to it); NULL or "" lists every file
+dfs_future *dfs_list_filtered(dfs_client *client, const char *remote_dir, const char *filter, dfs_callback callback, void *arg);
+// Find the lines containing `text` in the files below a directory ("search"), searched by the servers in parallel;
+// the message is one "<file>:<line>:<text of the line>" line per match, files named relative to the directory
+dfs_future *dfs_search(dfs_client *client, const char *remote_dir, const char *text, dfs_callback callback, void *arg);
+// List the files below a directory that contain every one of the space separated words ("query"), looked up in
+// the stores' term indexes without reading the files; the words are matched case-insensitively
+dfs_future *dfs_query(dfs_client *client, const char *remote_dir, const char *words, dfs_callback callback, void *arg);
+
+// Block until the request completed (and its callback returned), returns 0 on success and -1 on failure
+int dfs_wait(dfs_future *future);
+// Returns 1 once the request completed, 0 while it is pending
+int dfs_done(dfs_future *future);
+// The results below may be read in the callback or once the request completed
+// The server's reply: a confirmation, an "ERROR: ..." message, the file list of dfs_list or the saved file name
+const char *dfs_message(dfs_future *future);
+// The local file written by dfs_download or dfs_tar, empty for other requests or on failure
+const char *dfs_local_path(dfs_future *future);
+// Returns 1 if dfs_download found the file unchanged and copied it from the local cache
+int dfs_from_cache(dfs_future *future);
+// Give up the caller's reference, a pending request still completes (and calls its callback)
+void dfs_release(dfs_future *future);
+
+#endif